@@ -0,0 +1,136 @@
+/* CRC32C checksums for the isam library.
+   -------------------------------------------------------------------------
+   Goal: Part of an assignment on file system structure for the operating
+         systems course.
+   -------------------------------------------------------------------------
+   The CRC32C polynomial (0x1EDC6F41, 0x82F63B78 bit reversed) is the one
+   computed by the crc32 instruction of SSE4.2, which handles 8 bytes in
+   a few cycles; checking a block then costs far less than reading it.
+   Without that instruction a table of 256 entries is used, a byte at a
+   time. The version to use is determined once, at the first call. */
+
+#include <stddef.h>
+#include <string.h>
+#include "crc32c.h"
+
+#if defined(__GNUC__) && defined(__SSE2__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define CRC32C_X86
+#include <immintrin.h>
+#endif
+
+#define CRC32C_POLY 0x82F63B78UL
+
+static unsigned long crc32cTable[256];
+static int crc32cTableDone = 0;
+
+static void
+crc32c_makeTable(void)
+{
+    unsigned long c;
+    int     i, j;
+
+    for (i = 0; i < 256; i++)
+    {
+	c = i;
+	for (j = 0; j < 8; j++)
+	{
+	    c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+	}
+	crc32cTable[i] = c;
+    }
+    crc32cTableDone = 1;
+}
+
+unsigned long
+crc32cScalar(unsigned long crc, const void *data, size_t length)
+{
+    const unsigned char *p = data;
+    unsigned long c = ~crc & 0xffffffffUL;
+
+    if (!crc32cTableDone)
+    {
+	crc32c_makeTable();
+    }
+    while (length--)
+    {
+	c = crc32cTable[(c ^ *p++) & 0xff] ^ (c >> 8);
+    }
+    return ~c & 0xffffffffUL;
+}
+
+#ifdef CRC32C_X86
+
+__attribute__ ((target("sse4.2")))
+static unsigned long
+crc32cSSE42(unsigned long crc, const void *data, size_t length)
+{
+    const unsigned char *p = data;
+    unsigned int c = ~crc;
+#ifdef __x86_64__
+    unsigned long word;
+
+    /* Eight bytes at a time; memcpy becomes a single (unaligned) load */
+    for (; length >= 8; length -= 8, p += 8)
+    {
+	memcpy(&word, p, 8);
+	c = (unsigned int) _mm_crc32_u64(c, word);
+    }
+#endif
+    {
+	unsigned int half;
+
+	for (; length >= 4; length -= 4, p += 4)
+	{
+	    memcpy(&half, p, 4);
+	    c = _mm_crc32_u32(c, half);
+	}
+    }
+    while (length--)
+    {
+	c = _mm_crc32_u8(c, *p++);
+    }
+    return ~c & 0xffffffffUL;
+}
+
+#endif
+
+static unsigned long crc32cFirst(unsigned long crc, const void *data,
+				 size_t length);
+
+static unsigned long (*crc32cImpl) (unsigned long, const void *, size_t) =
+    crc32cFirst;
+
+static const char *crc32cImplName = "scalar";
+
+/* Select the best version on the first call */
+static unsigned long
+crc32cFirst(unsigned long crc, const void *data, size_t length)
+{
+    crc32cImpl = crc32cScalar;
+#ifdef CRC32C_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+    {
+	crc32cImpl = crc32cSSE42;
+	crc32cImplName = "sse4.2";
+    }
+#endif
+    return crc32cImpl(crc, data, length);
+}
+
+unsigned long
+crc32c(unsigned long crc, const void *data, size_t length)
+{
+    return crc32cImpl(crc, data, length);
+}
+
+const char *
+crc32cName(void)
+{
+    if (crc32cImpl == crc32cFirst)
+    {
+	crc32cFirst(0, "", 0);
+    }
+    return crc32cImplName;
+}
@@ -0,0 +1,28 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+/* -------------------------------------------------------------------------
+   CRC32C (Castagnoli) checksums over the blocks, header and index of an
+   isam file.
+   Goal: Part of an assignment on file system structure for the operating
+         systems course.
+----------------------------------------------------------------------------*/
+
+#include <stddef.h>
+
+/* crc32c returns the CRC32C of the length bytes at data, continuing from
+   crc, the result of a previous call (start with 0). So
+   crc32c(crc32c(0, a, n), b, m) is the CRC of the n bytes at a followed
+   by the m bytes at b. On x86 processors with SSE4.2 the crc32
+   instruction is used; the version is selected the first time it is
+   called. */
+unsigned long crc32c(unsigned long crc, const void *data, size_t length);
+
+/* The portable version of crc32c, a byte at a time with a table */
+unsigned long crc32cScalar(unsigned long crc, const void *data,
+			   size_t length);
+
+/* The name of the version used by crc32c ("scalar" or "sse4.2") */
+const char *crc32cName(void);
+
+#endif
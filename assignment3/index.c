@@ -12,15 +12,24 @@
    Goal: Part of an assignment on file system structure for the operating
          systems course.
    -------------------------------------------------------------------------
-   The strucure/implementation of this index is not very efficient.
-   We use an N-ary tree with a fixed branching factor of 4; it might
-       have been more logical to make this variable, depending on the
-       key length and an appropriate record/block size. This also depends on
-       whether the index blocks are retained in memory, or read when
-       needed.
-       The choice for a small number of elements per record also was
-       made to obtain a multi-level tree structure for a limited
-       number of elements.
+   The index is an N-ary tree. The branching factor (fan-out) is chosen
+       when the index is made; by default it is as large as fits in an
+       index record of INDEX_NODE_SIZE bytes, which keeps the tree shallow
+       for large files. The original version used a fixed fan-out of 4 to
+       obtain a multi-level tree for a limited number of elements; index
+       files of that kind can still be read.
+   The number of entries is fixed when the index is made. An index that
+       is full can be replaced by a larger one with index_grow; as the
+       index is kept in memory, that is only a matter of copying it.
+   Within a record the keys are sorted, so they are searched with a
+   binary search.
+   The records themselves are kept in memory in the same form as on
+   disk, but for searching we keep, per level, a separate contiguous
+   array with the first sizeof(unsigned long) bytes of every key packed
+   big-endian into an unsigned long. Comparing those prefixes as integers
+   gives the same order as strncmp, so the full key only has to be
+   compared when two prefixes are equal. The search thus touches a few
+   cache lines of prefixes rather than whole index records.
 
    Will we keep the index in memory?
    Well - that greatly simplifies matters - so let's do it */
@@ -35,6 +44,8 @@
 /* Use assert to pinpoint fatal errors - should be removed later */
 #include <assert.h>
 #include "index.h"
+#include "keycmp.h"
+#include "crc32c.h"
 
 /* C is not very helpful when you have to define structures with elements
    of which the size is not known at compile time. In this case, we will
@@ -44,23 +55,27 @@
    that will contain the actual variable part. When allocating memory
    for this structure, we will allocate the actual required size, and
    use higher index values to access that part of the array.
-   Also notice that the array (keys) will eventually contain four
-   key strings. We have to compute the starting points of the first,
-   second and third element when we actually need them.
+   Also notice that the record contains Fanout index values, followed
+   by Fanout key strings. We have to compute the starting points of
+   the keys when we actually need them.
    Macros can be very helpful to keep the code readable in such cases
    */
 typedef struct
 {
       unsigned long Nkeys;	/* The number of valid keys in this record */
-      unsigned long index[4];	/* Data/index record nrs for the keys */
-      char    keys[8];		/* Store 4 keys here; actual size will be larger */
+      unsigned long index[1];	/* Data/index record nrs for the keys;
+				   actual size will be Fanout, followed
+				   by the keys */
 } indexRecord;
 
 /* The index will contain a number of index records (defined above) and
    a structure describing the actual size of the index (element size,
    number of elements, number of levels, degree of filling).
    On disk this index header will, of course, precede the index 
-   records. */
+   records.
+   The fan-out is not stored separately: it follows from iRecordLength
+   and KeyLength (see FanoutOf), which keeps the header compatible with
+   the original fixed fan-out of 4. */
 
 typedef struct
 {
@@ -77,31 +92,134 @@ typedef struct
 typedef struct INDEX_IN_CORE
 {
       indexRecord *levels[8];	/* Arrays with index records */
+      unsigned long *prefix[8];	/* Key prefixes, Fanout per record */
+      unsigned long *rootPrefix;	/* Key prefixes for the root record */
+      unsigned long Fanout;	/* Number of keys per index record */
+      unsigned long RecordLength;	/* Size of an index record in memory;
+				   iRecordLength is its size on disk */
       indexheader to_disk;	/* This goes to disk         */
 } in_core;
 
-#define KeyInRec(key,rec,len)    (&((rec).keys[(key) * (len)]))
+/* Records are padded to a multiple of sizeof(unsigned long), so that the
+   Nkeys and index fields of every record in a level are aligned. The
+   padding is less than sizeof(unsigned long) + len, so FanoutOf still
+   finds the same fan-out. Older files, without the padding, keep their
+   iRecordLength on disk; in memory their records are padded as well */
+#define RecordLength(fan,len)	((sizeof(unsigned long) * (1 + (fan)) + \
+				  (fan) * (len) + sizeof(unsigned long) - 1) & \
+				 ~(sizeof(unsigned long) - 1))
+#define FanoutOf(reclen,len)	(((reclen) - sizeof(unsigned long)) / \
+				 (sizeof(unsigned long) + (len)))
 
+#define KeyInRec(key,rec,len,fan) \
+	(((char *) &((rec).index[(fan)])) + (key) * (len))
+
+#define RecInLevel(in,lev,nrec)	((indexRecord *) ((nrec) * \
+	(in)->RecordLength + (char *) (in)->levels[(lev)]))
+
+#ifdef __GNUC__
+__thread
+#endif
 int index_error = 0;
 
+/* Pack the first bytes of a key (up to the terminating zero, if any)
+   big-endian into an unsigned long */
+static unsigned long
+key_prefix(const char *key, unsigned long KeyLength)
+{
+    unsigned long prefix = 0;
+    unsigned int i;
+    int     end = 0;
+
+    for (i = 0; i < sizeof(unsigned long); i++)
+    {
+	if (i >= KeyLength || !key[i])
+	{
+	    end = 1;
+	}
+	prefix = (prefix << 8) | (end ? 0 : (unsigned char) key[i]);
+    }
+    return prefix;
+}
+
+/* Fill the prefix arrays from the index records (after reading an
+   index from disk) */
+static void
+build_prefixes(in_core * in)
+{
+    unsigned long KeyLength = in->to_disk.KeyLength;
+    unsigned long Fanout = in->Fanout;
+    unsigned long i, nrec, k;
+    indexRecord *rec;
+
+    rec = &(in->to_disk.root);
+    for (k = 0; k < rec->Nkeys; k++)
+    {
+	in->rootPrefix[k] = key_prefix(KeyInRec(k, *rec, KeyLength, Fanout),
+				       KeyLength);
+    }
+    for (i = 0; i < in->to_disk.Nlevels; i++)
+    {
+	for (nrec = 0; nrec < in->to_disk.NperLevel[i]; nrec++)
+	{
+	    rec = RecInLevel(in, i, nrec);
+	    for (k = 0; k < rec->Nkeys; k++)
+	    {
+		in->prefix[i][nrec * Fanout + k] =
+		    key_prefix(KeyInRec(k, *rec, KeyLength, Fanout), KeyLength);
+	    }
+	}
+    }
+}
+
+unsigned long
+index_maxFanout(unsigned long KeyLength)
+{
+    return FanoutOf(INDEX_NODE_SIZE, KeyLength);
+}
+
+unsigned long
+index_fanout(in_core * in)
+{
+    return in->Fanout;
+}
+
 /* index_makeNew will construct a new index (in memory only),
    characterised by Nblocks (the maximum number of entries in
-   the index) and KeyLength (the length of the key strings).
+   the index), KeyLength (the length of the key strings) and
+   Fanout (the number of keys per index record; 0 selects the largest
+   fan-out for which a record fits in INDEX_NODE_SIZE bytes).
    */
 in_core *
-index_makeNew(unsigned long Nblocks, unsigned long KeyLength)
+index_makeNew(unsigned long Nblocks, unsigned long KeyLength,
+	      unsigned long Fanout)
 {
-    unsigned long iRecordLength = sizeof(indexRecord) - sizeof(char[8]) +
-                                  4 * KeyLength;
-    in_core *in = calloc(1, sizeof(in_core) - sizeof(indexRecord) +
-			 iRecordLength);
+    unsigned long iRecordLength;
+    in_core *in;
     int     i;
     int     levs;
     int     n;
+
+    if (KeyLength == 0)
+    {
+	index_error = INDEX_BAD_KEYLENGTH;
+	return NULL;
+    }
+    if (Fanout == 0)
+    {
+	Fanout = index_maxFanout(KeyLength);
+    }
+    if (Fanout < 4)
+    {
+	Fanout = 4;
+    }
+    iRecordLength = RecordLength(Fanout, KeyLength);
+    in = calloc(1, sizeof(in_core) - sizeof(indexRecord) + iRecordLength);
     /* We will have NBlocks entries in the deepest level of nodes
-       (the leaf nodes). These will be contained in Nrec = (NBlocks + 3) / 4
-       index records.
-       These, in turn will need (Nrec + 3) / 4 index records, etc. */
+       (the leaf nodes). These will be contained in
+       Nrec = (NBlocks + Fanout - 1) / Fanout index records.
+       These, in turn will need (Nrec + Fanout - 1) / Fanout index
+       records, etc. */
 
 #ifdef DEBUG
     printf("iRecordLength = %d\n", iRecordLength);
@@ -111,20 +229,21 @@ index_makeNew(unsigned long Nblocks, unsigned long KeyLength)
 	index_error = INDEX_ALLOCATION_FAILURE;
 	return in;
     }
-    if (KeyLength == 0)
-    {
-	index_error = INDEX_BAD_KEYLENGTH;
-	free(in);
-	return NULL;
-    }
 #ifdef DEBUG
     printf("-------> 1\n");
 #endif
-    for (levs = 0, i = Nblocks; i > 1; levs++, i = (i + 3) >> 2)
+    for (levs = 0, i = Nblocks; i > 1; levs++, i = (i + Fanout - 1) / Fanout)
 	;
-    if (!levs)
+    /* There is always at least one level below the root */
+    if (levs < 2)
     {
-	levs = 1;
+	levs = 2;
+    }
+    if (levs > 9)
+    {
+	index_error = INDEX_FULL;
+	free(in);
+	return NULL;
     }
 #ifdef DEBUG
     printf("-------> 2\n");
@@ -132,22 +251,28 @@ index_makeNew(unsigned long Nblocks, unsigned long KeyLength)
 
     /* levs == 1 -> root only; otherwise (levs - 1) additional levels */
 
+    in->Fanout = Fanout;
+    in->RecordLength = iRecordLength;
     in->to_disk.iRecordLength = iRecordLength;
     in->to_disk.KeyLength = KeyLength;
     in->to_disk.Nkeys = 1;	/* The single empty key for record 0! */
     in->to_disk.root.Nkeys = 1;
     in->to_disk.Nlevels = levs - 1;
-    n = (Nblocks + 3) >> 2;
+    in->rootPrefix = calloc(Fanout, sizeof(unsigned long));
+    assert(in->rootPrefix != NULL);
+    n = (Nblocks + Fanout - 1) / Fanout;
     for (i = levs - 2; i >= 0; i--)
     {
 	in->levels[i] = calloc(n, iRecordLength);
 	assert(in->levels[i] != NULL);
+	in->prefix[i] = calloc(n * Fanout, sizeof(unsigned long));
+	assert(in->prefix[i] != NULL);
 	in->levels[i]->Nkeys = 1;
 	in->to_disk.NperLevel[i] = n;
 #ifdef DEBUG
 	printf("%d index records at level %d\n", n, i);
 #endif
-	n = (n + 3) >> 2;
+	n = (n + Fanout - 1) / Fanout;
     }
 #ifdef DEBUG
     printf("-------> 3\n");
@@ -155,84 +280,155 @@ index_makeNew(unsigned long Nblocks, unsigned long KeyLength)
     return in;
 }
 
-/* The following routine writes the index to disk. It assumes that
-   the file is already correctly positioned. It returns the
-   file position after the write */
+/* The records of level lev as they are on disk: the level itself, or,
+   for an older file without padding, a copy without it (to be freed) */
+static char *
+disk_image(in_core * in, unsigned long lev)
+{
+    unsigned long n;
+    char   *image;
+
+    if (in->to_disk.iRecordLength == in->RecordLength)
+    {
+	return (char *) in->levels[lev];
+    }
+    image = malloc(in->to_disk.NperLevel[lev] * in->to_disk.iRecordLength);
+    for (n = 0; image && n < in->to_disk.NperLevel[lev]; n++)
+    {
+	memcpy(image + n * in->to_disk.iRecordLength, RecInLevel(in, lev, n),
+	       in->to_disk.iRecordLength);
+    }
+    return image;
+}
+
+/* The following routine writes the index to disk, starting at byte
+   offset "offset" in the file. It returns the file offset just after
+   the index */
 
 long 
-index_writeToDisk(in_core * in, int fid)
+index_writeToDisk(in_core * in, int fid, long offset)
 {
     unsigned int     i;
     int     rv;
+    char   *image;
     if ((!in) || (!(in->to_disk.Nkeys)) || (!(in->to_disk.KeyLength)))
     {
 	index_error = INDEX_INVALID_HANDLE;
 	return -1;
     }
-    rv = write(fid, &(in->to_disk), sizeof(indexheader) - sizeof(indexRecord)
-	       + in->to_disk.iRecordLength);
+    rv = pwrite(fid, &(in->to_disk), sizeof(indexheader) - sizeof(indexRecord)
+	       + in->to_disk.iRecordLength, offset);
     if (rv != (int) (sizeof(indexheader) - sizeof(indexRecord) +
 	      in->to_disk.iRecordLength))
     {
 	index_error = INDEX_WRITE_FAIL;
 	return -1;
     }
+    offset += rv;
 #ifdef DEBUG
     printf("Wrote %d bytes\n", rv);
 #endif
     for (i = 0; i < in->to_disk.Nlevels; i++)
     {
-	rv = write(fid, in->levels[i], in->to_disk.NperLevel[i] *
-		   in->to_disk.iRecordLength);
+	image = disk_image(in, i);
+	if (!image)
+	{
+	    index_error = INDEX_ALLOCATION_FAILURE;
+	    return -1;
+	}
+	rv = pwrite(fid, image, in->to_disk.NperLevel[i] *
+		   in->to_disk.iRecordLength, offset);
+	if (image != (char *) in->levels[i])
+	{
+	    free(image);
+	}
 	if (rv != (int) (in->to_disk.NperLevel[i] * in->to_disk.iRecordLength))
 	{
 	    index_error = INDEX_WRITE_FAIL;
 	    return -1;
 	}
+	offset += rv;
 #ifdef DEBUG
 	printf("Wrote %d bytes\n", rv);
 #endif
     }
-    return lseek(fid, 0, SEEK_CUR);
+    return offset;
+}
+
+/* The checksum of what index_writeToDisk writes: the header with the
+   root record, and the records of the other levels */
+
+unsigned long
+index_checksum(in_core * in)
+{
+    unsigned int     i;
+    unsigned long crc, n;
+
+    crc = crc32c(0, &(in->to_disk), sizeof(indexheader) -
+		 sizeof(indexRecord) + in->to_disk.iRecordLength);
+    for (i = 0; i < in->to_disk.Nlevels; i++)
+    {
+	if (in->to_disk.iRecordLength == in->RecordLength)
+	{
+	    crc = crc32c(crc, in->levels[i], in->to_disk.NperLevel[i] *
+			 in->to_disk.iRecordLength);
+	    continue;
+	}
+	for (n = 0; n < in->to_disk.NperLevel[i]; n++)
+	{
+	    crc = crc32c(crc, RecInLevel(in, i, n), in->to_disk.iRecordLength);
+	}
+    }
+    return crc;
 }
 
-/* index_readFromDisk will read an index from disk. This is a three step
+/* index_readFromDisk will read an index from disk, starting at byte
+   offset "offset". This is a three step
    process. First the header is read to determine the size of the
    index, then index_makeNew is called to reserve and initialise the
    required memory, and finally, the actual index records are retrieved.
    */
 in_core *
-index_readFromDisk(int fid)
+index_readFromDisk(int fid, long offset)
 {
     unsigned int     i;
     int     rv;
     int     NBlocks;
+    unsigned long Fanout, n;
     indexheader head;
     in_core *in;
 
-    rv = read(fid, &(head), offsetof(indexheader, root));
+    rv = pread(fid, &(head), offsetof(indexheader, root), offset);
     if (rv != offsetof(indexheader, root))
     {
 	index_error = INDEX_READ_ERROR;
 	return NULL;
     }
-    NBlocks = 4 * head.NperLevel[head.Nlevels - 1];
-    in = index_makeNew(NBlocks, head.KeyLength);
+    offset += rv;
+    if ((head.Nlevels < 1) || (head.Nlevels > 8) || (head.KeyLength == 0))
+    {
+	index_error = INDEX_READ_ERROR;
+	return NULL;
+    }
+    Fanout = FanoutOf(head.iRecordLength, head.KeyLength);
+    NBlocks = Fanout * head.NperLevel[head.Nlevels - 1];
+    in = index_makeNew(NBlocks, head.KeyLength, Fanout);
     if (!in)
     {
 	return NULL;
     }
-    assert(head.iRecordLength == in->to_disk.iRecordLength);
+    assert(head.iRecordLength <= in->RecordLength);
     assert(head.Nlevels == in->to_disk.Nlevels);
     assert(head.NperLevel[head.Nlevels - 1] ==
 	   in->to_disk.NperLevel[head.Nlevels - 1]);
     in->to_disk = head;
-    rv = read(fid, &(in->to_disk.root), head.iRecordLength);
+    rv = pread(fid, &(in->to_disk.root), head.iRecordLength, offset);
     if (rv != (int) head.iRecordLength)
     {
 	index_error = INDEX_READ_ERROR;
 	return NULL;
     }
+    offset += rv;
 #ifdef DEBUG
     printf("Read %d bytes\n", rv);
     printf("Nlevels = %d\n", in->to_disk.Nlevels);
@@ -242,14 +438,25 @@ index_readFromDisk(int fid)
 #ifdef DEBUG
 	printf "NperLevel[%d] = %d\n", i, in->to_disk.NperLevel[i]);
 #endif
-	if (read(fid, in->levels[i], in->to_disk.NperLevel[i] *
-		 in->to_disk.iRecordLength) != (int) (in->to_disk.NperLevel[i] *
-	    in->to_disk.iRecordLength))
+	if (pread(fid, in->levels[i], in->to_disk.NperLevel[i] *
+		 in->to_disk.iRecordLength, offset) !=
+	    (int) (in->to_disk.NperLevel[i] * in->to_disk.iRecordLength))
 	{
 	    index_error = INDEX_READ_ERROR;
 	    return NULL;
 	}
+	offset += in->to_disk.NperLevel[i] * in->to_disk.iRecordLength;
+	/* Spread the records of an older file out to the padded size,
+	   last record first */
+	n = (in->to_disk.iRecordLength == in->RecordLength) ? 0 :
+	    in->to_disk.NperLevel[i];
+	while (n-- > 0)
+	{
+	    memmove(RecInLevel(in, i, n), (char *) in->levels[i] +
+		    n * in->to_disk.iRecordLength, in->to_disk.iRecordLength);
+	}
     }
+    build_prefixes(in);
     return in;
 }
 
@@ -257,30 +464,56 @@ index_readFromDisk(int fid)
    It will return the index entry corresponding to the largest valid
    key in the record that is not larger than the key sought.
    If no such key exists, it will return -1. (Zero is a valid index value)
+   The keys in a record are sorted, so we use a binary search, on the
+   key prefixes first.
    It needs as input:
-   The sought key
-   The index record
+   The sought key, and its prefix
+   The index record, and the prefixes of its keys (or NULL to compare
+   the full keys only)
    The length of the keys.
+   The fan-out of the index.
  */
 static long 
-key_to_index(indexRecord * rec, const char *key, unsigned long KeyLength)
+key_to_index(indexRecord * rec, const unsigned long *prefix,
+	     const char *key, unsigned long keyPrefix,
+	     unsigned long KeyLength, unsigned long Fanout)
 {
     int     rv;
     long    index = -1;
-    unsigned int     i;
-    for (i = 0; i < rec->Nkeys; i++)
+    unsigned long lo = 0;
+    unsigned long hi = rec->Nkeys;
+    unsigned long mid;
+
+    /* Invariant: keys below lo are <= key, keys from hi on are > key */
+    while (lo < hi)
     {
-	rv = strncmp(key, KeyInRec(i, *rec, KeyLength), KeyLength);
+	mid = (lo + hi) / 2;
+	if (prefix && keyPrefix != prefix[mid])
+	{
+	    rv = (keyPrefix < prefix[mid]) ? -1 : 1;
+	}
+	else
+	{
+	    rv = key_compare(key, KeyInRec(mid, *rec, KeyLength, Fanout),
+			     KeyLength);
+	}
 	if (rv < 0)
 	{
-	    break;
+	    hi = mid;
 	}
-	index = rec->index[i];
-	if (rv == 0)
+	else
 	{
-	    break;
+	    lo = mid + 1;
+	    if (rv == 0)
+	    {
+		break;
+	    }
 	}
     }
+    if (lo > 0)
+    {
+	index = rec->index[lo - 1];
+    }
 #ifdef DEBUG
     printf("index = %d ", index);
 #endif
@@ -291,16 +524,17 @@ key_to_index(indexRecord * rec, const char *key, unsigned long KeyLength)
    given key. The value it should return is the number of the data
    block where the key-search should continue.
    It needs as input:
-   The key sought
    A pointer to the in-core structure
-   The key length
+   The key sought
+   Whether to search on the key prefixes first
  */
-long 
-index_keyToBlock(in_core * in, const char *key)
+static long
+key_to_block(in_core * in, const char *key, int usePrefix)
 {
     long    index = 0;
     unsigned int     i;
-    int     KeyLength = in->to_disk.KeyLength;
+    int     KeyLength;
+    unsigned long keyPrefix;
     indexRecord *rec;
 
     if ((!in) || (!(in->to_disk.Nkeys)) || (!(in->to_disk.KeyLength)))
@@ -308,8 +542,11 @@ index_keyToBlock(in_core * in, const char *key)
 	index_error = INDEX_INVALID_HANDLE;
 	return -1;
     }
+    KeyLength = in->to_disk.KeyLength;
+    keyPrefix = key_prefix(key, KeyLength);
     rec = &(in->to_disk.root);
-    index = key_to_index(rec, key, KeyLength);
+    index = key_to_index(rec, usePrefix ? in->rootPrefix : NULL, key,
+			 keyPrefix, KeyLength, in->Fanout);
     if (index < 0)
     {
 	index_error = INDEX_INDEXING_ERROR;
@@ -318,9 +555,10 @@ index_keyToBlock(in_core * in, const char *key)
 
     for (i = 0; i < in->to_disk.Nlevels; i++)
     {
-	rec = (indexRecord *) (index * in->to_disk.iRecordLength +
-			       (char *) in->levels[i]);
-	index = key_to_index(rec, key, KeyLength);
+	rec = RecInLevel(in, i, index);
+	index = key_to_index(rec, usePrefix ?
+			     in->prefix[i] + index * in->Fanout : NULL, key,
+			     keyPrefix, KeyLength, in->Fanout);
 	if (index < 0)
 	{
 	    index_error = INDEX_INDEXING_ERROR;
@@ -330,6 +568,18 @@ index_keyToBlock(in_core * in, const char *key)
     return index;
 }
 
+long 
+index_keyToBlock(in_core * in, const char *key)
+{
+    return key_to_block(in, key, 1);
+}
+
+long 
+index_keyToBlockNoPrefix(in_core * in, const char *key)
+{
+    return key_to_block(in, key, 0);
+}
+
 /* The following routine must add a key at the end of an index. Now
    this is a complex operation.
    1) We must ensure that the key is indeed larger than the last key.
@@ -341,12 +591,13 @@ index_keyToBlock(in_core * in, const char *key)
 int 
 index_addKey(in_core * in, const char *key, int index)
 {
-    unsigned int     maxKeys = 4 * in->to_disk.NperLevel[in->to_disk.Nlevels - 1];
-    int     lev = in->to_disk.Nlevels - 1;
-    int     KeyLength = in->to_disk.KeyLength;
+    unsigned long Fanout;
+    unsigned int     maxKeys;
+    int     lev;
+    int     KeyLength;
     int     nrec;
     int     nkey;
-    int     keyno = in->to_disk.Nkeys;
+    int     keyno;
     int     do_prev;
     indexRecord *rec;
     int     rv;
@@ -356,6 +607,11 @@ index_addKey(in_core * in, const char *key, int index)
 	index_error = INDEX_INVALID_HANDLE;
 	return -1;
     }
+    Fanout = in->Fanout;
+    lev = in->to_disk.Nlevels - 1;
+    maxKeys = Fanout * in->to_disk.NperLevel[lev];
+    KeyLength = in->to_disk.KeyLength;
+    keyno = in->to_disk.Nkeys;
     /* See if we can accommodate more keys */
     if (in->to_disk.Nkeys >= maxKeys)
     {
@@ -364,11 +620,10 @@ index_addKey(in_core * in, const char *key, int index)
     }
     /* Find highest key and compare */
 
-    nrec = (keyno - 1) / 4;
-    nkey = (keyno - 1) & 0x0003;
-    rec = (indexRecord *) (nrec * in->to_disk.iRecordLength +
-			   (char *) in->levels[lev]);
-    rv = strncmp(key, KeyInRec(nkey, *rec, KeyLength), KeyLength);
+    nrec = (keyno - 1) / Fanout;
+    nkey = (keyno - 1) % Fanout;
+    rec = RecInLevel(in, lev, nrec);
+    rv = strncmp(key, KeyInRec(nkey, *rec, KeyLength, Fanout), KeyLength);
     if (rv <= 0)
     {
 	index_error = INDEX_KEY_NOT_LARGER;
@@ -376,15 +631,15 @@ index_addKey(in_core * in, const char *key, int index)
     }
     /* Find insertion point at leaf level and insert */
 
-    nrec = keyno / 4;
-    nkey = keyno & 0x0003;
-    rec = (indexRecord *) (nrec * in->to_disk.iRecordLength +
-			   (char *) in->levels[lev]);
+    nrec = keyno / Fanout;
+    nkey = keyno % Fanout;
+    rec = RecInLevel(in, lev, nrec);
 #ifdef DEBUG
     printf("nrec = %d, nkey = %d, lev = %d, NperLevel = %d\n",
 	    nrec, nkey, lev, in->to_disk.NperLevel[lev]);
 #endif
-    strncpy(KeyInRec(nkey, *rec, KeyLength), key, KeyLength);
+    strncpy(KeyInRec(nkey, *rec, KeyLength, Fanout), key, KeyLength);
+    in->prefix[lev][nrec * Fanout + nkey] = key_prefix(key, KeyLength);
     do_prev = !nkey;
     rec->index[nkey] = index;
     rec->Nkeys++;
@@ -397,15 +652,15 @@ index_addKey(in_core * in, const char *key, int index)
     for (; do_prev && (lev--);)
     {
 	keyno = nrec;
-	nrec = keyno / 4;
-	nkey = keyno & 0x0003;
+	nrec = keyno / Fanout;
+	nkey = keyno % Fanout;
 #ifdef DEBUG
 	printf("nrec = %d, nkey = %d, lev = %d, NperLevel = %d\n",
 		nrec, nkey, lev, in->to_disk.NperLevel[lev]);
 #endif
-	rec = (indexRecord *) (nrec * in->to_disk.iRecordLength +
-			       (char *) in->levels[lev]);
-	strncpy(KeyInRec(nkey, *rec, KeyLength), key, KeyLength);
+	rec = RecInLevel(in, lev, nrec);
+	strncpy(KeyInRec(nkey, *rec, KeyLength, Fanout), key, KeyLength);
+	in->prefix[lev][nrec * Fanout + nkey] = key_prefix(key, KeyLength);
 	do_prev = !nkey;
 	rec->index[nkey] = keyno;
 	rec->Nkeys++;
@@ -413,20 +668,107 @@ index_addKey(in_core * in, const char *key, int index)
     if (do_prev)
     {
 	/* Add key to root as well */
-	if (nrec >= 4)
+	if (nrec >= (int) Fanout)
 	{
 	    index_error = INDEX_WEIRD_ERROR;
 	    return -1;
 	}
 	nkey = nrec;
 	rec = &(in->to_disk.root);
-	strncpy(KeyInRec(nkey, *rec, KeyLength), key, KeyLength);
+	strncpy(KeyInRec(nkey, *rec, KeyLength, Fanout), key, KeyLength);
+	in->rootPrefix[nkey] = key_prefix(key, KeyLength);
 	rec->index[nkey] = nkey;
 	rec->Nkeys++;
     }
     return in->to_disk.Nkeys;
 }
 
+/* index_grow makes a larger index and adds the keys of the leaf level
+   of the old one to it, in order. The empty key for record 0 is already
+   present in every new index. */
+in_core *
+index_grow(in_core * in, unsigned long Nblocks)
+{
+    unsigned long KeyLength;
+    unsigned long lev;
+    unsigned long nrec;
+    unsigned long k;
+    indexRecord *rec;
+    in_core *grown;
+
+    if ((!in) || (!(in->to_disk.Nkeys)) || (!(in->to_disk.KeyLength)))
+    {
+	index_error = INDEX_INVALID_HANDLE;
+	return NULL;
+    }
+    KeyLength = in->to_disk.KeyLength;
+    lev = in->to_disk.Nlevels - 1;
+    if (Nblocks < 2 * in->Fanout * in->to_disk.NperLevel[lev])
+    {
+	Nblocks = 2 * in->Fanout * in->to_disk.NperLevel[lev];
+    }
+    grown = index_makeNew(Nblocks, KeyLength, in->Fanout);
+    if (!grown)
+    {
+	return NULL;
+    }
+    for (nrec = 0; nrec < in->to_disk.NperLevel[lev]; nrec++)
+    {
+	rec = RecInLevel(in, lev, nrec);
+	for (k = (nrec == 0); k < rec->Nkeys; k++)
+	{
+	    if (index_addKey(grown, KeyInRec(k, *rec, KeyLength, in->Fanout),
+			     rec->index[k]) < 0)
+	    {
+		index_free(grown);
+		return NULL;
+	    }
+	}
+    }
+    index_free(in);
+    return grown;
+}
+
+/* index_copy makes an exact copy of an index, with the same fan-out and
+   size */
+in_core *
+index_copy(in_core * in)
+{
+    unsigned long i;
+    unsigned long n;
+    in_core *copy;
+
+    if ((!in) || (!(in->to_disk.Nkeys)) || (!(in->to_disk.KeyLength)))
+    {
+	index_error = INDEX_INVALID_HANDLE;
+	return NULL;
+    }
+    copy = malloc(sizeof(in_core) - sizeof(indexRecord) + in->RecordLength);
+    if (!copy)
+    {
+	index_error = INDEX_ALLOCATION_FAILURE;
+	return NULL;
+    }
+    memcpy(copy, in, sizeof(in_core) - sizeof(indexRecord) +
+	   in->RecordLength);
+    copy->rootPrefix = malloc(in->Fanout * sizeof(unsigned long));
+    assert(copy->rootPrefix != NULL);
+    memcpy(copy->rootPrefix, in->rootPrefix,
+	   in->Fanout * sizeof(unsigned long));
+    for (i = 0; i < in->to_disk.Nlevels; i++)
+    {
+	n = in->to_disk.NperLevel[i];
+	copy->levels[i] = malloc(n * in->RecordLength);
+	assert(copy->levels[i] != NULL);
+	memcpy(copy->levels[i], in->levels[i], n * in->RecordLength);
+	copy->prefix[i] = malloc(n * in->Fanout * sizeof(unsigned long));
+	assert(copy->prefix[i] != NULL);
+	memcpy(copy->prefix[i], in->prefix[i],
+	       n * in->Fanout * sizeof(unsigned long));
+    }
+    return copy;
+}
+
 /* Call this function to free the memory used by the index */
 int 
 index_free(in_core * in)
@@ -448,7 +790,10 @@ index_free(in_core * in)
     {
 	free(in->levels[i]);
 	in->levels[i] = NULL;
+	free(in->prefix[i]);
+	in->prefix[i] = NULL;
     }
+    free(in->rootPrefix);
     in->to_disk.Nkeys = 0;
     in->to_disk.KeyLength = 0;
     free(in);
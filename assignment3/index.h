@@ -16,7 +16,12 @@
 	 that are also used in normal file systems.
 ----------------------------------------------------------------------------*/
 
+/* index_error is per thread, like isam_error */
+#ifdef __GNUC__
+extern __thread int index_error;
+#else
 extern int index_error;
+#endif
 
 #define INDEX_FULL			(100)
 #define INDEX_ALLOCATION_FAILURE	(101)
@@ -32,36 +37,64 @@ typedef struct INDEX_IN_CORE *index_handle;
 
 /* index_makeNew will construct a new index (in memory only),
    characterised by Nblocks (the maximum number if entries in
-   the index) and KeyLength (the length of the key strings).
+   the index), KeyLength (the length of the key strings) and Fanout
+   (the number of keys per index record, at least 4). With Fanout == 0
+   the fan-out is chosen such that an index record fills INDEX_NODE_SIZE
+   bytes.
    */
-index_handle index_makeNew(unsigned long Nblocks, unsigned long KeyLength);
+#define INDEX_NODE_SIZE			(4096)
+
+index_handle index_makeNew(unsigned long Nblocks, unsigned long KeyLength,
+			   unsigned long Fanout);
+
+/* index_maxFanout returns the fan-out index_makeNew chooses for
+   Fanout == 0: the largest for which an index record fits in
+   INDEX_NODE_SIZE bytes */
+unsigned long index_maxFanout(unsigned long KeyLength);
 
-/* The following routine writes the index to disk. It assumes that
-   the file is already correctly positioned. It returns the
-   file position after the write.
+/* index_fanout returns the fan-out of an index */
+unsigned long index_fanout(index_handle in);
+
+/* The following routine writes the index to disk. It uses positional
+   writes, so it does not depend on (or change) the file position. It
+   returns the file offset just after the index.
    Required input:
    The index handle
-   The file handle */
-long index_writeToDisk(index_handle in, int fid);
+   The file handle
+   The byte offset in the file where the index starts */
+long index_writeToDisk(index_handle in, int fid, long offset);
+
+/* index_checksum returns the CRC32C (see crc32c.h) of the bytes that
+   index_writeToDisk writes, so that an index read back with
+   index_readFromDisk can be checked against the value it had when it
+   was written. */
+unsigned long index_checksum(index_handle in);
 
 /* index_readFromDisk will read an index from disk. This is a three step
    process. First the header is read to determine the size of the
    index, then index_makeNew is called to reserve and initialise the
    required memory, and finally, the actual index records are retrieved.
-   The required input is the integer identifier of the (correctly positioned)
-   file.
+   The required input is the integer identifier of the file and the byte
+   offset in the file where the index starts.
    */
-index_handle index_readFromDisk(int fid);
+index_handle index_readFromDisk(int fid, long offset);
 
 /* The following routine will use a complete index to look for a
    given key. The value it should return is the number of the data
    block where the key-search should continue.
    It needs as input:
    The index handle for the index.
-   The key sought
+   The key sought (a field of KeyLength bytes, see key_compare)
  */
 long index_keyToBlock(index_handle in, const char * key);
 
+/* index_keyToBlockNoPrefix does the same search as index_keyToBlock,
+   but compares the full keys in the index records only, without first
+   comparing the key prefixes. It is meant for comparing the speed of
+   both (see isam_bench).
+ */
+long index_keyToBlockNoPrefix(index_handle in, const char * key);
+
 /* The following routine must add a key at the end of an index.
    It needs as input:
    The index handle for the index.
@@ -70,6 +103,18 @@ long index_keyToBlock(index_handle in, const char * key);
  */
 int index_addKey(index_handle in, const char * key, int index);
 
+/* index_grow replaces a full index by a larger one with the same keys,
+   with room for at least Nblocks entries (and at least twice as many as
+   before), and the default fan-out. The old index is freed; on failure
+   NULL is returned and the old index remains valid.
+ */
+index_handle index_grow(index_handle in, unsigned long Nblocks);
+
+/* index_copy returns an exact copy of an index, that is not affected by
+   later changes to the original, or NULL on failure.
+ */
+index_handle index_copy(index_handle in);
+
 /* Call this function to free the memory used by the index */
 int index_free(index_handle in);
 
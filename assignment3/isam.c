@@ -29,7 +29,7 @@
          initially filled.
          The key of the first record in each block is also used in the
          (fixed) index at the start of the file.
-             The index will be a N-ary tree (N = 4), organised in records.
+             The index will be a N-ary tree, organised in records.
              It will precede the area with the data blocks and will in turn
              be preceded by the information area for the file.
              The last part of the file is the general overflow area, which can
@@ -42,7 +42,9 @@
       File structure:
       File header - describes contents and field lengths
       ---------------------------------------
-      Index records:  ceil(Nblocks / 4) + ceil(Nblocks / 16) + ....
+      Index records:  ceil(Nblocks / N) + ceil(Nblocks / N^2) + ....
+      ---------------------------------------
+      Bloom filters (optional): one per regular data block
       ---------------------------------------
       Sequential data block area (Nblocks blocks)
       ---------------------------------------
@@ -70,35 +72,91 @@
       marked "reserved" right at the start.
       When creating the file, every Nth (N = NrecPB - 1) record's key will
       be inserted into the index.
-      The index will be a tree where every node has up to four children.
+      The index will be a tree where every node has up to N children
+      (by default N is chosen such that a node fills 4 KiB).
       The leaf nodes point to the records. The reason for not using a more
       sophisticated tree structure are that not all keys searched for need
       appear in the tree.
-      So the structure will be:
+      So the structure will be (for N = 4):
                                 1 17 33 49
                 1 5 9 13                        17 ..
       1 2 3 4   5 6 7 8   9 10 11 12   13 14 15 16   17 18 19 20 ....
 
       The depth of the tree will be determined by Nblocks
-        (D = ceil(log4(Nblocks)))
+        (D = ceil(logN(Nblocks)))
 */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
+#include <stddef.h>
+#include <time.h>
+#include <pthread.h>
+#ifdef HAVE_IO_URING
+#include <errno.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
 
 /* Use assert to pinpoint fatal errors - should be removed later */
 #include <assert.h>
 #include "isam.h"
 #include "index.h"
-
-/* Just one flag value describing the state of the file for now */
+#include "keycmp.h"
+#include "crc32c.h"
+
+/* Flag values describing the state of the file. ISAM_HAS_BLOOM marks a
+   file with Bloom filters (see below); such files have version 1, so
+   that versions of this library that do not maintain the filters refuse
+   to open them. Likewise, files with a write-ahead log (ISAM_HAS_WAL)
+   have version 2: an older version would ignore the log, and files with
+   secondary indexes (ISAM_HAS_SECONDARY) version 3, as an older version
+   would not maintain them. A file of which the index has grown beyond
+   its place in the file keeps it in a companion file
+   (ISAM_HAS_INDEX_FILE); such files have version 4, as an older version
+   would read the outdated index in the file. Files of which the blocks
+   are stored as slotted pages (ISAM_HAS_PAGES) have version 5, and
+   files with records of variable length (ISAM_HAS_VARLEN), which also
+   have pages, version 6. Files with checksums (ISAM_HAS_CHECKSUMS) have
+   version 7, as an older version would not see where the blocks are. */
 
 #define ISAM_STATE_UPDATING     (1024)
+#define ISAM_HAS_BLOOM          (2048)
+#define ISAM_HAS_WAL            (4096)
+#define ISAM_HAS_SECONDARY      (8192)
+#define ISAM_HAS_INDEX_FILE     (16384)
+#define ISAM_HAS_PAGES          (32768)
+#define ISAM_HAS_VARLEN         (65536)
+#define ISAM_HAS_CHECKSUMS      (131072)
+#define ISAM_VERSION_BLOOM      (1)
+#define ISAM_VERSION_WAL        (2)
+#define ISAM_VERSION_SECONDARY  (3)
+#define ISAM_VERSION_INDEX_FILE (4)
+#define ISAM_VERSION_PAGES      (5)
+#define ISAM_VERSION_VARLEN     (6)
+#define ISAM_VERSION_CHECKSUMS  (7)
+
+/* An option of isam_createWithOptions for internal use: the companion
+   files of secondary indexes have keys longer than the usual maximum of
+   40 bytes */
+
+#define ISAM_CREATE_LONG_KEYS   (256)
+
+/* Another one: with ISAM_CREATE_PAGES, NrecPB is the number of record
+   positions per block itself (as in the header of a file with pages),
+   rather than a size for the pages (see page_slots) */
+
+#define ISAM_CREATE_SLOTS       (512)
+
+/* The fan-out of ISAM_CREATE_FANOUT(n), or 0 for the default */
+
+#define CreateFanout(options)   (((unsigned long) (options) >> 16) & 0x7fff)
 
 /* An isam file will start with an information block that is described
    in the following typedef. */
@@ -118,6 +176,20 @@ typedef struct {
     unsigned long FileState;     /* Flags to indicate file state     */
 } fileHead;
 
+/* In a file with ISAM_HAS_CHECKSUMS, the header is followed by the
+   CRC32C of the header and that of the index (as written by
+   index_writeToDisk, in the file or in its companion file); the index
+   follows those. The header and its checksum are written together. */
+
+typedef struct {
+    unsigned long head;          /* Checksum of the header           */
+    unsigned long index;         /* Checksum of the index            */
+} fileCheck;
+
+#define IndexStart(state)   (sizeof(fileHead) + \
+                             (((state) & ISAM_HAS_CHECKSUMS) ? \
+                              sizeof(fileCheck) : 0))
+
 /* Occupied record positions come in three tastes, for now */
 
 #define ISAM_VALID        (1)
@@ -135,25 +207,355 @@ typedef struct {
     unsigned long statusFlags;
 } recordHead;
 
+/* In a file with ISAM_HAS_VARLEN, DataLen is the maximum length of the
+   data. In the cache, the data field of a record is followed by its
+   actual length (the rest of the field is zero) and by the position of
+   the value in the heap, if it is stored there (see page_encode) */
+
+typedef struct {
+    unsigned long length;
+    unsigned long heapPos;
+} dataTail;
+
 /* When a file is opened some additional information will be stored in
    memory, besides the file header. This includes, e.g. a cache for
-   recently used blocks. */
+   recently used blocks.
+   The cache is a small buffer pool: its number of slots is chosen when
+   the file is created or opened. Blocks are found through a hash table
+   (chained through hashNext) and replaced according to the CLOCK
+   algorithm: every slot has a reference bit that is set on each hit and
+   cleared when the clock hand passes; the first slot found with a clear
+   bit is replaced. Slots that are in use by a cursor (see below) are
+   never chosen.
+   Modified blocks are not written right away, but marked dirty; they
+   are written when their slot is replaced, or by isam_flush (which is
+   also called by isam_close). The same holds for the file header and
+   the index.
+   A file opened with ISAM_OPEN_MMAP is also mapped into memory. A slot
+   for a block that is present in the mapping then simply points into
+   the mapping (mapped[] is set), so no data are copied and a modified
+   block need not be written separately. Blocks beyond the mapping use
+   the private slot memory as usual; isam_flush renews the mapping (and
+   makes it larger) when the file has grown beyond it.
+   A file created with ISAM_CREATE_BLOOM has a Bloom filter for every
+   regular data block, stored between the index and the data blocks and
+   kept in memory while the file is open. The filter of block B contains
+   the keys of all records for which the index search ends in B, i.e.
+   the records in block B itself and those that went into the overflow
+   area from there. A search for a key that is not in the filter can
+   stop without reading any data block. Keys are added on isam_writeNew;
+   a Bloom filter cannot forget keys, so the filter of a block is
+   recomputed after ISAM_BLOOM_MAX_DELETES deletions.
+   All of this is shared by the cursors (struct ISAM, the isamPtr given
+   to the user) on the file; a cursor only holds the current position
+   and a buffer for the search key. isam_openCursor adds a cursor, the
+   file is closed with its last cursor.
+   Several threads may use the file, each with its own cursor. Routines
+   that only read take the file lock shared, routines that modify the
+   file take it exclusively. The cache administration is protected by
+   cacheLock; a block is read from disk without holding that mutex,
+   with loading[] set, so that other threads wait for it (on cacheCond)
+   rather than read it as well. A cursor pins the slot with its current
+   record and the slot it has loaded last (work), so that these remain
+   in place while other threads replace blocks.
+   With isam_setQueueDepth, a pool of I/O threads reads blocks into the
+   cache ahead of isam_readManyByKey and isam_scanRange, in the same
+   way (loading[] set while the read is in progress), so that many
+   reads are outstanding at the same time. A routine that takes the
+   file lock exclusively waits for those reads first.
+   A file created with ISAM_CREATE_WAL has a write-ahead log (see the
+   description with wal_commit). Each modifying routine logs the blocks
+   it has changed, and only returns when the log is on disk; the blocks
+   themselves are written later, as usual. Such a file needs a few more
+   slots, as a routine keeps the blocks it modifies in the cache until
+   it has logged them.
+   A secondary index (isam_addSecondary) is a companion ISAM file, opened
+   and closed with the file. Its keys consist of the indexed part of the
+   data field, a byte 1 and the key of the record; its data field holds
+   the number of the record. The modifying routines keep it up to date
+   while they hold the file lock; readers use it through a cursor of
+   their own on the companion file (secCursor).
+   A file grows beyond its Nblocks regular blocks when needed: blocks
+   past them are filled like regular blocks, and the first record of
+   each new block goes into the index. When the index is full it is
+   replaced by a larger one (index_grow), which no longer fits in its
+   place in the file; from then on it is written to a companion file,
+   the file name with ".idx" appended (indexFd). Blocks beyond Nblocks
+   that are not in the index are overflow blocks. As these are now mixed
+   with the others, a search for a free overflow slot starts at
+   freeHint rather than at Nblocks.
+   A file created with ISAM_CREATE_PAGES stores its blocks on disk in a
+   compact form, as slotted pages (see below) of pageSize bytes; in the
+   cache they have the usual layout of blockSize bytes. Such files are
+   never mapped into memory.
+   With ISAM_CREATE_VARLEN, a page only holds as many bytes of a data
+   field as the record actually has. Long values go to the heap, a
+   companion file (the file name with ".heap" appended, heapFd) to which
+   values are only appended: a value that is replaced or deleted leaves
+   its space behind until isam_reorganize.
+   With ISAM_CREATE_CHECKSUMS, every block on disk (page, or block in
+   the cache layout) is followed by a CRC32C of its contents and its
+   number (see block_seal), so that damaged blocks, and blocks written
+   in the wrong place, are noticed when they are read. A block on disk
+   then takes diskSize bytes. Such files are never mapped into memory
+   either. */
+
+#define ISAM_MIN_CACHE_SIZE     (4)
+#define ISAM_MIN_WAL_CACHE_SIZE (16)
+
+/* A snapshot (see isam_snapshot_begin) has a cache of its own, as its
+   blocks may differ from those of the file. It is mostly used for
+   scans, which need few blocks */
+
+#define ISAM_SNAPSHOT_CACHE     (64)
+
+/* Each filter has room for 2 * NrecPB keys (a full block plus as many
+   overflow records) at ISAM_BLOOM_BITS_PER_KEY bits per key, rounded up
+   to a multiple of 8 bytes */
+
+#define ISAM_BLOOM_BITS_PER_KEY (10)
+#define ISAM_BLOOM_PROBES       (5)
+#define ISAM_BLOOM_MAX_DELETES  (8)
+
+#define BloomBytes(NrecPB)  ((2 * (NrecPB) * ISAM_BLOOM_BITS_PER_KEY + 63) \
+                             / 64 * 8)
+
+/* A block of a file with ISAM_HAS_PAGES is stored on disk as a slotted
+   page: the number of records and the start of the record area (16 bits
+   each), followed by a slot per record giving its position in the block
+   and the offset of the record in the page (16 bits each). The records
+   are stored from the end of the page downwards. A record holds the
+   numbers of the next and previous records (32 bits each, so such a
+   file has at most 2^32 record positions), its status flags, the
+   number of leading key bytes it shares with the key of the preceding
+   slot, the number of key bytes that follow, those bytes (the zero
+   bytes padding a key are not stored) and the data field. The slots
+   are in key order, so that neighbouring keys share long prefixes;
+   free record positions are not stored at all.
+   A page holds as many records as fit: NrecPB is the number of record
+   positions in a block in the cache, and is chosen so high that it
+   hardly ever limits the number of records (PageSize). A record is only
+   added to a block when its page has room for it (page_fits).
+   In a file with ISAM_HAS_VARLEN, the data field is replaced by the
+   length of the value (32 bits) and the value itself, or, for a value
+   longer than inlineMax, its position in the heap (64 bits); the status
+   flags then include ISAM_PAGE_IN_HEAP. */
+
+#define ISAM_PAGE_HEAD      (4)
+#define ISAM_PAGE_SLOT      (4)
+#define ISAM_PAGE_RECORD    (11)
+#define ISAM_PAGE_LENGTH    (4)
+#define ISAM_PAGE_HEAP      (8)
+#define ISAM_PAGE_IN_HEAP   (128)
+#define ISAM_PAGE_MAX       (65535)
+#define ISAM_PAGE_MAX_REC   (0xffffffffUL)
+
+/* The heap starts with a few bytes to identify it, so that no value is
+   at position 0 */
+
+#define ISAM_HEAP_MAGIC     "isamheap"
+#define ISAM_HEAP_START     (8)
+
+/* The checksum following a block on disk, least significant byte
+   first */
+
+#define ISAM_BLOCK_CHECK    (4)
+
+/* The space a record with DataLen bytes of data takes in a page
+   (including its slot), and the size of a page with room for NrecPB of
+   those. Pages of a file with ISAM_HAS_VARLEN are sized for values of a
+   quarter of the maximum length (PageData) */
+
+#define PageMinRecord(DataLen)  (ISAM_PAGE_SLOT + ISAM_PAGE_RECORD + (DataLen))
+#define PageSize(NrecPB, DataLen)   (ISAM_PAGE_HEAD + \
+                                     (NrecPB) * PageMinRecord(DataLen))
+#define PageData(DataLen, state)    (((state) & ISAM_HAS_VARLEN) ? \
+                                     ISAM_PAGE_LENGTH + (DataLen) / 4 : \
+                                     (DataLen))
+
+/* The entries of a secondary index of a file are found in blocks of
+   about ISAM_SECONDARY_BLOCK bytes */
+
+#define ISAM_SECONDARY_BLOCK    (4096)
+
+/* A secondary index of a file. Its definition is also stored in the
+   data field of the dummy first record of the companion file (see
+   SecondaryDef) */
+
+struct isamSecondary {
+    isamPtr base;                       /* Cursor on the companion file,
+                                           or NULL if not in use          */
+    unsigned long offset;               /* Indexed part of the data field */
+    unsigned long length;
+    int     string;                     /* The part is a string           */
+};
+
+#define SecondaryDef(s)     (((s)->offset << 16) | ((s)->length << 1) | \
+                             ((s)->string ? 1 : 0))
+
+/* A growing memory buffer for records of the write-ahead log */
+
+struct walBuffer {
+    char   *data;
+    size_t  length;                     /* Bytes in use                   */
+    size_t  size;                       /* Bytes allocated                */
+};
+
+/* A copy of a data block (in the cache layout) saved for the snapshots,
+   followed by the block itself. gen is the generation of the latest
+   snapshot when it was saved; a snapshot reads the oldest copy of a
+   block saved in or after its own generation (the block was not
+   modified between the start of the snapshot and that of the copy), or
+   the block itself if there is none. */
+
+struct snapVersion {
+    unsigned long block_no;
+    unsigned long gen;
+    struct snapVersion *next;           /* Next copy in the same bucket;
+                                           newer copies come first      */
+};
 
-#define CACHE_SIZE  (6)
+/* Scratch arrays of page_order and the routines using it, for NrecPB + 1
+   records */
 
-typedef struct ISAM {
+struct pageScratch {
+    const char **keys;
+    int     *slots;
+    unsigned long *lengths;
+    unsigned char *inHeap;
+};
+
+/* Blocks stored as pages or with a checksum are read through one of
+   ISAM_READ_BUFS page buffers of the file, which readers take without
+   cacheLock (readBufBusy has a bit per buffer in use) */
+
+#define ISAM_READ_BUFS  (16)
+
+/* Dirty neighbours of a block are written together with it, at most
+   ISAM_MAX_RUN blocks at a time (see flush_cache_block) */
+
+#define ISAM_MAX_RUN    (16)
+
+typedef struct ISAM_FILE {
     fileHead fHead;                     /* The file header                */
     unsigned long blockSize;            /* The file datablock size        */
+    unsigned long pageSize;             /* Size of a block on disk,
+                                           without its checksum           */
+    unsigned long diskSize;             /* Size of a block on disk        */
+    char    *pageBuf;                   /* Pages of a run being written,
+                                           under cacheLock or the
+                                           exclusive lock                 */
+    char    *readBuf[ISAM_READ_BUFS];   /* Pages being read, allocated
+                                           on first use                   */
+    unsigned long readBufBusy;          /* Read buffers in use            */
+    struct pageScratch needScratch;     /* For page_need (writers)        */
+    struct pageScratch encodeScratch;   /* For page_encode (under
+                                           cacheLock or the exclusive
+                                           lock)                          */
+    unsigned long inlineMax;            /* Longest value kept in a page   */
+    int     heapFd;                     /* Heap for long values, or -1    */
+    unsigned long heapEnd;              /* Where the next value goes      */
     int     mayWrite;                   /* Unused - opened for read/write */
     int     fileId;                     /* The file-id for the file       */
     int     errorState;                 /* Unused                         */
-    int     cur_id;                     /* The cache-slot containing the current record */
-    int     cur_recno;                  /* The position in the cache of the current record */
-    int     last_in;                    /* For a FIFO cache               */
-    int     blockInCache[CACHE_SIZE];   /* block number per cache slot    */
+    int     cacheSize;                  /* Number of slots in the cache   */
+    int     clockHand;                  /* Next slot to consider for replacement */
+    unsigned long hashMask;             /* Number of hash buckets - 1     */
+    long    *blockInCache;              /* block number per cache slot    */
+    int     *hashHead;                  /* First cache slot per bucket    */
+    int     *hashNext;                  /* Next cache slot in same bucket */
+    unsigned char *refBit;              /* CLOCK reference bit per slot   */
+    unsigned char *dirty;               /* Slot modified, not yet written */
+    int     headDirty;                  /* Header modified, not yet written */
+    int     indexDirty;                 /* Index modified, not yet written */
+    int     unflushed;                  /* Modified since last isam_flush */
+    unsigned long diskBlocks;           /* Data blocks actually on disk   */
     index_handle index;         /* The handle for the index       */
-    char    *cache[CACHE_SIZE];         /* Pointers to cache blocks       */
+    char    **cache;                    /* Pointers to cache blocks       */
+    char    *cacheMem;                  /* Private memory for the slots   */
+    unsigned char *mapped;              /* Slot points into the mapping   */
+    char    *map;                       /* File mapping, or NULL          */
+    size_t  mapLength;                  /* Length of the mapping in bytes */
+    unsigned long mapBlocks;            /* Data blocks covered by mapping */
     char    * maxKey;                   /* The highest key in the file    */
+    unsigned char *bloom;               /* Bloom filters, or NULL         */
+    unsigned long bloomBytes;           /* Size of the filter per block   */
+    unsigned long bloomStart;           /* Byte offset of the filters     */
+    unsigned char *bloomDeletes;        /* Deletions since filter rebuild */
+    int     bloomDirty;                 /* Filters modified, not written  */
+    int     *pinCount;                  /* Cursors using the slot         */
+    unsigned char *loading;             /* Slot being read from disk      */
+    int     nHandles;                   /* Number of cursors on the file  */
+    pthread_rwlock_t lock;              /* Readers shared, writers exclusive */
+    pthread_mutex_t cacheLock;          /* Protects the cache administration */
+    pthread_cond_t  cacheCond;          /* A slot has been loaded         */
+    struct ISAM_STATS stats;            /* Work for all cursors, and that
+                                           of closed cursors (isam_stats) */
+    struct ISAM_STATS statsBase;        /* Totals at isam_resetStats      */
+    struct ISAM *cursors;               /* The open cursors on the file   */
+    int     walFd;                      /* Write-ahead log, or -1         */
+    int     indexFd;                    /* Companion file with the index,
+                                           or -1 if it is in the file    */
+    unsigned long freeHint;             /* No free slots in the blocks
+                                           from Nblocks up to this one   */
+    char    *walName;                   /* File name of the log           */
+    int     walActive;                  /* Logging the running routine    */
+    unsigned char *walPending;          /* Slot modified, not yet logged  */
+    int     *walSlots;                  /* The slots with walPending set  */
+    int     walNSlots;                  /* Number of those slots          */
+    unsigned long long *walLsn;         /* Log position holding the slot  */
+    struct walBuffer walTxn;            /* Transaction being built        */
+    struct walBuffer walBuf;            /* Committed, not yet written     */
+    struct walBuffer walSpare;          /* Buffer for the next writer     */
+    unsigned long long walEnd;          /* Log position after last commit */
+    unsigned long long walDurable;      /* Log position synced to disk    */
+    unsigned long long walFileBase;     /* Log position at start of file  */
+    int     walWriting;                 /* A thread is writing the log    */
+    int     walFailed;                  /* Writing the log has failed     */
+    pthread_mutex_t walLock;            /* Protects walBuf and the above  */
+    pthread_cond_t  walCond;            /* The log has been written       */
+    pthread_t *ioThreads;               /* Threads reading blocks ahead   */
+    int     ioDepth;                    /* Number of I/O threads, or 0    */
+    int     *ioQueue;                   /* Slots waiting to be read       */
+    int     ioHead;                     /* First entry of ioQueue         */
+    int     ioQueued;                   /* Entries in ioQueue             */
+    int     ioBusy;                     /* Slots being read by the threads */
+    int     ioStop;                     /* The threads should finish      */
+    pthread_cond_t  ioCond;             /* ioQueue is no longer empty     */
+    struct ioRing *ioRing;              /* io_uring for the reads ahead,
+                                           or NULL                        */
+    struct ISAM_FILE *snapOf;           /* Of a snapshot: its file, else
+                                           NULL                           */
+    struct ISAM_FILE *snapshots;        /* The snapshots of the file      */
+    struct ISAM_FILE *snapNext;         /* Next snapshot of the same file */
+    unsigned long snapGen;              /* Generation of the latest
+                                           snapshot; of a snapshot: its own */
+    unsigned long snapBlocks;           /* CurBlocks at the latest snapshot;
+                                           of a snapshot: diskBlocks then */
+    int     snapSave;                   /* Save blocks for the snapshots  */
+    struct snapVersion **snapHash;      /* Saved blocks, per hash bucket  */
+    pthread_mutex_t snapLock;           /* Protects the above (snapSave
+                                           is set by the writer)         */
+    char    *name;                      /* File name                      */
+    struct isamSecondary secondary[ISAM_MAX_SECONDARY];
+                                        /* Secondary indexes              */
+} isamFile;
+
+typedef struct ISAM {
+    isamFile *file;                     /* The file the cursor belongs to */
+    int     cur_id;                     /* The cache-slot containing the current record */
+    int     cur_recno;                  /* The position in the cache of the current record */
+    int     work;                       /* The slot loaded last, or -1    */
+    char    * keyBuf;                   /* Search key, padded to KeyLen   */
+    char    * dataBuf;                  /* Data being written, padded to
+                                           DataLen                        */
+    unsigned long dataLength;           /* Length of the data last read
+                                           or being written               */
+    struct ISAM_STATS stats;            /* Work done by this cursor       */
+    struct ISAM *nextCursor;            /* Next cursor on the same file   */
+    isamPtr secCursor[ISAM_MAX_SECONDARY];
+                                        /* Cursors on the companion files
+                                           of the secondary indexes       */
 } isam;
 
 /* Starting a file with a magic number provides a simple validity test
@@ -166,52 +568,398 @@ typedef struct ISAM {
    Apparently the use of key() as a macro does not interfere with the
    use of key as a variable name */
 
-#define head(isam,id,Nrec)  ((recordHead *)((isam).cache[(id)]+\
-            (Nrec)*((isam).fHead.RecordLen)))
+#define head(isam,id,Nrec)  ((recordHead *)((isam).file->cache[(id)]+\
+            (Nrec)*((isam).file->fHead.RecordLen)))
 
 #define cur_head(isam)      head((isam), (isam).cur_id, (isam).cur_recno)
 
 
-#define key(isam,id,Nrec)   (((isam).cache[(id)])+\
-        (Nrec)*((isam).fHead.RecordLen)+sizeof(recordHead))
+#define key(isam,id,Nrec)   (((isam).file->cache[(id)])+\
+        (Nrec)*((isam).file->fHead.RecordLen)+sizeof(recordHead))
 
 #define cur_key(isam)       key((isam), (isam).cur_id, (isam).cur_recno)
 
-#define data(isam,id,Nrec)  ((void *)((isam).cache[(id)]+\
-            (Nrec)*((isam).fHead.RecordLen)+sizeof(recordHead)+\
-            (isam).fHead.KeyLen))
+#define data(isam,id,Nrec)  ((void *)((isam).file->cache[(id)]+\
+            (Nrec)*((isam).file->fHead.RecordLen)+sizeof(recordHead)+\
+            (isam).file->fHead.KeyLen))
 
 #define cur_data(isam)      data((isam), (isam).cur_id, (isam).cur_recno)
 
-enum isam_error isam_error = ISAM_NO_ERROR;
+/* The number of the current record in the file */
+
+#define cur_rec(isam)       ((isam).file->blockInCache[(isam).cur_id] *\
+            (isam).file->fHead.NrecPB + (isam).cur_recno)
+
+ISAM_THREAD_LOCAL enum isam_error isam_error = ISAM_NO_ERROR;
+
+/* The counters are shared by all threads, so they are updated
+   atomically */
+
+#define ISAM_COUNT(counter) ((void) __sync_fetch_and_add(&(counter), 1))
+
+/* The statistics (see isam_stats) are kept per cursor, and per file for
+   work done on behalf of all cursors. Either set is only updated by one
+   thread at a time (the thread using the cursor, or holding the locks
+   needed for the work) but may be read by others, so the counters are
+   accessed atomically, but without the cost of a locked instruction. */
+
+#define ISAM_STAT(x, counter, n) \
+    __atomic_store_n(&((x)->stats.counter), (x)->stats.counter + (n), \
+            __ATOMIC_RELAXED)
+
+/* diskReads and bytesRead of a file are also counted by readers at the
+   same time, without those locks (heap_read, through block_read), so
+   they are always updated with an atomic addition */
+
+#define ISAM_STAT_SHARED(x, counter, n) \
+    ((void) __atomic_fetch_add(&((x)->stats.counter), (n), __ATOMIC_RELAXED))
 
 int cache_call_global = 0;
 int disk_reads_global = 0;
 int disk_writes_global = 0;
 
-/* makeIsamPtr creates an isamPtr given a file header, fills in some
-   data and initialises the cache */
+int cache_hits_global = 0;
+int cache_evictions_global = 0;
+int bloom_skips_global = 0;
+
+static void scratch_init(struct pageScratch *p, unsigned long n) {
+    p->keys = malloc(n * sizeof(char *));
+    p->slots = malloc(n * sizeof(int));
+    p->lengths = malloc(n * sizeof(unsigned long));
+    p->inHeap = malloc(n);
+    assert(p->keys != NULL && p->slots != NULL && p->lengths != NULL &&
+            p->inHeap != NULL);
+}
 
-static isamPtr  makeIsamPtr(fileHead * fHead) {
-    isamPtr  ipt = (isamPtr) calloc(1, sizeof(isam));
+static void scratch_free(struct pageScratch *p) {
+    free((void *) p->keys);
+    free(p->slots);
+    free(p->lengths);
+    free(p->inHeap);
+}
+
+/* makeIsamFile creates the in-memory administration of a file given its
+   header, fills in some data and initialises the cache with cacheSize
+   slots */
+
+static isamFile *makeIsamFile(fileHead * fHead, int cacheSize) {
+    isamFile *f = (isamFile *) calloc(1, sizeof(isamFile));
     int      blockSize;
+    unsigned long nHash;
     int      i;
 
-    assert(ipt != NULL);
-    ipt->fHead = *fHead;
-    ipt->blockSize = blockSize = fHead->NrecPB * fHead->RecordLen;
-    ipt->cache[0] = calloc(CACHE_SIZE, blockSize);
-    assert(ipt->cache[0] != NULL);
-    ipt->blockInCache[0] = -1;
-    for (i = 1; i < CACHE_SIZE; i++) {
-        ipt->cache[i] = blockSize + ipt->cache[i - 1];
-        ipt->blockInCache[i] = -1;
+    assert(f != NULL);
+    if (cacheSize < ISAM_MIN_CACHE_SIZE) {
+        cacheSize = ISAM_MIN_CACHE_SIZE;
+    }
+    if ((fHead->FileState & ISAM_HAS_WAL) &&
+            cacheSize < ISAM_MIN_WAL_CACHE_SIZE) {
+        cacheSize = ISAM_MIN_WAL_CACHE_SIZE;
+    }
+    /* Use a power of two, at least twice the number of slots, for the
+       number of hash buckets, so chains remain very short */
+    for (nHash = 1; nHash < 2 * (unsigned long) cacheSize; nHash <<= 1)
+        ;
+    f->fHead = *fHead;
+    f->blockSize = blockSize = fHead->NrecPB * fHead->RecordLen;
+    f->pageSize = (fHead->FileState & ISAM_HAS_PAGES) ?
+        PageSize(fHead->NrecPB, PageData(fHead->DataLen, fHead->FileState)) :
+        f->blockSize;
+    /* A value takes at most a quarter of a page */
+    f->inlineMax = (fHead->DataLen < f->pageSize / 4) ? fHead->DataLen :
+        f->pageSize / 4;
+    f->diskSize = f->pageSize + ((fHead->FileState & ISAM_HAS_CHECKSUMS) ?
+            ISAM_BLOCK_CHECK : 0);
+    f->cacheSize = cacheSize;
+    f->hashMask = nHash - 1;
+    f->cache = calloc(cacheSize, sizeof(char *));
+    f->blockInCache = calloc(cacheSize, sizeof(long));
+    f->hashNext = calloc(cacheSize, sizeof(int));
+    f->refBit = calloc(cacheSize, sizeof(unsigned char));
+    f->dirty = calloc(cacheSize, sizeof(unsigned char));
+    f->mapped = calloc(cacheSize, sizeof(unsigned char));
+    f->pinCount = calloc(cacheSize, sizeof(int));
+    f->loading = calloc(cacheSize, sizeof(unsigned char));
+    f->walPending = calloc(cacheSize, sizeof(unsigned char));
+    f->walSlots = calloc(cacheSize, sizeof(int));
+    f->walLsn = calloc(cacheSize, sizeof(unsigned long long));
+    f->hashHead = calloc(nHash, sizeof(int));
+    assert(f->cache != NULL && f->blockInCache != NULL &&
+            f->hashNext != NULL && f->refBit != NULL &&
+            f->dirty != NULL && f->mapped != NULL &&
+            f->pinCount != NULL && f->loading != NULL &&
+            f->walPending != NULL && f->walSlots != NULL &&
+            f->walLsn != NULL && f->hashHead != NULL);
+    f->cacheMem = calloc(cacheSize, blockSize);
+    assert(f->cacheMem != NULL);
+    if (fHead->FileState & (ISAM_HAS_PAGES | ISAM_HAS_CHECKSUMS)) {
+        f->pageBuf = malloc(ISAM_MAX_RUN * f->diskSize);
+        assert(f->pageBuf != NULL);
+    }
+    if (fHead->FileState & ISAM_HAS_PAGES) {
+        scratch_init(&(f->needScratch), fHead->NrecPB + 1);
+        scratch_init(&(f->encodeScratch), fHead->NrecPB + 1);
+    }
+    for (i = 0; i < cacheSize; i++) {
+        f->cache[i] = f->cacheMem + i * blockSize;
+        f->blockInCache[i] = -1;
+        f->hashNext[i] = -1;
+    }
+    for (nHash = 0; nHash <= f->hashMask; nHash++) {
+        f->hashHead[nHash] = -1;
     }
+    pthread_rwlock_init(&(f->lock), NULL);
+    pthread_mutex_init(&(f->cacheLock), NULL);
+    pthread_cond_init(&(f->cacheCond), NULL);
+    pthread_mutex_init(&(f->walLock), NULL);
+    pthread_cond_init(&(f->walCond), NULL);
+    pthread_cond_init(&(f->ioCond), NULL);
+    pthread_mutex_init(&(f->snapLock), NULL);
+    f->walFd = -1;
+    f->indexFd = -1;
+    f->heapFd = -1;
+    f->freeHint = fHead->Nblocks;
+
+    return f;
+}
+
+/* makeCursor creates a cursor on a file; it is not positioned yet */
+
+static isamPtr makeCursor(isamFile *f) {
+    isamPtr  ipt = (isamPtr) calloc(1, sizeof(isam));
 
+    assert(ipt != NULL);
+    ipt->file = f;
+    ipt->cur_id = -1;
+    ipt->work = -1;
+    ipt->keyBuf = calloc(1, f->fHead.KeyLen);
+    ipt->dataBuf = calloc(1, f->fHead.DataLen);
+    assert(ipt->keyBuf != NULL &&
+            (ipt->dataBuf != NULL || !f->fHead.DataLen));
+    ipt->dataLength = f->fHead.DataLen;
+    pthread_mutex_lock(&(f->cacheLock));
+    ipt->nextCursor = f->cursors;
+    f->cursors = ipt;
+    f->nHandles++;
+    pthread_mutex_unlock(&(f->cacheLock));
     return ipt;
 }
 
-static void dumpMaxKey(isamPtr f) {
+/* makeIsamPtr creates an isamPtr, i.e. a file with its first cursor */
+
+static isamPtr  makeIsamPtr(fileHead * fHead, int cacheSize) {
+    return makeCursor(makeIsamFile(fHead, cacheSize));
+}
+
+/* Release the memory held by a file (but do not close it; its log is
+   closed, but kept on disk) */
+
+static void freeIsamFile(isamFile *f) {
+    struct snapVersion *v;
+    unsigned long i;
+
+    if (f->map) {
+        munmap(f->map, f->mapLength);
+    }
+    if (f->walFd >= 0) {
+        close(f->walFd);
+    }
+    if (f->indexFd >= 0) {
+        close(f->indexFd);
+    }
+    if (f->heapFd >= 0) {
+        close(f->heapFd);
+    }
+    pthread_rwlock_destroy(&(f->lock));
+    pthread_mutex_destroy(&(f->cacheLock));
+    pthread_cond_destroy(&(f->cacheCond));
+    pthread_mutex_destroy(&(f->walLock));
+    pthread_cond_destroy(&(f->walCond));
+    pthread_cond_destroy(&(f->ioCond));
+    pthread_mutex_destroy(&(f->snapLock));
+    for (i = 0; f->snapHash && i <= f->hashMask; i++) {
+        while ((v = f->snapHash[i])) {
+            f->snapHash[i] = v->next;
+            free(v);
+        }
+    }
+    free(f->snapHash);
+    free(f->cacheMem);
+    free(f->pageBuf);
+    for (i = 0; i < ISAM_READ_BUFS; i++) {
+        free(f->readBuf[i]);
+    }
+    scratch_free(&(f->needScratch));
+    scratch_free(&(f->encodeScratch));
+    free(f->cache);
+    free(f->blockInCache);
+    free(f->hashNext);
+    free(f->refBit);
+    free(f->dirty);
+    free(f->mapped);
+    free(f->pinCount);
+    free(f->loading);
+    free(f->walPending);
+    free(f->walSlots);
+    free(f->walLsn);
+    free(f->walName);
+    free(f->name);
+    free(f->walTxn.data);
+    free(f->walBuf.data);
+    free(f->walSpare.data);
+    free(f->hashHead);
+    free(f->maxKey);
+    free(f->bloom);
+    free(f->bloomDeletes);
+    free(f);
+}
+
+static void stats_add(struct ISAM_STATS *to, struct ISAM_STATS *from);
+
+/* Release a cursor; returns the number of cursors left on its file. The
+   statistics of the cursor are kept in those of the file */
+
+static int freeCursor(isamPtr ipt) {
+    isamFile *f = ipt->file;
+    isamPtr *link;
+    int left;
+    int i;
+
+    for (i = 0; i < ISAM_MAX_SECONDARY; i++) {
+        if (ipt->secCursor[i]) {
+            isam_close(ipt->secCursor[i]);
+        }
+    }
+    pthread_mutex_lock(&(f->cacheLock));
+    if (ipt->cur_id >= 0) {
+        __sync_fetch_and_sub(&(f->pinCount[ipt->cur_id]), 1);
+    }
+    if (ipt->work >= 0) {
+        __sync_fetch_and_sub(&(f->pinCount[ipt->work]), 1);
+    }
+    for (link = &(f->cursors); *link != ipt; link = &((*link)->nextCursor))
+        ;
+    *link = ipt->nextCursor;
+    stats_add(&(f->stats), &(ipt->stats));
+    left = --(f->nHandles);
+    pthread_mutex_unlock(&(f->cacheLock));
+    free(ipt->keyBuf);
+    free(ipt->dataBuf);
+    free(ipt);
+    return left;
+}
+
+/* Release the memory held by an isamPtr with the file it belongs to */
+
+static void freeIsamPtr(isamPtr ipt) {
+    isamFile *f = ipt->file;
+
+    freeCursor(ipt);
+    freeIsamFile(f);
+}
+
+/* Make slot iCache the slot of the current record of cursor c. The slot
+   is always pinned already (as the cursor's work slot, or as its
+   current slot), so it cannot be replaced in the mean time. */
+
+static void cursor_set(isamPtr c, int iCache) {
+    __sync_fetch_and_add(&(c->file->pinCount[iCache]), 1);
+    if (c->cur_id >= 0) {
+        __sync_fetch_and_sub(&(c->file->pinCount[c->cur_id]), 1);
+    }
+    c->cur_id = iCache;
+}
+
+/* Find the cache slot holding block_no, or return -1 */
+
+static int cache_lookup(isamFile *f, unsigned long block_no) {
+    int iCache;
+
+    for (iCache = f->hashHead[block_no & f->hashMask]; iCache >= 0;
+            iCache = f->hashNext[iCache]) {
+        if (f->blockInCache[iCache] == (long) block_no) {
+            break;
+        }
+    }
+    return iCache;
+}
+
+/* Mark cache slot iCache as empty, removing it from its hash chain. The
+   slot gets its private memory back if it pointed into the mapping. */
+
+static void cache_release(isamFile *f, int iCache) {
+    int *link;
+
+    if (f->blockInCache[iCache] >= 0) {
+        link = &(f->hashHead[f->blockInCache[iCache] & f->hashMask]);
+        while (*link != iCache) {
+            link = &(f->hashNext[*link]);
+        }
+        *link = f->hashNext[iCache];
+    }
+    f->blockInCache[iCache] = -1;
+    f->hashNext[iCache] = -1;
+    f->refBit[iCache] = 0;
+    f->cache[iCache] = f->cacheMem + iCache * f->blockSize;
+    f->mapped[iCache] = 0;
+    f->walLsn[iCache] = 0;
+}
+
+/* Make cache slot iCache hold block block_no. The caller fills the
+   slot itself. */
+
+static void cache_assign(isamFile *f, int iCache, unsigned long block_no) {
+    cache_release(f, iCache);
+    f->blockInCache[iCache] = block_no;
+    f->hashNext[iCache] = f->hashHead[block_no & f->hashMask];
+    f->hashHead[block_no & f->hashMask] = iCache;
+    f->refBit[iCache] = 1;
+}
+
+static int flush_cache_block(isamFile *isam_ident, int iCache);
+
+/* Select a cache slot to be reused, following the CLOCK algorithm. Empty
+   slots are taken immediately, pinned slots, slots being loaded and
+   slots modified but not yet logged never. A dirty block is written to
+   disk before its slot is handed out. Called with cacheLock held. */
+
+static int cache_victim(isamFile *f) {
+    int iCache;
+    int n;
+
+    /* Two rounds clear all reference bits; after that, all slots are
+       pinned or being loaded */
+    for (n = 0; n <= 2 * f->cacheSize; n++) {
+        iCache = f->clockHand;
+        if (++(f->clockHand) >= f->cacheSize) {
+            f->clockHand = 0;
+        }
+        /* Pins are changed without cacheLock, but a slot is only pinned
+           by a cursor that already holds a pin on it */
+        if (__atomic_load_n(&(f->pinCount[iCache]), __ATOMIC_RELAXED) ||
+                f->loading[iCache] || f->walPending[iCache]) {
+            continue;
+        }
+        if (f->blockInCache[iCache] < 0) {
+            return iCache;
+        }
+        if (f->refBit[iCache]) {
+            f->refBit[iCache] = 0;
+            continue;
+        }
+        if (f->dirty[iCache] && flush_cache_block(f, iCache)) {
+            return -1;
+        }
+        ISAM_COUNT(cache_evictions_global);
+        ISAM_STAT(f, evictions, 1);
+        cache_release(f, iCache);
+        return iCache;
+    }
+    isam_error = ISAM_CACHE_FULL;
+    return -1;
+}
+
+static void dumpMaxKey(isamFile *f) {
     unsigned int i;
     fprintf(stderr, "Maxkey ='");
     for (i = 0; (i < f->fHead.KeyLen) && (f->maxKey[i]); i++) {
@@ -220,733 +968,3508 @@ static void dumpMaxKey(isamPtr f) {
     fprintf(stderr, "'\n");
 }
 
-/* Write the file header to disk (again) */
+/* Write the file header to disk (again), with its checksum if the file
+   has checksums */
+
+static int flushHead(isamFile *f) {
+    struct {
+        fileHead head;
+        unsigned long check;
+    } buf;
+    size_t length = sizeof(fileHead);
 
-static int writeHead(isamPtr f) {
 #ifdef DEBUG
     fprintf(stderr,
-            "writeHead: Nrecords = %lu DataStart = %lu CurBlocks = %lu FileState = %lu\n",
+            "flushHead: Nrecords = %lu DataStart = %lu CurBlocks = %lu FileState = %lu\n",
             f->fHead.Nrecords, f->fHead.DataStart,
             f->fHead.CurBlocks, f->fHead.FileState);
 #endif
 
-    if(lseek(f->fileId, 0, SEEK_SET)) {
-        isam_error = ISAM_SEEK_ERROR;
-        return -1;
+    buf.head = f->fHead;
+    if (f->fHead.FileState & ISAM_HAS_CHECKSUMS) {
+        buf.check = crc32c(0, &(f->fHead), sizeof(fileHead));
+        length += sizeof(buf.check);
     }
-
-    if(sizeof(fileHead) != write(f->fileId, &(f->fHead), sizeof(fileHead))) {
+    if((ssize_t) length != pwrite(f->fileId, &buf, length, 0)) {
         isam_error = ISAM_WRITE_FAIL;
         return -1;
     }
 
     /* STEP 2 INF: This is a good place to record the number of header writes.
     */
-    disk_writes_global++;
+    ISAM_COUNT(disk_writes_global);
+    ISAM_STAT(f, diskWrites, 1);
+    ISAM_STAT(f, bytesWritten, length);
+    f->headDirty = 0;
 
     return 0;
 }
 
-/* You never can predict what junk you get as a file pointer... */
-
-static int testPtr(isamPtr f) {
-    if ((!f) || (f->fHead.magic != isamMagic)) {
-        isam_error = ISAM_IDENT_INVALID;
-        return -1;
-    }
-    return 0;
-}
+/* Called before the first modification after a flush: the header on disk
+   gets the ISAM_STATE_UPDATING flag, so an unclean shutdown can be
+   recognised. isam_flush will clear the flag again. */
 
-/* In the remainder of the code, we should not need to worry about how and
-   where to write a given block from the cache */
-static int write_cache_block(isamPtr isam_ident, int iCache) {
-    unsigned long block_no = isam_ident->blockInCache[iCache];
+static int markUnflushed(isamFile *f) {
+    unsigned long state = f->fHead.FileState;
     int rv;
 
-    if (lseek(isam_ident->fileId, isam_ident->fHead.DataStart +
-                block_no * isam_ident->blockSize, SEEK_SET) == (off_t)-1) {
-        isam_error = ISAM_SEEK_ERROR;
-        return -1;
+    if (f->unflushed) {
+        return 0;
     }
-    rv = write(isam_ident->fileId, isam_ident->cache[iCache], isam_ident->blockSize);
+    f->fHead.FileState |= ISAM_STATE_UPDATING;
+    rv = flushHead(f);
+    f->fHead.FileState = state;
+    f->headDirty = 1;
+    f->unflushed = 1;
+    return rv;
+}
 
-    if (rv != (int) isam_ident->blockSize) {
-        isam_error = ISAM_WRITE_FAIL;
+/* Note that the file header has been modified; it is written by
+   isam_flush */
+
+static int writeHead(isamFile *f) {
+    if (markUnflushed(f)) {
         return -1;
     }
+    f->headDirty = 1;
+    return 0;
+}
 
-    /* STEP 2 INF: This is a good place to record the number of block writes. */
-    disk_writes_global++;
+/* The version of a file with the given state flags */
 
-    return 0;
+static unsigned long fileVersion(unsigned long state)
+{
+    if (state & ISAM_HAS_CHECKSUMS)
+    {
+        return ISAM_VERSION_CHECKSUMS;
+    }
+    if (state & ISAM_HAS_VARLEN)
+    {
+        return ISAM_VERSION_VARLEN;
+    }
+    if (state & ISAM_HAS_PAGES)
+    {
+        return ISAM_VERSION_PAGES;
+    }
+    if (state & ISAM_HAS_INDEX_FILE)
+    {
+        return ISAM_VERSION_INDEX_FILE;
+    }
+    if (state & ISAM_HAS_SECONDARY)
+    {
+        return ISAM_VERSION_SECONDARY;
+    }
+    if (state & ISAM_HAS_WAL)
+    {
+        return ISAM_VERSION_WAL;
+    }
+    return (state & ISAM_HAS_BLOOM) ? ISAM_VERSION_BLOOM : 0;
 }
 
-/* See if the requested block is in the cache (could be a data block, or
-   a block in the overflow area). If not, load the block. We will
-   assume that there are no "dirty" blocks - every block that is
-   modified is written to disk right away.
-   If the block lies beyond the last block in the file, there is no need
-   to read from the file (which should result in an EOF error anyway);
-   we just zero the cache block (corresponding to an empty record). */
+/* The name of the companion file holding the index of a file that has
+   outgrown its place in the file */
 
-static int isam_cache_block(isamPtr isam_ident, unsigned long block_no) {
-    int iCache;
-    int rv;
-#ifdef DEBUG
-    fprintf(stderr, "isam_cache_block(..., %lu)\n", block_no);
-#endif
+static char *idx_name(const char *name)
+{
+    char   *idxName = malloc(strlen(name) + sizeof(".idx"));
 
-    /* A block beyond the current end of the file. Write it to extend
-       the file right away */
+    assert(idxName != NULL);
+    strcpy(idxName, name);
+    strcat(idxName, ".idx");
+    return idxName;
+}
 
-    /* STEP 2: this function needs to be instrumented to record the
-       number of times it has been called (this is a good place to do
-       that) and the number of times it needs to read from disk (see
-       read() call below).  */
+/* The name of the heap of a file with ISAM_HAS_VARLEN */
 
-    cache_call_global++;
+static char *heap_name(const char *name)
+{
+    char   *heapName = malloc(strlen(name) + sizeof(".heap"));
 
-    if (block_no >= isam_ident->fHead.CurBlocks) {
-        iCache = isam_ident->last_in + 1;
+    assert(heapName != NULL);
+    strcpy(heapName, name);
+    strcat(heapName, ".heap");
+    return heapName;
+}
 
-        if (iCache >= CACHE_SIZE) {
-            iCache = 0;
-        }
-        memset(isam_ident->cache[iCache], 0, isam_ident->blockSize);
-        isam_ident->last_in = iCache;
-        isam_ident->blockInCache[iCache] = block_no;
+/* Start an empty heap for a new file, if it needs one; a heap left by an
+   earlier file with that name is removed */
 
-        if (write_cache_block(isam_ident, iCache)) {
-            return -1;
-        }
-        isam_ident->fHead.CurBlocks = block_no + 1;
+static int heap_create(isamFile *f, int needed)
+{
+    char   *name = heap_name(f->name);
 
-        if (writeHead(isam_ident)) {
-            return -1;
-        }
-        return iCache;
+    if (!needed)
+    {
+        unlink(name);
+        free(name);
+        return 0;
     }
-    /* A block within the current file bounds. First see if it is in the
-       cache already */
+    f->heapFd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0660);
+    free(name);
+    if (f->heapFd < 0)
+    {
+        isam_error = ISAM_OPEN_FAIL;
+        return -1;
+    }
+    if (pwrite(f->heapFd, ISAM_HEAP_MAGIC, ISAM_HEAP_START, 0) !=
+            (ssize_t) ISAM_HEAP_START)
+    {
+        isam_error = ISAM_WRITE_FAIL;
+        return -1;
+    }
+    f->heapEnd = ISAM_HEAP_START;
+    return 0;
+}
 
-    for (iCache = 0; iCache < CACHE_SIZE; iCache++) {
-        if ((int) block_no == isam_ident->blockInCache[iCache]) {
-            break;
-        }
+/* Open the heap of an existing file; values go after the last one */
+
+static int heap_open(isamFile *f)
+{
+    char   *name = heap_name(f->name);
+    struct stat buf;
+
+    f->heapFd = open(name, O_RDWR);
+    free(name);
+    if (f->heapFd < 0 || fstat(f->heapFd, &buf))
+    {
+        isam_error = ISAM_OPEN_FAIL;
+        return -1;
     }
-    if (iCache >= CACHE_SIZE) {
-        /* The block is not in the cache. Fill the slot after the last
-           slot filled */
-        iCache = isam_ident->last_in + 1;
-        if (iCache >= CACHE_SIZE) {
-            iCache = 0;
-        }
+    f->heapEnd = (buf.st_size > ISAM_HEAP_START) ? buf.st_size :
+        ISAM_HEAP_START;
+    return 0;
+}
 
-        if (lseek(isam_ident->fileId, isam_ident->fHead.DataStart +
-                    block_no * isam_ident->blockSize, SEEK_SET) == (off_t)-1) {
-            isam_error = ISAM_SEEK_ERROR;
-            return -1;
-        }
+/* Write the checksum of the index, as just written, to the file */
 
-        rv = read(isam_ident->fileId, isam_ident->cache[iCache], isam_ident->blockSize);
+static int writeIndexCheck(isamFile *f)
+{
+    unsigned long check;
 
-        if (rv != (int) isam_ident->blockSize) {
-            isam_error = ISAM_READ_ERROR;
-            return -1;
-        }
+    if (!(f->fHead.FileState & ISAM_HAS_CHECKSUMS))
+    {
+        return 0;
+    }
+    check = index_checksum(f->index);
+    if (pwrite(f->fileId, &check, sizeof(check), sizeof(fileHead) +
+                offsetof(fileCheck, index)) != (ssize_t) sizeof(check))
+    {
+        isam_error = ISAM_WRITE_FAIL;
+        return -1;
+    }
+    return 0;
+}
 
-        isam_ident->last_in = iCache;
-        isam_ident->blockInCache[iCache] = block_no;
+/* Write the index to the file, or to its companion file */
 
-        /* STEP 2: This is a good place to record the number of disk reads.  */
-        disk_reads_global++;
+static int writeIndex(isamFile *f, int doSync)
+{
+    long    start = (f->indexFd >= 0) ? 0 :
+        (long) IndexStart(f->fHead.FileState);
+    long    end;
+
+    end = index_writeToDisk(f->index, (f->indexFd >= 0) ? f->indexFd :
+            f->fileId, start);
+    if (end < 0 || (doSync && f->indexFd >= 0 && fsync(f->indexFd)) ||
+            writeIndexCheck(f))
+    {
+        isam_error = ISAM_WRITE_FAIL;
+        return -1;
     }
-    return iCache;
+    ISAM_STAT(f, diskWrites, 1);
+    ISAM_STAT(f, bytesWritten, end - start);
+    f->indexDirty = 0;
+    return 0;
 }
 
-/* We look for the first free record in a given block. We have a number
-   of options to do this - by block number (in which case we have to
-   make sure that the block is in the cache), or by cached block number
-   (putting the responsability for the blocknumber on the calling function)
-   We'll use the latter approach - it also has the advantage that we only
-   need to return a single value. */
-static int free_record_in_block(isamPtr isam_ident, int iCache)
+/* Add the key of the first record of block block_no to the index. A full
+   index is replaced by a larger one, which is written to the companion
+   file right away: the header may only point there once it is complete */
+
+static int addIndexKey(isamFile *f, const char *key, unsigned long block_no)
 {
-    unsigned int iFree;
-    if ((iCache < 0) || (iCache >= CACHE_SIZE))
+    index_handle grown;
+    char   *name;
+
+    f->indexDirty = 1;
+    if (index_addKey(f->index, key, block_no) >= 0)
     {
-#ifdef DEBUG
-        fprintf(stderr, "free_record iCache = %d\n", iCache);
-#endif
+        return 0;
+    }
+    if (index_error != INDEX_FULL)
+    {
+        isam_error = ISAM_INDEX_ERROR;
         return -1;
     }
-    if (isam_ident->blockInCache[iCache] < 0)
+    if (!(grown = index_grow(f->index, block_no + 1)))
     {
-#ifdef DEBUG
-        fprintf(stderr, "free_record blockInCache = %d\n",
-                isam_ident->blockInCache[iCache]);
-#endif
+        isam_error = ISAM_INDEX_ERROR;
         return -1;
     }
-    for (iFree = 0; iFree < isam_ident->fHead.NrecPB; iFree++)
+    f->index = grown;
+    if (index_addKey(f->index, key, block_no) < 0)
     {
-        /* We cannot use a deleted record either. Records are only
-           marked deleted rather than unused (free) if
-           1. they are the first record of a block and have been deleted.
-           (otherwise this plays havoc with the index).
-           2. temporarily, while pointers in the preceding and following
-           records are being updated after deletion. */
-        if (!(head(*isam_ident, iCache, iFree)->statusFlags))
+        isam_error = ISAM_INDEX_ERROR;
+        return -1;
+    }
+    if (f->indexFd < 0)
+    {
+        name = idx_name(f->name);
+        f->indexFd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0660);
+        free(name);
+        if (f->indexFd < 0)
         {
-            return iFree;
+            isam_error = ISAM_OPEN_FAIL;
+            return -1;
         }
     }
-    return -1;
-}
-
-/* Strictly for debugging - print some information about a record */
-
-static void debugRecord(isamPtr __attribute__((__unused__)) f,
-        unsigned long __attribute__((__unused__)) n,
-        char __attribute__((__unused__)) * from) {
-#ifdef DEBUG
-    int ib = n / f->fHead.NrecPB;
-    int ic = isam_cache_block(f, ib);
-    int ir = n % f->fHead.NrecPB;
+    if (writeIndex(f, 1))
+    {
+        return -1;
+    }
+    if (!(f->fHead.FileState & ISAM_HAS_INDEX_FILE))
+    {
+        f->fHead.FileState |= ISAM_HAS_INDEX_FILE;
+        f->fHead.version = fileVersion(f->fHead.FileState);
+        f->unflushed = 0;
+        return writeHead(f);
+    }
+    return 0;
+}
 
-    if (ic < 0) {
-        return;
+/* Keys are compared with key_compare, which needs key fields of the full
+   length. Keys given by the user are therefore first copied into keyBuf */
+
+static const char *padKey(isamPtr f, const char *key) {
+    if (key != f->keyBuf) {
+        strncpy(f->keyBuf, key, f->file->fHead.KeyLen);
     }
+    return f->keyBuf;
+}
 
-    fprintf(stderr, "%s: key = %s\n", from,
-            key(*f, ic, ir));
-#endif
+/* You never can predict what junk you get as a file pointer... */
+
+static int testPtr(isamPtr f) {
+    if ((!f) || (f->file->fHead.magic != isamMagic)) {
+        isam_error = ISAM_IDENT_INVALID;
+        return -1;
+    }
+    return 0;
 }
 
-/* The following function will create an empty isam file, with the specified
-   parameters. It will return an isamPtr when succesful, NULL if not.
-   The empty file should initially be written sequentially (i.e. with
-   increasing key numbers). Now, how long can that continue and what happens
-   when you write a non-sequential entry? That is for somewhere else...
-   Requirements here:
-   no file with the specified name should exist yet. */
+/* Snapshots (see isam_snapshot_begin) can only be read */
 
-isamPtr isam_create(const char * name, unsigned long KeyLen,
-        unsigned long DataLen, unsigned long NrecPB, unsigned long Nblocks)
-{
-    struct stat buf;
-    int     i, l;
-    long    rv;
-    isamPtr fp;
-    fileHead fHead;
+static int testNotSnapshot(isamPtr f) {
+    if (testPtr(f)) {
+        return -1;
+    }
+    if (f->file->snapOf) {
+        isam_error = ISAM_SNAPSHOT;
+        return -1;
+    }
+    return 0;
+}
 
-    memset(&fHead, 0, sizeof(fHead));
-    isam_error = ISAM_NO_ERROR;
-    if ((8 > KeyLen) || (40 < KeyLen))
-    {
-        isam_error = ISAM_KEY_LEN;
-        return NULL;
+/* Allocate the (empty) Bloom filters of a file */
+
+static void bloom_alloc(isamFile *f) {
+    f->bloomBytes = BloomBytes(f->fHead.NrecPB);
+    f->bloomStart = f->fHead.DataStart - f->fHead.Nblocks * f->bloomBytes;
+    f->bloom = calloc(f->fHead.Nblocks, f->bloomBytes);
+    f->bloomDeletes = calloc(f->fHead.Nblocks, sizeof(unsigned char));
+    assert(f->bloom != NULL && f->bloomDeletes != NULL);
+}
+
+/* Two independent hashes of a key (up to its terminating zero byte, like
+   key_compare); the probes are h1 + i * h2 (double hashing) */
+
+static void bloom_hash(isamFile *f, const char *key, unsigned long *h1,
+        unsigned long *h2) {
+    unsigned long i;
+    unsigned long a = 2166136261UL, b = 5381;
+
+    for (i = 0; i < f->fHead.KeyLen && key[i]; i++) {
+        a = ((a ^ (unsigned char) key[i]) * 16777619UL) & 0xffffffffUL;
+        b = (b * 33 + (unsigned char) key[i]) & 0xffffffffUL;
     }
+    *h1 = a;
+    *h2 = b | 1;
+}
 
-    /*
-     * First check if name points to an existing file. If it does, stat will
-     * return 0, and our routine should return NULL
-     */
-    if (!stat(name, &buf))
-    {
-        isam_error = ISAM_FILE_EXISTS;
-        return NULL;
+/* Add a key to the filter of block range */
+
+static void bloom_set(isamFile *f, unsigned long range, const char *key) {
+    unsigned char *bits = f->bloom + range * f->bloomBytes;
+    unsigned long nBits = 8 * f->bloomBytes;
+    unsigned long h1, h2, bit;
+    int i;
+
+    bloom_hash(f, key, &h1, &h2);
+    for (i = 0; i < ISAM_BLOOM_PROBES; i++) {
+        bit = (h1 + i * h2) % nBits;
+        bits[bit / 8] |= 1 << (bit % 8);
     }
+    f->bloomDirty = 1;
+}
 
-    /*
-     * Now stat may fail when the pointer is an existing, but invalid
-     * symbolic link. We do not want that either.
-     */
-    if (!lstat(name, &buf))
-    {
-        isam_error = ISAM_LINK_EXISTS;
-        return NULL;
+/* Add a key to the filter of the block where the index sends it */
+
+static void bloom_add(isamFile *f, const char *key) {
+    long range;
+
+    if (f->bloom && (range = index_keyToBlock(f->index, key)) >= 0 &&
+            (unsigned long) range < f->fHead.Nblocks) {
+        bloom_set(f, range, key);
     }
+}
 
-    /*
-     * Now create and initialize the file header and descriptor
-     */
-    fHead.magic  = isamMagic;
-    fHead.KeyLen = KeyLen;
-    fHead.DataLen = DataLen;
-    fHead.NrecPB = NrecPB;
-    fHead.Nblocks = Nblocks;
-    i = KeyLen + DataLen + sizeof(recordHead);
-    l = (i + 7) / 8;
-    fHead.RecordLen = 8 * l;
-    fp = makeIsamPtr(&fHead);
+/* Returns 0 if the key certainly does not occur in block range (or its
+   overflow records), 1 if it may. Only the regular blocks have a filter,
+   not those that the file has grown into. */
 
+static int bloom_mayContain(isamFile *f, unsigned long range, const char *key) {
+    const unsigned char *bits;
+    unsigned long nBits, h1, h2, bit;
+    int i;
 
-    /*
-     * At last - create a file
-     */
-    fp->fileId = open(name, O_RDWR | O_CREAT | O_EXCL, 0660);
-    if (fp->fileId < 0)
-    {
-        isam_error = ISAM_OPEN_FAIL;
-        free(fp->cache[0]);
-        free(fp);
-        return NULL;
+    if (!f->bloom || range >= f->fHead.Nblocks) {
+        return 1;
     }
-    /* Write an initial header */
-    if (writeHead(fp))
-    {
-        close(fp->fileId);
-        free(fp->cache[0]);
-        free(fp);
-        return NULL;
+    bits = f->bloom + range * f->bloomBytes;
+    nBits = 8 * f->bloomBytes;
+    bloom_hash(f, key, &h1, &h2);
+    for (i = 0; i < ISAM_BLOOM_PROBES; i++) {
+        bit = (h1 + i * h2) % nBits;
+        if (!(bits[bit / 8] & (1 << (bit % 8)))) {
+            ISAM_COUNT(bloom_skips_global);
+            return 0;
+        }
     }
-    fp->mayWrite = 1;
-    /* Initialise the file index and write it to disk */
-    fp->index = index_makeNew(Nblocks, KeyLen);
-    /* The data blocks will start immediately after the index */
-    fp->fHead.DataStart = rv = index_writeToDisk(fp->index, fp->fileId);
-    if (rv < 0)
-    {
+    return 1;
+}
+
+/* Write the Bloom filters to disk (again) */
+
+static int flushBloom(isamFile *f) {
+    size_t length = f->fHead.Nblocks * f->bloomBytes;
+
+    if (pwrite(f->fileId, f->bloom, length, f->bloomStart) !=
+            (ssize_t) length) {
         isam_error = ISAM_WRITE_FAIL;
-        index_free(fp->index);
-        close(fp->fileId);
-        free(fp->cache[0]);
-        free(fp);
-        return NULL;
+        return -1;
     }
-    /* Initialise the first data block with the dummy first record.
-       Store in cache and write to disk */
-    fp->blockInCache[0] = 0;
-    fp->cur_id = 0;
-    fp->cur_recno = 0;
-    cur_head((*fp))->statusFlags = ISAM_SPECIAL;
-    l = write(fp->fileId, fp->cache[0], fp->blockSize);
-    if (l != (int) fp->blockSize)
+    ISAM_COUNT(disk_writes_global);
+    ISAM_STAT(f, diskWrites, 1);
+    ISAM_STAT(f, bytesWritten, length);
+    f->bloomDirty = 0;
+    return 0;
+}
+
+static int isam_cache_block(isamPtr isam_ident, unsigned long block_no);
+
+/* Recompute the filter of block range from the records in its part of
+   the chain: from the first record of the block up to the first record
+   that the index sends elsewhere. The current record is not changed. */
+
+static int bloom_rebuildRange(isamPtr f, unsigned long range) {
+    unsigned long rec = range * f->file->fHead.NrecPB;
+    int iCache, rec_no;
+
+    memset(f->file->bloom + range * f->file->bloomBytes, 0, f->file->bloomBytes);
+    f->file->bloomDeletes[range] = 0;
+    f->file->bloomDirty = 1;
+    do {
+        iCache = isam_cache_block(f, rec / f->file->fHead.NrecPB);
+        if (iCache < 0) {
+            return -1;
+        }
+        rec_no = rec % f->file->fHead.NrecPB;
+        if (rec != range * f->file->fHead.NrecPB &&
+                index_keyToBlock(f->file->index, key(*f, iCache, rec_no)) !=
+                (long) range) {
+            break;
+        }
+        if (head(*f, iCache, rec_no)->statusFlags & ISAM_VALID) {
+            bloom_set(f->file, range, key(*f, iCache, rec_no));
+        }
+        rec = head(*f, iCache, rec_no)->next;
+    } while (rec);
+    return 0;
+}
+
+/* Numbers in a page are stored in n bytes, least significant first */
+
+static void page_put(unsigned char *p, unsigned long v, int n)
+{
+    for (; n > 0; n--, v >>= 8)
     {
-        isam_error = ISAM_WRITE_FAIL;
-        index_free(fp->index);
-        close(fp->fileId);
-        free(fp->cache[0]);
-        free(fp);
-        return NULL;
+        *p++ = v & 0xff;
     }
-    /* The file header can now be further updated */
+}
+
+static unsigned long page_get(const unsigned char *p, int n)
+{
+    unsigned long v = 0;
 
-    fp->fHead.CurBlocks = 1;
-    if (writeHead(fp))
+    while (n > 0)
     {
-        close(fp->fileId);
-        index_free(fp->index);
-        free(fp->cache[0]);
-        free(fp);
-        return NULL;
+        v = (v << 8) | p[--n];
     }
-    fp->maxKey = calloc(1, KeyLen);
-    assert(fp->maxKey != NULL);
-    return fp;
+    return v;
 }
 
-isamPtr
-isam_open(const char *name, int __attribute__((__unused__)) update)
+/* The length of a key field without its padding */
+
+static unsigned long page_keyLength(isamFile *f, const char *key)
 {
-    struct stat buf;
-    isamPtr fp;
-    fileHead fh;
-    int     fid;
-    int     block_no, rec_no;
-    int     iCache;
+    const char *end = memchr(key, 0, f->fHead.KeyLen);
 
-    memset(&fh, 0, sizeof(fh));
-    isam_error = ISAM_NO_ERROR;
+    return end ? (unsigned long) (end - key) : f->fHead.KeyLen;
+}
 
-    /*
-     * First check if name points to an existing file. If it does, stat will
-     * return 0, and our routine can continue
-     */
-    if (stat(name, &buf))
-    {
-    isam_error = ISAM_NO_SUCH_FILE;
-    return NULL;
-    }
+/* The number of leading bytes two keys of the given lengths share */
 
-    /*
-     * At last - open a file
-     */
-    fid = open(name, O_RDWR);
-    if (fid < 0)
+static unsigned long page_prefix(const char *a, unsigned long aLength,
+        const char *b, unsigned long bLength)
+{
+    unsigned long n = 0;
+
+    while (n < aLength && n < bLength && a[n] == b[n])
     {
-    isam_error = ISAM_OPEN_FAIL;
-    return NULL;
+        n++;
     }
-    /* read header and test amount of data read */
+    return n;
+}
+
+/* Collect the keys and positions of the records in a block (in the
+   cache layout) in key order, together with key extra, if not NULL
+   (position -1). Blocks are small, and mostly filled in key order, so
+   an insertion sort does. Returns the number of keys */
+
+static int page_order(isamFile *f, const char *block, const char *extra,
+        const char **keys, int *slots)
+{
+    recordHead h;
+    const char *k;
+    int     n = 0, i, j;
 
-    if (sizeof(fileHead) != read(fid, &fh, sizeof(fileHead)))
+    for (i = -1; i < (int) f->fHead.NrecPB; i++)
     {
-    isam_error = ISAM_READ_ERROR;
-        close(fid);
-    return NULL;
+        if (i < 0)
+        {
+            if (!extra)
+            {
+                continue;
+            }
+            k = extra;
+        }
+        else
+        {
+            memcpy(&h, block + i * f->fHead.RecordLen, sizeof(h));
+            if (!h.statusFlags)
+            {
+                continue;
+            }
+            k = block + i * f->fHead.RecordLen + sizeof(recordHead);
+        }
+        for (j = n; j > 0 && key_compare(k, keys[j - 1], f->fHead.KeyLen) < 0;
+                j--)
+        {
+            keys[j] = keys[j - 1];
+            slots[j] = slots[j - 1];
+        }
+        keys[j] = k;
+        slots[j] = i;
+        n++;
     }
+    return n;
+}
 
-    /* test if it could be an isam file */
-    if (fh.magic != isamMagic)
+/* The length of the value in a data field in the cache; the full DataLen
+   in a file without ISAM_HAS_VARLEN */
+
+static unsigned long data_length(isamFile *f, const char *data)
+{
+    dataTail t;
+
+    if (!(f->fHead.FileState & ISAM_HAS_VARLEN))
     {
-    isam_error = ISAM_BAD_MAGIC;
-    close(fid);
-    return NULL;
+        return f->fHead.DataLen;
     }
+    memcpy(&t, data + f->fHead.DataLen, sizeof(t));
+    return t.length;
+}
+
+/* The bytes a page needs for the data of a record with a value of the
+   given length. A short value is counted as if it took as much as a
+   position in the heap, so that page_encode can always make a page fit
+   by moving values to the heap, even after they have grown in place */
 
-    /* We can only handle version 0 */
-    if (fh.version > 0)
+static unsigned long page_dataBytes(isamFile *f, unsigned long length)
+{
+    if (!(f->fHead.FileState & ISAM_HAS_VARLEN))
     {
-    isam_error = ISAM_BAD_VERSION;
-    close(fid);
-    return NULL;
+        return f->fHead.DataLen;
     }
+    return ISAM_PAGE_LENGTH + ((length > f->inlineMax || length < ISAM_PAGE_HEAP) ?
+            ISAM_PAGE_HEAP : length);
+}
 
-    /* Now create and initialise the isamPtr */
-    fp = makeIsamPtr(&fh);
+/* The number of bytes the page of a block would take with key added, of
+   which the value has the given length. Only called by modifying
+   routines, which hold the exclusive lock */
 
-    isam_error = ISAM_NO_ERROR;
+static unsigned long page_need(isamFile *f, const char *block, const char *key,
+        unsigned long dataLength)
+{
+    const char **keys = f->needScratch.keys;
+    int     *slots = f->needScratch.slots;
+    unsigned long need = ISAM_PAGE_HEAD, length, prevLength = 0;
+    int     n, i;
 
-    if (!(fp->index = index_readFromDisk(fid)))
-    {
-    close(fid);
-    free(fp->cache[0]);
-    isam_error = ISAM_INDEX_ERROR;
-    free(fp);
-    return NULL;
-    }
-    fp->fileId = fid;
-    fp->mayWrite = 1;
-    fp->blockInCache[0] = 0;
-    fp->cur_id = 0;
-    fp->cur_recno = 0;
-    if (read(fp->fileId, fp->cache[0], fp->blockSize) != (int) fp->blockSize)
+    n = page_order(f, block, key, keys, slots);
+    for (i = 0; i < n; i++)
     {
-    index_free(fp->index);
-    close(fid);
-    free(fp->cache[0]);
-    isam_error = ISAM_READ_ERROR;
-    free(fp);
-    return NULL;
+        length = page_keyLength(f, keys[i]);
+        need += PageMinRecord(page_dataBytes(f, (slots[i] < 0) ? dataLength :
+                    data_length(f, keys[i] + f->fHead.KeyLen))) + length -
+            (i ? page_prefix(keys[i - 1], prevLength, keys[i], length) : 0);
+        prevLength = length;
     }
-    fp->maxKey = calloc(1, fp->fHead.KeyLen);
-    assert(fp->maxKey != NULL);
-    block_no = fp->fHead.MaxKeyRec / fp->fHead.NrecPB;
-    rec_no = fp->fHead.MaxKeyRec % fp->fHead.NrecPB;
-    iCache = isam_cache_block(fp, block_no);
-    if (iCache < 0)
+    return need;
+}
+
+/* Does the page of a block still have room for a record with the given
+   key and length of the value, leaving reserve bytes free? Always true
+   for files without pages */
+
+static int page_fits(isamFile *f, const char *block, const char *key,
+        unsigned long dataLength, unsigned long reserve)
+{
+    if (!(f->fHead.FileState & ISAM_HAS_PAGES))
     {
-    index_free(fp->index);
-    close(fid);
-    free(fp->cache[0]);
-    free(fp);
-    return NULL;
+        return 1;
     }
-    memcpy(fp->maxKey, key(*fp, iCache, rec_no), fp->fHead.KeyLen);
-
-    return fp;
+    return page_need(f, block, key, dataLength) + reserve <= f->pageSize;
 }
 
+/* Append a value to the heap; pos receives its position */
 
-/* Close an isam file and release the memory used */
-int isam_close(isamPtr f)
+static int heap_write(isamFile *f, const char *data, unsigned long length,
+        unsigned long *pos)
 {
-    int i;
-    /* Before closing the file, we should actually make sure it has been
-       "sync-ed" to disk. We'll make sure that any modifications are written
-       immediately by the function making the modification. So we'll need not
-       do any saving here */
-    isam_error = ISAM_NO_ERROR;
-    if (testPtr(f))
+    if (pwrite(f->heapFd, data, length, f->heapEnd) != (ssize_t) length)
     {
         return -1;
     }
-    free(f->cache[0]);
-    free(f->maxKey);
-    for (i = 0; i < CACHE_SIZE; i++)
+    ISAM_STAT(f, diskWrites, 1);
+    ISAM_STAT(f, bytesWritten, length);
+    *pos = f->heapEnd;
+    f->heapEnd += length;
+    return 0;
+}
+
+/* Read a value from the heap. Called through block_read, which readers
+   run at the same time without cacheLock */
+
+static int heap_read(isamFile *f, char *data, unsigned long length,
+        unsigned long pos)
+{
+    if (pos < ISAM_HEAP_START ||
+            pread(f->heapFd, data, length, pos) != (ssize_t) length)
     {
-        f->cache[i] = NULL;
+        return -1;
     }
-    index_free(f->index);
-    f->fHead.magic = 0;
-    close(f->fileId);
-
-    free(f);
+    ISAM_STAT_SHARED(f, diskReads, 1);
+    ISAM_STAT_SHARED(f, bytesRead, length);
     return 0;
 }
 
-/* Set the current pointer to the last valid record (if that exists) with
-   a key less than the requested key. isam_readNext will then read the
-   record with that key (if it exists), or the next higher key (if that
-   exists) */
+/* Forget where the values in a block (in the cache layout) are in the
+   heap, so that page_encode appends them again. A block from the log
+   may refer to values appended after the last isam_flush, which need
+   not have survived a crash */
 
-int isam_setKey(isamPtr isam_ident, const char *key)
+static void heap_forget(isamFile *f, char *block)
 {
-    int block_no;
-    int rec_no;
-    unsigned long next, prev;
-    int iCache;
-    int rv;
+    dataTail t;
+    char   *tail;
+    unsigned long i;
 
-    if (testPtr(isam_ident))
+    if (!(f->fHead.FileState & ISAM_HAS_VARLEN))
     {
-        return -1;
+        return;
     }
-    if (key[0] == 0)
+    for (i = 0; i < f->fHead.NrecPB; i++)
     {
-        /* "rewind" the file to the dummy first record.*/
-        iCache = isam_cache_block(isam_ident, 0);
-        if (iCache < 0)
+        tail = block + i * f->fHead.RecordLen + sizeof(recordHead) +
+            f->fHead.KeyLen + f->fHead.DataLen;
+        memcpy(&t, tail, sizeof(t));
+        t.heapPos = 0;
+        memcpy(tail, &t, sizeof(t));
+    }
+}
+
+/* Decide which values of the records with the given keys (in the order
+   of page_order) go to the heap: those longer than inlineMax, and when
+   the page is too full otherwise (a value that has grown in place), the
+   longest of the others */
+
+static void page_spill(isamFile *f, const char **keys, int n,
+        unsigned long *lengths, unsigned char *inHeap)
+{
+    unsigned long need = ISAM_PAGE_HEAD, length, prevLength = 0;
+    int     i, j;
+
+    for (i = 0; i < n; i++)
+    {
+        lengths[i] = data_length(f, keys[i] + f->fHead.KeyLen);
+        inHeap[i] = lengths[i] > f->inlineMax;
+        length = page_keyLength(f, keys[i]);
+        need += PageMinRecord(ISAM_PAGE_LENGTH +
+                (inHeap[i] ? ISAM_PAGE_HEAP : lengths[i])) + length -
+            (i ? page_prefix(keys[i - 1], prevLength, keys[i], length) : 0);
+        prevLength = length;
+    }
+    while (need > f->pageSize)
+    {
+        for (j = -1, i = 0; i < n; i++)
         {
-            return -1;
+            if (!inHeap[i] && lengths[i] > ISAM_PAGE_HEAP &&
+                    (j < 0 || lengths[i] > lengths[j]))
+            {
+                j = i;
+            }
         }
-        isam_ident->cur_id = iCache;
-        isam_ident->cur_recno = 0;
-        return 0;
+        /* Guaranteed by page_dataBytes */
+        assert(j >= 0);
+        inHeap[j] = 1;
+        need -= lengths[j] - ISAM_PAGE_HEAP;
     }
-    /* First find block number from index */
-    block_no = index_keyToBlock(isam_ident->index, key);
-    rec_no = 0;
-    /* Now make sure the block is in cache */
-    iCache = isam_cache_block(isam_ident, block_no);
-    if (iCache < 0)
+}
+
+/* Store a block (in the cache layout) as a page. The block may be a
+   copy in the log, so it need not be aligned. Values that go to the
+   heap are appended to it, unless the block already knows where they
+   are (heapPos); the block is updated with their positions. Returns -1
+   if the heap cannot be written. Blocks are only written under cacheLock
+   or the exclusive lock, so encodeScratch is free */
+
+static int page_encode(isamFile *f, char *block, char *page)
+{
+    const char **keys = f->encodeScratch.keys;
+    int     *slots = f->encodeScratch.slots;
+    unsigned long *lengths = NULL;
+    unsigned char *inHeap = NULL;
+    unsigned char *p = (unsigned char *) page, *r;
+    unsigned long end = f->pageSize, length, prefix, prevLength = 0, bytes;
+    char   *rec, *data;
+    recordHead h;
+    dataTail t;
+    int     n, i, rv = 0;
+
+    memset(page, 0, f->pageSize);
+    n = page_order(f, block, NULL, keys, slots);
+    if (f->fHead.FileState & ISAM_HAS_VARLEN)
     {
-        return -1;
+        lengths = f->encodeScratch.lengths;
+        inHeap = f->encodeScratch.inHeap;
+        page_spill(f, keys, n, lengths, inHeap);
     }
-    /* Skip all records with smaller keys */
-    while ((rv = strncmp(key, key((*isam_ident),iCache,rec_no),
-                    isam_ident->fHead.KeyLen)) > 0)
+    for (i = 0; i < n; i++)
     {
-        next = head((*isam_ident),iCache,rec_no)->next;
-        debugRecord(isam_ident, next, "setkey #1");
-        if (!next)
+        rec = block + slots[i] * f->fHead.RecordLen;
+        data = rec + sizeof(recordHead) + f->fHead.KeyLen;
+        memcpy(&h, rec, sizeof(h));
+        length = page_keyLength(f, keys[i]);
+        prefix = i ? page_prefix(keys[i - 1], prevLength, keys[i], length) : 0;
+        prevLength = length;
+        bytes = f->fHead.DataLen;
+        if (inHeap)
         {
-            /* There is no next record */
-            break;
+            memcpy(&t, data + f->fHead.DataLen, sizeof(t));
+            bytes = ISAM_PAGE_LENGTH + (inHeap[i] ? ISAM_PAGE_HEAP : t.length);
+            if (inHeap[i] && !t.heapPos)
+            {
+                if (heap_write(f, data, t.length, &(t.heapPos)))
+                {
+                    rv = -1;
+                    break;
+                }
+                memcpy(data + f->fHead.DataLen, &t, sizeof(t));
+            }
         }
-        block_no = next / isam_ident->fHead.NrecPB;
-        rec_no = next % isam_ident->fHead.NrecPB;
-        iCache = isam_cache_block(isam_ident, block_no);
-        if (iCache < 0)
+        /* Records are only added to blocks whose page has room */
+        assert(end >= ISAM_PAGE_HEAD + n * ISAM_PAGE_SLOT + ISAM_PAGE_RECORD +
+                length - prefix + bytes);
+        end -= ISAM_PAGE_RECORD + length - prefix + bytes;
+        page_put(p + ISAM_PAGE_HEAD + i * ISAM_PAGE_SLOT, slots[i], 2);
+        page_put(p + ISAM_PAGE_HEAD + i * ISAM_PAGE_SLOT + 2, end, 2);
+        r = p + end;
+        page_put(r, h.next, 4);
+        page_put(r + 4, h.previous, 4);
+        r[8] = h.statusFlags | ((inHeap && inHeap[i]) ? ISAM_PAGE_IN_HEAP : 0);
+        r[9] = prefix;
+        r[10] = length - prefix;
+        memcpy(r + ISAM_PAGE_RECORD, keys[i] + prefix, length - prefix);
+        r += ISAM_PAGE_RECORD + length - prefix;
+        if (!inHeap)
         {
-            return -1;
+            memcpy(r, data, f->fHead.DataLen);
+            continue;
         }
-    }
-    /* Now we have found / may have found a record with a key larger than
-       or equal to the given key - but then we promised to position at
-       the previous valid record - so look for that.
-       There may be no record with a larger key - in that case
-       (rv < 0) && (next == 0)
-       A valid record is a record that has the valid flag set.*/
-
-    while (((rv = strncmp(key, key((*isam_ident),iCache,rec_no),
-                        isam_ident->fHead.KeyLen)) <= 0) ||
-            (!(head((*isam_ident),iCache,rec_no)->statusFlags & ISAM_VALID)))
-    {
-        prev = head((*isam_ident),iCache,rec_no)->previous;
-        debugRecord(isam_ident, prev, "setkey #2");
-        /* prev may be 0 - that is OK; we are then pointing to the dummy
-           first record. However, that is not a valid record, but we
-           have no choice.
-           This means that a call to isam_prev must return an invalid result
-           */
-        block_no = prev / isam_ident->fHead.NrecPB;
-        rec_no = prev % isam_ident->fHead.NrecPB;
-        iCache = isam_cache_block(isam_ident, block_no);
-        if (iCache < 0)
+        page_put(r, t.length, ISAM_PAGE_LENGTH);
+        if (inHeap[i])
         {
-            return -1;
+            page_put(r + ISAM_PAGE_LENGTH, t.heapPos, ISAM_PAGE_HEAP);
         }
-        if (!prev)
+        else
         {
-            /* The "current" record is not "it", and the previous is the
-               dummy first record. We have gone there already.
-               This is completely normal */
-            isam_ident->cur_id = iCache;
-            isam_ident->cur_recno = 0;
-            return 0;
+            memcpy(r + ISAM_PAGE_LENGTH, data, t.length);
         }
     }
-    isam_ident->cur_id = iCache;
-    isam_ident->cur_recno = rec_no;
-    return 0;
+    page_put(p, n, 2);
+    page_put(p + 2, end, 2);
+    return rv;
 }
 
-/* isam_readNext will read the next valid record (from cur_recno and cur_id),
-   if such a record exists */
-
-int isam_readNext(isamPtr isam_ident, char *key, void *data) {
-    int block_no;
-    int rec_no;
-    int iCache;
-    int next;
+/* Restore a block from its page, reading the values in the heap if
+   withHeap is set (otherwise those data fields remain zero). Returns -1
+   if the page is damaged */
 
-    if (testPtr(isam_ident)) {
+static int page_decode(isamFile *f, const char *page, char *block,
+        int withHeap)
+{
+    const unsigned char *p = (const unsigned char *) page, *r;
+    unsigned long n = page_get(p, 2), start = page_get(p + 2, 2);
+    unsigned long i, j, slot, offset, prefix, length, prevLength = 0;
+    int     varlen = (f->fHead.FileState & ISAM_HAS_VARLEN) != 0, inHeap;
+    unsigned long bytes = varlen ? ISAM_PAGE_LENGTH : f->fHead.DataLen;
+    char   *rec, *key, *prevKey = NULL, *data;
+    recordHead h;
+    dataTail t;
+
+    memset(block, 0, f->blockSize);
+    /* A block that has never been written (in a hole in the file) is
+       empty */
+    if (!n && !start)
+    {
+        return 0;
+    }
+    if (n > f->fHead.NrecPB || start < ISAM_PAGE_HEAD + n * ISAM_PAGE_SLOT ||
+            start > f->pageSize)
+    {
         return -1;
     }
-    /* First we have to look for the next valid record (that is the way we
-       decided to make all this work! */
-    rec_no = isam_ident->cur_recno;
-    iCache = isam_ident->cur_id;
-    do {
-        next = head((*isam_ident),iCache,rec_no)->next;
-        debugRecord(isam_ident, next, "next #1");
-
-        if (! next) {
-            isam_error = ISAM_EOF;
+    for (i = 0; i < n; i++)
+    {
+        slot = page_get(p + ISAM_PAGE_HEAD + i * ISAM_PAGE_SLOT, 2);
+        offset = page_get(p + ISAM_PAGE_HEAD + i * ISAM_PAGE_SLOT + 2, 2);
+        if (slot >= f->fHead.NrecPB || offset < start ||
+                offset + ISAM_PAGE_RECORD > f->pageSize)
+        {
             return -1;
         }
-        block_no = next / isam_ident->fHead.NrecPB;
-        rec_no = next % isam_ident->fHead.NrecPB;
-        iCache = isam_cache_block(isam_ident, block_no);
-
-        if (iCache < 0) {
+        r = p + offset;
+        prefix = r[9];
+        length = r[10];
+        if (prefix > prevLength || prefix + length > f->fHead.KeyLen ||
+                offset + ISAM_PAGE_RECORD + length + bytes > f->pageSize)
+        {
             return -1;
         }
-    } while(!(head((*isam_ident),iCache,rec_no)->statusFlags & ISAM_VALID));
-
-    isam_ident->cur_id = iCache;
-    isam_ident->cur_recno = rec_no;
-    memcpy(key, cur_key(*isam_ident), isam_ident->fHead.KeyLen);
-    memcpy(data, cur_data(*isam_ident), isam_ident->fHead.DataLen);
-    isam_error = ISAM_NO_ERROR;
+        rec = block + slot * f->fHead.RecordLen;
+        h.next = page_get(r, 4);
+        h.previous = page_get(r + 4, 4);
+        h.statusFlags = r[8] & ~ISAM_PAGE_IN_HEAP;
+        memcpy(rec, &h, sizeof(h));
+        key = rec + sizeof(recordHead);
+        for (j = 0; j < prefix; j++)
+        {
+            key[j] = prevKey[j];
+        }
+        for (j = 0; j < length; j++)
+        {
+            key[prefix + j] = r[ISAM_PAGE_RECORD + j];
+        }
+        prevKey = key;
+        prevLength = prefix + length;
+        data = rec + sizeof(recordHead) + f->fHead.KeyLen;
+        if (!varlen)
+        {
+            memcpy(data, r + ISAM_PAGE_RECORD + length, f->fHead.DataLen);
+            continue;
+        }
+        inHeap = r[8] & ISAM_PAGE_IN_HEAP;
+        offset += ISAM_PAGE_RECORD + length;
+        r += ISAM_PAGE_RECORD + length;
+        t.length = page_get(r, ISAM_PAGE_LENGTH);
+        t.heapPos = 0;
+        if (t.length > f->fHead.DataLen)
+        {
+            return -1;
+        }
+        if (inHeap)
+        {
+            if (offset + ISAM_PAGE_LENGTH + ISAM_PAGE_HEAP > f->pageSize)
+            {
+                return -1;
+            }
+            t.heapPos = page_get(r + ISAM_PAGE_LENGTH, ISAM_PAGE_HEAP);
+            if (withHeap && heap_read(f, data, t.length, t.heapPos))
+            {
+                return -1;
+            }
+        }
+        else
+        {
+            if (offset + ISAM_PAGE_LENGTH + t.length > f->pageSize)
+            {
+                return -1;
+            }
+            memcpy(data, r + ISAM_PAGE_LENGTH, t.length);
+        }
+        memcpy(data + f->fHead.DataLen, &t, sizeof(t));
+    }
     return 0;
 }
 
-/* isam_readPrev will read the current record, if it is valid, and then
-   reposition the file to the preceding valid record (if that exists). */
-
-int isam_readPrev(isamPtr isam_ident, char *key, void *data) {
-    int block_no;
-    int rec_no = 0;
-    int iCache = 0;
-    int prev;
+/* The checksum of a block on disk covers its contents (pageSize bytes)
+   and its number, so that a block written in the wrong place does not
+   pass either. block_seal stores it after the contents, block_check
+   checks it. A block that has never been written (in a hole in the
+   file) consists of zero bytes only, and is accepted as empty. */
 
-    if (testPtr(isam_ident)) {
-        return -1;
-    }
-    /* We should now be at the correct valid record (unless we are at the
-       very first record). So we check, copy the data, and try to find
-       the preceding valid record. */
+static unsigned long block_checksum(isamFile *f, const char *page,
+        unsigned long block_no)
+{
+    unsigned char number[8];
 
-    isam_error = ISAM_NO_ERROR;
-    if (cur_head(*isam_ident)->statusFlags & ISAM_VALID) {
-        memcpy(key, cur_key(*isam_ident), isam_ident->fHead.KeyLen);
-        memcpy(data, cur_data(*isam_ident), isam_ident->fHead.DataLen);
-        rec_no = isam_ident->cur_recno;
-        iCache = isam_ident->cur_id;
+    page_put(number, block_no, sizeof(number));
+    return crc32c(crc32c(0, page, f->pageSize), number, sizeof(number));
+}
 
-        do {
-            prev = head((*isam_ident),iCache,rec_no)->previous;
-            block_no = prev / isam_ident->fHead.NrecPB;
-            rec_no = prev % isam_ident->fHead.NrecPB;
-            iCache = isam_cache_block(isam_ident, block_no);
+static void block_seal(isamFile *f, char *page, unsigned long block_no)
+{
+    page_put((unsigned char *) page + f->pageSize,
+            block_checksum(f, page, block_no), ISAM_BLOCK_CHECK);
+}
 
-            if (iCache < 0) {
-                return -1;
-            }
-            if (! prev) {
-                break;
-            }
-        }  while(!(head((*isam_ident),iCache,rec_no)->statusFlags&ISAM_VALID));
+static int block_check(isamFile *f, const char *page, unsigned long block_no)
+{
+    unsigned long check = page_get((const unsigned char *) page +
+            f->pageSize, ISAM_BLOCK_CHECK);
+    unsigned long i;
 
-        isam_ident->cur_id = iCache;
-        isam_ident->cur_recno = rec_no;
+    if (check == block_checksum(f, page, block_no))
+    {
         return 0;
     }
-    isam_error = ISAM_SOF;
-    return -1;
+    for (i = 0; !check && i < f->pageSize && !page[i]; i++)
+        ;
+    return (!check && i == f->pageSize) ? 0 : -1;
 }
 
-/* isam_readByKey will attempt to read a record with the requested key */
-int isam_readByKey(isamPtr isam_ident, const char *key, void *data) {
-    /* STEP 5: This implementation is inefficient, and I have not verified
-       that it really works according to its specification
-       For one thing, it does not test for a valid isam_ident before use.
-       It is probably better to include tempData and tempKey as part of the
-       structure pointed to by isam_ident. That also saves some mallocs
-       and frees */
+/* Fill in a block on disk (page, diskSize bytes) from a block in the
+   cache layout, and restore one. page_decode only reads the values in
+   the heap when withHeap is set */
 
-    int rv;
+static int block_encode(isamFile *f, char *block, char *page,
+        unsigned long block_no)
+{
+    if (f->fHead.FileState & ISAM_HAS_PAGES)
+    {
+        if (page_encode(f, block, page))
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        memcpy(page, block, f->blockSize);
+    }
+    if (f->fHead.FileState & ISAM_HAS_CHECKSUMS)
+    {
+        block_seal(f, page, block_no);
+    }
+    return 0;
+}
 
-    rv = isam_seekByKey(isam_ident, key);
-    if (rv) {
+static int block_decode(isamFile *f, const char *page, char *block,
+        unsigned long block_no, int withHeap)
+{
+    if ((f->fHead.FileState & ISAM_HAS_CHECKSUMS) &&
+            block_check(f, page, block_no))
+    {
+        isam_error = ISAM_CHECKSUM_ERROR;
         return -1;
     }
-    memcpy(data, cur_data(*isam_ident), isam_ident->fHead.DataLen);
+    if (f->fHead.FileState & ISAM_HAS_PAGES)
+    {
+        if (page_decode(f, page, block, withHeap))
+        {
+            isam_error = ISAM_READ_ERROR;
+            return -1;
+        }
+    }
+    else if (page != block)
+    {
+        memcpy(block, page, f->blockSize);
+    }
     return 0;
 }
 
-/* Search a record by its key. */
-int isam_seekByKey(isamPtr isam_ident, const char *key) {
+/* Blocks of a file with pages or checksums go through a buffer on their
+   way to and from the disk; other blocks are read and written as they
+   are in the cache */
 
-    int block_no;
-    int rec_no;
-    unsigned long next;
-    int iCache;
-    int rv;
+#define BlockBuffered(f)    ((f)->fHead.FileState & \
+                             (ISAM_HAS_PAGES | ISAM_HAS_CHECKSUMS))
 
-    if (testPtr(isam_ident)) {
-        return -1;
-    }
+/* Take a free read buffer, or return -1 when all are in use */
 
-    if (key[0] == 0)
+static int readBuf_take(isamFile *f)
+{
+    unsigned long bit;
+    int     i;
+
+    for (i = 0; i < ISAM_READ_BUFS; i++)
     {
-        /* "rewind" the file to the dummy first record.*/
-        iCache = isam_cache_block(isam_ident, 0);
-        if (iCache < 0)
+        bit = 1UL << i;
+        if (!(__atomic_fetch_or(&(f->readBufBusy), bit, __ATOMIC_ACQUIRE) &
+                    bit))
         {
-            return -1;
+            if (!f->readBuf[i])
+            {
+                f->readBuf[i] = malloc(f->diskSize);
+                assert(f->readBuf[i] != NULL);
+            }
+            return i;
         }
-        isam_ident->cur_id = iCache;
-        isam_ident->cur_recno = 0;
-        return 0;
     }
-    else {
-        /* First find block number from index */
-        block_no = index_keyToBlock(isam_ident->index, key);
-        rec_no = 0;
-        /* Now make sure the block is in cache */
-        iCache = isam_cache_block(isam_ident, block_no);
-        if (iCache < 0)
+    return -1;
+}
+
+/* Read a data block from disk into block (in the cache layout). Return
+   -1 on failure, with isam_error set (ISAM_CHECKSUM_ERROR for a block
+   with a wrong checksum). Readers call it at the same time, without
+   cacheLock; with more than ISAM_READ_BUFS of them, the others allocate
+   a buffer of their own */
+
+static int block_read(isamFile *f, char *block, unsigned long block_no)
+{
+    char   *page = block;
+    int     rv = 0, buf = -1;
+
+    if (BlockBuffered(f))
+    {
+        if ((buf = readBuf_take(f)) >= 0)
         {
-            return -1;
+            page = f->readBuf[buf];
         }
-        /* Skip all records with smaller keys */
-        while ((rv = strncmp(key, key((*isam_ident),iCache,rec_no),
-                        isam_ident->fHead.KeyLen)) > 0)
+        else
         {
-            next = head((*isam_ident),iCache,rec_no)->next;
-            debugRecord(isam_ident, next, "setkey #1");
-            if (!next)
-            {
-                /* There is no next record */
-                break;
-            }
-            block_no = next / isam_ident->fHead.NrecPB;
-            rec_no = next % isam_ident->fHead.NrecPB;
-            iCache = isam_cache_block(isam_ident, block_no);
-            if (iCache < 0)
-            {
-                return -1;
-            }
+            page = malloc(f->diskSize);
+            assert(page != NULL);
         }
+    }
+    if (pread(f->fileId, page, f->diskSize,
+                f->fHead.DataStart + block_no * f->diskSize) !=
+            (ssize_t) f->diskSize)
+    {
+        isam_error = ISAM_READ_ERROR;
+        rv = -1;
+    }
+    else
+    {
+        rv = block_decode(f, page, block, block_no, 1);
+    }
+    if (buf >= 0)
+    {
+        __atomic_fetch_and(&(f->readBufBusy), ~(1UL << buf),
+                __ATOMIC_RELEASE);
+    }
+    else if (page != block)
+    {
+        free(page);
+    }
+    return rv;
+}
 
-        if (((strncmp(key, key((*isam_ident),iCache,rec_no), isam_ident->fHead.KeyLen)) != 0) ||
-                    (!(head((*isam_ident),iCache, rec_no)->statusFlags & ISAM_VALID ))) {
-            isam_error = ISAM_NO_SUCH_KEY;
-            return -1;
-        }
+/* Write a block (in the cache layout) to disk. Return -1 on failure;
+   the caller sets isam_error. Only used while a single thread works on
+   the file (creating it, redoing the log), so it uses pageBuf */
 
-        isam_ident->cur_id = iCache;
-        isam_ident->cur_recno = rec_no;
-        return 0;
+static int block_write(isamFile *f, char *block, unsigned long block_no)
+{
+    char   *page = block;
+    int     rv = 0;
+
+    if (BlockBuffered(f))
+    {
+        page = f->pageBuf;
+        rv = block_encode(f, block, page, block_no);
+    }
+    if (!rv && pwrite(f->fileId, page, f->diskSize,
+                f->fHead.DataStart + block_no * f->diskSize) !=
+            (ssize_t) f->diskSize)
+    {
+        rv = -1;
     }
+    return rv;
 }
 
-/* isam_append implements part of the functionality of isam_writeNew.
+/* The write-ahead log of a file (ISAM_CREATE_WAL) is a series of
+   transactions, one for every call of a modifying routine. A
+   transaction holds the new contents of the blocks modified by the
+   routine, the keys it added to the index and the new file header,
+   followed by a commit record with a checksum over all of these. When
+   the file is opened, the transactions in the log are redone; the
+   first one that is incomplete or damaged (a crash happened while it
+   was written) ends the log. Redoing a transaction that has already
+   reached the file does no harm.
+   Positions in the log (LSNs) count the bytes logged since the file was
+   opened; isam_flush writes everything to the file and then empties
+   the log, after which it starts at walFileBase. The first transaction
+   after that consists of just the header, so that the header is also
+   restored when markUnflushed has written it in the mean time.
+   The blocks modified by a routine remain in the cache until they have
+   been logged (walPending), and a block is only written to the file
+   once its contents in the log are on disk (walLsn <= walDurable). */
+
+#define WAL_BLOCK   (1)
+#define WAL_INDEX   (2)
+#define WAL_HEAD    (3)
+#define WAL_COMMIT  (4)
+
+/* The log is emptied by an isam_flush, which a modifying routine calls
+   itself once the log has grown beyond ISAM_WAL_CHECKPOINT bytes */
+
+#define ISAM_WAL_CHECKPOINT (16 * 1024 * 1024)
+
+typedef struct {
+    unsigned long type;                 /* WAL_BLOCK, ..., WAL_COMMIT     */
+    unsigned long id;                   /* Block number, if any           */
+    unsigned long length;               /* Bytes following the record     */
+    unsigned long check;                /* Checksum of the transaction    */
+} walRecord;
+
+static void wal_append(struct walBuffer *b, const void *data, size_t length)
+{
+    if (b->length + length > b->size) {
+        b->size = 2 * (b->length + length);
+        b->data = realloc(b->data, b->size);
+        assert(b->data != NULL);
+    }
+    memcpy(b->data + b->length, data, length);
+    b->length += length;
+}
+
+/* Add a record to the transaction being built */
+
+static void wal_record(isamFile *f, unsigned long type, unsigned long id,
+        const void *data, unsigned long length)
+{
+    walRecord r;
+
+    r.type = type;
+    r.id = id;
+    r.length = length;
+    r.check = 0;
+    wal_append(&(f->walTxn), &r, sizeof(r));
+    if (length) {
+        wal_append(&(f->walTxn), data, length);
+    }
+}
+
+/* A 32 bits FNV-1a hash serves as checksum */
+
+static unsigned long wal_checksum(const char *data, size_t length)
+{
+    unsigned long h = 2166136261UL;
+    size_t  i;
+
+    for (i = 0; i < length; i++) {
+        h = ((h ^ (unsigned char) data[i]) * 16777619UL) & 0xffffffffUL;
+    }
+    return h;
+}
+
+/* Start a transaction for a modifying routine, if the file has a log.
+   While snapshots are open, the routine saves the blocks it uses for
+   them (see cache_done) until wal_commit */
+
+static void wal_begin(isamFile *f)
+{
+    f->walActive = (f->walFd >= 0);
+    f->snapSave = (__atomic_load_n(&(f->snapshots), __ATOMIC_RELAXED) !=
+            NULL);
+}
+
+/* Log a key added to the index */
+
+static void wal_addKey(isamFile *f, const char *key, unsigned long block_no)
+{
+    if (f->walActive) {
+        wal_record(f, WAL_INDEX, block_no, key, f->fHead.KeyLen);
+    }
+}
+
+/* End the transaction: add the modified blocks, the header and the
+   commit record, and append it to the log buffer. Returns the log
+   position up to which the log must be on disk for the transaction to
+   be safe, or 0 when nothing was modified (unless always is set).
+   Called with the file lock held exclusively. */
+
+static unsigned long long wal_commit(isamFile *f, int always)
+{
+    walRecord r;
+    unsigned long long lsn;
+    int     i, iCache;
+
+    f->snapSave = 0;
+    if (!f->walActive) {
+        return 0;
+    }
+    f->walActive = 0;
+    if (!always && !f->walNSlots && !f->walTxn.length) {
+        return 0;
+    }
+    for (i = 0; i < f->walNSlots; i++) {
+        iCache = f->walSlots[i];
+        wal_record(f, WAL_BLOCK, f->blockInCache[iCache], f->cache[iCache],
+                f->blockSize);
+    }
+    wal_record(f, WAL_HEAD, 0, &(f->fHead), sizeof(fileHead));
+    r.type = WAL_COMMIT;
+    r.id = 0;
+    r.length = 0;
+    r.check = wal_checksum(f->walTxn.data, f->walTxn.length);
+    wal_append(&(f->walTxn), &r, sizeof(r));
+
+    pthread_mutex_lock(&(f->walLock));
+    wal_append(&(f->walBuf), f->walTxn.data, f->walTxn.length);
+    lsn = f->walEnd += f->walTxn.length;
+    pthread_mutex_unlock(&(f->walLock));
+    for (i = 0; i < f->walNSlots; i++) {
+        f->walPending[f->walSlots[i]] = 0;
+        f->walLsn[f->walSlots[i]] = lsn;
+    }
+    f->walNSlots = 0;
+    f->walTxn.length = 0;
+    ISAM_STAT(f, logCommits, 1);
+    return lsn;
+}
+
+/* Make sure that the log is on disk up to position lsn. One thread at a
+   time writes everything committed so far and syncs the log; others
+   wait for it, and commits made in the mean time are written together
+   by the next thread (group commit). */
+
+static int wal_sync(isamFile *f, unsigned long long lsn)
+{
+    struct walBuffer b;
+    unsigned long long start;
+    off_t   offset;
+    int     rv = 0;
+
+    pthread_mutex_lock(&(f->walLock));
+    while (f->walDurable < lsn) {
+        if (f->walFailed) {
+            isam_error = ISAM_LOG_ERROR;
+            rv = -1;
+            break;
+        }
+        if (f->walWriting) {
+            pthread_cond_wait(&(f->walCond), &(f->walLock));
+            continue;
+        }
+        /* Take the buffer; new commits go to the spare one */
+        b = f->walBuf;
+        f->walBuf = f->walSpare;
+        f->walBuf.length = 0;
+        start = f->walDurable;
+        offset = start - f->walFileBase;
+        f->walWriting = 1;
+        pthread_mutex_unlock(&(f->walLock));
+        if (pwrite(f->walFd, b.data, b.length, offset) != (ssize_t) b.length ||
+                fdatasync(f->walFd)) {
+            isam_error = ISAM_LOG_ERROR;
+            rv = -1;
+        }
+        pthread_mutex_lock(&(f->walLock));
+        f->walWriting = 0;
+        if (rv) {
+            f->walFailed = 1;
+        } else {
+            f->walDurable = start + b.length;
+            ISAM_STAT(f, logWrites, 1);
+            ISAM_STAT(f, logBytes, b.length);
+        }
+        f->walSpare = b;
+        pthread_cond_broadcast(&(f->walCond));
+    }
+    pthread_mutex_unlock(&(f->walLock));
+    return rv;
+}
+
+/* Empty the log, after isam_flush has written and synced everything
+   logged so far, and log the header as it is now on disk. Called with
+   the file lock held exclusively. */
+
+static int wal_checkpoint(isamFile *f)
+{
+    pthread_mutex_lock(&(f->walLock));
+    f->walFileBase = f->walDurable;
+    pthread_mutex_unlock(&(f->walLock));
+    if (ftruncate(f->walFd, 0)) {
+        isam_error = ISAM_LOG_ERROR;
+        return -1;
+    }
+    wal_begin(f);
+    return wal_sync(f, wal_commit(f, 1));
+}
+
+/* Open the log of file name; when creating a file, any old log with
+   that name is discarded */
+
+static int wal_open(isamFile *f, const char *name, int create)
+{
+    f->walName = malloc(strlen(name) + sizeof(".wal"));
+    assert(f->walName != NULL);
+    strcpy(f->walName, name);
+    strcat(f->walName, ".wal");
+    f->walFd = open(f->walName, O_RDWR | O_CREAT | (create ? O_TRUNC : 0),
+            0660);
+    if (f->walFd < 0) {
+        isam_error = ISAM_LOG_ERROR;
+        return -1;
+    }
+    return 0;
+}
+
+/* Close and remove the log, once everything is in the file */
+
+static void wal_remove(isamFile *f)
+{
+    close(f->walFd);
+    f->walFd = -1;
+    unlink(f->walName);
+}
+
+/* Check the size and block number of a log record */
+
+static int wal_validRecord(isamFile *f, walRecord *r)
+{
+    switch (r->type) {
+        case WAL_BLOCK:
+            return r->length == f->blockSize;
+        case WAL_INDEX:
+            return r->length == f->fHead.KeyLen;
+        case WAL_HEAD:
+            return r->length == sizeof(fileHead) && r->id == 0;
+        default:
+            return 0;
+    }
+}
+
+/* Redo the transactions in the log of a file being opened, writing the
+   blocks to the file and adding keys to the index in memory. Returns
+   the number of transactions found, or -1 */
+
+static long wal_replay(isamFile *f)
+{
+    struct stat buf;
+    walRecord r;
+    char   *log, *end, *txn, *p;
+    long    n = 0;
+    int     rv = 0;
+
+    if (fstat(f->walFd, &buf)) {
+        isam_error = ISAM_LOG_ERROR;
+        return -1;
+    }
+    if (!buf.st_size) {
+        return 0;
+    }
+    log = malloc(buf.st_size);
+    assert(log != NULL);
+    if (pread(f->walFd, log, buf.st_size, 0) != buf.st_size) {
+        free(log);
+        isam_error = ISAM_LOG_ERROR;
+        return -1;
+    }
+    end = log + buf.st_size;
+    for (txn = log; !rv; txn = p + sizeof(r), n++) {
+        /* Find the commit record and check the transaction */
+        for (p = txn; (size_t) (end - p) >= sizeof(r); p += sizeof(r) + r.length) {
+            memcpy(&r, p, sizeof(r));
+            if (r.type == WAL_COMMIT || !wal_validRecord(f, &r) ||
+                    (size_t) (end - p) - sizeof(r) < r.length) {
+                break;
+            }
+        }
+        if ((size_t) (end - p) < sizeof(r) || r.type != WAL_COMMIT ||
+                r.length || r.check != wal_checksum(txn, p - txn)) {
+            break;
+        }
+        /* Redo it */
+        for (p = txn; !rv; p += sizeof(r) + r.length) {
+            memcpy(&r, p, sizeof(r));
+            if (r.type == WAL_COMMIT) {
+                break;
+            }
+            switch (r.type) {
+                case WAL_BLOCK:
+                    heap_forget(f, p + sizeof(r));
+                    if (block_write(f, p + sizeof(r), r.id)) {
+                        isam_error = ISAM_WRITE_FAIL;
+                        rv = -1;
+                    }
+                    break;
+                case WAL_INDEX:
+                    /* The key may have reached the index on disk */
+                    if (addIndexKey(f, p + sizeof(r), r.id) < 0 &&
+                            index_error != INDEX_KEY_NOT_LARGER) {
+                        rv = -1;
+                    }
+                    break;
+                case WAL_HEAD:
+                    memcpy(&(f->fHead), p + sizeof(r), sizeof(fileHead));
+                    break;
+            }
+        }
+    }
+    free(log);
+    return rv ? -1 : n;
+}
+
+/* In the remainder of the code, we should not need to worry about how and
+   where to write a given block from the cache.
+   Dirty neighbours of the block that are also in the cache are written
+   in the same (vectored) write, at most ISAM_MAX_RUN blocks at a time.
+   With a write-ahead log, the log must first hold all of them. */
+
+static int flush_cache_block(isamFile *isam_ident, int iCache) {
+    struct iovec iov[ISAM_MAX_RUN];
+    int     run[ISAM_MAX_RUN];
+    unsigned long first = isam_ident->blockInCache[iCache];
+    unsigned long long lsn = 0;
+    int     n, j;
+    ssize_t rv;
+
+    if (isam_ident->mapped[iCache]) {
+        /* Modified in place, the mapping takes care of it */
+        isam_ident->dirty[iCache] = 0;
+        return 0;
+    }
+    /* Find the first block of the run of dirty blocks */
+    for (n = 1; n < ISAM_MAX_RUN && first > 0; n++, first--) {
+        j = cache_lookup(isam_ident, first - 1);
+        if ((j < 0) || !isam_ident->dirty[j] || isam_ident->mapped[j] ||
+                isam_ident->walPending[j]) {
+            break;
+        }
+    }
+    /* And collect the run */
+    for (n = 0; n < ISAM_MAX_RUN; n++) {
+        j = cache_lookup(isam_ident, first + n);
+        if ((j < 0) || !isam_ident->dirty[j] || isam_ident->mapped[j] ||
+                isam_ident->walPending[j]) {
+            break;
+        }
+        run[n] = j;
+        iov[n].iov_base = isam_ident->cache[j];
+        iov[n].iov_len = isam_ident->diskSize;
+        if (isam_ident->walLsn[j] > lsn) {
+            lsn = isam_ident->walLsn[j];
+        }
+    }
+    assert(n > 0);
+    if (lsn && wal_sync(isam_ident, lsn)) {
+        return -1;
+    }
+    /* Blocks stored as pages or with a checksum are written from
+       pageBuf */
+    if (BlockBuffered(isam_ident)) {
+        for (j = 0; j < n; j++) {
+            iov[j].iov_base = isam_ident->pageBuf + j * isam_ident->diskSize;
+            if (block_encode(isam_ident, isam_ident->cache[run[j]],
+                        iov[j].iov_base, first + j)) {
+                isam_error = ISAM_WRITE_FAIL;
+                return -1;
+            }
+        }
+    }
+
+#ifdef HAVE_PWRITEV
+    rv = pwritev(isam_ident->fileId, iov, n, isam_ident->fHead.DataStart +
+            first * isam_ident->diskSize);
+    if (rv != (ssize_t) (n * isam_ident->diskSize)) {
+        isam_error = ISAM_WRITE_FAIL;
+        return -1;
+    }
+
+    /* STEP 2 INF: This is a good place to record the number of block writes. */
+    ISAM_COUNT(disk_writes_global);
+    ISAM_STAT(isam_ident, diskWrites, 1);
+    ISAM_STAT(isam_ident, bytesWritten, rv);
+#else
+    for (j = 0; j < n; j++) {
+        rv = pwrite(isam_ident->fileId, iov[j].iov_base, iov[j].iov_len,
+                isam_ident->fHead.DataStart +
+                (first + j) * isam_ident->diskSize);
+        if (rv != (ssize_t) isam_ident->diskSize) {
+            isam_error = ISAM_WRITE_FAIL;
+            return -1;
+        }
+        ISAM_COUNT(disk_writes_global);
+        ISAM_STAT(isam_ident, diskWrites, 1);
+        ISAM_STAT(isam_ident, bytesWritten, rv);
+    }
+#endif
+    ISAM_STAT(isam_ident, writeBacks, n);
+    for (j = 0; j < n; j++) {
+        isam_ident->dirty[run[j]] = 0;
+    }
+    if (first + n > isam_ident->diskBlocks) {
+        isam_ident->diskBlocks = first + n;
+    }
+
+    return 0;
+}
+
+/* Mark a modified block in the cache as dirty. It will be written when
+   it is replaced, or by isam_flush; with a write-ahead log, it is
+   logged at the end of the modifying routine */
+static int write_cache_block(isamFile *isam_ident, int iCache) {
+    if (markUnflushed(isam_ident)) {
+        return -1;
+    }
+    isam_ident->dirty[iCache] = 1;
+    if (isam_ident->walActive && !isam_ident->walPending[iCache]) {
+        isam_ident->walPending[iCache] = 1;
+        isam_ident->walSlots[isam_ident->walNSlots++] = iCache;
+    }
+    return 0;
+}
+
+/* (Re)map the file, such that the mapping covers nBlocks data blocks.
+   Slots pointing into an old mapping are moved to the new one. The
+   mapping may extend beyond the end of the file, but only blocks below
+   diskBlocks are ever accessed through it. */
+
+static int isam_map(isamFile *f, unsigned long nBlocks) {
+    size_t length = f->fHead.DataStart + nBlocks * f->blockSize;
+    char *map;
+    int iCache;
+
+    map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED,
+            f->fileId, 0);
+    if (map == MAP_FAILED) {
+        isam_error = ISAM_READ_ERROR;
+        return -1;
+    }
+    for (iCache = 0; iCache < f->cacheSize; iCache++) {
+        if (f->mapped[iCache]) {
+            f->cache[iCache] = map + f->fHead.DataStart +
+                f->blockInCache[iCache] * f->blockSize;
+        }
+    }
+    if (f->map) {
+        munmap(f->map, f->mapLength);
+    }
+    f->map = map;
+    f->mapLength = length;
+    f->mapBlocks = nBlocks;
+    return 0;
+}
+
+/* Save the block in slot iCache for the snapshots of file f, unless it
+   lies beyond the blocks they can see, or has been saved already since
+   the latest snapshot began */
+
+static void snap_save(isamFile *f, int iCache) {
+    unsigned long block_no = f->blockInCache[iCache];
+    struct snapVersion **bucket, *v;
+
+    pthread_mutex_lock(&(f->snapLock));
+    if (f->snapshots && block_no < f->snapBlocks) {
+        bucket = f->snapHash + (block_no & f->hashMask);
+        for (v = *bucket; v && v->block_no != block_no; v = v->next)
+            ;
+        if (!v || v->gen < f->snapGen) {
+            v = malloc(sizeof(struct snapVersion) + f->blockSize);
+            assert(v != NULL);
+            v->block_no = block_no;
+            v->gen = f->snapGen;
+            memcpy(v + 1, f->cache[iCache], f->blockSize);
+            v->next = *bucket;
+            *bucket = v;
+            ISAM_STAT(f, snapshotCopies, 1);
+        }
+    }
+    pthread_mutex_unlock(&(f->snapLock));
+}
+
+/* Copy the block saved for snapshot s, if any, into block. Returns 1 if
+   there is one, 0 if not */
+
+static int snap_find(isamFile *s, char *block, unsigned long block_no) {
+    isamFile *f = s->snapOf;
+    struct snapVersion *v, *found = NULL;
+
+    pthread_mutex_lock(&(f->snapLock));
+    for (v = f->snapHash[block_no & f->hashMask]; v; v = v->next) {
+        if (v->block_no == block_no && v->gen >= s->snapGen) {
+            found = v;
+        }
+    }
+    if (found) {
+        memcpy(block, found + 1, s->blockSize);
+    }
+    pthread_mutex_unlock(&(f->snapLock));
+    return found != NULL;
+}
+
+/* Read block block_no as snapshot s sees it: the copy saved for it, or
+   else the block on disk (when the snapshot began, the blocks modified
+   in the cache were saved). A modifying routine saves a block before it
+   can change it, in the cache or on disk, so when there is still no
+   copy after the block has been read, what was read is valid. */
+
+static int snap_read(isamFile *s, char *block, unsigned long block_no) {
+    enum isam_error error = isam_error;
+    int rv = 0;
+
+    if (snap_find(s, block, block_no)) {
+        return 0;
+    }
+    if (block_no >= s->snapBlocks) {
+        /* Not yet written when the snapshot began */
+        memset(block, 0, s->blockSize);
+    } else {
+        rv = block_read(s, block, block_no);
+    }
+    if (snap_find(s, block, block_no)) {
+        isam_error = error;
+        return 0;
+    }
+    return rv;
+}
+
+/* Make slot iCache (if >= 0) the work slot of cursor c, release
+   cacheLock and return iCache. A modifying routine may change the
+   block, so while snapshots are open, it is saved for them first */
+
+static int cache_done(isamPtr c, int iCache) {
+    if (iCache >= 0) {
+        if (c->file->snapSave) {
+            snap_save(c->file, iCache);
+        }
+        __sync_fetch_and_add(&(c->file->pinCount[iCache]), 1);
+        if (c->work >= 0) {
+            __sync_fetch_and_sub(&(c->file->pinCount[c->work]), 1);
+        }
+        c->work = iCache;
+    }
+    pthread_mutex_unlock(&(c->file->cacheLock));
+    return iCache;
+}
+
+/* See if the requested block is in the cache (could be a data block, or
+   a block in the overflow area). If not, load the block, possibly
+   writing a dirty block to make room.
+   If the block lies beyond the last block in the file, there is no need
+   to read from the file (which should result in an EOF error anyway);
+   we just zero the cache block (corresponding to an empty record).
+   The slot returned remains in place until the next call for the same
+   cursor, even when other threads use the cache. */
+
+static int isam_cache_block(isamPtr isam_ident, unsigned long block_no) {
+    isamFile *f = isam_ident->file;
+    int iCache;
+    int rv;
+#ifdef DEBUG
+    fprintf(stderr, "isam_cache_block(..., %lu)\n", block_no);
+#endif
+
+    /* STEP 2: this function needs to be instrumented to record the
+       number of times it has been called (this is a good place to do
+       that) and the number of times it needs to read from disk (see
+       pread() call below).  */
+
+    ISAM_COUNT(cache_call_global);
+    ISAM_STAT(isam_ident, cacheCalls, 1);
+    pthread_mutex_lock(&(f->cacheLock));
+
+    /* A block beyond the current end of the file. Mark it dirty; it
+       extends the file when it is written. Only a writer, holding the
+       file lock exclusively, gets here */
+
+    if (block_no >= f->fHead.CurBlocks) {
+        /* Pages hold 32-bit record numbers; a snapshot never writes */
+        if (f->snapOf || ((f->fHead.FileState & ISAM_HAS_PAGES) &&
+                block_no >= ISAM_PAGE_MAX_REC / f->fHead.NrecPB)) {
+            isam_error = ISAM_SEEK_ERROR;
+            return cache_done(isam_ident, -1);
+        }
+        ISAM_STAT(isam_ident, cacheMisses, 1);
+        iCache = cache_victim(f);
+        if (iCache < 0) {
+            return cache_done(isam_ident, -1);
+        }
+        memset(f->cache[iCache], 0, f->blockSize);
+        cache_assign(f, iCache, block_no);
+
+        if (write_cache_block(f, iCache)) {
+            return cache_done(isam_ident, -1);
+        }
+        f->fHead.CurBlocks = block_no + 1;
+
+        if (writeHead(f)) {
+            return cache_done(isam_ident, -1);
+        }
+        return cache_done(isam_ident, iCache);
+    }
+    /* A block within the current file bounds. First see if it is in the
+       cache already; if another thread is loading it, wait for that */
+
+    while ((iCache = cache_lookup(f, block_no)) >= 0 && f->loading[iCache]) {
+        pthread_cond_wait(&(f->cacheCond), &(f->cacheLock));
+    }
+    if (iCache >= 0) {
+        f->refBit[iCache] = 1;
+        ISAM_COUNT(cache_hits_global);
+        ISAM_STAT(isam_ident, cacheHits, 1);
+        return cache_done(isam_ident, iCache);
+    }
+    /* The block is not in the cache. Load it into the slot selected by
+       the replacement policy */
+    ISAM_STAT(isam_ident, cacheMisses, 1);
+    iCache = cache_victim(f);
+    if (iCache < 0) {
+        return cache_done(isam_ident, -1);
+    }
+    if (block_no >= f->diskBlocks) {
+        /* The file was extended beyond this block, but the block itself
+           has never been written: it is still empty */
+        memset(f->cache[iCache], 0, f->blockSize);
+        cache_assign(f, iCache, block_no);
+        return cache_done(isam_ident, iCache);
+    }
+    if (f->map && (block_no < f->mapBlocks)) {
+        /* Let the slot point into the mapping. Blocks beyond it are
+           read as usual, until isam_flush extends the mapping */
+        cache_assign(f, iCache, block_no);
+        f->cache[iCache] = f->map + f->fHead.DataStart +
+            block_no * f->blockSize;
+        f->mapped[iCache] = 1;
+        return cache_done(isam_ident, iCache);
+    }
+
+    /* Read the block without holding cacheLock */
+    cache_assign(f, iCache, block_no);
+    f->loading[iCache] = 1;
+    pthread_mutex_unlock(&(f->cacheLock));
+    rv = f->snapOf ? snap_read(f, f->cache[iCache], block_no) :
+        block_read(f, f->cache[iCache], block_no);
+    pthread_mutex_lock(&(f->cacheLock));
+    f->loading[iCache] = 0;
+    pthread_cond_broadcast(&(f->cacheCond));
+
+    if (rv) {
+        /* The slot contents are no longer valid; block_read has set
+           isam_error (a wrong checksum gives ISAM_CHECKSUM_ERROR) */
+        cache_release(f, iCache);
+        return cache_done(isam_ident, -1);
+    }
+
+    /* STEP 2: This is a good place to record the number of disk reads.  */
+    ISAM_COUNT(disk_reads_global);
+    ISAM_STAT(isam_ident, diskReads, 1);
+    ISAM_STAT(isam_ident, bytesRead, f->diskSize);
+    return cache_done(isam_ident, iCache);
+}
+
+/* An I/O thread reads the slots that cache_prefetch puts in ioQueue.
+   While a read is in progress, loading[] is set for the slot, so that
+   cursors needing the block wait for it. When the read fails, the slot
+   is released again, and a cursor needing the block reads it itself.
+   The threads finish when ioStop is set and the queue is empty. */
+
+static void *io_thread(void *arg) {
+    isamFile *f = (isamFile *) arg;
+    int     iCache;
+    unsigned long block_no;
+    int     rv;
+
+    pthread_mutex_lock(&(f->cacheLock));
+    for (;;) {
+        if (!f->ioQueued) {
+            if (f->ioStop) {
+                break;
+            }
+            pthread_cond_wait(&(f->ioCond), &(f->cacheLock));
+            continue;
+        }
+        iCache = f->ioQueue[f->ioHead];
+        f->ioHead = (f->ioHead + 1) % f->ioDepth;
+        f->ioQueued--;
+        f->ioBusy++;
+        block_no = f->blockInCache[iCache];
+        pthread_mutex_unlock(&(f->cacheLock));
+        rv = block_read(f, f->cache[iCache], block_no);
+        pthread_mutex_lock(&(f->cacheLock));
+        f->ioBusy--;
+        f->loading[iCache] = 0;
+        if (rv) {
+            cache_release(f, iCache);
+        } else {
+            ISAM_COUNT(disk_reads_global);
+            ISAM_STAT_SHARED(f, diskReads, 1);
+            ISAM_STAT_SHARED(f, bytesRead, f->diskSize);
+            ISAM_STAT(f, prefetches, 1);
+        }
+        pthread_cond_broadcast(&(f->cacheCond));
+    }
+    pthread_mutex_unlock(&(f->cacheLock));
+    return NULL;
+}
+
+#ifdef HAVE_IO_URING
+
+/* Where the kernel allows it, the reads ahead go through an io_uring
+   instead of ioQueue: the thread queueing them in cache_prefetch puts
+   them in the submission ring itself, and submits them all with one
+   system call. A single I/O thread (ioThreads[0]) waits for their
+   completions and finishes them like io_thread does; ioBusy counts the
+   reads submitted. The rings are used through the raw system calls, and
+   only under cacheLock (submissions) or by the one I/O thread
+   (completions). */
+
+struct ioRing {
+    int     fd;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void   *sq, *cq;
+    size_t  sqLength, cqLength, sqesLength;
+    unsigned pending;                   /* Entries not yet submitted      */
+};
+
+/* One read ahead; for blocks stored as pages or with a checksum, the
+   page read follows it */
+
+struct ringRead {
+    int     iCache;
+    unsigned long block_no;
+    struct iovec iov;
+};
+
+static int ring_enter(struct ioRing *r, unsigned toSubmit,
+        unsigned minComplete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, r->fd, toSubmit, minComplete, flags,
+            NULL, 0);
+}
+
+static void ring_free(struct ioRing *r) {
+    if (r->sq && r->sq != MAP_FAILED) {
+        munmap(r->sq, r->sqLength);
+    }
+    if (r->cq && r->cq != MAP_FAILED) {
+        munmap(r->cq, r->cqLength);
+    }
+    if (r->sqes && (void *) r->sqes != MAP_FAILED) {
+        munmap(r->sqes, r->sqesLength);
+    }
+    close(r->fd);
+    free(r);
+}
+
+/* Set up a ring with room for entries submissions, or return NULL when
+   the kernel does not allow it */
+
+static struct ioRing *ring_setup(unsigned entries) {
+    struct io_uring_params p;
+    struct ioRing *r;
+    int     fd;
+
+    memset(&p, 0, sizeof(p));
+    fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (fd < 0) {
+        return NULL;
+    }
+    r = calloc(1, sizeof(struct ioRing));
+    assert(r != NULL);
+    r->fd = fd;
+    r->sqLength = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cqLength = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqesLength = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sq = mmap(NULL, r->sqLength, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+            IORING_OFF_SQ_RING);
+    r->cq = mmap(NULL, r->cqLength, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+            IORING_OFF_CQ_RING);
+    r->sqes = mmap(NULL, r->sqesLength, PROT_READ | PROT_WRITE, MAP_SHARED,
+            fd, IORING_OFF_SQES);
+    if (r->sq == MAP_FAILED || r->cq == MAP_FAILED ||
+            (void *) r->sqes == MAP_FAILED) {
+        ring_free(r);
+        return NULL;
+    }
+    r->sqHead = (unsigned *) ((char *) r->sq + p.sq_off.head);
+    r->sqTail = (unsigned *) ((char *) r->sq + p.sq_off.tail);
+    r->sqMask = (unsigned *) ((char *) r->sq + p.sq_off.ring_mask);
+    r->sqArray = (unsigned *) ((char *) r->sq + p.sq_off.array);
+    r->cqHead = (unsigned *) ((char *) r->cq + p.cq_off.head);
+    r->cqTail = (unsigned *) ((char *) r->cq + p.cq_off.tail);
+    r->cqMask = (unsigned *) ((char *) r->cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *) ((char *) r->cq + p.cq_off.cqes);
+    return r;
+}
+
+/* Fill in the next submission entry; the caller holds cacheLock, and
+   never has more entries outstanding than the ring holds */
+
+static struct io_uring_sqe *ring_entry(struct ioRing *r) {
+    unsigned tail = *(r->sqTail);
+    struct io_uring_sqe *sqe = r->sqes + (tail & *(r->sqMask));
+
+    memset(sqe, 0, sizeof(*sqe));
+    r->sqArray[tail & *(r->sqMask)] = tail & *(r->sqMask);
+    __atomic_store_n(r->sqTail, tail + 1, __ATOMIC_RELEASE);
+    r->pending++;
+    return sqe;
+}
+
+/* Queue a read of the block in slot iCache (assigned and loading) */
+
+static int ring_queue(isamFile *f, int iCache) {
+    struct ringRead *rd;
+    struct io_uring_sqe *sqe;
+
+    rd = malloc(sizeof(struct ringRead) +
+            (BlockBuffered(f) ? f->diskSize : 0));
+    if (!rd) {
+        return -1;
+    }
+    rd->iCache = iCache;
+    rd->block_no = f->blockInCache[iCache];
+    rd->iov.iov_base = BlockBuffered(f) ? (char *) (rd + 1) :
+        f->cache[iCache];
+    rd->iov.iov_len = f->diskSize;
+    sqe = ring_entry(f->ioRing);
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = f->fileId;
+    sqe->off = f->fHead.DataStart + rd->block_no * f->diskSize;
+    sqe->addr = (unsigned long) &(rd->iov);
+    sqe->len = 1;
+    sqe->user_data = (unsigned long) rd;
+    return 0;
+}
+
+/* Submit the entries filled in. When the kernel does not take them, they
+   are taken back, and their slots released again */
+
+static void ring_submit(isamFile *f) {
+    struct ioRing *r = f->ioRing;
+    struct ringRead *rd;
+    unsigned first, head;
+    int     n;
+
+    while (r->pending) {
+        n = ring_enter(r, r->pending, 0, 0);
+        if (n > 0) {
+            r->pending -= n;
+        } else if (n == 0 || errno != EINTR) {
+            break;
+        }
+    }
+    if (!r->pending) {
+        return;
+    }
+    first = __atomic_load_n(r->sqHead, __ATOMIC_ACQUIRE);
+    for (head = first; head != *(r->sqTail); head++) {
+        rd = (struct ringRead *) (unsigned long)
+            r->sqes[r->sqArray[head & *(r->sqMask)]].user_data;
+        if (rd) {
+            f->loading[rd->iCache] = 0;
+            cache_release(f, rd->iCache);
+            f->ioBusy--;
+            free(rd);
+        }
+    }
+    __atomic_store_n(r->sqTail, first, __ATOMIC_RELEASE);
+    r->pending = 0;
+    pthread_cond_broadcast(&(f->cacheCond));
+}
+
+/* The I/O thread with an io_uring: finish the reads as they complete.
+   io_stop submits a no-op; after that, the thread finishes as soon as no
+   reads are outstanding */
+
+static void *ring_thread(void *arg) {
+    isamFile *f = (isamFile *) arg;
+    struct ioRing *r = f->ioRing;
+    struct io_uring_cqe cqe;
+    struct ringRead *rd;
+    unsigned head;
+    int     stop = 0, rv;
+
+    for (;;) {
+        pthread_mutex_lock(&(f->cacheLock));
+        rv = stop && !f->ioBusy;
+        pthread_mutex_unlock(&(f->cacheLock));
+        if (rv) {
+            break;
+        }
+        if (ring_enter(r, 0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+                errno != EINTR) {
+            break;
+        }
+        head = *(r->cqHead);
+        while (head != __atomic_load_n(r->cqTail, __ATOMIC_ACQUIRE)) {
+            cqe = r->cqes[head & *(r->cqMask)];
+            __atomic_store_n(r->cqHead, ++head, __ATOMIC_RELEASE);
+            rd = (struct ringRead *) (unsigned long) cqe.user_data;
+            if (!rd) {
+                stop = 1;
+                continue;
+            }
+            rv = (cqe.res != (int) f->diskSize) ||
+                (BlockBuffered(f) && block_decode(f, rd->iov.iov_base,
+                    f->cache[rd->iCache], rd->block_no, 1));
+            pthread_mutex_lock(&(f->cacheLock));
+            f->ioBusy--;
+            f->loading[rd->iCache] = 0;
+            if (rv) {
+                cache_release(f, rd->iCache);
+            } else {
+                ISAM_COUNT(disk_reads_global);
+                ISAM_STAT_SHARED(f, diskReads, 1);
+                ISAM_STAT_SHARED(f, bytesRead, f->diskSize);
+                ISAM_STAT(f, prefetches, 1);
+                ISAM_STAT(f, ringPrefetches, 1);
+            }
+            pthread_cond_broadcast(&(f->cacheCond));
+            pthread_mutex_unlock(&(f->cacheLock));
+            free(rd);
+        }
+    }
+    return NULL;
+}
+
+/* Start reading ahead through an io_uring, for depth reads at a time.
+   Returns -1 when the kernel does not allow it, or the thread cannot be
+   started; the caller then starts the I/O threads instead */
+
+static int ring_start(isamFile *f, int depth) {
+    f->ioRing = ring_setup(depth + 1);
+    if (!f->ioRing) {
+        return -1;
+    }
+    f->ioThreads = calloc(1, sizeof(pthread_t));
+    assert(f->ioThreads != NULL);
+    if (pthread_create(f->ioThreads, NULL, ring_thread, f)) {
+        ring_free(f->ioRing);
+        f->ioRing = NULL;
+        free(f->ioThreads);
+        f->ioThreads = NULL;
+        return -1;
+    }
+    f->ioDepth = depth;
+    return 0;
+}
+
+/* Have the thread of the ring finish (the caller holds cacheLock) */
+
+static void ring_stop(isamFile *f) {
+    ring_entry(f->ioRing)->opcode = IORING_OP_NOP;
+    ring_submit(f);
+}
+
+#else
+
+static int ring_queue(isamFile *f, int iCache) {
+    (void) f;
+    (void) iCache;
+    return -1;
+}
+
+static void ring_submit(isamFile *f) {
+    (void) f;
+}
+
+static int ring_start(isamFile *f, int depth) {
+    (void) f;
+    (void) depth;
+    return -1;
+}
+
+static void ring_stop(isamFile *f) {
+    (void) f;
+}
+
+#endif
+
+/* Have the I/O threads read blocks first up to last into the cache, as
+   far as they are on disk and not in the cache yet. At most ioDepth
+   reads are outstanding; for more, the caller waits until a read has
+   finished. The slots are not pinned, so a block may be replaced again
+   before it is used. Reading ahead is only an optimisation: when no
+   slot can be found, the remaining blocks are skipped. With an io_uring
+   the reads are submitted here, all at once. */
+
+static void cache_prefetch(isamFile *f, unsigned long first,
+        unsigned long last) {
+    enum isam_error error = isam_error;
+    int     iCache;
+
+    if (!f->ioDepth) {
+        return;
+    }
+    pthread_mutex_lock(&(f->cacheLock));
+    for (; first <= last && first < f->diskBlocks; first++) {
+        if ((f->map && first < f->mapBlocks) || cache_lookup(f, first) >= 0) {
+            continue;
+        }
+        while (f->ioQueued + f->ioBusy >= f->ioDepth) {
+            if (f->ioRing) {
+                ring_submit(f);
+            }
+            pthread_cond_wait(&(f->cacheCond), &(f->cacheLock));
+        }
+        /* Another thread may have read the block in the mean time */
+        if (cache_lookup(f, first) >= 0) {
+            continue;
+        }
+        if ((iCache = cache_victim(f)) < 0) {
+            break;
+        }
+        cache_assign(f, iCache, first);
+        f->loading[iCache] = 1;
+        if (f->ioRing) {
+            if (ring_queue(f, iCache)) {
+                f->loading[iCache] = 0;
+                cache_release(f, iCache);
+                break;
+            }
+            f->ioBusy++;
+            continue;
+        }
+        f->ioQueue[(f->ioHead + f->ioQueued) % f->ioDepth] = iCache;
+        f->ioQueued++;
+        pthread_cond_signal(&(f->ioCond));
+    }
+    if (f->ioRing) {
+        ring_submit(f);
+    }
+    pthread_mutex_unlock(&(f->cacheLock));
+    isam_error = error;
+}
+
+/* Stop the I/O threads of a file, after they have finished the reads
+   queued, and release them */
+
+static void io_stop(isamFile *f) {
+    int     i;
+
+    pthread_mutex_lock(&(f->cacheLock));
+    f->ioStop = 1;
+    if (f->ioRing) {
+        ring_stop(f);
+    }
+    pthread_cond_broadcast(&(f->ioCond));
+    pthread_mutex_unlock(&(f->cacheLock));
+    for (i = 0; i < (f->ioRing ? 1 : f->ioDepth); i++) {
+        pthread_join(f->ioThreads[i], NULL);
+    }
+#ifdef HAVE_IO_URING
+    if (f->ioRing) {
+        ring_free(f->ioRing);
+        f->ioRing = NULL;
+    }
+#endif
+    free(f->ioThreads);
+    free(f->ioQueue);
+    f->ioThreads = NULL;
+    f->ioQueue = NULL;
+    f->ioDepth = 0;
+    f->ioHead = 0;
+    f->ioStop = 0;
+}
+
+/* Take the file lock exclusively. The I/O threads do not take the file
+   lock, so wait until they have finished the reads started for other
+   threads: routines holding the lock exclusively use the cache without
+   cacheLock. */
+
+static void lock_exclusive(isamFile *f) {
+    pthread_rwlock_wrlock(&(f->lock));
+    if (f->ioDepth) {
+        pthread_mutex_lock(&(f->cacheLock));
+        while (f->ioQueued + f->ioBusy) {
+            pthread_cond_wait(&(f->cacheCond), &(f->cacheLock));
+        }
+        pthread_mutex_unlock(&(f->cacheLock));
+    }
+}
+
+/* Is the first record of the block in slot iCache in the index? This
+   holds for every regular block, and for the blocks beyond them that the
+   index has grown into; the key of such a record leads to its block. */
+
+static int block_indexed(isamPtr f, int iCache)
+{
+    unsigned long block_no = f->file->blockInCache[iCache];
+
+    return block_no < f->file->fHead.Nblocks ||
+        ((head(*f, iCache, 0)->statusFlags & (ISAM_VALID | ISAM_DELETED)) &&
+         index_keyToBlock(f->file->index, key(*f, iCache, 0)) ==
+         (long) block_no);
+}
+
+/* We look for the first free record in a given block. We have a number
+   of options to do this - by block number (in which case we have to
+   make sure that the block is in the cache), or by cached block number
+   (putting the responsability for the blocknumber on the calling function)
+   We'll use the latter approach - it also has the advantage that we only
+   need to return a single value. In a file with pages, the page must also
+   have room for a record with the given key. */
+
+static int free_record_in_block(isamPtr isam_ident, int iCache,
+        const char *key)
+{
+    unsigned int iFree;
+    if ((iCache < 0) || (iCache >= isam_ident->file->cacheSize))
+    {
+#ifdef DEBUG
+        fprintf(stderr, "free_record iCache = %d\n", iCache);
+#endif
+        return -1;
+    }
+    if (isam_ident->file->blockInCache[iCache] < 0)
+    {
+#ifdef DEBUG
+        fprintf(stderr, "free_record blockInCache = %ld\n",
+                isam_ident->file->blockInCache[iCache]);
+#endif
+        return -1;
+    }
+    if (!page_fits(isam_ident->file, isam_ident->file->cache[iCache], key,
+                isam_ident->dataLength, 0))
+    {
+        return -1;
+    }
+    for (iFree = 0; iFree < isam_ident->file->fHead.NrecPB; iFree++)
+    {
+        /* We cannot use a deleted record either. Records are only
+           marked deleted rather than unused (free) if
+           1. they are the first record of a block and have been deleted.
+           (otherwise this plays havoc with the index).
+           2. temporarily, while pointers in the preceding and following
+           records are being updated after deletion. */
+        if (!(head(*isam_ident, iCache, iFree)->statusFlags))
+        {
+            return iFree;
+        }
+    }
+    return -1;
+}
+
+/* Strictly for debugging - print some information about a record */
+
+static void debugRecord(isamPtr __attribute__((__unused__)) f,
+        unsigned long __attribute__((__unused__)) n,
+        char __attribute__((__unused__)) * from) {
+#ifdef DEBUG
+    int ib = n / f->file->fHead.NrecPB;
+    int ic = isam_cache_block(f, ib);
+    int ir = n % f->file->fHead.NrecPB;
+
+    if (ic < 0) {
+        return;
+    }
+
+    fprintf(stderr, "%s: key = %s\n", from,
+            key(*f, ic, ir));
+#endif
+}
+
+static char *sec_name(isamFile *f, int which);
+static int sec_open(isamPtr f, int rebuild);
+static int sec_flush(isamFile *f, int doSync);
+static void sec_closeAll(isamFile *f);
+
+/* Remember the name of a file */
+
+static void setName(isamFile *f, const char *name) {
+    f->name = malloc(strlen(name) + 1);
+    assert(f->name != NULL);
+    strcpy(f->name, name);
+}
+
+/* The number of record positions per block of a file with pages, such
+   that a page is at most as large as a block of NrecPB records in the
+   usual layout. DataLen is the space for the data of a record in a page
+   (PageData). A page must hold at least the dummy first record and one
+   other record with a key of the full length; with values of variable
+   length, an empty page must have room for a record with a value of
+   inlineMax bytes (a quarter of the page). Returns 0 if the data field
+   is too long for a page */
+
+static unsigned long page_slots(unsigned long KeyLen, unsigned long DataLen,
+        unsigned long RecordLen, unsigned long NrecPB, int varlen)
+{
+    unsigned long bytes = NrecPB * RecordLen;
+    unsigned long slots, least;
+
+    if (bytes > ISAM_PAGE_MAX)
+    {
+        bytes = ISAM_PAGE_MAX;
+    }
+    slots = bytes > ISAM_PAGE_HEAD ?
+        (bytes - ISAM_PAGE_HEAD) / PageMinRecord(DataLen) : 0;
+    least = 2 + (KeyLen + PageMinRecord(DataLen) - 1) / PageMinRecord(DataLen);
+    if (slots < least)
+    {
+        slots = least;
+    }
+    while (varlen && PageSize(slots, DataLen) <= ISAM_PAGE_MAX &&
+            ISAM_PAGE_HEAD + PageMinRecord(ISAM_PAGE_LENGTH) + KeyLen +
+            PageSize(slots, DataLen) / 4 > PageSize(slots, DataLen))
+    {
+        slots++;
+    }
+    return PageSize(slots, DataLen) > ISAM_PAGE_MAX ? 0 : slots;
+}
+
+/* The following function will create an empty isam file, with the specified
+   parameters. It will return an isamPtr when succesful, NULL if not.
+   The empty file should initially be written sequentially (i.e. with
+   increasing key numbers). Now, how long can that continue and what happens
+   when you write a non-sequential entry? That is for somewhere else...
+   Requirements here:
+   no file with the specified name should exist yet. */
+
+isamPtr isam_createWithOptions(const char * name, unsigned long KeyLen,
+        unsigned long DataLen, unsigned long NrecPB, unsigned long Nblocks,
+        int cacheSize, int options)
+{
+    struct stat buf;
+    int     i, l;
+    long    rv;
+    isamPtr fp;
+    fileHead fHead;
+    char   *idxName;
+
+    memset(&fHead, 0, sizeof(fHead));
+    isam_error = ISAM_NO_ERROR;
+    if ((8 > KeyLen) || (((options & ISAM_CREATE_LONG_KEYS) ?
+                    ISAM_MAX_SECONDARY_KEY : 40) < KeyLen))
+    {
+        isam_error = ISAM_KEY_LEN;
+        return NULL;
+    }
+    if (CreateFanout(options) && (CreateFanout(options) < 4 ||
+                CreateFanout(options) > index_maxFanout(KeyLen)))
+    {
+        isam_error = ISAM_BAD_FANOUT;
+        return NULL;
+    }
+
+    /*
+     * First check if name points to an existing file. If it does, stat will
+     * return 0, and our routine should return NULL
+     */
+    if (!stat(name, &buf))
+    {
+        isam_error = ISAM_FILE_EXISTS;
+        return NULL;
+    }
+
+    /*
+     * Now stat may fail when the pointer is an existing, but invalid
+     * symbolic link. We do not want that either.
+     */
+    if (!lstat(name, &buf))
+    {
+        isam_error = ISAM_LINK_EXISTS;
+        return NULL;
+    }
+
+    /*
+     * Now create and initialize the file header and descriptor
+     */
+    fHead.magic  = isamMagic;
+    fHead.KeyLen = KeyLen;
+    fHead.DataLen = DataLen;
+    fHead.NrecPB = NrecPB;
+    fHead.Nblocks = Nblocks;
+    if (options & ISAM_CREATE_BLOOM)
+    {
+        fHead.version = ISAM_VERSION_BLOOM;
+        fHead.FileState = ISAM_HAS_BLOOM;
+    }
+    if (options & ISAM_CREATE_WAL)
+    {
+        fHead.version = ISAM_VERSION_WAL;
+        fHead.FileState |= ISAM_HAS_WAL;
+    }
+    /* Values of variable length are kept in pages, and followed by their
+       length in the cache */
+    i = KeyLen + DataLen + sizeof(recordHead);
+    if (options & ISAM_CREATE_VARLEN)
+    {
+        i += sizeof(dataTail);
+        options |= ISAM_CREATE_PAGES;
+        fHead.FileState |= ISAM_HAS_VARLEN;
+    }
+    l = (i + 7) / 8;
+    fHead.RecordLen = 8 * l;
+    if (options & ISAM_CREATE_PAGES)
+    {
+        if (!(options & ISAM_CREATE_SLOTS))
+        {
+            fHead.NrecPB = page_slots(KeyLen,
+                    PageData(DataLen, fHead.FileState), fHead.RecordLen,
+                    NrecPB, (options & ISAM_CREATE_VARLEN) != 0);
+        }
+        if (!fHead.NrecPB || KeyLen > 255)
+        {
+            isam_error = ISAM_HEADER_ERROR;
+            return NULL;
+        }
+        fHead.version = (options & ISAM_CREATE_VARLEN) ?
+            ISAM_VERSION_VARLEN : ISAM_VERSION_PAGES;
+        fHead.FileState |= ISAM_HAS_PAGES;
+    }
+    if (options & ISAM_CREATE_CHECKSUMS)
+    {
+        fHead.version = ISAM_VERSION_CHECKSUMS;
+        fHead.FileState |= ISAM_HAS_CHECKSUMS;
+    }
+    fp = makeIsamPtr(&fHead, cacheSize);
+    setName(fp->file, name);
+
+
+    /*
+     * At last - create a file
+     */
+    fp->file->fileId = open(name, O_RDWR | O_CREAT | O_EXCL, 0660);
+    if (fp->file->fileId < 0)
+    {
+        isam_error = ISAM_OPEN_FAIL;
+        freeIsamPtr(fp);
+        return NULL;
+    }
+    /* Companion files of secondary indexes of an earlier file with this
+       name are no longer valid */
+    for (i = 0; i < ISAM_MAX_SECONDARY; i++)
+    {
+        char *secName = sec_name(fp->file, i);
+
+        unlink(secName);
+        free(secName);
+    }
+    idxName = idx_name(name);
+    unlink(idxName);
+    free(idxName);
+    if (heap_create(fp->file, options & ISAM_CREATE_VARLEN))
+    {
+        close(fp->file->fileId);
+        freeIsamPtr(fp);
+        return NULL;
+    }
+    /* Write an initial header */
+    if (flushHead(fp->file))
+    {
+        close(fp->file->fileId);
+        freeIsamPtr(fp);
+        return NULL;
+    }
+    fp->file->mayWrite = 1;
+    /* Initialise the file index and write it to disk */
+    fp->file->index = index_makeNew(Nblocks, KeyLen, CreateFanout(options));
+    /* The data blocks will start immediately after the index (and the
+       Bloom filters, if any) */
+    fp->file->fHead.DataStart = rv = index_writeToDisk(fp->file->index, fp->file->fileId,
+            IndexStart(fHead.FileState));
+    if (rv >= 0 && writeIndexCheck(fp->file))
+    {
+        rv = -1;
+    }
+    if (rv >= 0 && (options & ISAM_CREATE_BLOOM))
+    {
+        fp->file->fHead.DataStart += Nblocks * BloomBytes(fHead.NrecPB);
+        bloom_alloc(fp->file);
+        rv = flushBloom(fp->file);
+    }
+    if (rv < 0)
+    {
+        isam_error = ISAM_WRITE_FAIL;
+        index_free(fp->file->index);
+        close(fp->file->fileId);
+        freeIsamPtr(fp);
+        return NULL;
+    }
+    /* Initialise the first data block with the dummy first record.
+       Store in cache and write to disk */
+    cache_assign(fp->file, 0, 0);
+    cursor_set(fp, 0);
+    fp->cur_recno = 0;
+    cur_head((*fp))->statusFlags = ISAM_SPECIAL;
+    if (block_write(fp->file, fp->file->cache[0], 0))
+    {
+        isam_error = ISAM_WRITE_FAIL;
+        index_free(fp->file->index);
+        close(fp->file->fileId);
+        freeIsamPtr(fp);
+        return NULL;
+    }
+    /* The file header can now be further updated */
+
+    fp->file->fHead.CurBlocks = 1;
+    fp->file->diskBlocks = 1;
+    if (flushHead(fp->file))
+    {
+        close(fp->file->fileId);
+        index_free(fp->file->index);
+        freeIsamPtr(fp);
+        return NULL;
+    }
+    fp->file->maxKey = calloc(1, KeyLen);
+    assert(fp->file->maxKey != NULL);
+    /* Start the log with the header as written */
+    if ((options & ISAM_CREATE_WAL) &&
+            (wal_open(fp->file, name, 1) || wal_checkpoint(fp->file)))
+    {
+        close(fp->file->fileId);
+        index_free(fp->file->index);
+        freeIsamPtr(fp);
+        return NULL;
+    }
+    return fp;
+}
+
+isamPtr isam_createWithCache(const char * name, unsigned long KeyLen,
+        unsigned long DataLen, unsigned long NrecPB, unsigned long Nblocks,
+        int cacheSize)
+{
+    return isam_createWithOptions(name, KeyLen, DataLen, NrecPB, Nblocks,
+            cacheSize, 0);
+}
+
+unsigned long isam_maxFanout(unsigned long KeyLen)
+{
+    return index_maxFanout(KeyLen);
+}
+
+isamPtr isam_create(const char * name, unsigned long KeyLen,
+        unsigned long DataLen, unsigned long NrecPB, unsigned long Nblocks)
+{
+    return isam_createWithOptions(name, KeyLen, DataLen, NrecPB, Nblocks,
+            ISAM_DEFAULT_CACHE_SIZE, 0);
+}
+
+isamPtr
+isam_openWithCache(const char *name, int update, int cacheSize)
+{
+    struct stat buf;
+    isamPtr fp;
+    fileHead fh;
+    fileCheck check;
+    int     fid;
+    int     block_no, rec_no;
+    int     iCache;
+    long    replayed = 0;
+    char   *idxName;
+
+    memset(&fh, 0, sizeof(fh));
+    isam_error = ISAM_NO_ERROR;
+
+    /*
+     * First check if name points to an existing file. If it does, stat will
+     * return 0, and our routine can continue
+     */
+    if (stat(name, &buf))
+    {
+    isam_error = ISAM_NO_SUCH_FILE;
+    return NULL;
+    }
+
+    /*
+     * At last - open a file
+     */
+    fid = open(name, O_RDWR);
+    if (fid < 0)
+    {
+    isam_error = ISAM_OPEN_FAIL;
+    return NULL;
+    }
+    /* read header and test amount of data read */
+
+    if (sizeof(fileHead) != pread(fid, &fh, sizeof(fileHead), 0))
+    {
+    isam_error = ISAM_READ_ERROR;
+        close(fid);
+    return NULL;
+    }
+
+    /* test if it could be an isam file */
+    if (fh.magic != isamMagic)
+    {
+    isam_error = ISAM_BAD_MAGIC;
+    close(fid);
+    return NULL;
+    }
+
+    /* We can only handle version 0, version 1 for files with Bloom
+       filters, version 2 for files with a log, version 3 for files
+       with secondary indexes, version 4 for files with the index in
+       a companion file, version 5 for files with pages, version 6
+       for files with values of variable length and version 7 for files
+       with checksums */
+    if (fh.version > ISAM_VERSION_CHECKSUMS ||
+            (fh.version == ISAM_VERSION_BLOOM &&
+             !(fh.FileState & ISAM_HAS_BLOOM)) ||
+            (fh.version == ISAM_VERSION_WAL &&
+             !(fh.FileState & ISAM_HAS_WAL)) ||
+            (fh.version == ISAM_VERSION_SECONDARY &&
+             !(fh.FileState & ISAM_HAS_SECONDARY)) ||
+            (fh.version == ISAM_VERSION_INDEX_FILE &&
+             !(fh.FileState & ISAM_HAS_INDEX_FILE)) ||
+            (fh.version == ISAM_VERSION_PAGES &&
+             !(fh.FileState & ISAM_HAS_PAGES)) ||
+            (fh.version == ISAM_VERSION_VARLEN &&
+             !(fh.FileState & ISAM_HAS_VARLEN)) ||
+            (fh.version == ISAM_VERSION_CHECKSUMS &&
+             !(fh.FileState & ISAM_HAS_CHECKSUMS)))
+    {
+    isam_error = ISAM_BAD_VERSION;
+    close(fid);
+    return NULL;
+    }
+
+    /* Check the header against its checksum */
+    if ((fh.FileState & ISAM_HAS_CHECKSUMS) &&
+            ((ssize_t) sizeof(check) != pread(fid, &check, sizeof(check),
+                                    sizeof(fileHead)) ||
+             check.head != crc32c(0, &fh, sizeof(fileHead))))
+    {
+    isam_error = ISAM_CHECKSUM_ERROR;
+    close(fid);
+    return NULL;
+    }
+
+    /* Now create and initialise the isamPtr */
+    fp = makeIsamPtr(&fh, cacheSize);
+    setName(fp->file, name);
+
+    isam_error = ISAM_NO_ERROR;
+
+    if (fh.FileState & ISAM_HAS_INDEX_FILE)
+    {
+        idxName = idx_name(name);
+        fp->file->indexFd = open(idxName, O_RDWR);
+        free(idxName);
+    }
+    if ((fh.FileState & ISAM_HAS_INDEX_FILE) ? (fp->file->indexFd < 0 ||
+                !(fp->file->index = index_readFromDisk(fp->file->indexFd, 0))) :
+            !(fp->file->index = index_readFromDisk(fid,
+                    IndexStart(fh.FileState))))
+    {
+    close(fid);
+    isam_error = ISAM_INDEX_ERROR;
+    freeIsamPtr(fp);
+    return NULL;
+    }
+    /* The index matches its checksum, unless the file was not closed
+       cleanly: the index may then have been written without it */
+    if ((fh.FileState & ISAM_HAS_CHECKSUMS) &&
+            !(fh.FileState & ISAM_STATE_UPDATING) &&
+            check.index != index_checksum(fp->file->index))
+    {
+    index_free(fp->file->index);
+    close(fid);
+    isam_error = ISAM_CHECKSUM_ERROR;
+    freeIsamPtr(fp);
+    return NULL;
+    }
+    fp->file->fileId = fid;
+    fp->file->mayWrite = 1;
+    if (fp->file->fHead.FileState & ISAM_HAS_BLOOM)
+    {
+        bloom_alloc(fp->file);
+        if (pread(fid, fp->file->bloom, fp->file->fHead.Nblocks * fp->file->bloomBytes,
+                    fp->file->bloomStart) !=
+                (ssize_t) (fp->file->fHead.Nblocks * fp->file->bloomBytes))
+        {
+        index_free(fp->file->index);
+        close(fid);
+        isam_error = ISAM_READ_ERROR;
+        freeIsamPtr(fp);
+        return NULL;
+        }
+    }
+    /* The heap must be there before the log is redone */
+    if ((fh.FileState & ISAM_HAS_VARLEN) && heap_open(fp->file))
+    {
+    index_free(fp->file->index);
+    close(fid);
+    freeIsamPtr(fp);
+    return NULL;
+    }
+    /* Redo what is in the log; that can extend the file */
+    if ((fh.FileState & ISAM_HAS_WAL) &&
+            (wal_open(fp->file, name, 0) ||
+             (replayed = wal_replay(fp->file)) < 0 || fstat(fid, &buf)))
+    {
+    index_free(fp->file->index);
+    close(fid);
+    freeIsamPtr(fp);
+    return NULL;
+    }
+    if (replayed)
+    {
+        /* Let the Bloom filters be rebuilt, and everything be written */
+        fp->file->fHead.FileState |= ISAM_STATE_UPDATING;
+        fp->file->headDirty = 1;
+        fp->file->unflushed = 1;
+    }
+    /* Trust the file size rather than the header for the number of
+       blocks present on disk */
+    fp->file->diskBlocks = fp->file->fHead.CurBlocks;
+    if (buf.st_size < (off_t) (fp->file->fHead.DataStart +
+                fp->file->diskBlocks * fp->file->diskSize)) {
+        fp->file->diskBlocks = (buf.st_size > (off_t) fp->file->fHead.DataStart) ?
+            (buf.st_size - fp->file->fHead.DataStart) / fp->file->diskSize : 0;
+    }
+    if ((update & ISAM_OPEN_MMAP) && fp->file->walFd < 0 &&
+            !(fh.FileState & (ISAM_HAS_PAGES | ISAM_HAS_CHECKSUMS)) &&
+            isam_map(fp->file, 2 * fp->file->diskBlocks))
+    {
+    index_free(fp->file->index);
+    close(fid);
+    freeIsamPtr(fp);
+    return NULL;
+    }
+    cache_assign(fp->file, 0, 0);
+    cursor_set(fp, 0);
+    fp->cur_recno = 0;
+    if (block_read(fp->file, fp->file->cache[0], 0))
+    {
+    index_free(fp->file->index);
+    close(fid);
+    freeIsamPtr(fp);
+    return NULL;
+    }
+    fp->file->maxKey = calloc(1, fp->file->fHead.KeyLen);
+    assert(fp->file->maxKey != NULL);
+    block_no = fp->file->fHead.MaxKeyRec / fp->file->fHead.NrecPB;
+    rec_no = fp->file->fHead.MaxKeyRec % fp->file->fHead.NrecPB;
+    iCache = isam_cache_block(fp, block_no);
+    if (iCache < 0)
+    {
+    index_free(fp->file->index);
+    close(fid);
+    freeIsamPtr(fp);
+    return NULL;
+    }
+    memcpy(fp->file->maxKey, key(*fp, iCache, rec_no), fp->file->fHead.KeyLen);
+    /* After an unclean shutdown the filters on disk may lack keys */
+    if (fp->file->bloom && (fp->file->fHead.FileState & ISAM_STATE_UPDATING) &&
+            isam_rebuildBloom(fp))
+    {
+    index_free(fp->file->index);
+    close(fid);
+    freeIsamPtr(fp);
+    return NULL;
+    }
+    /* Open the secondary indexes; after an unclean shutdown they may
+       lack changes, so they are rebuilt */
+    if ((fp->file->fHead.FileState & ISAM_HAS_SECONDARY) &&
+            sec_open(fp, fp->file->fHead.FileState & ISAM_STATE_UPDATING))
+    {
+    sec_closeAll(fp->file);
+    index_free(fp->file->index);
+    close(fid);
+    freeIsamPtr(fp);
+    return NULL;
+    }
+    /* Write what has been redone to the file, and start the log
+       afresh */
+    if (fp->file->walFd >= 0 &&
+            (replayed ? isam_flush(fp, 1) : wal_checkpoint(fp->file)))
+    {
+    sec_closeAll(fp->file);
+    index_free(fp->file->index);
+    close(fid);
+    freeIsamPtr(fp);
+    return NULL;
+    }
+
+    return fp;
+}
+
+isamPtr
+isam_open(const char *name, int update)
+{
+    return isam_openWithCache(name, update, ISAM_DEFAULT_CACHE_SIZE);
+}
+
+
+/* Write all dirty blocks, the index and the header to disk. The header
+   goes last, so that it only loses its ISAM_STATE_UPDATING flag once
+   everything else is on disk. With doSync != 0, the data are forced to
+   the disk with fsync before and after the header is written. A file
+   with a log is always synced, as the log is emptied afterwards. */
+static int do_flush(isamPtr f, int doSync)
+{
+    int iCache;
+
+    if (testPtr(f))
+    {
+        return -1;
+    }
+    if (f->file->walFd >= 0)
+    {
+        if (wal_sync(f->file, f->file->walEnd))
+        {
+            return -1;
+        }
+        doSync = 1;
+    }
+    for (iCache = 0; iCache < f->file->cacheSize; iCache++)
+    {
+        if (f->file->dirty[iCache] && flush_cache_block(f->file, iCache))
+        {
+            return -1;
+        }
+    }
+    if (f->file->map && (f->file->diskBlocks > f->file->mapBlocks) &&
+            isam_map(f->file, 2 * f->file->diskBlocks))
+    {
+        return -1;
+    }
+    if (f->file->indexDirty && writeIndex(f->file, doSync))
+    {
+        return -1;
+    }
+    if (f->file->bloomDirty && flushBloom(f->file))
+    {
+        return -1;
+    }
+    /* The secondary indexes must be complete before the header loses
+       its ISAM_STATE_UPDATING flag */
+    if (sec_flush(f->file, doSync))
+    {
+        return -1;
+    }
+    if (!f->file->headDirty && !f->file->unflushed)
+    {
+        return 0;
+    }
+    if (doSync && f->file->map && msync(f->file->map, f->file->mapLength, MS_SYNC))
+    {
+        isam_error = ISAM_WRITE_FAIL;
+        return -1;
+    }
+    /* The heap, too, must be complete before the header loses its
+       ISAM_STATE_UPDATING flag */
+    if (doSync && ((f->file->heapFd >= 0 && fsync(f->file->heapFd)) ||
+                fsync(f->file->fileId)))
+    {
+        isam_error = ISAM_WRITE_FAIL;
+        return -1;
+    }
+    f->file->fHead.FileState &= ~ISAM_STATE_UPDATING;
+    if (flushHead(f->file))
+    {
+        return -1;
+    }
+    if (doSync && fsync(f->file->fileId))
+    {
+        isam_error = ISAM_WRITE_FAIL;
+        return -1;
+    }
+    f->file->unflushed = 0;
+    if (f->file->walFd >= 0)
+    {
+        return wal_checkpoint(f->file);
+    }
+    return 0;
+}
+
+/* Close a cursor; with the last cursor, close the isam file and release
+   the memory used */
+int isam_close(isamPtr f)
+{
+    isamFile *file;
+    int rv;
+
+    isam_error = ISAM_NO_ERROR;
+    if (testPtr(f))
+    {
+        return -1;
+    }
+    file = f->file;
+    if (file->snapOf)
+    {
+        return isam_snapshot_end(f);
+    }
+    lock_exclusive(file);
+    if (file->nHandles > 1)
+    {
+        freeCursor(f);
+        pthread_rwlock_unlock(&(file->lock));
+        return 0;
+    }
+    pthread_mutex_lock(&(file->snapLock));
+    rv = (file->snapshots != NULL);
+    pthread_mutex_unlock(&(file->snapLock));
+    if (rv)
+    {
+        /* The snapshots read the file */
+        pthread_rwlock_unlock(&(file->lock));
+        isam_error = ISAM_SNAPSHOT;
+        return -1;
+    }
+    /* Before closing the file, we make sure all modifications have been
+       written (but not necessarily "sync-ed") to disk. The log is no
+       longer needed then */
+    io_stop(file);
+    rv = do_flush(f, 0);
+    if (!rv && file->walFd >= 0)
+    {
+        wal_remove(file);
+    }
+    sec_closeAll(file);
+    index_free(file->index);
+    file->fHead.magic = 0;
+    close(file->fileId);
+    pthread_rwlock_unlock(&(file->lock));
+
+    freeIsamPtr(f);
+    return rv;
+}
+
+/* Set the current pointer to the last valid record (if that exists) with
+   a key less than the requested key. isam_readNext will then read the
+   record with that key (if it exists), or the next higher key (if that
+   exists) */
+
+static int do_setKey(isamPtr isam_ident, const char *key)
+{
+    int block_no;
+    int rec_no;
+    unsigned long next, prev;
+    int iCache;
+    int rv;
+
+    if (testPtr(isam_ident))
+    {
+        return -1;
+    }
+    key = padKey(isam_ident, key);
+    if (key[0] == 0)
+    {
+        /* "rewind" the file to the dummy first record.*/
+        iCache = isam_cache_block(isam_ident, 0);
+        if (iCache < 0)
+        {
+            return -1;
+        }
+        cursor_set(isam_ident, iCache);
+        isam_ident->cur_recno = 0;
+        return 0;
+    }
+    /* First find block number from index */
+    block_no = index_keyToBlock(isam_ident->file->index, key);
+    rec_no = 0;
+    /* Now make sure the block is in cache */
+    iCache = isam_cache_block(isam_ident, block_no);
+    if (iCache < 0)
+    {
+        return -1;
+    }
+    /* Skip all records with smaller keys */
+    while ((rv = key_compare(key, key((*isam_ident),iCache,rec_no),
+                    isam_ident->file->fHead.KeyLen)) > 0)
+    {
+        next = head((*isam_ident),iCache,rec_no)->next;
+        debugRecord(isam_ident, next, "setkey #1");
+        if (!next)
+        {
+            /* There is no next record */
+            break;
+        }
+        block_no = next / isam_ident->file->fHead.NrecPB;
+        rec_no = next % isam_ident->file->fHead.NrecPB;
+        iCache = isam_cache_block(isam_ident, block_no);
+        if (iCache < 0)
+        {
+            return -1;
+        }
+    }
+    /* Now we have found / may have found a record with a key larger than
+       or equal to the given key - but then we promised to position at
+       the previous valid record - so look for that.
+       There may be no record with a larger key - in that case
+       (rv < 0) && (next == 0)
+       A valid record is a record that has the valid flag set.*/
+
+    while (((rv = key_compare(key, key((*isam_ident),iCache,rec_no),
+                        isam_ident->file->fHead.KeyLen)) <= 0) ||
+            (!(head((*isam_ident),iCache,rec_no)->statusFlags & ISAM_VALID)))
+    {
+        prev = head((*isam_ident),iCache,rec_no)->previous;
+        debugRecord(isam_ident, prev, "setkey #2");
+        /* prev may be 0 - that is OK; we are then pointing to the dummy
+           first record. However, that is not a valid record, but we
+           have no choice.
+           This means that a call to isam_prev must return an invalid result
+           */
+        block_no = prev / isam_ident->file->fHead.NrecPB;
+        rec_no = prev % isam_ident->file->fHead.NrecPB;
+        iCache = isam_cache_block(isam_ident, block_no);
+        if (iCache < 0)
+        {
+            return -1;
+        }
+        if (!prev)
+        {
+            /* The "current" record is not "it", and the previous is the
+               dummy first record. We have gone there already.
+               This is completely normal */
+            cursor_set(isam_ident, iCache);
+            isam_ident->cur_recno = 0;
+            return 0;
+        }
+    }
+    cursor_set(isam_ident, iCache);
+    isam_ident->cur_recno = rec_no;
+    return 0;
+}
+
+/* isam_readNext will read the next valid record (from cur_recno and cur_id),
+   if such a record exists */
+
+static int do_readNext(isamPtr isam_ident, char *key, void *data) {
+    int block_no;
+    int rec_no;
+    int iCache;
+    int next;
+
+    if (testPtr(isam_ident)) {
+        return -1;
+    }
+    /* First we have to look for the next valid record (that is the way we
+       decided to make all this work! */
+    rec_no = isam_ident->cur_recno;
+    iCache = isam_ident->cur_id;
+    do {
+        next = head((*isam_ident),iCache,rec_no)->next;
+        debugRecord(isam_ident, next, "next #1");
+
+        if (! next) {
+            isam_error = ISAM_EOF;
+            return -1;
+        }
+        block_no = next / isam_ident->file->fHead.NrecPB;
+        rec_no = next % isam_ident->file->fHead.NrecPB;
+        iCache = isam_cache_block(isam_ident, block_no);
+
+        if (iCache < 0) {
+            return -1;
+        }
+    } while(!(head((*isam_ident),iCache,rec_no)->statusFlags & ISAM_VALID));
+
+    cursor_set(isam_ident, iCache);
+    isam_ident->cur_recno = rec_no;
+    memcpy(key, cur_key(*isam_ident), isam_ident->file->fHead.KeyLen);
+    memcpy(data, cur_data(*isam_ident), isam_ident->file->fHead.DataLen);
+    isam_ident->dataLength = data_length(isam_ident->file,
+            cur_data(*isam_ident));
+    isam_error = ISAM_NO_ERROR;
+    return 0;
+}
+
+/* isam_readPrev will read the current record, if it is valid, and then
+   reposition the file to the preceding valid record (if that exists). */
+
+static int do_readPrev(isamPtr isam_ident, char *key, void *data) {
+    int block_no;
+    int rec_no = 0;
+    int iCache = 0;
+    int prev;
+
+    if (testPtr(isam_ident)) {
+        return -1;
+    }
+    /* We should now be at the correct valid record (unless we are at the
+       very first record). So we check, copy the data, and try to find
+       the preceding valid record. */
+
+    isam_error = ISAM_NO_ERROR;
+    if (cur_head(*isam_ident)->statusFlags & ISAM_VALID) {
+        memcpy(key, cur_key(*isam_ident), isam_ident->file->fHead.KeyLen);
+        memcpy(data, cur_data(*isam_ident), isam_ident->file->fHead.DataLen);
+        isam_ident->dataLength = data_length(isam_ident->file,
+                cur_data(*isam_ident));
+        rec_no = isam_ident->cur_recno;
+        iCache = isam_ident->cur_id;
+
+        do {
+            prev = head((*isam_ident),iCache,rec_no)->previous;
+            block_no = prev / isam_ident->file->fHead.NrecPB;
+            rec_no = prev % isam_ident->file->fHead.NrecPB;
+            iCache = isam_cache_block(isam_ident, block_no);
+
+            if (iCache < 0) {
+                return -1;
+            }
+            if (! prev) {
+                break;
+            }
+        }  while(!(head((*isam_ident),iCache,rec_no)->statusFlags&ISAM_VALID));
+
+        cursor_set(isam_ident, iCache);
+        isam_ident->cur_recno = rec_no;
+        return 0;
+    }
+    isam_error = ISAM_SOF;
+    return -1;
+}
+
+static int do_seekByKey(isamPtr isam_ident, const char *key);
+
+/* isam_readByKey will attempt to read a record with the requested key */
+static int do_readByKey(isamPtr isam_ident, const char *key, void *data) {
+    /* STEP 5: This implementation is inefficient, and I have not verified
+       that it really works according to its specification
+       For one thing, it does not test for a valid isam_ident before use.
+       It is probably better to include tempData and tempKey as part of the
+       structure pointed to by isam_ident. That also saves some mallocs
+       and frees */
+
+    int rv;
+
+    rv = do_seekByKey(isam_ident, key);
+    if (rv) {
+        return -1;
+    }
+    memcpy(data, cur_data(*isam_ident), isam_ident->file->fHead.DataLen);
+    isam_ident->dataLength = data_length(isam_ident->file,
+            cur_data(*isam_ident));
+    return 0;
+}
+
+/* Follow the chain of records from record *rec (which must not have a
+   larger key than key) up to the first record with a key that is not
+   smaller, or the last record in the file. *rec is set to that record;
+   the slot holding it is returned, or -1 */
+static int seek_chain(isamPtr isam_ident, const char *key, unsigned long *rec) {
+    unsigned long next;
+    int block_no = *rec / isam_ident->file->fHead.NrecPB;
+    int rec_no = *rec % isam_ident->file->fHead.NrecPB;
+    int iCache;
+
+    iCache = isam_cache_block(isam_ident, block_no);
+    if (iCache < 0)
+    {
+        return -1;
+    }
+    /* Skip all records with smaller keys */
+    while (key_compare(key, key((*isam_ident),iCache,rec_no),
+                isam_ident->file->fHead.KeyLen) > 0)
+    {
+        next = head((*isam_ident),iCache,rec_no)->next;
+        debugRecord(isam_ident, next, "setkey #1");
+        if (!next)
+        {
+            /* There is no next record */
+            break;
+        }
+        rec_no = next % isam_ident->file->fHead.NrecPB;
+        /* Most steps stay within the block, which is still in the
+           (pinned) work slot */
+        if (next / isam_ident->file->fHead.NrecPB != (unsigned long) block_no)
+        {
+            block_no = next / isam_ident->file->fHead.NrecPB;
+            iCache = isam_cache_block(isam_ident, block_no);
+            if (iCache < 0)
+            {
+                return -1;
+            }
+        }
+    }
+    *rec = block_no * isam_ident->file->fHead.NrecPB + rec_no;
+    return iCache;
+}
+
+/* Search a record by its key. */
+static int do_seekByKey(isamPtr isam_ident, const char *key) {
+
+    int block_no;
+    int rec_no;
+    unsigned long rec;
+    int iCache;
+
+    if (testPtr(isam_ident)) {
+        return -1;
+    }
+    key = padKey(isam_ident, key);
+
+    if (key[0] == 0)
+    {
+        /* "rewind" the file to the dummy first record.*/
+        iCache = isam_cache_block(isam_ident, 0);
+        if (iCache < 0)
+        {
+            return -1;
+        }
+        cursor_set(isam_ident, iCache);
+        isam_ident->cur_recno = 0;
+        return 0;
+    }
+    else {
+        /* First find block number from index */
+        block_no = index_keyToBlock(isam_ident->file->index, key);
+        /* The Bloom filter of the block may tell that the key is absent */
+        if (block_no >= 0 && !bloom_mayContain(isam_ident->file, block_no, key))
+        {
+            ISAM_STAT(isam_ident, bloomSkips, 1);
+            isam_error = ISAM_NO_SUCH_KEY;
+            return -1;
+        }
+        /* Walk from the first record of the block */
+        rec = block_no * isam_ident->file->fHead.NrecPB;
+        iCache = seek_chain(isam_ident, key, &rec);
+        if (iCache < 0)
+        {
+            return -1;
+        }
+        rec_no = rec % isam_ident->file->fHead.NrecPB;
+
+        if (((key_compare(key, key((*isam_ident),iCache,rec_no), isam_ident->file->fHead.KeyLen)) != 0) ||
+                    (!(head((*isam_ident),iCache, rec_no)->statusFlags & ISAM_VALID ))) {
+            isam_error = ISAM_NO_SUCH_KEY;
+            return -1;
+        }
+
+        cursor_set(isam_ident, iCache);
+        isam_ident->cur_recno = rec_no;
+        return 0;
+    }
+}
+
+/* A key of isam_readManyByKey: padded to KeyLen (plus a terminating
+   zero, so that keys can be compared with strcmp), its position in the
+   arrays of the caller and the regular block where its search starts
+   (-1 for the empty key) */
+
+struct manyKey {
+    char   *key;
+    size_t  pos;
+    long    block;
+};
+
+static int many_compare(const void *a, const void *b)
+{
+    return strcmp(((const struct manyKey *) a)->key,
+            ((const struct manyKey *) b)->key);
+}
+
+/* Ask the kernel to read ahead the regular blocks needed for the sorted
+   keys that are not in the cache, in runs of consecutive blocks */
+
+static void many_readAhead(isamFile *f, struct manyKey *sorted, size_t n)
+{
+    long    block, first = -1, last = -1;
+    size_t  i;
+    int     inCache;
+
+    for (i = 0; i <= n; i++) {
+        block = -1;
+        if (i < n) {
+            block = sorted[i].block;
+            if (block < 0 || block == last) {
+                continue;
+            }
+            /* Skip blocks that are cached or not yet on disk */
+            pthread_mutex_lock(&(f->cacheLock));
+            inCache = (block >= (long) f->diskBlocks ||
+                    cache_lookup(f, block) >= 0);
+            pthread_mutex_unlock(&(f->cacheLock));
+            if (inCache) {
+                continue;
+            }
+            if (block == last + 1 && first >= 0) {
+                last = block;
+                continue;
+            }
+        }
+        if (first >= 0) {
+            posix_fadvise(f->fileId, f->fHead.DataStart + first * f->diskSize,
+                    (last - first + 1) * f->diskSize, POSIX_FADV_WILLNEED);
+        }
+        first = last = block;
+    }
+}
+
+/* The keys are looked up in sorted order. As long as they fall in the
+   range of the same regular block, the search for a key continues where
+   that of the previous key stopped, instead of starting again at the
+   first record of the block.
+   With I/O threads, the regular blocks of the next keys are read into
+   the cache meanwhile, keeping ioDepth blocks ahead of the key being
+   looked up; otherwise the kernel is asked to read all of them ahead */
+
+static long do_readManyByKey(isamPtr isam_ident, const char **keys, size_t n,
+        void *data, unsigned long *lengths, int *found)
+{
+    isamFile *f;
+    struct manyKey *sorted;
+    char   *keyMem;
+    unsigned long KeyLen, DataLen;
+    unsigned long rec = 0;
+    long    block_no, range = -1, last = -1;
+    unsigned long lastLength;
+    size_t  i, next = 0;
+    long    nFound = 0;
+    int     iCache, rec_no, ahead = 0;
+
+    if (testPtr(isam_ident)) {
+        return -1;
+    }
+    f = isam_ident->file;
+    lastLength = isam_ident->dataLength;
+    KeyLen = f->fHead.KeyLen;
+    DataLen = f->fHead.DataLen;
+    sorted = malloc(n * sizeof(struct manyKey) + 1);
+    keyMem = calloc(n + 1, KeyLen + 1);
+    assert(sorted != NULL && keyMem != NULL);
+    for (i = 0; i < n; i++) {
+        sorted[i].key = keyMem + i * (KeyLen + 1);
+        strncpy(sorted[i].key, keys[i], KeyLen);
+        sorted[i].pos = i;
+        found[i] = 0;
+    }
+    qsort(sorted, n, sizeof(struct manyKey), many_compare);
+    for (i = 0; i < n; i++) {
+        sorted[i].block = -1;
+        if (sorted[i].key[0] &&
+                (sorted[i].block = index_keyToBlock(f->index,
+                        sorted[i].key)) < 0) {
+            isam_error = ISAM_INDEX_ERROR;
+            free(sorted);
+            free(keyMem);
+            return -1;
+        }
+    }
+    if (!f->map && !f->ioDepth) {
+        many_readAhead(f, sorted, n);
+    }
+    for (i = 0; i < n; i++) {
+        if (f->ioDepth) {
+            /* The block of this key was one of those read ahead */
+            if (sorted[i].block >= 0 && sorted[i].block != range &&
+                    ahead > 0) {
+                ahead--;
+            }
+            for (; next < n && ahead < f->ioDepth; next++) {
+                if (sorted[next].block >= 0 && sorted[next].block != last) {
+                    last = sorted[next].block;
+                    cache_prefetch(f, last, last);
+                    ahead++;
+                }
+            }
+        }
+        if (i > 0 && !strcmp(sorted[i].key, sorted[i - 1].key)) {
+            /* The same key again */
+            if ((found[sorted[i].pos] = found[sorted[i - 1].pos])) {
+                memcpy((char *) data + sorted[i].pos * DataLen,
+                        (char *) data + sorted[i - 1].pos * DataLen, DataLen);
+                if (lengths) {
+                    lengths[sorted[i].pos] = lengths[sorted[i - 1].pos];
+                }
+                nFound++;
+            }
+            continue;
+        }
+        if (!sorted[i].key[0]) {
+            /* The empty key, as isam_readByKey handles it */
+            if (do_readByKey(isam_ident, sorted[i].key,
+                        (char *) data + sorted[i].pos * DataLen)) {
+                nFound = -1;
+                break;
+            }
+            if (lengths) {
+                lengths[sorted[i].pos] = isam_ident->dataLength;
+            }
+            isam_ident->dataLength = lastLength;
+            found[sorted[i].pos] = 1;
+            nFound++;
+            continue;
+        }
+        block_no = sorted[i].block;
+        if (block_no != range) {
+            range = block_no;
+            rec = block_no * f->fHead.NrecPB;
+        }
+        if (!bloom_mayContain(f, block_no, sorted[i].key)) {
+            ISAM_STAT(isam_ident, bloomSkips, 1);
+            continue;
+        }
+        iCache = seek_chain(isam_ident, sorted[i].key, &rec);
+        if (iCache < 0) {
+            nFound = -1;
+            break;
+        }
+        rec_no = rec % f->fHead.NrecPB;
+        if (!key_compare(sorted[i].key, key(*isam_ident, iCache, rec_no), KeyLen) &&
+                (head(*isam_ident, iCache, rec_no)->statusFlags & ISAM_VALID)) {
+            memcpy((char *) data + sorted[i].pos * DataLen,
+                    data(*isam_ident, iCache, rec_no), DataLen);
+            if (lengths) {
+                lengths[sorted[i].pos] = data_length(f,
+                        data(*isam_ident, iCache, rec_no));
+            }
+            found[sorted[i].pos] = 1;
+            nFound++;
+        }
+    }
+    if (nFound >= 0) {
+        isam_error = ISAM_NO_ERROR;
+    }
+    free(sorted);
+    free(keyMem);
+    return nFound;
+}
+
+/* Ask the kernel to read blocks first up to last (as far as they are on
+   disk) ahead */
+
+static void scan_readAhead(isamFile *f, unsigned long first, unsigned long last)
+{
+    /* diskBlocks grows when other threads write blocks */
+    pthread_mutex_lock(&(f->cacheLock));
+    if (last >= f->diskBlocks) {
+        last = f->diskBlocks - 1;
+    }
+    pthread_mutex_unlock(&(f->cacheLock));
+    if (first <= last) {
+        posix_fadvise(f->fileId, f->fHead.DataStart + first * f->diskSize,
+                (last - first + 1) * f->diskSize, POSIX_FADV_WILLNEED);
+    }
+}
+
+/* Follow the chain of records from the first record with a key not
+   smaller than from. Each time the chain enters the regular block
+   following the previous regular block, readahead is extended to
+   ISAM_SCAN_READAHEAD blocks beyond it (once half of the previous
+   window has been used). I/O threads, if any, meanwhile read the next
+   ioDepth regular blocks into the cache */
+
+static long do_scanRange(isamPtr isam_ident, const char *from, const char *to,
+        isam_scanFunc fn, void *context)
+{
+    isamFile *f;
+    char   *toKey = NULL;
+    unsigned long rec, next, nb, ahead = 0;
+    long    block_no, regular = -1, n = 0;
+    int     iCache, rec_no;
+    recordHead *h;
+
+    if (testPtr(isam_ident)) {
+        return -1;
+    }
+    f = isam_ident->file;
+    if (to) {
+        toKey = calloc(1, f->fHead.KeyLen);
+        assert(toKey != NULL);
+        strncpy(toKey, to, f->fHead.KeyLen);
+    }
+    from = padKey(isam_ident, from);
+    block_no = from[0] ? index_keyToBlock(f->index, from) : 0;
+    if (block_no < 0) {
+        free(toKey);
+        isam_error = ISAM_INDEX_ERROR;
+        return -1;
+    }
+    rec = block_no * f->fHead.NrecPB;
+    iCache = seek_chain(isam_ident, from, &rec);
+    if (rec / f->fHead.NrecPB < f->fHead.Nblocks) {
+        regular = rec / f->fHead.NrecPB;
+    }
+    while (iCache >= 0) {
+        rec_no = rec % f->fHead.NrecPB;
+        h = head(*isam_ident, iCache, rec_no);
+        /* The last record of the file may have a smaller key */
+        if (key_compare(key(*isam_ident, iCache, rec_no), from,
+                    f->fHead.KeyLen) >= 0) {
+            if (toKey && key_compare(key(*isam_ident, iCache, rec_no), toKey,
+                        f->fHead.KeyLen) > 0) {
+                break;
+            }
+            if (h->statusFlags & ISAM_VALID) {
+                n++;
+                if (fn(context, key(*isam_ident, iCache, rec_no),
+                            data(*isam_ident, iCache, rec_no),
+                            data_length(f, data(*isam_ident, iCache,
+                                    rec_no)))) {
+                    break;
+                }
+            }
+        }
+        if (!(next = h->next)) {
+            break;
+        }
+        nb = next / f->fHead.NrecPB;
+        if (nb != rec / f->fHead.NrecPB) {
+            if (nb < f->fHead.Nblocks) {
+                if ((long) nb == regular + 1 &&
+                        nb + ISAM_SCAN_READAHEAD / 2 >= ahead) {
+                    scan_readAhead(f, ahead > nb ? ahead + 1 : nb + 1,
+                            nb + ISAM_SCAN_READAHEAD);
+                    ahead = nb + ISAM_SCAN_READAHEAD;
+                }
+                if ((long) nb == regular + 1) {
+                    cache_prefetch(f, nb + 1, nb + f->ioDepth);
+                }
+                regular = nb;
+            }
+            iCache = isam_cache_block(isam_ident, nb);
+        }
+        rec = next;
+    }
+    free(toKey);
+    return iCache < 0 ? -1 : n;
+}
+
+/* Store the data of a record in the cache. In a file with
+   ISAM_HAS_VARLEN, the value has the length in dataLength of the cursor,
+   and the data are padded with zeros up to DataLen */
+
+static void set_data(isamPtr isam_ident, int iCache, int rec_no,
+        const void *data)
+{
+    dataTail t;
+
+    memcpy(data(*isam_ident, iCache, rec_no), data,
+            isam_ident->file->fHead.DataLen);
+    if (isam_ident->file->fHead.FileState & ISAM_HAS_VARLEN)
+    {
+        t.length = isam_ident->dataLength;
+        t.heapPos = 0;
+        memcpy((char *) data(*isam_ident, iCache, rec_no) +
+                isam_ident->file->fHead.DataLen, &t, sizeof(t));
+    }
+}
+
+/* isam_append implements part of the functionality of isam_writeNew.
    It is only used when the key is larger than or equal to the largest key
    so far (this can be a key in a regular record, in a deleted first record
    of a block, or in an overflow record. The latter can happen if a record was
@@ -958,905 +4481,2931 @@ int isam_seekByKey(isamPtr isam_ident, const char *key) {
    the deleted record.
    2. The first free slot in the block returned by an index search for the
    maximum key, as long as that is not the last slot in that block.
-   3. The first slot in a new block if that still fits in with the regular
-   data blocks. In this case the key must be added to the index and
-   the index rewritten.
-   4. An overflow record position (last block in a record, or a free slot
-   in an overflow block)*/
+   3. The first slot in a new block, also beyond the regular data blocks.
+   In this case the key must be added to the index and the index
+   rewritten (and grown, if it is full).
+   4. A free slot in a later block (an overflow block, or one that the
+   file has grown into)*/
 static int isam_append(isamPtr isam_ident, const char * key, const void * data)
 {
-    int block_no;
-    int rec_no;
-    int new_block_no, new_rec_no;
-    unsigned long next;
-    int iCache, nCache;
-    int rv;
+    int block_no;
+    int rec_no;
+    int new_block_no, new_rec_no;
+    unsigned long next;
+    int iCache, nCache;
+    int rv;
+
+    /* First find block number from index */
+    block_no = index_keyToBlock(isam_ident->file->index, key);
+    rec_no = 0;
+    /* Now make sure the block is in cache */
+    iCache = isam_cache_block(isam_ident, block_no);
+    if (iCache < 0)
+    {
+        return -1;
+    }
+    /* First see if this is a deleted first record.
+       There are a lot of properties that we could check.
+       1. The first record must have been deleted (but it may still have a
+       smaller key)
+       2. The first record has the same key as the requested key (and as
+       maxKey).
+       3. The next pointer of the first record is zero (this appears to be
+       the most sensible test anyway). */
+    next = head((*isam_ident),iCache,rec_no)->next;
+    if (next == 0)
+    {
+        /* I think this must be a deleted first record. It still may have
+           a smaller key than the new record.
+           This actually is a bit a doubtful case for append -
+           let it be for now */
+        if ((rv =key_compare(key, key((*isam_ident),iCache,rec_no), isam_ident->file->fHead.KeyLen)))
+        {
+            assert(rv > 0);
+            /* This now implies an otherwise normal append */
+        } else
+        {
+            /* Keys are indeed equal - but, have we checked anywhere else
+               if the key did not yet exist by chance? So let's check that
+               here. Next check maxKey for added security */
+            if (ISAM_VALID & head((*isam_ident),iCache,rec_no)->statusFlags)
+            {
+                isam_error = ISAM_RECORD_EXISTS;
+                return -1;
+            }
+            assert(0 == key_compare(key, isam_ident->file->maxKey,
+                        isam_ident->file->fHead.KeyLen));
+            /* Assert deleted state */
+            assert(ISAM_DELETED ==
+                    head((*isam_ident),iCache,rec_no)->statusFlags);
+            /* We only need to copy the data and mark the record as valid */
+            set_data(isam_ident, iCache, rec_no, data);
+            head(*isam_ident, iCache, rec_no)->statusFlags = ISAM_VALID;
+            isam_ident->file->fHead.Nrecords++;
+            cursor_set(isam_ident, iCache);
+            isam_ident->cur_recno = rec_no;
+            /* Now what do we write first? - writing the header twice is
+               extra work, but at least makes it easy to identify an
+               inconsistent file. Writing intentions would be even more
+               secure*/
+            isam_ident->file->fHead.FileState |= ISAM_STATE_UPDATING;
+            writeHead(isam_ident->file);
+            if (write_cache_block(isam_ident->file, iCache))
+            {
+                return -1;
+            }
+            isam_ident->file->fHead.FileState &= ~ISAM_STATE_UPDATING;
+            return writeHead(isam_ident->file);
+        }
+    }
+    /* So there is a next, follow it to the bitter end */
+    while (next)
+    {
+        block_no = next / isam_ident->file->fHead.NrecPB;
+        rec_no = next % isam_ident->file->fHead.NrecPB;
+        iCache = isam_cache_block(isam_ident, block_no);
+        if (iCache < 0)
+        {
+            return -1;
+        }
+        next = head((*isam_ident),iCache,rec_no)->next;
+    }
+    /* Now we should have a record with a smaller key, equal to
+       maxKey */
+    rv = key_compare(key, key((*isam_ident),iCache,rec_no),
+            isam_ident->file->fHead.KeyLen);
+    if (rv <= 0)
+    {
+        unsigned int i;
+        dumpMaxKey(isam_ident->file);
+        fprintf(stderr, "key = '%s', found key ='", key);
+        for (i = 0; i <= isam_ident->file->fHead.KeyLen; i++)
+        {
+            fprintf(stderr, "%c", key((*isam_ident),iCache,rec_no)[i]);
+        }
+        fprintf(stderr, "'\n");
+    }
+    assert(rv > 0);
+    new_block_no = block_no;
+    nCache = iCache;
+    new_rec_no = free_record_in_block(isam_ident, iCache, key);
+    while (new_rec_no < 0 || new_rec_no >= (int) isam_ident->file->fHead.NrecPB)
+    {
+        /* We'll leave the last slot free for inserts. Beyond the
+           regular blocks the file grows as if they were regular */
+        new_block_no ++;
+        nCache = isam_cache_block(isam_ident, new_block_no);
+        if (nCache < 0)
+        {
+            return -1;
+        }
+        new_rec_no = free_record_in_block(isam_ident, nCache, key);
+    }
+    memcpy(isam_ident->file->maxKey, key, isam_ident->file->fHead.KeyLen);
+    cursor_set(isam_ident, nCache);
+    isam_ident->cur_recno = new_rec_no;
+    memcpy(cur_key(*isam_ident), key, isam_ident->file->fHead.KeyLen);
+    set_data(isam_ident, isam_ident->cur_id, isam_ident->cur_recno, data);
+    cur_head(*isam_ident)->statusFlags = ISAM_VALID;
+    cur_head(*isam_ident)->previous = block_no * isam_ident->file->fHead.NrecPB +
+        rec_no;
+    cur_head(*isam_ident)->next = 0;
+    /* Beware - the previous record may have been deleted from the
+       cache, but re-reading it may remove the current record.
+       We'll first update the file header */
+    isam_ident->file->fHead.FileState |= ISAM_STATE_UPDATING;
+    isam_ident->file->fHead.Nrecords++;
+    isam_ident->file->fHead.MaxKeyRec = new_rec_no +
+        new_block_no * isam_ident->file->fHead.NrecPB;
+    writeHead(isam_ident->file);
+    /* We'll now update the index - if needed. It is written to disk
+       together with the header. A free first slot means a new block, or
+       an overflow block of which the first record has been deleted */
+    if (new_rec_no == 0) {
+        if (addIndexKey(isam_ident->file, key, new_block_no)) {
+            return -1;
+        }
+        wal_addKey(isam_ident->file, key, new_block_no);
+    }
+    if (new_block_no == block_no) {
+        /* Update the "next" pointer here and now */
+        assert(iCache == nCache);
+        head(*isam_ident, iCache, rec_no)->next =
+            isam_ident->file->fHead.MaxKeyRec;
+    }
+    if (write_cache_block(isam_ident->file, nCache)) {
+        return -1;
+    }
+    if (new_block_no != block_no) {
+        iCache = isam_cache_block(isam_ident, block_no);
+        if (iCache < 0) {
+            return -1;
+        }
+        head(*isam_ident, iCache, rec_no)->next =
+            isam_ident->file->fHead.MaxKeyRec;
+
+        if (write_cache_block(isam_ident->file, iCache)) {
+            return -1;
+        }
+    }
+    isam_ident->file->fHead.FileState &= ~ISAM_STATE_UPDATING;
+    return writeHead(isam_ident->file);
+}
+
+/* isam_insert implements the remainder of isam_writeNew: it inserts a
+   record with a key smaller than the largest key so far */
+static int isam_insert(isamPtr isam_ident, const char *key, const void *data) {
+    int block_no;
+    int rec_no;
+    int new_block_no, new_rec_no;
+    int prev_block_no, prev_rec_no;
+    unsigned long next, prev;
+    int iCache, nCache, pCache;
+    int rv;
+
+    /* Now look for the record with the highest key less than key
+       The successor will be the one with the lowest greater than...
+       Beware of equal keys, unless for deleted records. We might
+       be tempted to use setkey, but setkey selects the last valid
+       record - and we are not interested in that now. Copy some code,
+       though. */
+
+    block_no = index_keyToBlock(isam_ident->file->index, key);
+    rec_no = 0;
+    /* Now make sure the block is in cache */
+    iCache = isam_cache_block(isam_ident, block_no);
+
+    if (iCache < 0) {
+        return -1;
+    }
+    next = block_no * isam_ident->file->fHead.NrecPB;
+    while ((rv = key_compare(key, key((*isam_ident),iCache,rec_no),
+                    isam_ident->file->fHead.KeyLen)) > 0) {
+        next = head((*isam_ident),iCache,rec_no)->next;
+        assert(next);
+        block_no = next / isam_ident->file->fHead.NrecPB;
+        rec_no = next % isam_ident->file->fHead.NrecPB;
+        iCache = isam_cache_block(isam_ident, block_no);
+
+        if (iCache < 0) {
+            return -1;
+        }
+    }
+    /* As we (should have) avoided the last record by going to append
+       when needed - and by doing this "assert(next)" stuff, we can
+       now proceed on the assumption that the record found really
+       has an equal or larger key */
+    /* Is the key equal ? */
+    if (rv == 0) {
+        if (head((*isam_ident),iCache,rec_no)->statusFlags & ISAM_DELETED) {
+            /* Should be simple and OK */
+            /* We only need to copy the data and mark the record as valid */
+            set_data(isam_ident, iCache, rec_no, data);
+            head(*isam_ident, iCache, rec_no)->statusFlags = ISAM_VALID;
+            isam_ident->file->fHead.Nrecords++;
+            /* No what do we write first? - writing the header twice is
+               extra work, but at least makes it easy to identify an
+               inconsistent file. Writing intentions would be even more
+               secure*/
+            isam_ident->file->fHead.FileState |= ISAM_STATE_UPDATING;
+            writeHead(isam_ident->file);
+            if (write_cache_block(isam_ident->file, iCache))
+            {
+                return -1;
+            }
+            isam_ident->file->fHead.FileState &= ~ISAM_STATE_UPDATING;
+            cursor_set(isam_ident, iCache);
+            isam_ident->cur_recno = rec_no;
+            return writeHead(isam_ident->file);
+        } else {
+            /* Someone is trying to update a record with isam_writeNew,
+               we are not going to allow that */
+            isam_error = ISAM_RECORD_EXISTS;
+            return -1;
+        }
+    }
+    /* So, now we know that the key of the record pointed to by "next" is
+       larger, and its predecessor must be smaller (possibly the empty key
+       "")
+       We first look for the previous record (bearing in mind that we may
+       lose the current in doing so), then look for a free slot from
+       that point forward. Here we have the choice to only use last slots,
+       or any free slot. Let's keep it simple....*/
+    prev = head(*isam_ident, iCache, rec_no)->previous;
+    prev_block_no = prev / isam_ident->file->fHead.NrecPB;
+    prev_rec_no = prev % isam_ident->file->fHead.NrecPB;
+    pCache = isam_cache_block(isam_ident, prev_block_no);
+    if (pCache < 0)
+    {
+        return -1;
+    }
+    nCache = pCache;
+    new_block_no = prev_block_no;
+    new_rec_no = free_record_in_block(isam_ident, nCache, key);
+    if (new_rec_no < 0)
+    {
+        new_block_no = isam_ident->file->freeHint - 1;
+        while (new_rec_no < 0)
+        {
+            new_block_no ++;
+            nCache = isam_cache_block(isam_ident, new_block_no);
+            if (nCache < 0)
+            {
+                return -1;
+            }
+            new_rec_no = free_record_in_block(isam_ident, nCache, key);
+        }
+        isam_ident->file->freeHint = new_block_no;
+    }
+    /* Set new record as current (isam_readPrev should allow you to re-read it)
+       and store all necessary information (key, data, prev and next pointers
+       and set to VALID */
+    cursor_set(isam_ident, nCache);
+    isam_ident->cur_recno = new_rec_no;
+    memcpy(cur_key(*isam_ident), key, isam_ident->file->fHead.KeyLen);
+    set_data(isam_ident, isam_ident->cur_id, isam_ident->cur_recno, data);
+    cur_head(*isam_ident)->statusFlags = ISAM_VALID;
+    cur_head(*isam_ident)->previous = prev;
+    cur_head(*isam_ident)->next = next;
+    /* Update file header and prepare for writing. */
+    isam_ident->file->fHead.Nrecords++;
+    isam_ident->file->fHead.FileState |= ISAM_STATE_UPDATING;
+    writeHead(isam_ident->file);
+    /* Now we have three records that may or may not lie in the same block.
+       We'll not explore all possibilities, but check at least this:
+       prev_block_no == new_block_no
+       prev_block_no == new_block_no && new_block_no == block_no */
+    if (prev_block_no == new_block_no) {
+        /* Also update pointer in preceding record when writing block */
+        assert(pCache == nCache);
+        head(*isam_ident, pCache, prev_rec_no)->next = new_rec_no +
+            new_block_no * isam_ident->file->fHead.NrecPB;
+        if (new_block_no == block_no) {
+            /* And also that in the next record */
+            assert(iCache == nCache);
+            head(*isam_ident, iCache, rec_no)->previous = new_rec_no +
+                new_block_no * isam_ident->file->fHead.NrecPB;
+            if (write_cache_block(isam_ident->file, nCache))
+            {
+                return -1;
+            }
+            /* Complete update and return */
+            isam_ident->file->fHead.FileState &= ~ISAM_STATE_UPDATING;
+            return writeHead(isam_ident->file);
+        }
+        if (write_cache_block(isam_ident->file, nCache))
+        {
+            return -1;
+        }
+        /* Make sure next record is in cache, update and write */
+        iCache = isam_cache_block(isam_ident, block_no);
+        if (iCache < 0)
+        {
+            return -1;
+        }
+        head(*isam_ident, iCache, rec_no)->previous = new_rec_no +
+            new_block_no * isam_ident->file->fHead.NrecPB;
+        if (write_cache_block(isam_ident->file, iCache))
+        {
+            return -1;
+        }
+        /* Finish update and return */
+        nCache = isam_cache_block(isam_ident, new_block_no);
+        if (nCache < 0)
+        {
+            return -1;
+        }
+        cursor_set(isam_ident, nCache);
+        isam_ident->cur_recno = new_rec_no;
+        isam_ident->file->fHead.FileState &= ~ISAM_STATE_UPDATING;
+        return writeHead(isam_ident->file);
+    }
+    /* Process all three records separately */
+    if (write_cache_block(isam_ident->file, nCache))
+    {
+        return -1;
+    }
+    /* Preceding record */
+    pCache = isam_cache_block(isam_ident, prev_block_no);
+    if (pCache < 0)
+    {
+        return -1;
+    }
+    head(*isam_ident, pCache, prev_rec_no)->next = new_rec_no +
+        new_block_no * isam_ident->file->fHead.NrecPB;
+    if (write_cache_block(isam_ident->file, pCache))
+    {
+        return -1;
+    }
+    /* Next record */
+    iCache = isam_cache_block(isam_ident, block_no);
+    if (iCache < 0)
+    {
+        return -1;
+    }
+    head(*isam_ident, iCache, rec_no)->previous = new_rec_no +
+        new_block_no * isam_ident->file->fHead.NrecPB;
+    if (write_cache_block(isam_ident->file, iCache))
+    {
+        return -1;
+    }
+    /* Finish and return */
+    nCache = isam_cache_block(isam_ident, new_block_no);
+    if (nCache < 0)
+    {
+        return -1;
+    }
+    cursor_set(isam_ident, nCache);
+    isam_ident->cur_recno = new_rec_no;
+    isam_ident->file->fHead.FileState &= ~ISAM_STATE_UPDATING;
+    return writeHead(isam_ident->file);
+}
+
+static int sec_add(isamPtr f, const char *key, const void *data);
+static int sec_remove(isamPtr f, const char *key, const void *data);
+
+static int do_writeNew(isamPtr isam_ident, const char *key, const void *data) {
+    int rv;
+
+    if (testPtr(isam_ident)) {
+        return -1;
+    }
+    key = padKey(isam_ident, key);
+    if (!key[0]) {
+        isam_error = ISAM_NULL_KEY;
+        return -1;
+    }
+
+    if (key_compare(key, isam_ident->file->maxKey, isam_ident->file->fHead.KeyLen) >= 0) {
+        rv = isam_append(isam_ident, key, data);
+    } else {
+        rv = isam_insert(isam_ident, key, data);
+    }
+    /* Only now the index tells in which block's filter the key belongs */
+    if (!rv) {
+        bloom_add(isam_ident->file, key);
+        rv = sec_add(isam_ident, key, data);
+    }
+    return rv;
+}
+
+/* The following routine should give a lot more explanation of the nature
+   of the error than it does now. */
+
+int isam_perror(const char *str) {
+    /* STEP 1: instead of printing an error number, print textual
+       representation for every possible error.
+       */
+
+    char *msg;
+
+    switch ((int)isam_error) {
+        case ISAM_NO_ERROR:
+            msg = "Number error";
+            break;
+        case ISAM_WRITE_FAIL:
+            msg = "Write failure";
+            break;
+        case ISAM_KEY_LEN:
+            msg = "key length";
+            break;
+        case ISAM_FILE_EXISTS:
+            msg = "File doesn't exist";
+            break;
+        case ISAM_LINK_EXISTS:
+            msg = "Link doesn't exist";
+            break;
+        case ISAM_OPEN_FAIL:
+            msg = "open fail";
+            break;
+        case ISAM_NO_SUCH_FILE:
+            msg = "no such file";
+            break;
+        case ISAM_OPEN_COUNT:
+            msg = "open count fail";
+            break;
+        case ISAM_INDEX_ERROR:
+            msg = "index error";
+            break;
+        case ISAM_READ_ERROR:
+            msg = "read error";
+            break;
+        case ISAM_BAD_MAGIC:
+            msg = "bad magic";
+            break;
+        case ISAM_BAD_VERSION:
+            msg = "bad version";
+            break;
+        case ISAM_HEADER_ERROR:
+            msg = "header error";
+            break;
+        case ISAM_OPEN_FOR_UPDATE:
+            msg = "open for update";
+            break;
+        case ISAM_IDENT_INVALID:
+            msg = "identity invalid";
+            break;
+        case ISAM_NO_SUCH_KEY:
+            msg = "no such key";
+            break;
+        case ISAM_NULL_KEY:
+            msg = "key is null";
+            break;
+        case ISAM_DATA_MISMATCH:
+            msg = "data mismatch";
+            break;
+        case ISAM_RECORD_EXISTS:
+            msg = "record exists";
+            break;
+        case ISAM_SEEK_ERROR:
+            msg = "seek error";
+            break;
+        case ISAM_SOF:
+            msg = "Start of file";
+            break;
+        case ISAM_EOF:
+            msg = "End of file";
+            break;
+        case ISAM_NO_BLOOM:
+            msg = "no Bloom filters";
+            break;
+        case ISAM_NOT_SORTED:
+            msg = "keys not sorted";
+            break;
+        case ISAM_CACHE_FULL:
+            msg = "all cache slots in use by cursors";
+            break;
+        case ISAM_LOG_ERROR:
+            msg = "write-ahead log error";
+            break;
+        case ISAM_THREAD_ERROR:
+            msg = "cannot start I/O threads";
+            break;
+        case ISAM_NO_SECONDARY:
+            msg = "no such secondary index";
+            break;
+        case ISAM_DATA_LENGTH:
+            msg = "data too long";
+            break;
+        case ISAM_CHECKSUM_ERROR:
+            msg = "checksum mismatch";
+            break;
+        case ISAM_SNAPSHOT:
+            msg = "not possible with a snapshot";
+            break;
+        case ISAM_BAD_FANOUT:
+            msg = "index fan-out out of range";
+            break;
+        default:
+            break;
+    }
+
+    if (str) {
+        fprintf(stderr, "isam_perror: %s - error no %d, %s", str, (int)isam_error, msg);
+    } else {
+        fprintf(stderr, "isam_perror: error no %d, %s", (int)isam_error, msg);
+    }
+    fprintf(stderr, "\n");
+
+    return 0;
+}
+
+/* isam_delete will delete a record if
+   - it exists,
+   - is valid
+   - key and data match */
+
+static int do_delete(isamPtr isam_ident, const char *key, const void *data)
+{
+    unsigned long block_no;
+    int rec_no;
+    unsigned long next, prev, prev_valid;
+    int iCache;
+    int rv;
+    int keep_link = 0;
+    int prev_block_no, prev_rec_no, pCache;
+    int next_block_no, next_rec_no, nCache;
+    int prev_valid_block_no, prev_valid_rec_no, pvCache;
+    unsigned long range;
+
+
+    if (testPtr(isam_ident))
+    {
+        return -1;
+    }
+    key = padKey(isam_ident, key);
+    if (key[0] == 0)
+    {
+        isam_error = ISAM_NULL_KEY;
+        return -1;
+    }
+    /* First find block number from index */
+    range = block_no = index_keyToBlock(isam_ident->file->index, key);
+    rec_no = 0;
+    if (!bloom_mayContain(isam_ident->file, range, key))
+    {
+        ISAM_STAT(isam_ident, bloomSkips, 1);
+        isam_error = ISAM_NO_SUCH_KEY;
+        return -1;
+    }
+    /* Now make sure the block is in cache */
+    iCache = isam_cache_block(isam_ident, block_no);
+    if (iCache < 0)
+    {
+        return -1;
+    }
+    /* Skip all records with smaller keys */
+    while ((rv = key_compare(key, key((*isam_ident),iCache,rec_no),
+                    isam_ident->file->fHead.KeyLen)) > 0)
+    {
+        next = head((*isam_ident),iCache,rec_no)->next;
+        debugRecord(isam_ident, next, "delete #1");
+        if (!next)
+        {
+            /* There is no next record */
+            break;
+        }
+        block_no = next / isam_ident->file->fHead.NrecPB;
+        rec_no = next % isam_ident->file->fHead.NrecPB;
+        iCache = isam_cache_block(isam_ident, block_no);
+        if (iCache < 0)
+        {
+            return -1;
+        }
+    }
+    /* Now either rv != 0 - in which case there is no matching key,
+       independent of next being zero or not, or rv == 0, in which
+       case at least the key matches */
+    if (rv || !(head(*isam_ident, iCache, rec_no)->statusFlags & ISAM_VALID)) {
+        isam_error = ISAM_NO_SUCH_KEY;
+        return -1;
+    }
+    /* So the key matches and the record is valid, now see if the data
+       match. The data may not be strings - so compare the full length.
+       So the user must beware to include the same junk in the remainder
+       of a data field, if it happens to be a string (isam_readByKey will
+       take care of that) */
+    if (memcmp(data, data(*isam_ident, iCache, rec_no), isam_ident->file->fHead.DataLen)) {
+        isam_error = ISAM_DATA_MISMATCH;
+        return -1;
+    }
+    /* So we can now delete the record. Begin by marking it "deleted" */
+    head(*isam_ident, iCache, rec_no)->statusFlags = ISAM_DELETED;
+    isam_ident->file->fHead.FileState |= ISAM_STATE_UPDATING;
+    isam_ident->file->fHead.Nrecords--;
+
+    if (writeHead(isam_ident->file)) {
+        return -1;
+    }
+    if ((rec_no == 0) && block_indexed(isam_ident, iCache)) {
+        /* This record occurs in the index, so we only mark it as deleted,
+           but keep it in the linked list */
+        keep_link = 1;
+        if (write_cache_block(isam_ident->file, iCache)) {
+            return -1;
+        }
+    }
+    /* We'll need two kinds of preceding record - the immediately preceding
+       (which will always exist), and the preceding valid (which may exist).
+       The latter is needed to reposition the cur_id and the cur_block_no.
+       Let's begin with the preceding*/
+    /* The record cannot be the dummy first, so there must be a previous
+       record */
+    next = head(*isam_ident, iCache, rec_no)->next;
+    prev = head(*isam_ident, iCache, rec_no)->previous;
+    prev_block_no = prev / isam_ident->file->fHead.NrecPB;
+    prev_rec_no   = prev % isam_ident->file->fHead.NrecPB;
+    pCache = isam_cache_block(isam_ident, prev_block_no);
+    if (pCache < 0)
+    {
+        return -1;
+    }
+    prev_valid = prev;
+    prev_valid_block_no = prev_block_no;
+    prev_valid_rec_no  = prev_rec_no;
+    pvCache = pCache;
+    cursor_set(isam_ident, pvCache);
+    isam_ident->cur_recno = prev_valid_rec_no;
+    if (!keep_link)
+    {
+        cur_head(*isam_ident)->next = next;
+        if (write_cache_block(isam_ident->file, pCache))
+        {
+            return -1;
+        }
+        /* The next record need not exist (we may have deleted the last)*/
+        if (next)
+        {
+            next_block_no = next / isam_ident->file->fHead.NrecPB;
+            next_rec_no   = next % isam_ident->file->fHead.NrecPB;
+            nCache = isam_cache_block(isam_ident, next_block_no);
+            if (nCache < 0)
+            {
+                return -1;
+            }
+            head(*isam_ident, nCache, next_rec_no)->previous = prev;
+            if (write_cache_block(isam_ident->file, nCache))
+            {
+                return -1;
+            }
+        } else
+        {
+            /* This is likely to be the record with the maxKey; if it is,
+               maxKey must be set to that of the preceding record */
+            if (!key_compare(key, isam_ident->file->maxKey, isam_ident->file->fHead.KeyLen))
+            {
+                memcpy(isam_ident->file->maxKey, key(*isam_ident, pCache, prev_rec_no),
+                        isam_ident->file->fHead.KeyLen);
+                isam_ident->file->fHead.MaxKeyRec = prev;
+            }
+        }
+        /* Now clear all status flags, but first ensure that the record
+           still/again is cached */
+        iCache = isam_cache_block(isam_ident, block_no);
+        if (iCache < 0)
+        {
+            return -1;
+        }
+        head(*isam_ident, iCache, rec_no)->statusFlags = 0;
+        if (block_no >= isam_ident->file->fHead.Nblocks &&
+                (unsigned long) block_no < isam_ident->file->freeHint)
+        {
+            isam_ident->file->freeHint = block_no;
+        }
+        if (write_cache_block(isam_ident->file, iCache))
+        {
+            return -1;
+        }
+    }
+    isam_ident->file->fHead.FileState &= ~ISAM_STATE_UPDATING;
+    if (writeHead(isam_ident->file))
+    {
+        return -1;
+    }
+
+    /* Now make sure the previous valid record is found and cached */
+    pvCache = isam_cache_block(isam_ident, prev_valid_block_no);
+    if (pvCache < 0)
+    {
+        return -1;
+    }
+    while (prev_valid && (!(cur_head(*isam_ident)->statusFlags & ISAM_VALID)))
+    {
+        prev_valid = cur_head(*isam_ident)->previous;
+        prev_valid_block_no = prev_valid / isam_ident->file->fHead.NrecPB;
+        prev_valid_rec_no   = prev_valid % isam_ident->file->fHead.NrecPB;
+        pvCache = isam_cache_block(isam_ident, prev_valid_block_no);
+        if (pvCache < 0)
+        {
+            return -1;
+        }
+        cursor_set(isam_ident, pvCache);
+        isam_ident->cur_recno = prev_valid_rec_no;
+    }
+
+    if (sec_remove(isam_ident, key, data))
+    {
+        return -1;
+    }
+
+    /* The deleted key stays in the Bloom filter until it is rebuilt */
+    if (isam_ident->file->bloom &&
+            (unsigned long) range < isam_ident->file->fHead.Nblocks &&
+            ++(isam_ident->file->bloomDeletes[range]) >= ISAM_BLOOM_MAX_DELETES)
+    {
+        return bloom_rebuildRange(isam_ident, range);
+    }
+    return 0;
+}
+
+/* STEP 5:
+   isam_update overwrites the data of the record where it is: the key and
+   the length of the record do not change, so neither do the chain and
+   the index, and only the block with the record is written. The record
+   becomes the current record. A value of variable length may grow, but
+   page_encode then moves values of the block to the heap as needed. */
+
+static int sec_update(isamPtr f, const char *key, const void *oldData,
+        const void *newData);
+
+static int do_update(isamPtr isam_ident, const char *key, const void *old_data,
+        const void *new_data)
+{
+    if (testPtr(isam_ident))
+    {
+        return -1;
+    }
+    key = padKey(isam_ident, key);
+    if (key[0] == 0)
+    {
+        isam_error = ISAM_NULL_KEY;
+        return -1;
+    }
+    if (do_seekByKey(isam_ident, key))
+    {
+        return -1;
+    }
+    /* As in isam_delete, the full data field must match */
+    if (memcmp(old_data, cur_data(*isam_ident),
+                isam_ident->file->fHead.DataLen))
+    {
+        isam_error = ISAM_DATA_MISMATCH;
+        return -1;
+    }
+    set_data(isam_ident, isam_ident->cur_id, isam_ident->cur_recno, new_data);
+    if (write_cache_block(isam_ident->file, isam_ident->cur_id))
+    {
+        return -1;
+    }
+    return sec_update(isam_ident, key, old_data, new_data);
+}
+
+/* Like strlen, but with a maximum length allowed.  There is "strnlen" in
+   GNU libc, but it's non-standard, hence we provide our own version.
+   */
+static long my_strnlen(const char* str, int maxLen)
+{
+    const char* s = str;
+    while (maxLen-- > 0 && *s)
+    {
+        s++;
+    }
+    return s-str;
+}
+
+/* Go through the file and collect statistics on the filling of records
+   and complete blocks, separately for sequential part and for overflow
+   part.  Also collect statistics on the key length used.
+   */
+static int do_fileStats(isamPtr isam_ident, struct ISAM_FILE_STATS* stats) {
+    int iCache;
+    unsigned long block_no;
+    unsigned long keySum = 0;
+    unsigned long keyNo = 0;
+    unsigned long blocksRegularUsedSum = 0;
+    unsigned long blocksOverflowUsedSum = 0;
+
+    if (testPtr(isam_ident))
+    {
+        return -1;
+    }
+
+    /* Initialise statistics.  */
+    stats->blocksRegularNEmpty = 0;
+    stats->blocksRegularNPartial = 0;
+    stats->blocksRegularNFull = 0;
+    stats->blocksRegularUsedMin = 0xffffffff;
+    stats->blocksRegularUsedMax = 0;
+    stats->blocksRegularUsedAverage = 0;
+    stats->recordsRegularNEmpty = 0;
+    stats->recordsRegularNUsed = 0;
+    stats->blocksOverflowNEmpty = 0;
+    stats->blocksOverflowNPartial = 0;
+    stats->blocksOverflowNFull = 0;
+    stats->blocksOverflowUsedMin = 0xffffffff;
+    stats->blocksOverflowUsedMax = 0;
+    stats->blocksOverflowUsedAverage = 0;
+    stats->recordsOverflowNEmpty = 0;
+    stats->recordsOverflowNUsed = 0;
+    stats->keyMin = -1;
+    stats->keyMax = 0;
+    stats->keyAverage = 0;
+
+    /* Iterate through all the blocks.  */
+    for (block_no = 0; block_no < isam_ident->file->fHead.CurBlocks; block_no++)
+    {
+        unsigned long rec_no;
+
+        unsigned long empty = 0;
+        unsigned long used = 0;
+
+        iCache = isam_cache_block(isam_ident, block_no);
+        if (iCache < 0)
+        {
+            return -1;
+        }
+
+        /* Iterate through all the records in each block.  */
+        for (rec_no = 0; rec_no < isam_ident->file->fHead.NrecPB; rec_no++)
+        {
+            recordHead* rec = head(*isam_ident, iCache, rec_no);
+
+            if (rec->statusFlags & ISAM_VALID)
+            {
+                /* Record is used.  Collect key length statistics.  */
+                int keyLen = my_strnlen(key(*isam_ident, iCache, rec_no),
+                        isam_ident->file->fHead.KeyLen);
+                used++;
+
+                if (stats->keyMin == -1 || keyLen < stats->keyMin)
+                {
+                    stats->keyMin = keyLen;
+                }
+                if (keyLen > stats->keyMax)
+                {
+                    stats->keyMax = keyLen;
+                }
+                keySum += keyLen;
+                keyNo++;
+            }
+            else if (rec->statusFlags & ISAM_SPECIAL)
+            {
+                /* Special null start record.  */
+                used++;
+            }
+            else
+            {
+                /* The record is empty.  Either it's ISAM_DELETED (being
+                   the index record), or it doesn't serve any function.  */
+                empty++;
+            }
+        }
+
+        /* Collect statistics after iterating through all the records of
+           a block.  */
+        if (block_indexed(isam_ident, iCache))
+        {
+            /* Ordinary, sequential block (possibly one the file has grown
+               into).  */
+            stats->recordsRegularNEmpty += empty;
+            stats->recordsRegularNUsed += used;
+
+            if (empty == isam_ident->file->fHead.NrecPB)
+            {
+                stats->blocksRegularNEmpty++;
+            }
+            else if (used == isam_ident->file->fHead.NrecPB)
+            {
+                stats->blocksRegularNFull++;
+            }
+            else
+            {
+                stats->blocksRegularNPartial++;
+            }
+
+            if (stats->blocksRegularUsedMin == 0xffffffff ||
+                    used < stats->blocksRegularUsedMin)
+            {
+                stats->blocksRegularUsedMin = used;
+            }
+            if (used > stats->blocksRegularUsedMax)
+            {
+                stats->blocksRegularUsedMax = used;
+            }
+            blocksRegularUsedSum += used;
+        }
+        else
+        {
+            /* Overflow block.  */
+            stats->recordsOverflowNEmpty += empty;
+            stats->recordsOverflowNUsed += used;
+
+            if (empty == isam_ident->file->fHead.NrecPB)
+            {
+                stats->blocksOverflowNEmpty++;
+            }
+            else if (used == isam_ident->file->fHead.NrecPB)
+            {
+                stats->blocksOverflowNFull++;
+            }
+            else
+            {
+                stats->blocksOverflowNPartial++;
+            }
+
+            if (stats->blocksOverflowUsedMin == 0xffffffff ||
+                    used < stats->blocksOverflowUsedMin)
+            {
+                stats->blocksOverflowUsedMin = used;
+            }
+            if (used > stats->blocksOverflowUsedMax)
+            {
+                stats->blocksOverflowUsedMax = used;
+            }
+            blocksOverflowUsedSum += used;
+        }
+    }
+
+    /* Collect statistics after iterating through all the records of all
+       blocks.  Take into account the possibility that no statistics could
+       have been collected.  */
+    if (stats->blocksRegularNEmpty + stats->blocksRegularNFull +
+            stats->blocksRegularNPartial > 0)
+    {
+        stats->blocksRegularUsedAverage = blocksRegularUsedSum /
+            (stats->blocksRegularNEmpty + stats->blocksRegularNFull +
+             stats->blocksRegularNPartial);
+    }
+    if (stats->blocksOverflowNEmpty + stats->blocksOverflowNFull +
+            stats->blocksOverflowNPartial)
+    {
+        stats->blocksOverflowUsedAverage = blocksOverflowUsedSum /
+            (stats->blocksOverflowNEmpty + stats->blocksOverflowNFull +
+             stats->blocksOverflowNPartial);
+    }
+    if (keyNo > 0)
+    {
+        stats->keyAverage = keySum / keyNo;
+    }
+    if (stats->blocksRegularUsedMin == 0xffffffff)
+    {
+        stats->blocksRegularUsedMin = 0;
+    }
+    if (stats->blocksOverflowUsedMin == 0xffffffff)
+    {
+        stats->blocksOverflowUsedMin = 0;
+    }
+
+    /* Leave the ISAM file in a well defined state.  */
+    iCache = isam_cache_block(isam_ident, 0);
+    if (iCache < 0)
+    {
+        return -1;
+    }
+    cursor_set(isam_ident, iCache);
+    isam_ident->cur_recno = 0;
+
+    return 0;
+}
+
+/* isam_verify reads the data blocks straight from the file (after
+   writing the cache), ISAM_VERIFY_BYTES at a time, bypassing the cache.
+   Every block is checked against its checksum and decoded, and the
+   links of its records are checked as far as that can be done locally:
+   they must lie within the file, and two records in the same block must
+   be in key order. To see whether every next link is matched by the
+   previous link of the record it points to would require all links of
+   the file in memory. Instead, the links of either kind are summed as
+   (from, to) pairs through a hash (verify_link): the sums are equal
+   when the links match, and almost certainly differ when they do not. */
+
+#define ISAM_VERIFY_BYTES   (1024 * 1024)
+
+static unsigned long long verify_mix(unsigned long long h)
+{
+    /* The finaliser of MurmurHash3 */
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static unsigned long long verify_link(unsigned long from, unsigned long to)
+{
+    return verify_mix(verify_mix(from) + to);
+}
+
+/* Check the records of a block (in the cache layout) */
+
+static void verify_block(isamFile *f, const char *block,
+        unsigned long block_no, struct ISAM_VERIFY_STATS *stats,
+        unsigned long long *nextSum, unsigned long long *prevSum)
+{
+    unsigned long nRec = f->fHead.CurBlocks * f->fHead.NrecPB;
+    unsigned long i, rec;
+    const recordHead *h, *n;
+
+    for (i = 0; i < f->fHead.NrecPB; i++)
+    {
+        h = (const recordHead *) (block + i * f->fHead.RecordLen);
+        if (!h->statusFlags)
+        {
+            continue;
+        }
+        rec = block_no * f->fHead.NrecPB + i;
+        stats->records++;
+        if (h->statusFlags & ISAM_VALID)
+        {
+            stats->validRecords++;
+        }
+        if (!h->next)
+        {
+            /* Only the record with the highest key ends the chain */
+            stats->chainEnds++;
+            if (rec != f->fHead.MaxKeyRec)
+            {
+                stats->badLinks++;
+            }
+        }
+        else if (h->next >= nRec || h->next == rec)
+        {
+            stats->badLinks++;
+        }
+        else
+        {
+            *nextSum += verify_link(rec, h->next);
+            n = (const recordHead *) (block + (h->next % f->fHead.NrecPB) *
+                    f->fHead.RecordLen);
+            if (h->next / f->fHead.NrecPB == block_no && n->statusFlags &&
+                    key_compare((const char *) (h + 1),
+                        (const char *) (n + 1), f->fHead.KeyLen) >= 0)
+            {
+                stats->badLinks++;
+            }
+        }
+        /* The dummy first record has no previous record */
+        if (!rec)
+        {
+            continue;
+        }
+        if (h->previous >= nRec || h->previous == rec)
+        {
+            stats->badLinks++;
+        }
+        else
+        {
+            *prevSum += verify_link(h->previous, rec);
+        }
+    }
+}
+
+static long do_verify(isamPtr isam_ident, struct ISAM_VERIFY_STATS *stats)
+{
+    isamFile *f = isam_ident->file;
+    unsigned long perRead = ISAM_VERIFY_BYTES / f->diskSize;
+    unsigned long nBlocks, first, n, i;
+    unsigned long long nextSum = 0, prevSum = 0;
+    fileHead fh;
+    fileCheck check;
+    index_handle in;
+    char   *buf, *block = NULL, *page;
+    long    rv = 0;
+
+    memset(stats, 0, sizeof(*stats));
+    if (do_flush(isam_ident, 0))
+    {
+        return -1;
+    }
+    /* The header and the index as they are on disk */
+    if (f->fHead.FileState & ISAM_HAS_CHECKSUMS)
+    {
+        if (pread(f->fileId, &fh, sizeof(fh), 0) != (ssize_t) sizeof(fh) ||
+                pread(f->fileId, &check, sizeof(check), sizeof(fh)) !=
+                (ssize_t) sizeof(check))
+        {
+            isam_error = ISAM_READ_ERROR;
+            return -1;
+        }
+        if (check.head != crc32c(0, &fh, sizeof(fh)))
+        {
+            stats->badHeader++;
+        }
+        in = (f->indexFd >= 0) ? index_readFromDisk(f->indexFd, 0) :
+            index_readFromDisk(f->fileId, IndexStart(f->fHead.FileState));
+        if (!in || check.index != index_checksum(in))
+        {
+            stats->badHeader++;
+        }
+        if (in)
+        {
+            index_free(in);
+        }
+    }
+    /* Blocks that have never been written are empty */
+    nBlocks = (f->diskBlocks < f->fHead.CurBlocks) ? f->diskBlocks :
+        f->fHead.CurBlocks;
+    if (perRead < 1)
+    {
+        perRead = 1;
+    }
+    buf = malloc(perRead * f->diskSize);
+    assert(buf != NULL);
+    /* Pages, and blocks followed by a checksum (which are not aligned
+       in buf), are decoded into a block of their own */
+    if (BlockBuffered(f))
+    {
+        block = malloc(f->blockSize);
+        assert(block != NULL);
+    }
+    posix_fadvise(f->fileId, f->fHead.DataStart, 0, POSIX_FADV_SEQUENTIAL);
+    for (first = 0; first < nBlocks && !rv; first += n)
+    {
+        n = (nBlocks - first < perRead) ? nBlocks - first : perRead;
+        if (pread(f->fileId, buf, n * f->diskSize, f->fHead.DataStart +
+                    first * f->diskSize) != (ssize_t) (n * f->diskSize))
+        {
+            isam_error = ISAM_READ_ERROR;
+            rv = -1;
+            break;
+        }
+        ISAM_COUNT(disk_reads_global);
+        ISAM_STAT_SHARED(f, diskReads, 1);
+        ISAM_STAT_SHARED(f, bytesRead, n * f->diskSize);
+        for (i = 0; i < n; i++)
+        {
+            page = buf + i * f->diskSize;
+            stats->blocks++;
+            /* The values in the heap are not needed */
+            if (block_decode(f, page, block ? block : page, first + i, 0))
+            {
+                if (!stats->badBlocks++)
+                {
+                    stats->firstBadBlock = first + i;
+                }
+                continue;
+            }
+            verify_block(f, block ? block : page, first + i, stats,
+                    &nextSum, &prevSum);
+        }
+    }
+    posix_fadvise(f->fileId, f->fHead.DataStart, 0, POSIX_FADV_NORMAL);
+    free(buf);
+    free(block);
+    if (rv)
+    {
+        return -1;
+    }
+    stats->chainMismatch = nextSum != prevSum;
+    return stats->badHeader + stats->badBlocks + stats->badLinks +
+        stats->chainMismatch + (stats->chainEnds != 1) +
+        (stats->validRecords != f->fHead.Nrecords);
+}
+
+/* isam_load adds a record with a key larger than all keys in the file
+   right after the last record, filling blocks in order up to perBlock
+   records each (block 0 includes the dummy first record), and in a file
+   with pages as long as reserve bytes remain free in the page. The first
+   record of every block goes into the index, which grows beyond the
+   regular blocks when needed. Blocks are only
+   written when they leave the cache, so a file is loaded with large
+   sequential writes. */
+
+static int isam_load(isamPtr f, const char *key, const void *data,
+        unsigned long perBlock, unsigned long reserve)
+{
+    unsigned long last = f->file->fHead.MaxKeyRec;
+    unsigned long block_no = last / f->file->fHead.NrecPB;
+    unsigned long rec_no = last % f->file->fHead.NrecPB;
+    unsigned long pos;
+    int     iCache, full;
+
+    if (key_compare(key, f->file->maxKey, f->file->fHead.KeyLen) <= 0)
+    {
+        isam_error = ISAM_RECORD_EXISTS;
+        return -1;
+    }
+    pos = last + 1;
+    full = (rec_no + 1 >= perBlock);
+    if (!full && (f->file->fHead.FileState & ISAM_HAS_PAGES))
+    {
+        iCache = isam_cache_block(f, block_no);
+        if (iCache < 0)
+        {
+            return -1;
+        }
+        full = !page_fits(f->file, f->file->cache[iCache], key,
+                f->dataLength, reserve);
+    }
+    if (full)
+    {
+        block_no++;
+        pos = block_no * f->file->fHead.NrecPB;
+    }
+    iCache = isam_cache_block(f, pos / f->file->fHead.NrecPB);
+    if (iCache < 0)
+    {
+        return -1;
+    }
+    cursor_set(f, iCache);
+    f->cur_recno = pos % f->file->fHead.NrecPB;
+    memcpy(cur_key(*f), key, f->file->fHead.KeyLen);
+    set_data(f, f->cur_id, f->cur_recno, data);
+    cur_head(*f)->statusFlags = ISAM_VALID;
+    cur_head(*f)->previous = last;
+    cur_head(*f)->next = 0;
+    if (write_cache_block(f->file, iCache))
+    {
+        return -1;
+    }
+    /* Link the previous record (normally still in the cache) */
+    iCache = isam_cache_block(f, last / f->file->fHead.NrecPB);
+    if (iCache < 0)
+    {
+        return -1;
+    }
+    head(*f, iCache, last % f->file->fHead.NrecPB)->next = pos;
+    if (write_cache_block(f->file, iCache))
+    {
+        return -1;
+    }
+    if ((f->cur_recno == 0) && addIndexKey(f->file, key, block_no))
+    {
+        return -1;
+    }
+    memcpy(f->file->maxKey, key, f->file->fHead.KeyLen);
+    f->file->fHead.MaxKeyRec = pos;
+    f->file->fHead.Nrecords++;
+    bloom_add(f->file, key);
+    return writeHead(f->file);
+}
+
+/* isam_bulkLoad fills a new file from records in key order. It places
+   the records like isam_load does, but builds the blocks in a buffer of
+   ISAM_LOAD_BLOCKS blocks that is written with a single write when it
+   is full, bypassing the cache. The next pointer of each record is set
+   to the place of the following record before that is known, and is
+   cleared again for the last record. */
+
+#define ISAM_LOAD_BLOCKS    (256)
+
+static unsigned long load_nextPos(isamFile *f, unsigned long pos,
+        unsigned long perBlock)
+{
+    if (pos % f->fHead.NrecPB + 1 < perBlock)
+    {
+        return pos + 1;
+    }
+    return (pos / f->fHead.NrecPB + 1) * f->fHead.NrecPB;
+}
+
+static int load_writeBuffer(isamFile *f, const char *buf, unsigned long first,
+        unsigned long nBlocks)
+{
+    size_t length = nBlocks * f->blockSize;
+
+    if (pwrite(f->fileId, buf, length, f->fHead.DataStart +
+                first * f->blockSize) != (ssize_t) length)
+    {
+        isam_error = ISAM_WRITE_FAIL;
+        return -1;
+    }
+    ISAM_COUNT(disk_writes_global);
+    ISAM_STAT(f, diskWrites, 1);
+    ISAM_STAT(f, bytesWritten, length);
+    return 0;
+}
+
+static long bulk_load(const char *name, unsigned long KeyLen,
+        unsigned long DataLen, unsigned long NrecPB, unsigned long Nblocks,
+        int options, isam_loadNext next, void *context)
+{
+    isamPtr f;
+    char   *buf, *key, *rec;
+    void   *data;
+    unsigned long perBlock, pos, last = 0, first = 0, block_no;
+    long    n = 0;
+    int     rv, iCache;
+    enum isam_error error;
+
+    f = isam_createWithOptions(name, KeyLen, DataLen, NrecPB, Nblocks,
+            ISAM_DEFAULT_CACHE_SIZE, options);
+    if (!f)
+    {
+        return -1;
+    }
+    rv = markUnflushed(f->file);
+    perBlock = (NrecPB > 1) ? NrecPB - 1 : 1;
+    buf = calloc(ISAM_LOAD_BLOCKS, f->file->blockSize);
+    key = malloc(KeyLen);
+    data = malloc(DataLen);
+    assert(buf != NULL && key != NULL && data != NULL);
+    /* The buffer starts with block 0, which holds the dummy first record.
+       The cache is emptied, as the blocks in the file change under it */
+    memcpy(buf, f->file->cache[0], f->file->blockSize);
+    for (iCache = 0; iCache < f->file->cacheSize; iCache++)
+    {
+        cache_release(f->file, iCache);
+    }
+    ((recordHead *) buf)->next = load_nextPos(f->file, 0, perBlock);
+    while (!rv)
+    {
+        memset(key, 0, KeyLen);
+        if (next(context, key, data))
+        {
+            break;
+        }
+        if (key_compare(key, f->file->maxKey, KeyLen) <= 0)
+        {
+            isam_error = key[0] ? ISAM_NOT_SORTED : ISAM_NULL_KEY;
+            rv = -1;
+            break;
+        }
+        pos = load_nextPos(f->file, last, perBlock);
+        block_no = pos / NrecPB;
+        if (block_no >= first + ISAM_LOAD_BLOCKS)
+        {
+            if (load_writeBuffer(f->file, buf, first, ISAM_LOAD_BLOCKS))
+            {
+                rv = -1;
+                break;
+            }
+            first += ISAM_LOAD_BLOCKS;
+            memset(buf, 0, ISAM_LOAD_BLOCKS * f->file->blockSize);
+        }
+        rec = buf + (block_no - first) * f->file->blockSize +
+            (pos % NrecPB) * f->file->fHead.RecordLen;
+        ((recordHead *) rec)->next = load_nextPos(f->file, pos, perBlock);
+        ((recordHead *) rec)->previous = last;
+        ((recordHead *) rec)->statusFlags = ISAM_VALID;
+        memcpy(rec + sizeof(recordHead), key, KeyLen);
+        memcpy(rec + sizeof(recordHead) + KeyLen, data, DataLen);
+        if ((pos % NrecPB == 0) && addIndexKey(f->file, key, block_no))
+        {
+            rv = -1;
+            break;
+        }
+        memcpy(f->file->maxKey, key, KeyLen);
+        last = pos;
+        n++;
+    }
+    if (!rv)
+    {
+        /* The last record is still in the buffer */
+        block_no = last / NrecPB;
+        ((recordHead *) (buf + (block_no - first) * f->file->blockSize +
+                         (last % NrecPB) * f->file->fHead.RecordLen))->next = 0;
+        rv = load_writeBuffer(f->file, buf, first, block_no - first + 1);
+        f->file->fHead.CurBlocks = f->file->diskBlocks = block_no + 1;
+        f->file->fHead.Nrecords = n;
+        f->file->fHead.MaxKeyRec = last;
+        f->file->indexDirty = 1;
+        f->file->headDirty = 1;
+    }
+    /* isam_close writes the index and the header */
+    error = isam_error;
+    if (isam_close(f))
+    {
+        rv = -1;
+    }
+    else if (rv)
+    {
+        isam_error = error;
+    }
+    if (rv)
+    {
+        unlink(name);
+    }
+    free(buf);
+    free(key);
+    free(data);
+    return rv ? -1 : n;
+}
+
+long isam_bulkLoad(const char *name, unsigned long KeyLen,
+        unsigned long DataLen, unsigned long NrecPB, unsigned long Nblocks,
+        isam_loadNext next, void *context)
+{
+    return bulk_load(name, KeyLen, DataLen, NrecPB, Nblocks, 0, next,
+            context);
+}
+
+static int sec_rebuildAll(const char *name,
+        struct isamSecondary *secondary);
+
+/* Rewrite a file in key order; see isam.h */
+int isam_reorganize(const char *name, int fillPercent,
+        struct ISAM_FILE_STATS *before, struct ISAM_FILE_STATS *after)
+{
+    isamPtr src, dst;
+    unsigned long perBlock, Nblocks, reserve;
+    char   *newName, *key, *idxName, *newIdxName, *heapName, *newHeapName;
+    void   *data;
+    int     rv = 0;
+    enum isam_error error;
+    struct isamSecondary secondary[ISAM_MAX_SECONDARY];
+
+    src = isam_open(name, 1);
+    if (!src)
+    {
+        return -1;
+    }
+    memcpy(secondary, src->file->secondary, sizeof(secondary));
+    if (before && isam_fileStats(src, before))
+    {
+        isam_close(src);
+        return -1;
+    }
+    /* By default, fill blocks as isam_create expects them to be filled:
+       one slot per block remains free for inserts */
+    perBlock = src->file->fHead.NrecPB - 1;
+    if (fillPercent > 0)
+    {
+        perBlock = (src->file->fHead.NrecPB * fillPercent + 99) / 100;
+    }
+    if (perBlock < 1)
+    {
+        perBlock = 1;
+    }
+    if (perBlock > src->file->fHead.NrecPB)
+    {
+        perBlock = src->file->fHead.NrecPB;
+    }
+    /* Pages are filled by size as well: by default leaving room for one
+       record with a key of the full length */
+    reserve = PageMinRecord(PageData(src->file->fHead.DataLen,
+                src->file->fHead.FileState)) + src->file->fHead.KeyLen;
+    if (fillPercent > 0)
+    {
+        reserve = (fillPercent < 100) ?
+            src->file->pageSize * (100 - fillPercent) / 100 : 0;
+    }
+    /* Enough regular blocks for all records plus the dummy first record,
+       and never fewer than before */
+    Nblocks = (src->file->fHead.Nrecords + perBlock) / perBlock;
+    if (Nblocks < src->file->fHead.Nblocks)
+    {
+        Nblocks = src->file->fHead.Nblocks;
+    }
+
+    newName = malloc(strlen(name) + sizeof(".reorg"));
+    key = malloc(src->file->fHead.KeyLen);
+    data = malloc(src->file->fHead.DataLen);
+    assert(newName != NULL && key != NULL && data != NULL);
+    strcpy(newName, name);
+    strcat(newName, ".reorg");
+    dst = isam_createWithOptions(newName, src->file->fHead.KeyLen,
+            src->file->fHead.DataLen, src->file->fHead.NrecPB, Nblocks, src->file->cacheSize,
+            (src->file->bloom ? ISAM_CREATE_BLOOM : 0) |
+            (src->file->walFd >= 0 ? ISAM_CREATE_WAL : 0) |
+            ((src->file->fHead.FileState & ISAM_HAS_PAGES) ?
+             ISAM_CREATE_PAGES | ISAM_CREATE_SLOTS : 0) |
+            ((src->file->fHead.FileState & ISAM_HAS_VARLEN) ?
+             ISAM_CREATE_VARLEN : 0) |
+            ((src->file->fHead.FileState & ISAM_HAS_CHECKSUMS) ?
+             ISAM_CREATE_CHECKSUMS : 0) |
+            ISAM_CREATE_FANOUT(index_fanout(src->file->index)));
+    if (!dst)
+    {
+        rv = -1;
+    }
+    /* Copy the records in key order; the source is read sequentially */
+    if (!rv && isam_setKey(src, ""))
+    {
+        rv = -1;
+    }
+    while (!rv && !isam_readNext(src, key, data))
+    {
+        dst->dataLength = src->dataLength;
+        rv = isam_load(dst, key, data, perBlock, reserve);
+    }
+    if (!rv && isam_error != ISAM_EOF)
+    {
+        rv = -1;
+    }
+    if (!rv && after && isam_fileStats(dst, after))
+    {
+        rv = -1;
+    }
+    error = isam_error;
+    if (dst && isam_close(dst))
+    {
+        rv = -1;
+        error = isam_error;
+    }
+    isam_close(src);
+    isam_error = error;
+    /* Only replace the original when the copy is complete. An index in a
+       companion file goes along; that of the original is outdated. So
+       does the heap, which now only holds values still in use */
+    if (!rv && rename(newName, name))
+    {
+        isam_error = ISAM_WRITE_FAIL;
+        rv = -1;
+    }
+    if (!rv)
+    {
+        idxName = idx_name(name);
+        newIdxName = idx_name(newName);
+        if (rename(newIdxName, idxName))
+        {
+            unlink(idxName);
+        }
+        free(idxName);
+        free(newIdxName);
+        heapName = heap_name(name);
+        newHeapName = heap_name(newName);
+        if (rename(newHeapName, heapName))
+        {
+            unlink(heapName);
+        }
+        free(heapName);
+        free(newHeapName);
+    }
+    if (rv && dst)
+    {
+        unlink(newName);
+        newHeapName = heap_name(newName);
+        unlink(newHeapName);
+        free(newHeapName);
+    }
+    /* The records have moved, so the secondary indexes are rebuilt */
+    if (!rv)
+    {
+        rv = sec_rebuildAll(name, secondary);
+    }
+    if (!rv)
+    {
+        isam_error = ISAM_NO_ERROR;
+    }
+    free(newName);
+    free(key);
+    free(data);
+    return rv;
+}
+
+/* Recompute all Bloom filters, walking the chain of records in the file */
+static int do_rebuildBloom(isamPtr isam_ident)
+{
+    unsigned long rec = 0;
+    long    range;
+    int     iCache, rec_no;
 
-    /* First find block number from index */
-    block_no = index_keyToBlock(isam_ident->index, key);
-    rec_no = 0;
-    /* Now make sure the block is in cache */
-    iCache = isam_cache_block(isam_ident, block_no);
+    if (testPtr(isam_ident))
+    {
+        return -1;
+    }
+    if (!isam_ident->file->bloom)
+    {
+        isam_error = ISAM_NO_BLOOM;
+        return -1;
+    }
+    memset(isam_ident->file->bloom, 0,
+            isam_ident->file->fHead.Nblocks * isam_ident->file->bloomBytes);
+    memset(isam_ident->file->bloomDeletes, 0, isam_ident->file->fHead.Nblocks);
+    isam_ident->file->bloomDirty = 1;
+    do
+    {
+        iCache = isam_cache_block(isam_ident, rec / isam_ident->file->fHead.NrecPB);
+        if (iCache < 0)
+        {
+            return -1;
+        }
+        rec_no = rec % isam_ident->file->fHead.NrecPB;
+        if ((head(*isam_ident, iCache, rec_no)->statusFlags & ISAM_VALID) &&
+                (range = index_keyToBlock(isam_ident->file->index,
+                    key(*isam_ident, iCache, rec_no))) >= 0 &&
+                (unsigned long) range < isam_ident->file->fHead.Nblocks)
+        {
+            bloom_set(isam_ident->file, range, key(*isam_ident, iCache, rec_no));
+        }
+        rec = head(*isam_ident, iCache, rec_no)->next;
+    } while (rec);
+    return 0;
+}
+
+/* Secondary indexes (see isam_addSecondary). The companion file of
+   index which has the name of the file with ".sec" and which appended */
+
+static char *sec_name(isamFile *f, int which)
+{
+    char   *name = malloc(strlen(f->name) + sizeof(".sec") + 4);
+
+    assert(name != NULL);
+    sprintf(name, "%s.sec%d", f->name, which);
+    return name;
+}
+
+/* The key length of the companion file of secondary index s */
+
+static unsigned long sec_keyLength(isamFile *f, struct isamSecondary *s)
+{
+    return (s->string ? s->length : 2 * s->length) + 1 + f->fHead.KeyLen;
+}
+
+/* Store the indexed part of field in part, and return its length. A
+   string ends at its first zero byte; raw bytes are written as two hex
+   digits each, which keeps their order but avoids zero bytes (that
+   would end the key) */
+
+static unsigned long sec_part(struct isamSecondary *s, const char *field,
+        char *part)
+{
+    static const char hex[] = "0123456789abcdef";
+    unsigned long i;
+
+    if (s->string)
+    {
+        for (i = 0; i < s->length && field[i]; i++)
+        {
+            part[i] = field[i];
+        }
+        return i;
+    }
+    for (i = 0; i < s->length; i++)
+    {
+        part[2 * i] = hex[(unsigned char) field[i] >> 4];
+        part[2 * i + 1] = hex[(unsigned char) field[i] & 15];
+    }
+    return 2 * s->length;
+}
+
+/* Build the key of the entry in secondary index s for the record with
+   the given key and data */
+
+static void sec_key(isamFile *f, struct isamSecondary *s, const char *key,
+        const char *data, char *secKey)
+{
+    unsigned long n;
+
+    memset(secKey, 0, sec_keyLength(f, s));
+    n = sec_part(s, data + s->offset, secKey);
+    secKey[n] = 1;
+    strncpy(secKey + n + 1, key, f->fHead.KeyLen);
+}
+
+/* Add the entry for a record, the current record of f, to secondary
+   index s */
+
+static int sec_addEntry(isamPtr f, struct isamSecondary *s, const char *key,
+        const void *data)
+{
+    char    secKey[ISAM_MAX_SECONDARY_KEY];
+    unsigned long rec = cur_rec(*f);
+
+    sec_key(f->file, s, key, data, secKey);
+    return isam_writeNew(s->base, secKey, &rec);
+}
+
+/* Remove the entry for a record from secondary index s. An entry that is
+   missing (after an unclean shutdown) is no error. */
+
+static int sec_removeEntry(isamPtr f, struct isamSecondary *s,
+        const char *key, const void *data)
+{
+    char    secKey[ISAM_MAX_SECONDARY_KEY];
+    unsigned long rec;
+
+    sec_key(f->file, s, key, data, secKey);
+    if ((isam_readByKey(s->base, secKey, &rec) ||
+                isam_delete(s->base, secKey, &rec)) &&
+            isam_error != ISAM_NO_SUCH_KEY)
+    {
+        return -1;
+    }
+    isam_error = ISAM_NO_ERROR;
+    return 0;
+}
+
+/* Add the entries for a new record, the current record of f, to the
+   secondary indexes */
+
+static int sec_add(isamPtr f, const char *key, const void *data)
+{
+    int     i;
+
+    for (i = 0; i < ISAM_MAX_SECONDARY; i++)
+    {
+        if (f->file->secondary[i].base &&
+                sec_addEntry(f, f->file->secondary + i, key, data))
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Remove the entries for a deleted record from the secondary indexes */
+
+static int sec_remove(isamPtr f, const char *key, const void *data)
+{
+    int     i;
+
+    for (i = 0; i < ISAM_MAX_SECONDARY; i++)
+    {
+        if (f->file->secondary[i].base &&
+                sec_removeEntry(f, f->file->secondary + i, key, data))
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Replace the entries for a record, the current record of f, of which the
+   data have changed in place; only the indexes on a part that differs
+   are affected */
+
+static int sec_update(isamPtr f, const char *key, const void *oldData,
+        const void *newData)
+{
+    struct isamSecondary *s;
+    int     i;
+
+    for (i = 0; i < ISAM_MAX_SECONDARY; i++)
+    {
+        s = f->file->secondary + i;
+        if (s->base && memcmp((const char *) oldData + s->offset,
+                    (const char *) newData + s->offset, s->length) &&
+                (sec_removeEntry(f, s, key, oldData) ||
+                 sec_addEntry(f, s, key, newData)))
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* A search through a secondary index: the entries with keys starting
+   with from (partLength bytes followed by a byte 1) are passed to
+   sec_found */
+
+struct secSearch {
+    isamPtr f;
+    struct isamSecondary *s;
+    const char *from;
+    unsigned long partLength;
+    char   *part;                       /* Part of a record found         */
+    isam_scanFunc fn;
+    void   *context;
+    long    n;                          /* Records passed to fn           */
+    int     failed;
+};
+
+/* Find the record of an entry: first at the record number stored in the
+   entry, where it normally still is, else by its key. Records that no
+   longer exist or no longer match (left behind by an unclean shutdown)
+   are skipped. */
+
+static int sec_found(void *context, const char *secKey, const void *secData,
+        unsigned long secLength)
+{
+    struct secSearch *q = (struct secSearch *) context;
+    isamPtr f = q->f;
+    unsigned long NrecPB = f->file->fHead.NrecPB;
+    unsigned long rec;
+    int     iCache = -1, rec_no = 0;
+
+    (void) secLength;
+    if (memcmp(secKey, q->from, q->partLength + 1))
+    {
+        return 0;
+    }
+    memcpy(&rec, secData, sizeof(rec));
+    strncpy(f->keyBuf, secKey + q->partLength + 1, f->file->fHead.KeyLen);
+    if (rec / NrecPB < f->file->fHead.CurBlocks)
+    {
+        if ((iCache = isam_cache_block(f, rec / NrecPB)) < 0)
+        {
+            q->failed = 1;
+            return 1;
+        }
+        rec_no = rec % NrecPB;
+        if (!(head(*f, iCache, rec_no)->statusFlags & ISAM_VALID) ||
+                key_compare(f->keyBuf, key(*f, iCache, rec_no),
+                    f->file->fHead.KeyLen))
+        {
+            iCache = -1;
+        }
+    }
     if (iCache < 0)
+    {
+        if (do_seekByKey(f, f->keyBuf))
+        {
+            q->failed = (isam_error != ISAM_NO_SUCH_KEY);
+            return q->failed;
+        }
+        iCache = f->cur_id;
+        rec_no = f->cur_recno;
+    }
+    if (sec_part(q->s, (char *) data(*f, iCache, rec_no) + q->s->offset,
+                q->part) != q->partLength ||
+            memcmp(q->part, q->from, q->partLength))
+    {
+        return 0;
+    }
+    q->n++;
+    return q->fn(q->context, key(*f, iCache, rec_no),
+            data(*f, iCache, rec_no),
+            data_length(f->file, data(*f, iCache, rec_no)));
+}
+
+/* Search secondary index which for value, through the cursor of f on
+   its companion file */
+
+static long do_readBySecondary(isamPtr isam_ident, int which,
+        const void *value, isam_scanFunc fn, void *context)
+{
+    char    from[ISAM_MAX_SECONDARY_KEY + 1];
+    char    to[ISAM_MAX_SECONDARY_KEY + 1];
+    char    part[ISAM_MAX_SECONDARY_KEY];
+    struct secSearch q;
+    isamFile *f;
+
+    if (testPtr(isam_ident))
     {
         return -1;
     }
-    /* First see if this is a deleted first record.
-       There are a lot of properties that we could check.
-       1. The first record must have been deleted (but it may still have a
-       smaller key)
-       2. The first record has the same key as the requested key (and as
-       maxKey).
-       3. The next pointer of the first record is zero (this appears to be
-       the most sensible test anyway). */
-    next = head((*isam_ident),iCache,rec_no)->next;
-    if (next == 0)
+    f = isam_ident->file;
+    if (which < 0 || which >= ISAM_MAX_SECONDARY || !f->secondary[which].base)
     {
-        /* I think this must be a deleted first record. It still may have
-           a smaller key than the new record.
-           This actually is a bit a doubtful case for append -
-           let it be for now */
-        if ((rv =strncmp(key, key((*isam_ident),iCache,rec_no), isam_ident->fHead.KeyLen)))
+        isam_error = ISAM_NO_SECONDARY;
+        return -1;
+    }
+    if (!isam_ident->secCursor[which] && !(isam_ident->secCursor[which] =
+                isam_openCursor(f->secondary[which].base)))
+    {
+        return -1;
+    }
+    q.f = isam_ident;
+    q.s = f->secondary + which;
+    q.from = from;
+    q.part = part;
+    q.fn = fn;
+    q.context = context;
+    q.n = 0;
+    q.failed = 0;
+    /* All entries for value lie from value + 1 up to value + 2 */
+    memset(from, 0, sizeof(from));
+    memset(to, 0, sizeof(to));
+    q.partLength = sec_part(q.s, value, from);
+    memcpy(to, from, q.partLength);
+    from[q.partLength] = 1;
+    to[q.partLength] = 2;
+    if (isam_scanRange(isam_ident->secCursor[which], from, to, sec_found,
+                &q) < 0 || q.failed)
+    {
+        return -1;
+    }
+    isam_error = ISAM_NO_ERROR;
+    return q.n;
+}
+
+/* Close secondary index which: the cursors on its companion file, and
+   the file itself. Called with the file lock held exclusively. */
+
+static int sec_close(isamFile *f, int which)
+{
+    isamPtr c;
+    int     rv;
+
+    if (!f->secondary[which].base)
+    {
+        return 0;
+    }
+    for (c = f->cursors; c; c = c->nextCursor)
+    {
+        if (c->secCursor[which])
         {
-            assert(rv > 0);
-            /* This now implies an otherwise normal append */
-        } else
+            isam_close(c->secCursor[which]);
+            c->secCursor[which] = NULL;
+        }
+    }
+    rv = isam_close(f->secondary[which].base);
+    f->secondary[which].base = NULL;
+    return rv;
+}
+
+static void sec_closeAll(isamFile *f)
+{
+    int     i;
+
+    for (i = 0; i < ISAM_MAX_SECONDARY; i++)
+    {
+        sec_close(f, i);
+    }
+}
+
+/* Write what has been modified in the companion files */
+
+static int sec_flush(isamFile *f, int doSync)
+{
+    int     i;
+
+    for (i = 0; i < ISAM_MAX_SECONDARY; i++)
+    {
+        if (f->secondary[i].base && isam_flush(f->secondary[i].base, doSync))
         {
-            /* Keys are indeed equal - but, have we checked anywhere else
-               if the key did not yet exist by chance? So let's check that
-               here. Next check maxKey for added security */
-            if (ISAM_VALID & head((*isam_ident),iCache,rec_no)->statusFlags)
-            {
-                isam_error = ISAM_RECORD_EXISTS;
-                return -1;
-            }
-            assert(0 == strncmp(key, isam_ident->maxKey,
-                        isam_ident->fHead.KeyLen));
-            /* Assert deleted state */
-            assert(ISAM_DELETED ==
-                    head((*isam_ident),iCache,rec_no)->statusFlags);
-            /* We only need to copy the data and mark the record as valid */
-            memcpy(data(*isam_ident, iCache, rec_no), data,
-                    isam_ident->fHead.DataLen);
-            head(*isam_ident, iCache, rec_no)->statusFlags = ISAM_VALID;
-            isam_ident->fHead.Nrecords++;
-            /* Now what do we write first? - writing the header twice is
-               extra work, but at least makes it easy to identify an
-               inconsistent file. Writing intentions would be even more
-               secure*/
-            isam_ident->fHead.FileState |= ISAM_STATE_UPDATING;
-            writeHead(isam_ident);
-            if (write_cache_block(isam_ident, iCache))
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* The entries of a secondary index being built: their keys (each
+   followed by a zero byte, so that they can be sorted with strcmp) and
+   the numbers of their records */
+
+struct secEntry {
+    char   *key;
+    unsigned long rec;
+};
+
+struct secLoad {
+    struct secEntry *entries;
+    size_t  n;
+    size_t  next;
+    unsigned long keyLength;
+};
+
+static int sec_compare(const void *a, const void *b)
+{
+    return strcmp(((const struct secEntry *) a)->key,
+            ((const struct secEntry *) b)->key);
+}
+
+static int sec_loadNext(void *context, char *key, void *data)
+{
+    struct secLoad *l = (struct secLoad *) context;
+
+    if (l->next >= l->n)
+    {
+        return 1;
+    }
+    memcpy(key, l->entries[l->next].key, l->keyLength);
+    memcpy(data, &(l->entries[l->next].rec), sizeof(unsigned long));
+    l->next++;
+    return 0;
+}
+
+/* (Re)build secondary index which of f from the records in the file: the
+   entries are collected following the chain of records, sorted, and
+   loaded into a new companion file with bulk_load. The companion file
+   gets blocks of about ISAM_SECONDARY_BLOCK bytes, and room for twice
+   as many entries as the file was made for or holds now. Called with
+   the file lock held exclusively. */
+
+static int sec_build(isamPtr f, int which, unsigned long offset,
+        unsigned long length, int string)
+{
+    isamFile *file = f->file;
+    struct isamSecondary *s = file->secondary + which;
+    struct isamSecondary def;
+    struct secLoad load;
+    char   *name, *keyMem = NULL;
+    unsigned long *recs = NULL;
+    unsigned long keyLength, recordLength, NrecPB, Nblocks, defWord;
+    unsigned long rec = 0;
+    size_t  size = 0, i;
+    int     iCache, rec_no, rv = 0;
+
+    def.base = NULL;
+    def.offset = offset;
+    def.length = length;
+    def.string = (string != 0);
+    keyLength = sec_keyLength(file, &def);
+    if (length == 0 || offset + length > file->fHead.DataLen ||
+            keyLength > ISAM_MAX_SECONDARY_KEY)
+    {
+        isam_error = ISAM_KEY_LEN;
+        return -1;
+    }
+    sec_close(file, which);
+    load.n = 0;
+    do
+    {
+        iCache = isam_cache_block(f, rec / file->fHead.NrecPB);
+        if (iCache < 0)
+        {
+            rv = -1;
+            break;
+        }
+        rec_no = rec % file->fHead.NrecPB;
+        if (head(*f, iCache, rec_no)->statusFlags & ISAM_VALID)
+        {
+            if (load.n == size)
             {
-                return -1;
+                size = 2 * size + 1024;
+                keyMem = realloc(keyMem, size * (keyLength + 1));
+                recs = realloc(recs, size * sizeof(unsigned long));
+                assert(keyMem != NULL && recs != NULL);
             }
-            isam_ident->fHead.FileState &= ~ISAM_STATE_UPDATING;
-            return writeHead(isam_ident);
+            sec_key(file, &def, key(*f, iCache, rec_no),
+                    data(*f, iCache, rec_no),
+                    keyMem + load.n * (keyLength + 1));
+            keyMem[load.n * (keyLength + 1) + keyLength] = 0;
+            recs[load.n++] = rec;
         }
+        rec = head(*f, iCache, rec_no)->next;
+    } while (rec);
+
+    load.entries = malloc(load.n * sizeof(struct secEntry) + 1);
+    assert(load.entries != NULL);
+    for (i = 0; i < load.n; i++)
+    {
+        load.entries[i].key = keyMem + i * (keyLength + 1);
+        load.entries[i].rec = recs[i];
     }
-    /* So there is a next, follow it to the bitter end */
-    while (next)
+    qsort(load.entries, load.n, sizeof(struct secEntry), sec_compare);
+    load.next = 0;
+    load.keyLength = keyLength;
+
+    recordLength = (keyLength + sizeof(unsigned long) + sizeof(recordHead) +
+            7) / 8 * 8;
+    NrecPB = ISAM_SECONDARY_BLOCK / recordLength;
+    if (NrecPB < 4)
     {
-        block_no = next / isam_ident->fHead.NrecPB;
-        rec_no = next % isam_ident->fHead.NrecPB;
-        iCache = isam_cache_block(isam_ident, block_no);
-        if (iCache < 0)
+        NrecPB = 4;
+    }
+    Nblocks = file->fHead.Nblocks * (file->fHead.NrecPB - 1);
+    if (Nblocks < load.n)
+    {
+        Nblocks = load.n;
+    }
+    Nblocks = 2 * Nblocks / (NrecPB - 1) + 1;
+
+    name = sec_name(file, which);
+    unlink(name);
+    if (!rv && bulk_load(name, keyLength, sizeof(unsigned long), NrecPB,
+                Nblocks, ISAM_CREATE_LONG_KEYS, sec_loadNext, &load) < 0)
+    {
+        rv = -1;
+    }
+    if (!rv && !(s->base = isam_open(name, 1)))
+    {
+        rv = -1;
+    }
+    if (!rv)
+    {
+        /* Record the definition in the dummy first record, which is the
+           current record of the new cursor */
+        s->offset = def.offset;
+        s->length = def.length;
+        s->string = def.string;
+        defWord = SecondaryDef(s);
+        memcpy(cur_data(*(s->base)), &defWord, sizeof(defWord));
+        if (write_cache_block(s->base->file, s->base->cur_id) ||
+                isam_flush(s->base, 0))
         {
-            return -1;
+            rv = -1;
         }
-        next = head((*isam_ident),iCache,rec_no)->next;
     }
-    /* Now we should have a record with a smaller key, equal to
-       maxKey */
-    rv = strncmp(key, key((*isam_ident),iCache,rec_no),
-            isam_ident->fHead.KeyLen);
-    if (rv <= 0)
+    if (rv && s->base)
+    {
+        isam_close(s->base);
+        s->base = NULL;
+        unlink(name);
+    }
+    if (!rv)
+    {
+        /* The header on disk must show the flag right away, so that
+           the index is rebuilt if the file is not closed properly */
+        file->fHead.FileState |= ISAM_HAS_SECONDARY;
+        file->fHead.version = fileVersion(file->fHead.FileState);
+        file->unflushed = 0;
+        rv = writeHead(file);
+    }
+    free(name);
+    free(keyMem);
+    free(recs);
+    free(load.entries);
+    return rv;
+}
+
+/* Open the companion files of the secondary indexes of a file being
+   opened, and rebuild them if asked to */
+
+static int sec_open(isamPtr f, int rebuild)
+{
+    isamFile *file = f->file;
+    struct isamSecondary *s;
+    struct stat buf;
+    unsigned long defWord;
+    char   *name;
+    int     i, found = 0;
+
+    for (i = 0; i < ISAM_MAX_SECONDARY; i++)
     {
-        unsigned int i;
-        dumpMaxKey(isam_ident);
-        fprintf(stderr, "key = '%s', found key ='", key);
-        for (i = 0; i <= isam_ident->fHead.KeyLen; i++)
+        s = file->secondary + i;
+        name = sec_name(file, i);
+        if (stat(name, &buf))
         {
-            fprintf(stderr, "%c", key((*isam_ident),iCache,rec_no)[i]);
+            free(name);
+            continue;
         }
-        fprintf(stderr, "'\n");
-    }
-    assert(rv > 0);
-    new_block_no = block_no;
-    nCache = iCache;
-    new_rec_no = free_record_in_block(isam_ident, iCache);
-    while (new_rec_no < 0 || new_rec_no >= (int) isam_ident->fHead.NrecPB)
-    {
-        /* We'll leave the last slot free for inserts */
-        new_block_no ++;
-        if (new_block_no >= (int) isam_ident->fHead.Nblocks)
+        s->base = isam_open(name, 1);
+        free(name);
+        if (!s->base)
         {
-            /* Insertion in an overflow block obeys slightly different
-               rules - e.g. we do not add to the index, and we do not
-               leave a free slot */
-            break;
+            return -1;
         }
-        nCache = isam_cache_block(isam_ident, new_block_no);
-        if (nCache < 0)
+        memcpy(&defWord, cur_data(*(s->base)), sizeof(defWord));
+        s->offset = defWord >> 16;
+        s->length = (defWord >> 1) & 0x7fff;
+        s->string = defWord & 1;
+        found++;
+        if (rebuild && sec_build(f, i, s->offset, s->length, s->string))
         {
             return -1;
         }
-        new_rec_no = free_record_in_block(isam_ident, nCache);
     }
-    while (new_rec_no < 0)
+    if (!found)
     {
-        new_block_no ++;
-        nCache = isam_cache_block(isam_ident, new_block_no);
-        if (nCache < 0)
+        file->fHead.FileState &= ~ISAM_HAS_SECONDARY;
+        file->fHead.version = fileVersion(file->fHead.FileState);
+        file->headDirty = 1;
+    }
+    return 0;
+}
+
+/* Rebuild the secondary indexes of file name (after isam_reorganize has
+   moved its records) that are in use in secondary. The companion files
+   themselves have been closed already, so only their definitions are
+   used. */
+
+static int sec_rebuildAll(const char *name, struct isamSecondary *secondary)
+{
+    isamPtr f;
+    int     i, rv = 0;
+
+    for (i = 0; i < ISAM_MAX_SECONDARY && !secondary[i].base; i++)
+        ;
+    if (i == ISAM_MAX_SECONDARY)
+    {
+        return 0;
+    }
+    f = isam_open(name, 1);
+    if (!f)
+    {
+        return -1;
+    }
+    lock_exclusive(f->file);
+    for (; i < ISAM_MAX_SECONDARY && !rv; i++)
+    {
+        if (secondary[i].base)
         {
-            return -1;
+            rv = sec_build(f, i, secondary[i].offset, secondary[i].length,
+                    secondary[i].string);
         }
-        new_rec_no = free_record_in_block(isam_ident, nCache);
     }
-    memcpy(isam_ident->maxKey, key, isam_ident->fHead.KeyLen);
-    isam_ident->cur_id = nCache;
-    isam_ident->cur_recno = new_rec_no;
-    memcpy(cur_key(*isam_ident), key, isam_ident->fHead.KeyLen);
-    memcpy(cur_data(*isam_ident), data, isam_ident->fHead.DataLen);
-    cur_head(*isam_ident)->statusFlags = ISAM_VALID;
-    cur_head(*isam_ident)->previous = block_no * isam_ident->fHead.NrecPB +
-        rec_no;
-    cur_head(*isam_ident)->next = 0;
-    /* Beware - the previous record may have been deleted from the
-       cache, but re-reading it may remove the current record.
-       We'll first update the file header */
-    isam_ident->fHead.FileState |= ISAM_STATE_UPDATING;
-    isam_ident->fHead.Nrecords++;
-    isam_ident->fHead.MaxKeyRec = new_rec_no +
-        new_block_no * isam_ident->fHead.NrecPB;
-    writeHead(isam_ident);
-    /* We'll now update the index - if needed and as long as the
-       file pointer is correct */
-    if (new_rec_no == 0 && new_block_no < (int) isam_ident->fHead.Nblocks) {
-        index_addKey(isam_ident->index, key, new_block_no);
-        index_writeToDisk(isam_ident->index, isam_ident->fileId);
+    pthread_rwlock_unlock(&(f->file->lock));
+    if (isam_close(f))
+    {
+        rv = -1;
     }
-    if (new_block_no == block_no) {
-        /* Update the "next" pointer here and now */
-        assert(iCache == nCache);
-        head(*isam_ident, iCache, rec_no)->next =
-            isam_ident->fHead.MaxKeyRec;
+    return rv;
+}
+
+/* The time of a call is measured with a monotonic clock, in ns. Reading
+   the clock costs about as much as a cached isam_readNext, so only one
+   in ISAM_STATS_SAMPLE calls per cursor is timed */
+
+#define ISAM_STATS_SAMPLE   (8)
+
+static unsigned long long stats_now(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+/* The start time of a call of routine op, or 0 if it is not timed */
+
+static unsigned long long stats_start(isamPtr f, enum isam_op op)
+{
+    return (f->stats.op[op].calls % ISAM_STATS_SAMPLE) ? 0 : stats_now();
+}
+
+/* Record a call of routine op that started at start and returned rv */
+
+static void stats_op(isamPtr f, enum isam_op op, unsigned long long start,
+        int rv)
+{
+    unsigned long long ns;
+    int     bucket = 0;
+
+    ISAM_STAT(f, op[op].calls, 1);
+    if (rv)
+    {
+        ISAM_STAT(f, op[op].errors, 1);
     }
-    if (write_cache_block(isam_ident, nCache)) {
-        return -1;
+    if (!start)
+    {
+        return;
     }
-    if (new_block_no != block_no) {
-        iCache = isam_cache_block(isam_ident, block_no);
-        if (iCache < 0) {
-            return -1;
+    ns = stats_now() - start;
+    while (bucket < ISAM_LATENCY_BUCKETS - 1 && (ns >> (bucket + 1)))
+    {
+        bucket++;
+    }
+    ISAM_STAT(f, op[op].timed, 1);
+    ISAM_STAT(f, op[op].nanoseconds, ns);
+    ISAM_STAT(f, op[op].latency[bucket], 1);
+}
+
+/* End the transaction of a modifying routine that returned rv, release
+   the file lock and wait until the log holds the transaction */
+
+static int wal_finish(isamPtr f, int rv)
+{
+    isamFile *file = f->file;
+    unsigned long long lsn;
+
+    lsn = wal_commit(file, 0);
+    if (lsn && file->walEnd - file->walFileBase > ISAM_WAL_CHECKPOINT)
+    {
+        /* This also writes the transaction */
+        if (do_flush(f, 1))
+        {
+            rv = -1;
         }
-        head(*isam_ident, iCache, rec_no)->next =
-            isam_ident->fHead.MaxKeyRec;
+        lsn = 0;
+    }
+    pthread_rwlock_unlock(&(file->lock));
+    if (lsn && wal_sync(file, lsn))
+    {
+        rv = -1;
+    }
+    return rv;
+}
 
-        if (write_cache_block(isam_ident, iCache)) {
-            return -1;
+/* The entry points below take the file lock around the routines above:
+   shared for routines that only read, exclusive for routines that may
+   modify the file or the in-memory administration beyond the cache.
+   Those that are counted in the statistics also measure their time. */
+
+/* The length of a value given without one: in a file with
+   ISAM_HAS_VARLEN, the trailing zero bytes of the data field are not
+   stored (a read pads the value with zeros again) */
+
+static unsigned long data_trim(isamFile *f, const void *data)
+{
+    const char *d = data;
+    unsigned long length = f->fHead.DataLen;
+
+    if (f->fHead.FileState & ISAM_HAS_VARLEN)
+    {
+        while (length > 0 && !d[length - 1])
+        {
+            length--;
         }
     }
-    isam_ident->fHead.FileState &= ~ISAM_STATE_UPDATING;
-    return writeHead(isam_ident);
+    return length;
 }
 
-int isam_writeNew(isamPtr isam_ident, const char *key, const void *data) {
-    int block_no;
-    int rec_no;
-    int new_block_no, new_rec_no;
-    int prev_block_no, prev_rec_no;
-    unsigned long next, prev;
-    int iCache, nCache, pCache;
-    int rv;
+/* A value of the given length, padded with zeros to DataLen (in dataBuf
+   of the cursor) if it is shorter, or NULL if it is too long */
 
-    if (testPtr(isam_ident)) {
-        return -1;
+static const void *data_pad(isamPtr isam_ident, const void *data,
+        unsigned long length)
+{
+    unsigned long DataLen = isam_ident->file->fHead.DataLen;
+
+    if (length > DataLen)
+    {
+        isam_error = ISAM_DATA_LENGTH;
+        return NULL;
     }
-    if (!key[0]) {
-        isam_error = ISAM_NULL_KEY;
-        return -1;
+    isam_ident->dataLength = length;
+    if (length == DataLen)
+    {
+        return data;
     }
+    memcpy(isam_ident->dataBuf, data, length);
+    memset(isam_ident->dataBuf + length, 0, DataLen - length);
+    return isam_ident->dataBuf;
+}
+
+int isam_flush(isamPtr isam_ident, int doSync)
+{
+    int rv;
 
-    rv = strncmp(key, isam_ident->maxKey, isam_ident->fHead.KeyLen);
-    if (rv >= 0) {
-        return isam_append(isam_ident, key, data);
+    if (testNotSnapshot(isam_ident))
+    {
+        return -1;
     }
-    /* Now look for the record with the highest key less than key
-       The successor will be the one with the lowest greater than...
-       Beware of equal keys, unless for deleted records. We might
-       be tempted to use setkey, but setkey selects the last valid
-       record - and we are not interested in that now. Copy some code,
-       though. */
+    lock_exclusive(isam_ident->file);
+    rv = do_flush(isam_ident, doSync);
+    pthread_rwlock_unlock(&(isam_ident->file->lock));
+    return rv;
+}
 
-    block_no = index_keyToBlock(isam_ident->index, key);
-    rec_no = 0;
-    /* Now make sure the block is in cache */
-    iCache = isam_cache_block(isam_ident, block_no);
+int isam_setKey(isamPtr isam_ident, const char *key)
+{
+    int rv;
+    unsigned long long start;
 
-    if (iCache < 0) {
+    if (testPtr(isam_ident))
+    {
         return -1;
     }
-    next = block_no * isam_ident->fHead.NrecPB;
-    while ((rv = strncmp(key, key((*isam_ident),iCache,rec_no),
-                    isam_ident->fHead.KeyLen)) > 0) {
-        next = head((*isam_ident),iCache,rec_no)->next;
-        assert(next);
-        block_no = next / isam_ident->fHead.NrecPB;
-        rec_no = next % isam_ident->fHead.NrecPB;
-        iCache = isam_cache_block(isam_ident, block_no);
+    start = stats_start(isam_ident, ISAM_OP_SETKEY);
+    pthread_rwlock_rdlock(&(isam_ident->file->lock));
+    rv = do_setKey(isam_ident, key);
+    pthread_rwlock_unlock(&(isam_ident->file->lock));
+    stats_op(isam_ident, ISAM_OP_SETKEY, start, rv);
+    return rv;
+}
 
-        if (iCache < 0) {
-            return -1;
-        }
-    }
-    /* As we (should have) avoided the last record by going to append
-       when needed - and by doing this "assert(next)" stuff, we can
-       now proceed on the assumption that the record found really
-       has an equal or larger key */
-    /* Is the key equal ? */
-    if (rv == 0) {
-        if (head((*isam_ident),iCache,rec_no)->statusFlags & ISAM_DELETED) {
-            /* Should be simple and OK */
-            /* We only need to copy the data and mark the record as valid */
-            memcpy(data(*isam_ident, iCache, rec_no), data,
-                    isam_ident->fHead.DataLen);
-            head(*isam_ident, iCache, rec_no)->statusFlags = ISAM_VALID;
-            isam_ident->fHead.Nrecords++;
-            /* No what do we write first? - writing the header twice is
-               extra work, but at least makes it easy to identify an
-               inconsistent file. Writing intentions would be even more
-               secure*/
-            isam_ident->fHead.FileState |= ISAM_STATE_UPDATING;
-            writeHead(isam_ident);
-            if (write_cache_block(isam_ident, iCache))
-            {
-                return -1;
-            }
-            isam_ident->fHead.FileState &= ~ISAM_STATE_UPDATING;
-            isam_ident->cur_id = iCache;
-            isam_ident->cur_recno = rec_no;
-            return writeHead(isam_ident);
-        } else {
-            /* Someone is trying to update a record with isam_writeNew,
-               we are not going to allow that */
-            isam_error = ISAM_RECORD_EXISTS;
-            return -1;
-        }
-    }
-    /* So, now we know that the key of the record pointed to by "next" is
-       larger, and its predecessor must be smaller (possibly the empty key
-       "")
-       We first look for the previous record (bearing in mind that we may
-       lose the current in doing so), then look for a free slot from
-       that point forward. Here we have the choice to only use last slots,
-       or any free slot. Let's keep it simple....*/
-    prev = head(*isam_ident, iCache, rec_no)->previous;
-    prev_block_no = prev / isam_ident->fHead.NrecPB;
-    prev_rec_no = prev % isam_ident->fHead.NrecPB;
-    pCache = isam_cache_block(isam_ident, prev_block_no);
-    if (pCache < 0)
+int isam_readNext(isamPtr isam_ident, char *key, void *data)
+{
+    int rv;
+    unsigned long long start;
+
+    if (testPtr(isam_ident))
     {
         return -1;
     }
-    nCache = pCache;
-    new_block_no = prev_block_no;
-    new_rec_no = free_record_in_block(isam_ident, nCache);
-    if (new_rec_no < 0)
+    start = stats_start(isam_ident, ISAM_OP_READNEXT);
+    pthread_rwlock_rdlock(&(isam_ident->file->lock));
+    rv = do_readNext(isam_ident, key, data);
+    pthread_rwlock_unlock(&(isam_ident->file->lock));
+    stats_op(isam_ident, ISAM_OP_READNEXT, start, rv);
+    return rv;
+}
+
+int isam_readPrev(isamPtr isam_ident, char *key, void *data)
+{
+    int rv;
+    unsigned long long start;
+
+    if (testPtr(isam_ident))
     {
-        new_block_no = isam_ident->fHead.Nblocks - 1;
-        while (new_rec_no < 0)
-        {
-            new_block_no ++;
-            nCache = isam_cache_block(isam_ident, new_block_no);
-            if (nCache < 0)
-            {
-                return -1;
-            }
-            new_rec_no = free_record_in_block(isam_ident, nCache);
-        }
-    }
-    /* Set new record as current (isam_readPrev should allow you to re-read it)
-       and store all necessary information (key, data, prev and next pointers
-       and set to VALID */
-    isam_ident->cur_id = nCache;
-    isam_ident->cur_recno = new_rec_no;
-    memcpy(cur_key(*isam_ident), key, isam_ident->fHead.KeyLen);
-    memcpy(cur_data(*isam_ident), data, isam_ident->fHead.DataLen);
-    cur_head(*isam_ident)->statusFlags = ISAM_VALID;
-    cur_head(*isam_ident)->previous = prev;
-    cur_head(*isam_ident)->next = next;
-    /* Update file header and prepare for writing. */
-    isam_ident->fHead.Nrecords++;
-    isam_ident->fHead.FileState |= ISAM_STATE_UPDATING;
-    writeHead(isam_ident);
-    /* Now we have three records that may or may not lie in the same block.
-       We'll not explore all possibilities, but check at least this:
-       prev_block_no == new_block_no
-       prev_block_no == new_block_no && new_block_no == block_no */
-    if (prev_block_no == new_block_no) {
-        /* Also update pointer in preceding record when writing block */
-        assert(pCache == nCache);
-        head(*isam_ident, pCache, prev_rec_no)->next = new_rec_no +
-            new_block_no * isam_ident->fHead.NrecPB;
-        if (new_block_no == block_no) {
-            /* And also that in the next record */
-            assert(iCache == nCache);
-            head(*isam_ident, iCache, rec_no)->previous = new_rec_no +
-                new_block_no * isam_ident->fHead.NrecPB;
-            if (write_cache_block(isam_ident, nCache))
-            {
-                return -1;
-            }
-            /* Complete update and return */
-            isam_ident->fHead.FileState &= ~ISAM_STATE_UPDATING;
-            return writeHead(isam_ident);
-        }
-        if (write_cache_block(isam_ident, nCache))
-        {
-            return -1;
-        }
-        /* Make sure next record is in cache, update and write */
-        iCache = isam_cache_block(isam_ident, block_no);
-        if (iCache < 0)
-        {
-            return -1;
-        }
-        head(*isam_ident, iCache, rec_no)->previous = new_rec_no +
-            new_block_no * isam_ident->fHead.NrecPB;
-        if (write_cache_block(isam_ident, iCache))
-        {
-            return -1;
-        }
-        /* Finish update and return */
-        nCache = isam_cache_block(isam_ident, new_block_no);
-        if (nCache < 0)
-        {
-            return -1;
-        }
-        isam_ident->cur_id = nCache;
-        isam_ident->cur_recno = new_rec_no;
-        isam_ident->fHead.FileState &= ~ISAM_STATE_UPDATING;
-        return writeHead(isam_ident);
+        return -1;
     }
-    /* Process all three records separately */
-    if (write_cache_block(isam_ident, nCache))
+    start = stats_start(isam_ident, ISAM_OP_READPREV);
+    pthread_rwlock_rdlock(&(isam_ident->file->lock));
+    rv = do_readPrev(isam_ident, key, data);
+    pthread_rwlock_unlock(&(isam_ident->file->lock));
+    stats_op(isam_ident, ISAM_OP_READPREV, start, rv);
+    return rv;
+}
+
+int isam_readByKey(isamPtr isam_ident, const char *key, void *data)
+{
+    int rv;
+    unsigned long long start;
+
+    if (testPtr(isam_ident))
     {
         return -1;
     }
-    /* Preceding record */
-    pCache = isam_cache_block(isam_ident, prev_block_no);
-    if (pCache < 0)
+    start = stats_start(isam_ident, ISAM_OP_READBYKEY);
+    pthread_rwlock_rdlock(&(isam_ident->file->lock));
+    rv = do_readByKey(isam_ident, key, data);
+    pthread_rwlock_unlock(&(isam_ident->file->lock));
+    stats_op(isam_ident, ISAM_OP_READBYKEY, start, rv);
+    return rv;
+}
+
+int isam_seekByKey(isamPtr isam_ident, const char *key)
+{
+    int rv;
+    unsigned long long start;
+
+    if (testPtr(isam_ident))
     {
         return -1;
     }
-    head(*isam_ident, pCache, prev_rec_no)->next = new_rec_no +
-        new_block_no * isam_ident->fHead.NrecPB;
-    if (write_cache_block(isam_ident, pCache))
+    start = stats_start(isam_ident, ISAM_OP_SEEKBYKEY);
+    pthread_rwlock_rdlock(&(isam_ident->file->lock));
+    rv = do_seekByKey(isam_ident, key);
+    pthread_rwlock_unlock(&(isam_ident->file->lock));
+    stats_op(isam_ident, ISAM_OP_SEEKBYKEY, start, rv);
+    return rv;
+}
+
+long isam_readManyByKey(isamPtr isam_ident, const char **keys, size_t n,
+        void *data, unsigned long *lengths, int *found)
+{
+    long rv;
+    unsigned long long start;
+
+    if (testPtr(isam_ident))
     {
         return -1;
     }
-    /* Next record */
-    iCache = isam_cache_block(isam_ident, block_no);
-    if (iCache < 0)
+    start = stats_start(isam_ident, ISAM_OP_READMANYBYKEY);
+    pthread_rwlock_rdlock(&(isam_ident->file->lock));
+    rv = do_readManyByKey(isam_ident, keys, n, data, lengths, found);
+    pthread_rwlock_unlock(&(isam_ident->file->lock));
+    stats_op(isam_ident, ISAM_OP_READMANYBYKEY, start, rv < 0);
+    return rv;
+}
+
+long isam_scanRange(isamPtr isam_ident, const char *from, const char *to,
+        isam_scanFunc fn, void *context)
+{
+    long rv;
+    unsigned long long start;
+
+    if (testPtr(isam_ident))
     {
         return -1;
     }
-    head(*isam_ident, iCache, rec_no)->previous = new_rec_no +
-        new_block_no * isam_ident->fHead.NrecPB;
-    if (write_cache_block(isam_ident, iCache))
+    start = stats_start(isam_ident, ISAM_OP_SCANRANGE);
+    pthread_rwlock_rdlock(&(isam_ident->file->lock));
+    rv = do_scanRange(isam_ident, from, to, fn, context);
+    pthread_rwlock_unlock(&(isam_ident->file->lock));
+    stats_op(isam_ident, ISAM_OP_SCANRANGE, start, rv < 0);
+    return rv;
+}
+
+long isam_readBySecondary(isamPtr isam_ident, int which, const void *value,
+        isam_scanFunc fn, void *context)
+{
+    long rv;
+    unsigned long long start;
+
+    if (testPtr(isam_ident))
     {
         return -1;
     }
-    /* Finish and return */
-    nCache = isam_cache_block(isam_ident, new_block_no);
-    if (nCache < 0)
+    start = stats_start(isam_ident, ISAM_OP_READBYSECONDARY);
+    pthread_rwlock_rdlock(&(isam_ident->file->lock));
+    rv = do_readBySecondary(isam_ident, which, value, fn, context);
+    pthread_rwlock_unlock(&(isam_ident->file->lock));
+    stats_op(isam_ident, ISAM_OP_READBYSECONDARY, start, rv < 0);
+    return rv;
+}
+
+int isam_writeNew(isamPtr isam_ident, const char *key, const void *data)
+{
+    int rv;
+    unsigned long long start;
+
+    if (testNotSnapshot(isam_ident))
     {
         return -1;
     }
-    isam_ident->cur_id = nCache;
-    isam_ident->cur_recno = new_rec_no;
-    isam_ident->fHead.FileState &= ~ISAM_STATE_UPDATING;
-    return writeHead(isam_ident);
+    start = stats_start(isam_ident, ISAM_OP_WRITENEW);
+    lock_exclusive(isam_ident->file);
+    wal_begin(isam_ident->file);
+    isam_ident->dataLength = data_trim(isam_ident->file, data);
+    rv = wal_finish(isam_ident, do_writeNew(isam_ident, key, data));
+    stats_op(isam_ident, ISAM_OP_WRITENEW, start, rv);
+    return rv;
 }
 
-/* The following routine should give a lot more explanation of the nature
-   of the error than it does now. */
-
-int isam_perror(const char *str) {
-    /* STEP 1: instead of printing an error number, print textual
-       representation for every possible error.
-       */
-
-    char *msg;
-
-    switch ((int)isam_error) {
-        case ISAM_NO_ERROR:
-            msg = "Number error";
-            break;
-        case ISAM_WRITE_FAIL:
-            msg = "Write failure";
-            break;
-        case ISAM_KEY_LEN:
-            msg = "key length";
-            break;
-        case ISAM_FILE_EXISTS:
-            msg = "File doesn't exist";
-            break;
-        case ISAM_LINK_EXISTS:
-            msg = "Link doesn't exist";
-            break;
-        case ISAM_OPEN_FAIL:
-            msg = "open fail";
-            break;
-        case ISAM_NO_SUCH_FILE:
-            msg = "no such file";
-            break;
-        case ISAM_OPEN_COUNT:
-            msg = "open count fail";
-            break;
-        case ISAM_INDEX_ERROR:
-            msg = "index error";
-            break;
-        case ISAM_READ_ERROR:
-            msg = "read error";
-            break;
-        case ISAM_BAD_MAGIC:
-            msg = "bad magic";
-            break;
-        case ISAM_BAD_VERSION:
-            msg = "bad version";
-            break;
-        case ISAM_HEADER_ERROR:
-            msg = "header error";
-            break;
-        case ISAM_OPEN_FOR_UPDATE:
-            msg = "open for update";
-            break;
-        case ISAM_IDENT_INVALID:
-            msg = "identity invalid";
-            break;
-        case ISAM_NO_SUCH_KEY:
-            msg = "no such key";
-            break;
-        case ISAM_NULL_KEY:
-            msg = "key is null";
-            break;
-        case ISAM_DATA_MISMATCH:
-            msg = "data mismatch";
-            break;
-        case ISAM_RECORD_EXISTS:
-            msg = "record exists";
-            break;
-        case ISAM_SEEK_ERROR:
-            msg = "seek error";
-            break;
-        case ISAM_SOF:
-            msg = "Start of file";
-            break;
-        case ISAM_EOF:
-            msg = "End of file";
-            break;
-        default:
-            break;
-    }
+int isam_writeNewLength(isamPtr isam_ident, const char *key, const void *data,
+        unsigned long length)
+{
+    int rv;
+    unsigned long long start;
 
-    if (str) {
-        fprintf(stderr, "isam_perror: %s - error no %d, %s", str, (int)isam_error, msg);
-    } else {
-        fprintf(stderr, "isam_perror: error no %d, %s", (int)isam_error, msg);
+    if (testNotSnapshot(isam_ident))
+    {
+        return -1;
     }
-    fprintf(stderr, "\n");
-
-    return 0;
+    start = stats_start(isam_ident, ISAM_OP_WRITENEW);
+    lock_exclusive(isam_ident->file);
+    wal_begin(isam_ident->file);
+    data = data_pad(isam_ident, data, length);
+    rv = wal_finish(isam_ident, data ? do_writeNew(isam_ident, key, data) : -1);
+    stats_op(isam_ident, ISAM_OP_WRITENEW, start, rv);
+    return rv;
 }
 
-/* isam_delete will delete a record if
-   - it exists,
-   - is valid
-   - key and data match */
-
 int isam_delete(isamPtr isam_ident, const char *key, const void *data)
 {
-    unsigned long block_no;
-    int rec_no;
-    unsigned long next, prev, prev_valid;
-    int iCache;
     int rv;
-    int keep_link = 0;
-    int prev_block_no, prev_rec_no, pCache;
-    int next_block_no, next_rec_no, nCache;
-    int prev_valid_block_no, prev_valid_rec_no, pvCache;
-
+    unsigned long long start;
 
-    if (testPtr(isam_ident))
+    if (testNotSnapshot(isam_ident))
     {
         return -1;
     }
-    if (key[0] == 0)
+    start = stats_start(isam_ident, ISAM_OP_DELETE);
+    lock_exclusive(isam_ident->file);
+    wal_begin(isam_ident->file);
+    rv = wal_finish(isam_ident, do_delete(isam_ident, key, data));
+    stats_op(isam_ident, ISAM_OP_DELETE, start, rv);
+    return rv;
+}
+
+int isam_update(isamPtr isam_ident, const char *key, const void *old_data,
+        const void *new_data)
+{
+    int rv;
+    unsigned long long start;
+
+    if (testNotSnapshot(isam_ident))
     {
-        isam_error = ISAM_NULL_KEY;
         return -1;
     }
-    /* First find block number from index */
-    block_no = index_keyToBlock(isam_ident->index, key);
-    rec_no = 0;
-    /* Now make sure the block is in cache */
-    iCache = isam_cache_block(isam_ident, block_no);
-    if (iCache < 0)
+    start = stats_start(isam_ident, ISAM_OP_UPDATE);
+    lock_exclusive(isam_ident->file);
+    wal_begin(isam_ident->file);
+    isam_ident->dataLength = data_trim(isam_ident->file, new_data);
+    rv = wal_finish(isam_ident, do_update(isam_ident, key, old_data, new_data));
+    stats_op(isam_ident, ISAM_OP_UPDATE, start, rv);
+    return rv;
+}
+
+int isam_updateLength(isamPtr isam_ident, const char *key,
+        const void *old_data, const void *new_data, unsigned long length)
+{
+    int rv;
+    unsigned long long start;
+
+    if (testNotSnapshot(isam_ident))
     {
         return -1;
     }
-    /* Skip all records with smaller keys */
-    while ((rv = strncmp(key, key((*isam_ident),iCache,rec_no),
-                    isam_ident->fHead.KeyLen)) > 0)
+    start = stats_start(isam_ident, ISAM_OP_UPDATE);
+    lock_exclusive(isam_ident->file);
+    wal_begin(isam_ident->file);
+    new_data = data_pad(isam_ident, new_data, length);
+    rv = wal_finish(isam_ident, new_data ?
+            do_update(isam_ident, key, old_data, new_data) : -1);
+    stats_op(isam_ident, ISAM_OP_UPDATE, start, rv);
+    return rv;
+}
+
+long isam_dataLength(isamPtr isam_ident)
+{
+    if (testPtr(isam_ident))
     {
-        next = head((*isam_ident),iCache,rec_no)->next;
-        debugRecord(isam_ident, next, "delete #1");
-        if (!next)
-        {
-            /* There is no next record */
-            break;
-        }
-        block_no = next / isam_ident->fHead.NrecPB;
-        rec_no = next % isam_ident->fHead.NrecPB;
-        iCache = isam_cache_block(isam_ident, block_no);
-        if (iCache < 0)
-        {
-            return -1;
-        }
-    }
-    /* Now either rv != 0 - in which case there is no matching key,
-       independent of next being zero or not, or rv == 0, in which
-       case at least the key matches */
-    if (rv || !(head(*isam_ident, iCache, rec_no)->statusFlags & ISAM_VALID)) {
-        isam_error = ISAM_NO_SUCH_KEY;
-        return -1;
-    }
-    /* So the key matches and the record is valid, now see if the data
-       match. The data may not be strings - so compare the full length.
-       So the user must beware to include the same junk in the remainder
-       of a data field, if it happens to be a string (isam_readByKey will
-       take care of that) */
-    if (memcmp(data, data(*isam_ident, iCache, rec_no), isam_ident->fHead.DataLen)) {
-        isam_error = ISAM_DATA_MISMATCH;
         return -1;
     }
-    /* So we can now delete the record. Begin by marking it "deleted" */
-    head(*isam_ident, iCache, rec_no)->statusFlags = ISAM_DELETED;
-    isam_ident->fHead.FileState |= ISAM_STATE_UPDATING;
-    isam_ident->fHead.Nrecords--;
+    return (long) isam_ident->dataLength;
+}
 
-    if (writeHead(isam_ident)) {
-        return -1;
-    }
-    if ((rec_no == 0) && (block_no < isam_ident->fHead.Nblocks)) {
-        /* This record occurs in the index, so we only mark it as deleted,
-           but keep it in the linked list */
-        keep_link = 1;
-        if (write_cache_block(isam_ident, iCache)) {
-            return -1;
-        }
-    }
-    /* We'll need two kinds of preceding record - the immediately preceding
-       (which will always exist), and the preceding valid (which may exist).
-       The latter is needed to reposition the cur_id and the cur_block_no.
-       Let's begin with the preceding*/
-    /* The record cannot be the dummy first, so there must be a previous
-       record */
-    next = head(*isam_ident, iCache, rec_no)->next;
-    prev = head(*isam_ident, iCache, rec_no)->previous;
-    prev_block_no = prev / isam_ident->fHead.NrecPB;
-    prev_rec_no   = prev % isam_ident->fHead.NrecPB;
-    pCache = isam_cache_block(isam_ident, prev_block_no);
-    if (pCache < 0)
+int isam_fileStats(isamPtr isam_ident, struct ISAM_FILE_STATS* stats)
+{
+    int rv;
+
+    if (testPtr(isam_ident))
     {
         return -1;
     }
-    prev_valid = prev;
-    prev_valid_block_no = prev_block_no;
-    prev_valid_rec_no  = prev_rec_no;
-    pvCache = pCache;
-    isam_ident->cur_id = pvCache;
-    isam_ident->cur_recno = prev_valid_rec_no;
-    if (!keep_link)
+    pthread_rwlock_rdlock(&(isam_ident->file->lock));
+    rv = do_fileStats(isam_ident, stats);
+    pthread_rwlock_unlock(&(isam_ident->file->lock));
+    return rv;
+}
+
+long isam_verify(isamPtr isam_ident, struct ISAM_VERIFY_STATS *stats)
+{
+    long rv;
+
+    if (testNotSnapshot(isam_ident))
     {
-        cur_head(*isam_ident)->next = next;
-        if (write_cache_block(isam_ident, pCache))
-        {
-            return -1;
-        }
-        /* The next record need not exist (we may have deleted the last)*/
-        if (next)
-        {
-            next_block_no = next / isam_ident->fHead.NrecPB;
-            next_rec_no   = next % isam_ident->fHead.NrecPB;
-            nCache = isam_cache_block(isam_ident, next_block_no);
-            if (nCache < 0)
-            {
-                return -1;
-            }
-            head(*isam_ident, nCache, next_rec_no)->previous = prev;
-            if (write_cache_block(isam_ident, nCache))
-            {
-                return -1;
-            }
-        } else
-        {
-            /* This is likely to be the record with the maxKey; if it is,
-               maxKey must be set to that of the preceding record */
-            if (!strncmp(key, isam_ident->maxKey, isam_ident->fHead.KeyLen))
-            {
-                memcpy(isam_ident->maxKey, key(*isam_ident, pCache, prev_rec_no),
-                        isam_ident->fHead.KeyLen);
-                isam_ident->fHead.MaxKeyRec = prev;
-            }
-        }
-        /* Now clear all status flags, but first ensure that the record
-           still/again is cached */
-        iCache = isam_cache_block(isam_ident, block_no);
-        if (iCache < 0)
-        {
-            return -1;
-        }
-        head(*isam_ident, iCache, rec_no)->statusFlags = 0;
-        if (write_cache_block(isam_ident, iCache))
-        {
-            return -1;
-        }
+        return -1;
     }
-    isam_ident->fHead.FileState &= ~ISAM_STATE_UPDATING;
-    if (writeHead(isam_ident))
+    lock_exclusive(isam_ident->file);
+    rv = do_verify(isam_ident, stats);
+    pthread_rwlock_unlock(&(isam_ident->file->lock));
+    return rv;
+}
+
+int isam_rebuildBloom(isamPtr isam_ident)
+{
+    int rv;
+
+    if (testNotSnapshot(isam_ident))
     {
         return -1;
     }
+    lock_exclusive(isam_ident->file);
+    rv = do_rebuildBloom(isam_ident);
+    pthread_rwlock_unlock(&(isam_ident->file->lock));
+    return rv;
+}
 
-    /* Now make sure the previous valid record is found and cached */
-    pvCache = isam_cache_block(isam_ident, prev_valid_block_no);
-    if (pvCache < 0)
+/* Add a secondary index in the first free place */
+int isam_addSecondary(isamPtr isam_ident, unsigned long offset,
+        unsigned long length, int flags)
+{
+    isamFile *f;
+    int which;
+
+    if (testNotSnapshot(isam_ident))
     {
         return -1;
     }
-    while (prev_valid && (!(cur_head(*isam_ident)->statusFlags & ISAM_VALID)))
+    f = isam_ident->file;
+    lock_exclusive(f);
+    for (which = 0; which < ISAM_MAX_SECONDARY && f->secondary[which].base;
+            which++)
+        ;
+    if (which == ISAM_MAX_SECONDARY)
     {
-        prev_valid = cur_head(*isam_ident)->previous;
-        prev_valid_block_no = prev_valid / isam_ident->fHead.NrecPB;
-        prev_valid_rec_no   = prev_valid % isam_ident->fHead.NrecPB;
-        pvCache = isam_cache_block(isam_ident, prev_valid_block_no);
-        if (pvCache < 0)
-        {
-            return -1;
-        }
-        isam_ident->cur_id = pvCache;
-        isam_ident->cur_recno = prev_valid_rec_no;
+        isam_error = ISAM_NO_SECONDARY;
+        which = -1;
     }
-
-    return 0;
+    else if (sec_build(isam_ident, which, offset, length,
+                flags & ISAM_SECONDARY_STRING))
+    {
+        which = -1;
+    }
+    pthread_rwlock_unlock(&(f->lock));
+    return which;
 }
 
-/* STEP 5:
-   Updating a record effectively has the same effect as first deleting it,
-   and the rewriting it again (though the resulting file structure may
-   be different). Here we choose the quick-and-dirty implementation,
-   deleting and writing. The correct and more efficient implementation,
-   where far fewer records need to be written, is left as an exercise.
-   */
-
-int isam_update(isamPtr isam_ident, const char *key, const void *old_data,
-        const void *new_data)
+int isam_dropSecondary(isamPtr isam_ident, int which)
 {
-    int rv = isam_delete(isam_ident, key, old_data);
-    if (rv)
+    isamFile *f;
+    char *name;
+    int rv = 0;
+    int i;
+
+    if (testNotSnapshot(isam_ident))
     {
         return -1;
     }
-    return isam_writeNew(isam_ident, key, new_data);
+    f = isam_ident->file;
+    if (which < 0 || which >= ISAM_MAX_SECONDARY)
+    {
+        isam_error = ISAM_NO_SECONDARY;
+        return -1;
+    }
+    lock_exclusive(f);
+    if (!f->secondary[which].base)
+    {
+        isam_error = ISAM_NO_SECONDARY;
+        rv = -1;
+    }
+    else
+    {
+        sec_close(f, which);
+        name = sec_name(f, which);
+        unlink(name);
+        free(name);
+        for (i = 0; i < ISAM_MAX_SECONDARY && !f->secondary[i].base; i++)
+            ;
+        if (i == ISAM_MAX_SECONDARY)
+        {
+            f->fHead.FileState &= ~ISAM_HAS_SECONDARY;
+            f->fHead.version = fileVersion(f->fHead.FileState);
+            rv = writeHead(f);
+        }
+    }
+    pthread_rwlock_unlock(&(f->lock));
+    return rv;
 }
 
-/* Like strlen, but with a maximum length allowed.  There is "strnlen" in
-   GNU libc, but it's non-standard, hence we provide our own version.
-   */
-static long my_strnlen(const char* str, int maxLen)
+/* Add a cursor to an open file, positioned at the start of the file */
+isamPtr isam_openCursor(isamPtr f)
 {
-    const char* s = str;
-    while (maxLen-- > 0 && *s)
+    isamPtr c;
+
+    if (testNotSnapshot(f))
     {
-        s++;
+        return NULL;
     }
-    return s-str;
+    pthread_rwlock_rdlock(&(f->file->lock));
+    c = makeCursor(f->file);
+    if (do_setKey(c, ""))
+    {
+        freeCursor(c);
+        c = NULL;
+    }
+    pthread_rwlock_unlock(&(f->file->lock));
+    return c;
 }
 
-/* Go through the file and collect statistics on the filling of records
-   and complete blocks, separately for sequential part and for overflow
-   part.  Also collect statistics on the key length used.
-   */
-int isam_fileStats(isamPtr isam_ident, struct ISAM_FILE_STATS* stats) {
+/* Open a snapshot of the file: a cursor on a private copy of the file
+   administration, that reads the blocks with snap_read. The blocks
+   modified in the cache are saved first, as they need not be on disk
+   yet. */
+isamPtr isam_snapshot_begin(isamPtr isam_ident)
+{
+    isamFile *f, *s;
+    isamPtr c;
     int iCache;
-    unsigned long block_no;
-    unsigned long keySum = 0;
-    unsigned long keyNo = 0;
-    unsigned long blocksRegularUsedSum = 0;
-    unsigned long blocksOverflowUsedSum = 0;
 
-    if (testPtr(isam_ident))
+    if (testNotSnapshot(isam_ident))
     {
-        return -1;
+        return NULL;
     }
-
-    /* Initialise statistics.  */
-    stats->blocksRegularNEmpty = 0;
-    stats->blocksRegularNPartial = 0;
-    stats->blocksRegularNFull = 0;
-    stats->blocksRegularUsedMin = 0xffffffff;
-    stats->blocksRegularUsedMax = 0;
-    stats->blocksRegularUsedAverage = 0;
-    stats->recordsRegularNEmpty = 0;
-    stats->recordsRegularNUsed = 0;
-    stats->blocksOverflowNEmpty = 0;
-    stats->blocksOverflowNPartial = 0;
-    stats->blocksOverflowNFull = 0;
-    stats->blocksOverflowUsedMin = 0xffffffff;
-    stats->blocksOverflowUsedMax = 0;
-    stats->blocksOverflowUsedAverage = 0;
-    stats->recordsOverflowNEmpty = 0;
-    stats->recordsOverflowNUsed = 0;
-    stats->keyMin = -1;
-    stats->keyMax = 0;
-    stats->keyAverage = 0;
-
-    /* Iterate through all the blocks.  */
-    for (block_no = 0; block_no < isam_ident->fHead.CurBlocks; block_no++)
+    f = isam_ident->file;
+    lock_exclusive(f);
+    s = makeIsamFile(&(f->fHead), ISAM_SNAPSHOT_CACHE);
+    if (!(s->index = index_copy(f->index)))
     {
-        unsigned long rec_no;
-
-        unsigned long empty = 0;
-        unsigned long used = 0;
-
-        iCache = isam_cache_block(isam_ident, block_no);
-        if (iCache < 0)
+        pthread_rwlock_unlock(&(f->lock));
+        freeIsamFile(s);
+        isam_error = ISAM_INDEX_ERROR;
+        return NULL;
+    }
+    s->maxKey = malloc(f->fHead.KeyLen);
+    assert(s->maxKey != NULL);
+    memcpy(s->maxKey, f->maxKey, f->fHead.KeyLen);
+    s->fileId = f->fileId;
+    s->heapFd = f->heapFd;
+    /* All blocks are read with snap_read */
+    s->diskBlocks = f->fHead.CurBlocks;
+    s->snapBlocks = f->diskBlocks;
+    s->snapOf = f;
+    pthread_mutex_lock(&(f->snapLock));
+    if (!f->snapHash)
+    {
+        f->snapHash = calloc(f->hashMask + 1, sizeof(struct snapVersion *));
+        assert(f->snapHash != NULL);
+    }
+    s->snapGen = ++(f->snapGen);
+    f->snapBlocks = f->fHead.CurBlocks;
+    s->snapNext = f->snapshots;
+    f->snapshots = s;
+    pthread_mutex_unlock(&(f->snapLock));
+    for (iCache = 0; iCache < f->cacheSize; iCache++)
+    {
+        if (f->dirty[iCache])
         {
-            return -1;
+            snap_save(f, iCache);
         }
+    }
+    pthread_rwlock_unlock(&(f->lock));
+    c = makeCursor(s);
+    if (do_setKey(c, ""))
+    {
+        isam_snapshot_end(c);
+        c = NULL;
+    }
+    return c;
+}
 
-        /* Iterate through all the records in each block.  */
-        for (rec_no = 0; rec_no < isam_ident->fHead.NrecPB; rec_no++)
-        {
-            recordHead* rec = head(*isam_ident, iCache, rec_no);
-
-            if (rec->statusFlags & ISAM_VALID)
-            {
-                /* Record is used.  Collect key length statistics.  */
-                int keyLen = my_strnlen(key(*isam_ident, iCache, rec_no),
-                        isam_ident->fHead.KeyLen);
-                used++;
-
-                if (stats->keyMin == -1 || keyLen < stats->keyMin)
-                {
-                    stats->keyMin = keyLen;
-                }
-                if (keyLen > stats->keyMax)
-                {
-                    stats->keyMax = keyLen;
-                }
-                keySum += keyLen;
-                keyNo++;
-            }
-            else if (rec->statusFlags & ISAM_SPECIAL)
-            {
-                /* Special null start record.  */
-                used++;
-            }
-            else
-            {
-                /* The record is empty.  Either it's ISAM_DELETED (being
-                   the index record), or it doesn't serve any function.  */
-                empty++;
-            }
-        }
+/* End a snapshot. The blocks saved before the oldest remaining snapshot
+   began are no longer needed by any. */
+int isam_snapshot_end(isamPtr snapshot)
+{
+    isamFile *f, *s, **link;
+    struct snapVersion **v, *old;
+    unsigned long oldest, i;
 
-        /* Collect statistics after iterating through all the records of
-           a block.  */
-        if (block_no < isam_ident->fHead.Nblocks)
+    if (testPtr(snapshot))
+    {
+        return -1;
+    }
+    s = snapshot->file;
+    if (!(f = s->snapOf))
+    {
+        isam_error = ISAM_IDENT_INVALID;
+        return -1;
+    }
+    pthread_mutex_lock(&(f->snapLock));
+    for (link = &(f->snapshots); *link != s; link = &((*link)->snapNext))
+        ;
+    *link = s->snapNext;
+    oldest = f->snapGen + 1;
+    for (s = f->snapshots; s; s = s->snapNext)
+    {
+        if (s->snapGen < oldest)
         {
-            /* Ordinary, sequential block.  */
-            stats->recordsRegularNEmpty += empty;
-            stats->recordsRegularNUsed += used;
-
-            if (empty == isam_ident->fHead.NrecPB)
-            {
-                stats->blocksRegularNEmpty++;
-            }
-            else if (used == isam_ident->fHead.NrecPB)
-            {
-                stats->blocksRegularNFull++;
-            }
-            else
-            {
-                stats->blocksRegularNPartial++;
-            }
-
-            if (stats->blocksRegularUsedMin == 0xffffffff ||
-                    used < stats->blocksRegularUsedMin)
-            {
-                stats->blocksRegularUsedMin = used;
-            }
-            if (used > stats->blocksRegularUsedMax)
-            {
-                stats->blocksRegularUsedMax = used;
-            }
-            blocksRegularUsedSum += used;
+            oldest = s->snapGen;
         }
-        else
+    }
+    for (i = 0; i <= f->hashMask; i++)
+    {
+        v = f->snapHash + i;
+        while (*v)
         {
-            /* Overflow block.  */
-            stats->recordsOverflowNEmpty += empty;
-            stats->recordsOverflowNUsed += used;
-
-            if (empty == isam_ident->fHead.NrecPB)
-            {
-                stats->blocksOverflowNEmpty++;
-            }
-            else if (used == isam_ident->fHead.NrecPB)
+            if ((*v)->gen < oldest)
             {
-                stats->blocksOverflowNFull++;
+                old = *v;
+                *v = old->next;
+                free(old);
             }
             else
             {
-                stats->blocksOverflowNPartial++;
-            }
-
-            if (stats->blocksOverflowUsedMin == 0xffffffff ||
-                    used < stats->blocksOverflowUsedMin)
-            {
-                stats->blocksOverflowUsedMin = used;
-            }
-            if (used > stats->blocksOverflowUsedMax)
-            {
-                stats->blocksOverflowUsedMax = used;
+                v = &((*v)->next);
             }
-            blocksOverflowUsedSum += used;
         }
     }
+    pthread_mutex_unlock(&(f->snapLock));
+    s = snapshot->file;
+    index_free(s->index);
+    /* The files belong to f */
+    s->heapFd = -1;
+    s->fHead.magic = 0;
+    freeIsamPtr(snapshot);
+    return 0;
+}
 
-    /* Collect statistics after iterating through all the records of all
-       blocks.  Take into account the possibility that no statistics could
-       have been collected.  */
-    if (stats->blocksRegularNEmpty + stats->blocksRegularNFull +
-            stats->blocksRegularNPartial > 0)
+/* Replace the I/O threads of the file by depth new ones, or by an
+   io_uring with one thread. At most a quarter of the cache is used for
+   blocks read ahead. */
+int isam_setQueueDepth(isamPtr isam_ident, int depth)
+{
+    isamFile *f;
+    int rv = 0;
+    int threads = depth & ISAM_QUEUE_THREADS;
+
+    if (testNotSnapshot(isam_ident))
     {
-        stats->blocksRegularUsedAverage = blocksRegularUsedSum /
-            (stats->blocksRegularNEmpty + stats->blocksRegularNFull +
-             stats->blocksRegularNPartial);
+        return -1;
     }
-    if (stats->blocksOverflowNEmpty + stats->blocksOverflowNFull +
-            stats->blocksOverflowNPartial)
+    f = isam_ident->file;
+    depth &= ~ISAM_QUEUE_THREADS;
+    if (depth > ISAM_MAX_QUEUE_DEPTH)
     {
-        stats->blocksOverflowUsedAverage = blocksOverflowUsedSum /
-            (stats->blocksOverflowNEmpty + stats->blocksOverflowNFull +
-             stats->blocksOverflowNPartial);
+        depth = ISAM_MAX_QUEUE_DEPTH;
     }
-    if (keyNo > 0)
+    if (depth > f->cacheSize / 4)
     {
-        stats->keyAverage = keySum / keyNo;
+        depth = f->cacheSize / 4;
     }
-    if (stats->blocksRegularUsedMin == 0xffffffff)
+    lock_exclusive(f);
+    io_stop(f);
+    if (depth > 0 && (threads || ring_start(f, depth)))
     {
-        stats->blocksRegularUsedMin = 0;
+        f->ioThreads = calloc(depth, sizeof(pthread_t));
+        f->ioQueue = calloc(depth, sizeof(int));
+        assert(f->ioThreads != NULL && f->ioQueue != NULL);
+        /* Nothing is queued before ioDepth is set */
+        while (f->ioDepth < depth &&
+                !pthread_create(f->ioThreads + f->ioDepth, NULL, io_thread, f))
+        {
+            f->ioDepth++;
+        }
+        if (f->ioDepth < depth)
+        {
+            /* Not all threads could be started */
+            io_stop(f);
+            isam_error = ISAM_THREAD_ERROR;
+            rv = -1;
+        }
     }
-    if (stats->blocksOverflowUsedMin == 0xffffffff)
+    pthread_rwlock_unlock(&(f->lock));
+    return rv;
+}
+
+/* struct ISAM_STATS consists of counters only, which are summed one at
+   a time. Other threads may be updating the counters in from. */
+
+static void stats_add(struct ISAM_STATS *to, struct ISAM_STATS *from)
+{
+    unsigned long long *dst = (unsigned long long *) to;
+    unsigned long long *src = (unsigned long long *) from;
+    size_t  i;
+
+    for (i = 0; i < sizeof(struct ISAM_STATS) / sizeof(*src); i++)
     {
-        stats->blocksOverflowUsedMin = 0;
+        __atomic_store_n(dst + i, dst[i] +
+                __atomic_load_n(src + i, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
     }
+}
 
-    /* Leave the ISAM file in a well defined state.  */
-    iCache = isam_cache_block(isam_ident, 0);
-    if (iCache < 0)
+/* The totals for a file since it was opened, with cacheLock held */
+
+static void stats_total(isamFile *f, struct ISAM_STATS *total)
+{
+    isamPtr c;
+
+    memset(total, 0, sizeof(*total));
+    stats_add(total, &(f->stats));
+    for (c = f->cursors; c; c = c->nextCursor)
+    {
+        stats_add(total, &(c->stats));
+    }
+}
+
+int isam_stats(isamPtr isam_ident, struct ISAM_STATS *stats)
+{
+    unsigned long long *dst = (unsigned long long *) stats;
+    unsigned long long *base;
+    size_t  i;
+
+    if (testPtr(isam_ident))
     {
         return -1;
     }
-    isam_ident->cur_id = iCache;
-    isam_ident->cur_recno = 0;
+    pthread_mutex_lock(&(isam_ident->file->cacheLock));
+    stats_total(isam_ident->file, stats);
+    base = (unsigned long long *) &(isam_ident->file->statsBase);
+    for (i = 0; i < sizeof(struct ISAM_STATS) / sizeof(*dst); i++)
+    {
+        dst[i] -= base[i];
+    }
+    pthread_mutex_unlock(&(isam_ident->file->cacheLock));
+    return 0;
+}
+
+/* The counters keep running; isam_stats subtracts their values at the
+   time of the reset */
 
+int isam_resetStats(isamPtr isam_ident)
+{
+    if (testPtr(isam_ident))
+    {
+        return -1;
+    }
+    pthread_mutex_lock(&(isam_ident->file->cacheLock));
+    stats_total(isam_ident->file, &(isam_ident->file->statsBase));
+    pthread_mutex_unlock(&(isam_ident->file->cacheLock));
     return 0;
 }
 
@@ -1864,13 +7413,12 @@ int isam_fileStats(isamPtr isam_ident, struct ISAM_FILE_STATS* stats) {
  * measure performance.
  */
 int isam_cacheStats(struct ISAM_CACHE_STATS* stats) {
-    stats->cache_call = cache_call_global;
-    stats->disk_reads = disk_reads_global;
-    stats->disk_writes = disk_writes_global;
-
-    cache_call_global = 0;
-    disk_reads_global = 0;
-    disk_writes_global = 0;
+    stats->cache_call = __sync_fetch_and_and(&cache_call_global, 0);
+    stats->disk_reads = __sync_fetch_and_and(&disk_reads_global, 0);
+    stats->disk_writes = __sync_fetch_and_and(&disk_writes_global, 0);
+    stats->cache_hits = __sync_fetch_and_and(&cache_hits_global, 0);
+    stats->cache_evictions = __sync_fetch_and_and(&cache_evictions_global, 0);
+    stats->bloom_skips = __sync_fetch_and_and(&bloom_skips_global, 0);
 
     return 0;
 }
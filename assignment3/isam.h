@@ -16,9 +16,13 @@
      that are also used in normal file systems.
 --------------------------------------------------------------------------*/
 
+#include <stddef.h>
+
 typedef struct ISAM *isamPtr;
 struct ISAM_FILE_STATS;
+struct ISAM_VERIFY_STATS;
 struct ISAM_CACHE_STATS;
+struct ISAM_STATS;
 
 /* isam_create will create an isam_file, but only if a file of that name
    does not yet exist.
@@ -29,31 +33,208 @@ struct ISAM_CACHE_STATS;
    NrecPB:   number of records that should be put into one block (including
          one overflow record per block).
    Nblocks:  The number of regular data blocks = number of entries in the
-         index
+         index. This is only an estimate: a file that outgrows it adds
+         blocks, which are indexed like the regular ones. The index then
+         grows too, and moves to a companion file (the file name with
+         ".idx" appended); such files cannot be opened by older versions
+         of this library.
    isam_create will return an isamPtr on success, NULL on failure
 */
 
 isamPtr isam_create(const char *name, unsigned long key_len,
     unsigned long data_len, unsigned long NrecPB, unsigned long Nblocks);
 
+/* isam_createWithCache is isam_create, but lets the user choose the number
+   of blocks in the cache (buffer pool) kept for the file, instead of
+   ISAM_DEFAULT_CACHE_SIZE. Values below 4 are rounded up to 4.
+*/
+
+#define ISAM_DEFAULT_CACHE_SIZE (64)
+
+isamPtr isam_createWithCache(const char *name, unsigned long key_len,
+    unsigned long data_len, unsigned long NrecPB, unsigned long Nblocks,
+    int cacheSize);
+
+/* isam_createWithOptions is isam_createWithCache, with options that
+   select optional features of the file:
+   ISAM_CREATE_BLOOM: keep a Bloom filter for every regular data block
+         (not for the blocks a file adds beyond Nblocks),
+         so that most searches for keys that are not in the file end
+         without reading a data block. The filters take 2.5 * NrecPB
+         bytes per block. Files with filters cannot be opened by older
+         versions of this library.
+   ISAM_CREATE_WAL: keep a write-ahead log (the file name with ".wal"
+         appended) of all modifications. isam_writeNew, isam_delete and
+         isam_update then only return when their changes are safely on
+         disk in the log, and a crash can no longer leave the file
+         inconsistent: isam_open repeats the logged changes that had
+         not reached the file itself. Modified blocks are still written
+         to the file only when they leave the cache or by isam_flush.
+         Calls from different threads that finish at about the same
+         time share the writing and syncing of the log. Such files are
+         never mapped into memory (ISAM_OPEN_MMAP is ignored), get a
+         cache of at least 16 blocks and cannot be opened by older
+         versions of this library.
+   ISAM_CREATE_PAGES: store the data blocks on disk as slotted pages, in
+         which records take much less room: record numbers take 32 bits
+         instead of 64, the key of a record is stored without its
+         padding and without the leading bytes it shares with the key
+         before it, and free record positions take no room at all. A
+         page is at most as large as a block of NrecPB records without
+         pages, but holds as many records as fit in it, so that more
+         records are read per block. The file then has at most 2^32
+         record positions, keys of at most 255 bytes and data fields
+         that fit in a page of 64 KiB. Such files are never mapped into
+         memory (ISAM_OPEN_MMAP is ignored) and cannot be opened by
+         older versions of this library.
+   ISAM_CREATE_VARLEN: implies ISAM_CREATE_PAGES; data_len is the
+         maximum length of the data, and a record only takes as much
+         room as its value is long. isam_writeNewLength and
+         isam_updateLength store a value of a given length;
+         isam_writeNew and isam_update store the data field without
+         its trailing zero bytes. Reads pad the value with zeros to
+         data_len; isam_dataLength tells its length. A value longer
+         than a quarter of a page is stored in a heap (the file name
+         with ".heap" appended); the heap only grows, until
+         isam_reorganize rewrites it with just the values in use.
+         Pages are sized for values of a quarter of data_len, so that
+         a block in the cache takes about four times as much memory as
+         without this option. Such files cannot be opened by older
+         versions of this library.
+   ISAM_CREATE_CHECKSUMS: store a CRC32C checksum with every data block,
+         and with the header and the index. A block is checked when it
+         is read into the cache; a block that does not match its
+         checksum gives ISAM_CHECKSUM_ERROR, as does isam_open for a
+         header or index that does not match. The checksums are
+         computed with the crc32 instruction where the processor has
+         it (see crc32c.h), which takes far less time than the I/O.
+         isam_verify checks all of them. Such files are never mapped
+         into memory (ISAM_OPEN_MMAP is ignored) and cannot be opened
+         by older versions of this library.
+   ISAM_CREATE_FANOUT(n): give the index a fan-out of n keys per index
+         record instead of the default, the largest fan-out for which
+         an index record fits in INDEX_NODE_SIZE (4096) bytes. A smaller
+         fan-out gives a deeper index with smaller records. n must be
+         at least 4 and at most isam_maxFanout(key_len); otherwise the
+         call fails with ISAM_BAD_FANOUT. The fan-out is kept in the
+         file, also when the index grows.
+*/
+
+#define ISAM_CREATE_BLOOM       (1)
+#define ISAM_CREATE_WAL         (2)
+#define ISAM_CREATE_PAGES       (4)
+#define ISAM_CREATE_VARLEN      (8)
+#define ISAM_CREATE_CHECKSUMS   (16)
+#define ISAM_CREATE_FANOUT(n)   ((int) (n) << 16)
+
+isamPtr isam_createWithOptions(const char *name, unsigned long key_len,
+    unsigned long data_len, unsigned long NrecPB, unsigned long Nblocks,
+    int cacheSize, int options);
+
+/* isam_maxFanout returns the largest fan-out ISAM_CREATE_FANOUT allows
+   for keys of key_len bytes, which is also the default */
+
+unsigned long isam_maxFanout(unsigned long key_len);
+
 /* isam_open will open an existing isam file.
    The parameters are:
    name:     name of the file, possibly including directory information
    update:   (not used) when != 0 the file is opened for reading and writing
          (it actually always is).
+         When ISAM_OPEN_MMAP is or-ed in, the data blocks are accessed
+         through a memory mapping of the file instead of being read
+         into the cache. This is much faster for files that are mostly
+         read and fit in memory.
    isam_open will return an isamPtr on success, NULL on failure
 */
 
+#define ISAM_OPEN_MMAP  (2)
+
 isamPtr isam_open(const char *name, int update);
 
+/* isam_openWithCache is isam_open with a user-chosen cache size (see
+   isam_createWithCache).
+*/
+
+isamPtr isam_openWithCache(const char *name, int update, int cacheSize);
+
 /* isam_close will close a previously opened/created isam_file
    The parameters are:
    isam_ident: the isamPtr for the file.
    isam_close will return 0 on success, -1 on failure.
+   If other cursors (see isam_openCursor) remain, only this cursor is
+   closed; the file is closed with the last one, which fails with
+   ISAM_SNAPSHOT while snapshots of the file are open. Closing a
+   snapshot (see isam_snapshot_begin) ends it.
 */
 
 int isam_close(isamPtr isam_ident);
 
+/* isam_openCursor returns a new isamPtr for the file of isam_ident,
+   positioned at the start of the file. Every isamPtr has its own
+   current record, and all can be used for all operations. Different
+   threads may use the file at the same time, each through its own
+   isamPtr (one isamPtr must not be used by two threads at once):
+   reading routines run in parallel, routines that modify the file
+   run one at a time. After a record has been deleted through one
+   isamPtr, others positioned on it should use isam_setKey again.
+   Each isamPtr keeps up to two cache blocks in place, so the cache
+   should have more than twice as many slots as there are isamPtrs in
+   use; otherwise operations can fail with ISAM_CACHE_FULL.
+   The parameters are:
+   isam_ident: an isamPtr for the file.
+   isam_openCursor will return an isamPtr on success, NULL on failure.
+*/
+
+isamPtr isam_openCursor(isamPtr isam_ident);
+
+/* isam_snapshot_begin returns a new isamPtr that sees the file as it is
+   at the moment of the call: records written, deleted or updated later,
+   through any other isamPtr, are not seen, and a scan with
+   isam_readNext or isam_readPrev follows the chain of records as it was
+   then. This is meant for long scans that run while other threads
+   modify the file. A snapshot has its own small cache and a copy of the
+   index, and does not take the file lock, so its reads never wait for
+   modifying routines, and these never wait for it. Instead, a modifying
+   routine first saves a copy of every block it uses that has not been
+   saved since the latest snapshot began; the copies are kept until the
+   snapshots that need them have ended. A long-running snapshot thus
+   costs memory in proportion to the number of blocks modified.
+   All reading routines can be used on a snapshot, except
+   isam_readBySecondary (ISAM_NO_SECONDARY) and the Bloom filters, which
+   are not used. The modifying routines, isam_flush, isam_verify,
+   isam_rebuildBloom, the secondary index routines, isam_openCursor and
+   isam_setQueueDepth fail with ISAM_SNAPSHOT. A snapshot must be used by
+   one thread at a time.
+   The parameters are:
+   isam_ident: an isamPtr for the file (not a snapshot).
+   isam_snapshot_begin will return an isamPtr on success, NULL on failure.
+*/
+
+isamPtr isam_snapshot_begin(isamPtr isam_ident);
+
+/* isam_snapshot_end ends a snapshot and releases its memory, and that of
+   the saved blocks no other snapshot needs.
+   The parameters are:
+   snapshot: an isamPtr returned by isam_snapshot_begin.
+   isam_snapshot_end will return 0 on success, -1 on failure.
+*/
+
+int isam_snapshot_end(isamPtr snapshot);
+
+/* isam_flush will write all modified blocks, the index and the file header
+   to disk. Modifications are otherwise only written when a block is
+   removed from the cache, or when the file is closed.
+   The parameters are:
+   isam_ident: the isamPtr for the file.
+   doSync:     when != 0, fsync is used to force the data onto the disk.
+           For a file with a write-ahead log (see ISAM_CREATE_WAL)
+           this is always done, after which the log is emptied.
+   isam_flush will return 0 on success, -1 on failure.
+*/
+
+int isam_flush(isamPtr isam_ident, int doSync);
+
 /* isam_setKey will position an isam file on the last valid record with
    a key smaller than the requested key, such that the next call to
    isam_readNext will return the record with the given key, if it exists.
@@ -110,9 +291,152 @@ int isam_readByKey(isamPtr isam_ident, const char *key, void *data);
 
 int isam_seekByKey(isamPtr isam_ident, const char *key);
 
+/* isam_readManyByKey reads the records for n keys at once. It gives the
+   same results as n calls of isam_readByKey, but looks the keys up in
+   sorted order, so that every block needed is read only once, and in
+   the order of the file; the kernel is asked to read ahead the regular
+   blocks not yet in the cache. Keys may occur more than once.
+   The parameters are:
+   isam_ident: the isamPtr for the file.
+   keys:       an array of n strings with the requested keys.
+   n:          the number of keys.
+   data:       an array of n data fields: the data of the record with
+           keys[i] are stored in the i-th field, padded with zeros.
+   lengths:    NULL, or an array of n lengths: lengths[i] is set to the
+           length of the value found for keys[i] (as isam_dataLength
+           would tell after isam_readByKey), and left unchanged if
+           there is no such record.
+   found:      an array of n flags: found[i] is set to 1 if a record with
+           keys[i] exists, and to 0 (leaving its data field unchanged)
+           if not.
+   Afterwards the current record is undefined; use isam_setKey before
+   isam_readNext or isam_readPrev.
+   isam_readManyByKey will return the number of records found, or -1 on
+   failure.
+*/
+
+long isam_readManyByKey(isamPtr isam_ident, const char **keys, size_t n,
+    void *data, unsigned long *lengths, int *found);
+
+/* isam_scanRange calls a function for all valid records with keys from
+   from up to and including to, in the order of their keys. The key and
+   data passed point into the cache of the file, so nothing is copied;
+   they are only valid during the call. When the records follow each
+   other through consecutive regular blocks, the kernel is asked to
+   read the next ISAM_SCAN_READAHEAD blocks ahead.
+   The file remains locked for modifications during the scan, so the
+   function must not modify the file (it may read it through another
+   isamPtr).
+   The parameters are:
+   isam_ident: the isamPtr for the file.
+   from:       the first key of the range ("" for the start of the file).
+   to:         the last key of the range, or NULL for the end of the file.
+   fn:         called for every record with the given context, the key
+           field (key_len bytes, only terminated by a zero byte when the
+           key is shorter), the data field (which need not be
+           aligned for the type stored in it) and the length of the
+           value in it (data_len, unless the file was created with
+           ISAM_CREATE_VARLEN). It should return 0 to continue the
+           scan, or a non-zero value to end it.
+   context:    passed to fn.
+   Afterwards the current record is undefined; use isam_setKey before
+   isam_readNext or isam_readPrev.
+   isam_scanRange will return the number of records passed to fn, or -1
+   on failure.
+*/
+
+#define ISAM_SCAN_READAHEAD     (32)
+
+typedef int (*isam_scanFunc) (void *context, const char *key,
+    const void *data, unsigned long length);
+
+long isam_scanRange(isamPtr isam_ident, const char *from, const char *to,
+    isam_scanFunc fn, void *context);
+
+/* isam_setQueueDepth starts depth I/O threads for the file (replacing
+   those started before), that read blocks into the cache while
+   isam_readManyByKey and isam_scanRange work on the blocks read before,
+   so that up to depth reads are outstanding at the same time. This pays
+   when the blocks are not in memory yet: the disk (especially an SSD)
+   handles many reads in parallel. Without I/O threads (depth 0, the
+   default) those routines only ask the kernel to read ahead. The depth
+   is at most ISAM_MAX_QUEUE_DEPTH and a quarter of the cache size; the
+   setting holds for all isamPtrs on the file.
+   On Linux, where the kernel allows it, the reads are submitted through
+   an io_uring instead, by the thread asking for them, and a single I/O
+   thread finishes them; ISAM_STATS.ringPrefetches counts those. With
+   ISAM_QUEUE_THREADS or'ed into depth, the I/O threads are used anyway.
+   isam_setQueueDepth will return 0 on success, -1 on failure.
+*/
+
+#define ISAM_MAX_QUEUE_DEPTH (64)
+#define ISAM_QUEUE_THREADS (0x10000)
+
+int isam_setQueueDepth(isamPtr isam_ident, int depth);
+
+/* isam_addSecondary declares a secondary index on a part of the data
+   field: the length bytes starting at byte offset. The index is kept in
+   a companion ISAM file (the file name with ".sec" and the number of
+   the index appended), built from the records present, and maintained
+   by isam_writeNew, isam_delete and isam_update from then on; it is
+   opened with the file by isam_open, and rebuilt there after an
+   unclean shutdown. An entry holds the indexed part, the key and the
+   number of the record, so a lookup reads no data blocks besides those
+   of the records found. Files with secondary indexes cannot be opened
+   by older versions of this library.
+   The parameters are:
+   isam_ident: the isamPtr for the file.
+   offset:     the offset of the indexed part in the data field.
+   length:     its length in bytes.
+   flags:      ISAM_SECONDARY_STRING for a (zero terminated) string: only
+           the bytes up to the first zero byte count. Otherwise the
+           part is indexed as raw bytes, in the order of memcmp; note
+           that on most machines this is not the numerical order of an
+           integer.
+   The indexed part with the key may take at most ISAM_MAX_SECONDARY_KEY
+   bytes (a part of raw bytes counts twice).
+   isam_addSecondary will return the number of the index (below
+   ISAM_MAX_SECONDARY) on success, -1 on failure.
+*/
+
+#define ISAM_MAX_SECONDARY      (8)
+#define ISAM_MAX_SECONDARY_KEY  (255)
+#define ISAM_SECONDARY_STRING   (1)
+
+int isam_addSecondary(isamPtr isam_ident, unsigned long offset,
+    unsigned long length, int flags);
+
+/* isam_dropSecondary removes secondary index number which, and its
+   companion file.
+   isam_dropSecondary will return 0 on success, -1 on failure.
+*/
+
+int isam_dropSecondary(isamPtr isam_ident, int which);
+
+/* isam_readBySecondary calls a function for all valid records of which
+   the part of the data field indexed by secondary index which equals
+   value, in the order of their keys. As with isam_scanRange, the key and
+   data passed point into the cache, the function must not modify the
+   file and it can end the search by returning a non-zero value.
+   The parameters are:
+   isam_ident: the isamPtr for the file.
+   which:      the number of the index (see isam_addSecondary).
+   value:      the value sought: length bytes, or a string for an index
+           on a string.
+   fn, context: as for isam_scanRange.
+   Afterwards the current record is undefined; use isam_setKey before
+   isam_readNext or isam_readPrev.
+   isam_readBySecondary will return the number of records passed to fn,
+   or -1 on failure.
+*/
+
+long isam_readBySecondary(isamPtr isam_ident, int which, const void *value,
+    isam_scanFunc fn, void *context);
+
 /* isam_update will replace the data field for a record with the given key,
    if such a record exists. As a security measure, it will verify that the
-   user has the correct original data.
+   user has the correct original data. The record is changed where it
+   is, so only its block is written; it becomes the current record.
    The parameters are:
    isam_ident: the isamPtr for the file.
    key:        a string containing the requested key.
@@ -125,6 +449,16 @@ int isam_seekByKey(isamPtr isam_ident, const char *key);
 int isam_update(isamPtr isam_ident, const char *key, const void *old_data,
     const void *new_data);
 
+/* isam_updateLength is isam_update for a new value of length bytes (at
+   most data_len); a shorter value is padded with zeros. old_data is the
+   full data field, as a read returns it. Only in a file created with
+   ISAM_CREATE_VARLEN is the length stored.
+   isam_updateLength will return 0 on success, -1 on failure.
+*/
+
+int isam_updateLength(isamPtr isam_ident, const char *key,
+    const void *old_data, const void *new_data, unsigned long length);
+
 /* isam_writeNew will write a new record to the file, but only if the key is
    not yet in use.
    The parameters are:
@@ -136,6 +470,25 @@ int isam_update(isamPtr isam_ident, const char *key, const void *old_data,
 
 int isam_writeNew(isamPtr isam_ident, const char *key, const void *data);
 
+/* isam_writeNewLength is isam_writeNew for a value of length bytes (at
+   most data_len); a shorter value is padded with zeros. Only in a file
+   created with ISAM_CREATE_VARLEN is the length stored.
+   isam_writeNewLength will return 0 on success, -1 on failure.
+*/
+
+int isam_writeNewLength(isamPtr isam_ident, const char *key,
+    const void *data, unsigned long length);
+
+/* isam_dataLength returns the length of the value last read through
+   this cursor by isam_readNext, isam_readPrev or isam_readByKey (or
+   last written by it), or -1 on failure. That is data_len, unless the
+   file was created with ISAM_CREATE_VARLEN. isam_readManyByKey,
+   isam_scanRange and isam_readBySecondary deliver the lengths of the
+   values they read themselves, and leave this length unchanged.
+*/
+
+long isam_dataLength(isamPtr isam_ident);
+
 /* isam_delete will delete the record with the given key. As a security
    measure, it will verify that the user has the correct original data.
    The parameters are:
@@ -157,14 +510,113 @@ int isam_delete(isamPtr isam_ident, const char *key, const void *data);
 
 int isam_fileStats(isamPtr isam_ident, struct ISAM_FILE_STATS* stats);
 
+/* isam_verify checks a whole file on disk. It first writes the modified
+   blocks in the cache, then reads all data blocks in large sequential
+   reads, bypassing the cache, so that it runs at about the speed of the
+   disk. In a file with checksums (see ISAM_CREATE_CHECKSUMS) the
+   header, the index and every block are checked against their
+   checksums. In any file, the records are checked to form a single
+   chain: the next and previous links must match, lie within the file
+   and (within a block) follow the key order, only the record with the
+   highest key may end the chain, and the number of valid records must
+   be that in the header. Other routines on the file wait until it is
+   done.
+   The parameters are:
+   isam_ident: the isamPtr for the file.
+   stats:      filled in with what was found.
+   isam_verify will return the number of problems found (0 for a sound
+   file), or -1 on failure.
+*/
+
+long isam_verify(isamPtr isam_ident, struct ISAM_VERIFY_STATS *stats);
+
+
+/* isam_bulkLoad creates a new file (like isam_create) and fills it with
+   records that are supplied in increasing key order. The blocks are
+   built in memory and written with large sequential writes, and the
+   index is built along the way, which is much faster than isam_writeNew
+   for every record. Each block gets NrecPB - 1 records, leaving one free
+   for later inserts; records that do not fit in Nblocks blocks go to
+   further blocks, which are indexed as well.
+   The parameters are:
+   name, key_len, data_len, NrecPB, Nblocks: as for isam_create.
+   next:     called for every record with the given context; it should
+         store the key (at most key_len characters, the buffer is cleared
+         before each call) and data_len bytes of data, and return 0, or
+         return a non-zero value when there are no more records.
+   context:  passed to next.
+   isam_bulkLoad will return the number of records loaded on success, -1
+   on failure (e.g. ISAM_NOT_SORTED); the file is then removed.
+*/
+
+typedef int (*isam_loadNext) (void *context, char *key, void *data);
+
+long isam_bulkLoad(const char *name, unsigned long key_len,
+    unsigned long data_len, unsigned long NrecPB, unsigned long Nblocks,
+    isam_loadNext next, void *context);
+
+/* isam_reorganize rewrites a file in key order into a new file with the
+   same parameters, in which all records are in regular data blocks, so
+   the chains no longer hop to the overflow area, and rebuilds the index.
+   The records are copied with isam_readNext, so memory use does not
+   depend on the size of the file. The new file replaces the old one
+   only when it is complete. The file must not be open.
+   The parameters are:
+   name:        name of the file.
+   fillPercent: the percentage of the records in a block to fill (the
+            remainder is left free for later inserts). With 0, one
+            record per block is left free, as after isam_create. In a
+            file with pages (see ISAM_CREATE_PAGES), the percentage of
+            the page to fill; with 0, room for one record is left.
+   before, after: when not NULL, these are filled in with the statistics
+            (see isam_fileStats) of the file before and after.
+   The number of regular blocks grows if needed to hold all records.
+   Secondary indexes (see isam_addSecondary) are rebuilt afterwards.
+   isam_reorganize will return 0 on success, -1 on failure.
+*/
+
+int isam_reorganize(const char *name, int fillPercent,
+    struct ISAM_FILE_STATS *before, struct ISAM_FILE_STATS *after);
+
+/* isam_rebuildBloom recomputes the Bloom filters of a file created with
+   ISAM_CREATE_BLOOM from its records. Deleted keys remain in a filter
+   for some time, which makes it less effective; a rebuild removes them.
+   After an unclean shutdown isam_open rebuilds the filters itself.
+   The parameters are:
+   isam_ident: the isamPtr for the file.
+   isam_rebuildBloom will return 0 on success, -1 on failure.
+*/
+
+int isam_rebuildBloom(isamPtr isam_ident);
 
-/* All above routines will set the global variable isam_error when an
-   error occurs. Like the standard routine perror, isam_perror should
-   print a suitable error message to stderr, optionally preceded by the
-   message mess provided by the user */
+/* isam_cacheStats copies the cache counters collected since the previous
+   call into stats, and then resets them. The hit ratio is
+   cache_hits / cache_call. */
 
 int isam_cacheStats(struct ISAM_CACHE_STATS* stats);
 
+/* isam_stats copies the statistics of an open file into stats: the
+   number of calls, failed calls and a latency histogram per routine,
+   and counters for the cache and the disk I/O. They are collected for
+   all isamPtrs on the file together, since it was opened or since the
+   last call of isam_resetStats. Unlike isam_cacheStats, the counters
+   are per file and do not overflow on long runs.
+   The parameters are:
+   isam_ident: the isamPtr for the file.
+   stats:      the structure to fill in.
+   isam_stats and isam_resetStats will return 0 on success, -1 on
+   failure.
+*/
+
+int isam_stats(isamPtr isam_ident, struct ISAM_STATS *stats);
+
+int isam_resetStats(isamPtr isam_ident);
+
+/* All above routines will set the variable isam_error when an
+   error occurs; every thread has its own isam_error. Like the standard
+   routine perror, isam_perror should print a suitable error message to
+   stderr, optionally preceded by the message mess provided by the user */
+
 int isam_perror(const char * mess);
 
 /* Not all of the following errors are actually used .... */
@@ -190,14 +642,31 @@ enum isam_error {
     ISAM_RECORD_EXISTS,
     ISAM_SEEK_ERROR,
     ISAM_SOF,
-    ISAM_EOF
+    ISAM_EOF,
+    ISAM_NO_BLOOM,
+    ISAM_NOT_SORTED,
+    ISAM_CACHE_FULL,
+    ISAM_LOG_ERROR,
+    ISAM_THREAD_ERROR,
+    ISAM_NO_SECONDARY,
+    ISAM_DATA_LENGTH,
+    ISAM_CHECKSUM_ERROR,
+    ISAM_SNAPSHOT,
+    ISAM_BAD_FANOUT
 };
 
-extern enum isam_error isam_error;
+#ifdef __GNUC__
+#define ISAM_THREAD_LOCAL   __thread
+#else
+#define ISAM_THREAD_LOCAL
+#endif
+
+extern ISAM_THREAD_LOCAL enum isam_error isam_error;
 
 /* Statistics obtained using isam_fileStats.  */
 struct ISAM_FILE_STATS {
-    /* Statistics for regular (sequential) blocks.  */
+    /* Statistics for regular (sequential) blocks, including those with
+       an entry in the index beyond the first Nblocks.  */
     unsigned long blocksRegularNEmpty;       /* # of totally empty blocks    */
     unsigned long blocksRegularNPartial;     /* # of partially occupied blocks.  */
     unsigned long blocksRegularNFull;        /* # of fully occupied blocks.  */
@@ -228,11 +697,90 @@ struct ISAM_FILE_STATS {
     int keyAverage;                          /* Average key length (floor)   */
 };
 
+/* What isam_verify found */
+struct ISAM_VERIFY_STATS {
+    unsigned long blocks;                    /* # of data blocks read        */
+    unsigned long badBlocks;                 /* # of blocks with a wrong
+                                                checksum, or that could not
+                                                be decoded                   */
+    unsigned long firstBadBlock;             /* The first of those           */
+    unsigned long badHeader;                 /* Header and index with a
+                                                wrong checksum (0, 1 or 2)   */
+    unsigned long records;                   /* # of records in the chain,
+                                                deleted ones included        */
+    unsigned long validRecords;              /* # of valid records           */
+    unsigned long chainEnds;                 /* # of records without a next
+                                                record (1 in a sound file)   */
+    unsigned long badLinks;                  /* # of links out of range or
+                                                out of key order             */
+    int chainMismatch;                       /* The next links do not match
+                                                the previous links           */
+};
 
 struct ISAM_CACHE_STATS {
-    int cache_call;
-    int disk_reads;
-    int disk_writes;
+    int cache_call;                          /* # of block requests          */
+    int disk_reads;                          /* # of blocks read from disk   */
+    int disk_writes;                         /* # of write calls (a call may
+                                                write several blocks)        */
+    int cache_hits;                          /* # of requests found in cache */
+    int cache_evictions;                     /* # of blocks replaced         */
+    int bloom_skips;                         /* # of searches ended by a
+                                                Bloom filter                 */
+};
+
+/* Statistics obtained using isam_stats. Not every call is timed (one
+   in eight is): nanoseconds and latency cover the timed calls. Latency
+   bucket i counts the timed calls that took from 2^i up to 2^(i+1)
+   nanoseconds (bucket 0 also the faster ones, the last bucket also the
+   slower ones). */
+
+enum isam_op {
+    ISAM_OP_SETKEY,
+    ISAM_OP_READNEXT,
+    ISAM_OP_READPREV,
+    ISAM_OP_READBYKEY,
+    ISAM_OP_SEEKBYKEY,
+    ISAM_OP_WRITENEW,
+    ISAM_OP_DELETE,
+    ISAM_OP_UPDATE,
+    ISAM_OP_READMANYBYKEY,
+    ISAM_OP_SCANRANGE,
+    ISAM_OP_READBYSECONDARY,
+    ISAM_NOPS
+};
+
+#define ISAM_LATENCY_BUCKETS    (40)
+
+struct ISAM_OP_STATS {
+    unsigned long long calls;                /* # of calls                   */
+    unsigned long long errors;               /* # of calls returning -1      */
+    unsigned long long timed;                /* # of calls timed             */
+    unsigned long long nanoseconds;          /* Total time of timed calls    */
+    unsigned long long latency[ISAM_LATENCY_BUCKETS];
+};
+
+struct ISAM_STATS {
+    struct ISAM_OP_STATS op[ISAM_NOPS];      /* Per routine, see isam_op     */
+    unsigned long long cacheCalls;           /* # of block requests          */
+    unsigned long long cacheHits;            /* # of requests found in cache */
+    unsigned long long cacheMisses;          /* # of requests not in cache   */
+    unsigned long long evictions;            /* # of blocks replaced         */
+    unsigned long long writeBacks;           /* # of dirty blocks written    */
+    unsigned long long diskReads;            /* # of read calls              */
+    unsigned long long diskWrites;           /* # of write calls             */
+    unsigned long long bytesRead;            /* # of bytes read              */
+    unsigned long long bytesWritten;         /* # of bytes written           */
+    unsigned long long bloomSkips;           /* # of searches ended by a
+                                                Bloom filter                 */
+    unsigned long long logCommits;           /* # of changes logged (WAL)    */
+    unsigned long long logWrites;            /* # of writes to the log       */
+    unsigned long long logBytes;             /* # of bytes written to the log */
+    unsigned long long prefetches;           /* # of blocks read by the I/O
+                                                threads (also in diskReads) */
+    unsigned long long snapshotCopies;       /* # of blocks saved for
+                                                snapshots                    */
+    unsigned long long ringPrefetches;       /* # of prefetches read through
+                                                an io_uring                  */
 };
 
 #endif /*ISAM_H */
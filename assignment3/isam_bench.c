@@ -11,12 +11,20 @@ Date: January 2002 */
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <string.h>
+#include <sys/time.h>
 #include <sys/resource.h>
 #include <time.h>
+#include <math.h>
+#include <pthread.h>
 
 #include "mt19937.h"
 #include "isam.h"
+#include "index.h"
+#include "ptable.h"
+#include "keycmp.h"
+#include "crc32c.h"
 
 void print_elapsed_ru(struct rusage start, struct rusage stop);
 void print_elapsed_clock(clock_t start, clock_t stop);
@@ -25,16 +33,19 @@ double get_sec(struct timeval data);
 int contains_numbers(char *word);
 
 
+/* De naam staat achteraan: in een bestand met ISAM_CREATE_VARLEN worden
+   de nullen achter de naam dan niet opgeslagen */
+
 typedef struct KLANT
 {
-    char    naam[64];
-    char    voorvoegsel[16];
-    char    initialen[16];
-    char    titel[16];
     unsigned long klantSinds;         /* Dag na 1/1/1900 */
     unsigned long laatsteMailing;     /* Dag na 1/1/1900 */
     unsigned long laatsteBestelling;
     unsigned long nummerBestelling;
+    char    voorvoegsel[16];
+    char    initialen[16];
+    char    titel[16];
+    char    naam[64];
 }
 klant;
 
@@ -74,6 +85,88 @@ int     Nsleutels = 0;
 static
 int     report = 0;
 
+/* Aantal blokken in de cache van het isam bestand */
+static
+int     cacheBlokken = ISAM_DEFAULT_CACHE_SIZE;
+
+/* Vlaggen voor isam_open (b.v. ISAM_OPEN_MMAP) */
+static
+int     openVlaggen = 1;
+
+/* Opties voor isam_createWithOptions (b.v. ISAM_CREATE_BLOOM) */
+static
+int     maakOpties = 0;
+
+/* Vul een nieuw bestand met isam_bulkLoad in plaats van isam_writeNew */
+static
+int     bulkLaden = 0;
+
+/* Aantal records voor een synthetische test van isam_bulkLoad */
+static
+long    bulkTest = 0;
+
+/* Reorganiseer het bestand na afloop, met dit vullingspercentage */
+static
+int     reorgVulling = -1;
+
+/* Meet ook de snelheid van de sleutelvergelijking */
+static
+int     meetVergelijking = 0;
+
+/* Vergelijk het zoeken in een index met dit aantal sleutels met en
+   zonder de sleutelprefixen, en met een Eytzinger indeling */
+static
+long    indexSleutels = 0;
+
+/* Toon de statistieken van isam_stats voor het sluiten van het bestand */
+static
+int     toonStats = 0;
+
+/* Vergelijk isam_readByKey met isam_readManyByKey voor groepen van dit
+   aantal sleutels */
+static
+int     veelSleutels = 0;
+
+/* Vergelijk isam_readNext met isam_scanRange */
+static
+int     meetScan = 0;
+
+/* Maak een secundaire index op de naam, en vergelijk het zoeken op naam
+   met en zonder die index */
+static
+int     meetSecundair = 0;
+
+/* Vergelijk isam_readManyByKey en isam_scanRange zonder en met dit
+   aantal I/O-draden (isam_setQueueDepth) */
+static
+int     ioDiepte = 0;
+
+/* Controleer het bestand na afloop met isam_verify */
+static
+int     controle = 0;
+
+/* Lees het bestand met een momentopname terwijl andere draden schrijven */
+static
+int     meetMomentopname = 0;
+
+/* Verdeel het bestand over dit aantal partities (ptable.h) */
+static
+int     partities = 0;
+
+/* Meerdradige benchmark: aantal draden, duur in seconden, percentages
+   lezen/update/schrijven/poetsen en verdeling van de sleutels */
+static
+int     draden = 0;
+
+static
+int     duur = 10;
+
+static
+int     menging[4] = {80, 10, 5, 5};
+
+static
+int     verdeling = 0;
+
 /* Bereken dagnummer met 1/1/1900 == 1 */
 /* Routine faalt op en na 1/3/2100     */
 
@@ -329,187 +422,2032 @@ poetsBestaandRecord (isamPtr ip, int sleutelNr)
     return rv;
 }
 
-void print_elapsed_ru(struct rusage start, struct rusage stop) {
-    double tuser, tsystem;
-    tuser = get_sec(stop.ru_utime) - get_sec(start.ru_utime);
-    tsystem = get_sec(stop.ru_stime) - get_sec(start.ru_stime);
-    printf("User cpu time (s):     %f\n", tuser);
-    printf("System cpu time (s):   %f\n", tsystem);
-    printf("Total cpu time (s):    %f\n", tuser + tsystem);
+/* Vergelijk sleutels met een vergelijkingsfunctie, en geef de kortste
+   tijd van VERGELIJK_RONDES rondes terug. Met gelijk != 0 wordt elke
+   sleutel met (een kopie van) zichzelf vergeleken, zoals bij elke
+   gevonden sleutel gebeurt; anders worden alle paren sleutels
+   vergeleken, die meestal al in de eerste bytes verschillen. Zonder
+   vergelijk wordt key_compare gebruikt, dat in de lus ingevoegd
+   (inline) wordt, zoals in isam.c. */
+
+#define VERGELIJK_RONDES (5)
+
+    static double
+tijdVergelijking (int (*vergelijk) (const char *, const char *, unsigned long),
+        int gelijk, long *som)
+{
+    clock_t start;
+    double  t, beste = 0;
+    char    kopie[20];
+    long    s = 0;
+    int     r, i, j;
+
+    for (r = 0; r < VERGELIJK_RONDES; r++)
+    {
+        s = 0;
+        start = clock ();
+        for (i = 0; i < Nsleutels; i++)
+        {
+            memcpy (kopie, sleutels[i], 20);
+            for (j = 0; j < Nsleutels; j++)
+            {
+                if (vergelijk)
+                {
+                    s += vergelijk (sleutels[i],
+                            gelijk ? kopie : sleutels[j], 20) < 0;
+                }
+                else
+                {
+                    s += key_compare (sleutels[i],
+                            gelijk ? kopie : sleutels[j], 20) < 0;
+                }
+            }
+        }
+        t = (double) (clock () - start) / CLOCKS_PER_SEC;
+        if (r == 0 || t < beste)
+        {
+            beste = t;
+        }
+    }
+    *som += s;
+    return beste;
 }
 
-double get_sec(struct timeval data) {
-    return data.tv_sec + data.tv_usec/1000000.0;
+    static int
+strncmpVergelijking (const char *a, const char *b, unsigned long len)
+{
+    return strncmp (a, b, len);
 }
 
-void print_elapsed_clock(clock_t start, clock_t stop) {
-    printf("seconds:               %f\n",
-            (float)(stop - start)/CLOCKS_PER_SEC);
+/* Voor isam_bulkLoad worden de klanten eerst in het geheugen gemaakt
+   en op sleutel gesorteerd */
+
+static
+klant   bulkKlanten[maxSleutels];
+
+static
+char    bulkSleutels[maxSleutels][20];
+
+static
+int     bulkVolgorde[maxSleutels];
+
+/* Sorteer op sleutel; bij gelijke sleutels komt de eerst gemaakte eerst */
+
+    static int
+vergelijkBulk (const void *a, const void *b)
+{
+    int     i = *(const int *) a, j = *(const int *) b;
+    int     rv = strncmp (bulkSleutels[i], bulkSleutels[j], 20);
+
+    return rv ? rv : i - j;
 }
 
-int main (int argc, char *argv[]) {
-    isamPtr ip;
-    FILE   *inp;
-    char    sleutel[20] =
-    {0};
-    klant   nieuweKlant;
-    char    str[512];
-    int     i, j;
+/* Lever het volgende record in gesorteerde volgorde aan isam_bulkLoad,
+   en sla dubbele sleutels over (isam_writeNew zou die weigeren) */
 
-    clock_t start, stop;
-    struct rusage start_tdata, stop_tdata;
+    static int
+volgendeBulk (void *context, char *sleutel, void *data)
+{
+    int    *positie = (int *) context;
+    int     i;
 
-    start = clock();
-    getrusage(RUSAGE_SELF, &start_tdata);
+    while (*positie < Nsleutels)
+    {
+        i = bulkVolgorde[(*positie)++];
+        if (*positie > 1 && !strncmp (bulkSleutels[i],
+                    bulkSleutels[bulkVolgorde[*positie - 2]], 20))
+        {
+            continue;
+        }
+        strncpy (sleutel, bulkSleutels[i], 20);
+        memcpy (data, &bulkKlanten[i], sizeof (klant));
+        return 0;
+    }
+    return 1;
+}
 
-    memset(&nieuweKlant, 0, sizeof(nieuweKlant));
-    /* Lees het bestand met namen (en voorvoegsels) */
+/* Maak en vul het klantenbestand met isam_bulkLoad, met dezelfde klanten
+   als de vulling met isam_writeNew. Geeft NULL als het bestand al
+   bestaat. */
 
-    init_genrand(171717);
-    if (argc < 4)
+    static isamPtr
+laadBulk (void)
+{
+    int     i, j, positie = 0;
+    long    n;
+
+    i = 0;
+    while (maakSleutel (bulkSleutels[i]))
     {
-        printf ("Gebruik: %s namen initialen titels [optional-debug]\n", argv[0]);
-        return -1;
+        maakKlant (&bulkKlanten[i]);
+        bulkVolgorde[i] = i;
+        i++;
     }
-    if (argc == 5)
+    Nsleutels = i;
+    qsort (bulkVolgorde, Nsleutels, sizeof (int), vergelijkBulk);
+    n = isam_bulkLoad ("klant.isam", 20, sizeof (klant), 8, 360,
+            volgendeBulk, &positie);
+    if (n < 0)
     {
-        report = 1;
-        printf ("Produceer meer debug uitvoer\n");
+        return NULL;
     }
-    inp = fopen (argv[1], "r");
-    if (inp)
+    /* De sleutels in volgorde van aanmaken, zonder de dubbele (van
+       achter naar voren, zodat de vergelijking nog klopt) */
+    for (i = Nsleutels - 1; i > 0; i--)
     {
-        i = 0;
-        printf ("Lees namen van %s\n", argv[1]);
-        while (fgets (str, 512, inp))
+        if (!strncmp (bulkSleutels[bulkVolgorde[i]],
+                    bulkSleutels[bulkVolgorde[i - 1]], 20))
         {
-            strncpy (namen[i].naam, strtok (str, ";\t\n"), 64);
-            strncpy (namen[i].voorvoegsel, strtok (NULL, ";\t\n"), 16);
-            i++;
+            bulkSleutels[bulkVolgorde[i]][0] = 0;
         }
-        fclose (inp);
-        Nnamen = i;
     }
-    else
+    for (i = 0, j = 0; i < Nsleutels; i++)
     {
-        perror ("Failed to open names file");
-        exit (-1);
+        if (bulkSleutels[i][0])
+        {
+            if (report)
+            {
+                printKlant (stdout, NULL, bulkSleutels[i], &bulkKlanten[i]);
+            }
+            memcpy (sleutels[j++], bulkSleutels[i], 20);
+        }
     }
+    Nsleutels = j;
+    printf ("Isam bestand bevat %d records\n", j);
+    return isam_openWithCache ("klant.isam", openVlaggen, cacheBlokken);
+}
 
-    /* Lees het bestand met initialen */
+/* Synthetische test van isam_bulkLoad: n records met oplopende sleutels */
 
-    inp = fopen (argv[2], "r");
-    if (inp)
+    static int
+volgendeTest (void *context, char *sleutel, void *data)
+{
+    long   *nummer = (long *) context;
+
+    if (*nummer >= bulkTest)
     {
-        i = 0;
-        printf ("Lees initialen van %s\n", argv[2]);
-        while (fgets (str, 512, inp))
-        {
-            strncpy (initialen[i], strtok (str, "\n"), 16);
-            i++;
-        }
-        fclose (inp);
-        Ninit = i;
+        return 1;
     }
-    else
+    sprintf (sleutel, "%012ld", ++(*nummer));
+    memset (data, 0, sizeof (klant));
+    return 0;
+}
+
+    static void
+testBulk (void)
+{
+    struct timeval start, stop;
+    long    nummer = 0, n;
+    double  t;
+
+    unlink ("bulk.isam");
+    gettimeofday (&start, NULL);
+    n = isam_bulkLoad ("bulk.isam", 20, sizeof (klant), 8,
+            bulkTest / 7 + 1, volgendeTest, &nummer);
+    gettimeofday (&stop, NULL);
+    if (n < 0)
     {
-        perror ("Failed to open initials file");
-        exit (-1);
+        isam_perror ("bulk loading bulk.isam");
+        return;
+    }
+    t = get_sec (stop) - get_sec (start);
+    printf ("isam_bulkLoad van %ld records: %f s, %.0f records/s, %.1f MB/s\n",
+            n, t, t > 0 ? n / t : 0.0,
+            t > 0 ? n * (20.0 + sizeof (klant)) / t / 1e6 : 0.0);
+    unlink ("bulk.isam");
+}
+
+/* Reorganiseer het bestand en rapporteer de vulling voor en na */
+
+    static void
+reorganiseer (void)
+{
+    struct ISAM_FILE_STATS voor, na;
+    clock_t start;
+
+    start = clock ();
+    if (isam_reorganize ("klant.isam", reorgVulling, &voor, &na))
+    {
+        isam_perror ("reorganizing the file");
+        return;
     }
+    printf ("Reorganisatie in %f s\n",
+            (double) (clock () - start) / CLOCKS_PER_SEC);
+    printf ("                    voor      na\n");
+    printf ("Records regulier  %6lu  %6lu\n", voor.recordsRegularNUsed,
+            na.recordsRegularNUsed);
+    printf ("Records overloop  %6lu  %6lu\n", voor.recordsOverflowNUsed,
+            na.recordsOverflowNUsed);
+    printf ("Blokken regulier  %6lu  %6lu\n", voor.blocksRegularNEmpty +
+            voor.blocksRegularNPartial + voor.blocksRegularNFull,
+            na.blocksRegularNEmpty + na.blocksRegularNPartial +
+            na.blocksRegularNFull);
+    printf ("Blokken overloop  %6lu  %6lu\n", voor.blocksOverflowNEmpty +
+            voor.blocksOverflowNPartial + voor.blocksOverflowNFull,
+            na.blocksOverflowNEmpty + na.blocksOverflowNPartial +
+            na.blocksOverflowNFull);
+}
 
-    /* Lees het bestand met titels */
+/* Rapporteer de snelheid van key_compare voor de 20-byte sleutels */
 
-    inp = fopen (argv[3], "r");
-    if (inp)
+    static void
+vergelijkSleutels (void)
+{
+    long    som[4];
+    double  tStrncmp, tScalar, tVector, tKey;
+    int     gelijk;
+
+    printf ("Sleutelvergelijking, %d x %d sleutels van 20 bytes:\n",
+            Nsleutels, Nsleutels);
+    for (gelijk = 0; gelijk < 2; gelijk++)
     {
-        i = 0;
-        printf ("Lees titels van %s\n", argv[3]);
-        while (fgets (str, 512, inp))
+        som[0] = som[1] = som[2] = som[3] = 0;
+        tStrncmp = tijdVergelijking (strncmpVergelijking, gelijk, som);
+        tScalar = tijdVergelijking (key_compareScalar, gelijk, som + 1);
+        tVector = tijdVergelijking (key_compareVector, gelijk, som + 2);
+        tKey = tijdVergelijking (NULL, gelijk, som + 3);
+        if (som[0] != som[1] || som[0] != som[2] || som[0] != som[3])
         {
-            strncpy (titels[i], strtok (str, "\n"), 16);
-            i++;
+            printf ("Sleutelvergelijkingen geven verschillende resultaten!\n");
         }
-        fclose (inp);
-        Ntitels = i;
-    }
-    else
-    {
-        perror ("Failed to open titles file");
-        exit (-1);
+        printf ("%s:\n", gelijk ? "Gelijke sleutels" : "Alle paren");
+        printf ("strncmp:                    %f s\n", tStrncmp);
+        printf ("key_compareScalar:          %f s\n", tScalar);
+        printf ("key_compareVector (%s):   %f s\n", key_compareName (),
+                tVector);
+        printf ("key_compare (inline):       %f s (versnelling %.2f t.o.v. "
+                "strncmp, %.2f t.o.v. scalar)\n", tKey,
+                tKey > 0 ? tStrncmp / tKey : 0.0,
+                tKey > 0 ? tScalar / tKey : 0.0);
     }
+}
 
-    /* Probeer een isam bestand aan te maken. Als dat mislukt,
-       bestaat het mogelijk al - probeer het dan te lezen */
+/* Het p-de percentiel van een isam latentie histogram: de bovengrens
+   van het vak, in microseconden */
 
-    ip = isam_create ("klant.isam", 20, sizeof (klant), 8, 360);
-    if (!ip)
-    {
-        /* Mislukt ... bestaat het al ? */
+    static double
+isamPercentiel (struct ISAM_OP_STATS *op, double p)
+{
+    unsigned long long nodig = (unsigned long long) ceil (p * op->timed);
+    unsigned long long som = 0;
+    int     v;
 
-        isam_perror ("Failed to create file");
-        ip = isam_open ("klant.isam", 1);
-        if (!ip)
+    for (v = 0; v < ISAM_LATENCY_BUCKETS - 1; v++)
+    {
+        som += op->latency[v];
+        if (som >= nodig)
         {
-            isam_perror ("Failed to open file");
-            exit (-1);
+            break;
         }
+    }
+    return (double) (2ULL << v) / 1000.0;
+}
 
-        /* Lees alle sleutels */
+    static void
+toonStatistiek (isamPtr ip)
+{
+    static const char *naam[ISAM_NOPS] =
+    {"setKey", "readNext", "readPrev", "readByKey", "seekByKey",
+        "writeNew", "delete", "update", "readMany", "scanRange",
+        "readBySec"};
+    struct ISAM_STATS st;
+    int     i;
 
-        i = 0;
-        while (0 == isam_readNext (ip, sleutels[i], &nieuweKlant))
+    if (isam_stats (ip, &st))
+    {
+        isam_perror ("getting file statistics");
+        return;
+    }
+    printf ("routine      aanroepen  mislukt  gem. us  p50 us <  p99 us <\n");
+    for (i = 0; i < ISAM_NOPS; i++)
+    {
+        if (!st.op[i].timed)
         {
-            i++;
+            continue;
         }
-        Nsleutels = i;
-        printf ("Bestaand bestand met %d records geopend\n", Nsleutels);
+        printf ("%-10s %11llu %8llu %8.2f %9.2f %9.2f\n", naam[i],
+                st.op[i].calls, st.op[i].errors,
+                st.op[i].nanoseconds / 1000.0 / st.op[i].timed,
+                isamPercentiel (&st.op[i], 0.50),
+                isamPercentiel (&st.op[i], 0.99));
     }
-    else
+    printf ("Blokken gevraagd %llu, in cache %llu, niet in cache %llu\n",
+            st.cacheCalls, st.cacheHits, st.cacheMisses);
+    printf ("Blokken vervangen %llu, gewijzigd teruggeschreven %llu\n",
+            st.evictions, st.writeBacks);
+    printf ("Gelezen %llu keer, %llu bytes; geschreven %llu keer, %llu bytes\n",
+            st.diskReads, st.bytesRead, st.diskWrites, st.bytesWritten);
+    printf ("Zoekopdrachten beeindigd door Bloom filter %llu\n",
+            st.bloomSkips);
+    if (st.logCommits)
     {
-        /* Vul het bestand, min of meer sequentieel */
+        printf ("Wijzigingen gelogd %llu, in %llu schrijfopdrachten (met fsync), %llu bytes\n",
+                st.logCommits, st.logWrites, st.logBytes);
+    }
+    if (st.prefetches)
+    {
+        printf ("Blokken vooruit gelezen door I/O-draden %llu, via io_uring %llu\n",
+                st.prefetches, st.ringPrefetches);
+    }
+}
 
-        i = 0;
-        while (maakSleutel (sleutel))
-        {
-            maakKlant (&nieuweKlant);
-            if (isam_writeNew (ip, sleutel, &nieuweKlant))
-            {
-                isam_perror ("Failed to create customer record");
-            }
-            else
-            {
-                if (report)
-                {
-                    printKlant (stdout, NULL, sleutel, &nieuweKlant);
-                }
-                strncpy (sleutels[i], sleutel, 20);
-                i++;
-            }
-        }
-        printf ("Isam bestand bevat %d records\n", i);
+/* Meerdradige benchmark: een aantal werkers voert gedurende een vaste
+   tijd een mengsel van lees-, update-, schrijf- en poetsopdrachten uit,
+   elk met een eigen cursor (isam_openCursor) en een eigen stroom
+   random getallen. Per soort opdracht wordt de latentie bijgehouden in
+   een histogram met LAT_SUB deelvakken per macht van twee (ca. 6%
+   nauwkeurig), waaruit de percentielen worden bepaald. */
 
-        Nsleutels = i;
+#define NSOORTEN    (4)
+#define LAT_SUB     (16)
+#define LAT_VAKKEN  (64 * LAT_SUB)
 
-        /* Dit hoeft niet, maar test open en close */
+enum { LEZEN, UPDATE, SCHRIJVEN, POETSEN };
 
-        isam_close (ip);
-        ip = isam_open ("klant.isam", 1);
-    }
+static const char *soortNaam[NSOORTEN] =
+{"lezen", "update", "schrijven", "poetsen"};
 
-    /* Doe een aantal bewerkingen op het bestand -
-       lees sequentieel plus update
-       lees op sleutel
-       poets
-       schrijf nieuw
-       Probeer dit te herhalen.
-       */
-    int n_runs;
-    for(n_runs = 0; n_runs < 3; n_runs++)
-    {
-        leesBereik (ip, "2300", "4500", berekenDag (25, 1, 2002));
-        for (i = 0, j = 0; i < 500; i++)
-        {
-            if (leesBestaandRecord (ip, genrand_int31 () % Nsleutels))
+enum { UNIFORM, ZIPF, SEQUENTIEEL };
+
+static const char *verdelingNaam[] = {"uniform", "zipf", "seq"};
+
+typedef struct WERKER
+{
+    pthread_t draad;
+    isamPtr ip;
+    mt19937_state toeval;
+    int     nummer;
+    long    volgende;             /* Volgende sleutel bij sequentieel */
+    long    nieuw;                /* Aantal geschreven eigen sleutels */
+    long    gepoetst;             /* Aantal gepoetste eigen sleutels  */
+    long    aantal[NSOORTEN];
+    long    mislukt[NSOORTEN];
+    long    latentie[NSOORTEN][LAT_VAKKEN];
+}
+werker;
+
+/* Zipf verdeling over de sleutels, met exponent zipfTheta, volgens
+   Gray et al., "Quickly generating billion-record synthetic databases" */
+static
+double  zipfTheta = 0.99, zipfZetaN, zipfAlpha, zipfEta;
+
+static volatile int stoppen = 0;
+
+    static unsigned long
+nanoseconden (void)
+{
+    struct timespec t;
+
+    clock_gettime (CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000UL + t.tv_nsec;
+}
+
+    static int
+latVak (unsigned long ns)
+{
+    int     e = 0;
+
+    if (ns < LAT_SUB)
+    {
+        return ns;
+    }
+    while ((ns >> e) >= 2 * LAT_SUB)
+    {
+        e++;
+    }
+    return (e + 1) * LAT_SUB + (int) ((ns >> e) - LAT_SUB);
+}
+
+/* Het midden van vak v in ns */
+    static double
+latWaarde (int v)
+{
+    int     e = v / LAT_SUB - 1;
+
+    if (v < LAT_SUB)
+    {
+        return v;
+    }
+    return ((double) (LAT_SUB + v % LAT_SUB) + 0.5) * (1UL << e);
+}
+
+    static void
+zipfInit (long n)
+{
+    double  zeta2 = 1.0 + pow (0.5, zipfTheta);
+    long    i;
+
+    zipfZetaN = 0;
+    for (i = 1; i <= n; i++)
+    {
+        zipfZetaN += 1.0 / pow ((double) i, zipfTheta);
+    }
+    zipfAlpha = 1.0 / (1.0 - zipfTheta);
+    zipfEta = (1.0 - pow (2.0 / n, 1.0 - zipfTheta)) /
+        (1.0 - zeta2 / zipfZetaN);
+}
+
+/* Kies een sleutel volgens de gekozen verdeling. Bij zipf worden de
+   rangnummers over de sleutels verspreid, zodat de populaire sleutels
+   niet allemaal in dezelfde blokken staan */
+
+    static long
+kiesSleutel (werker * w)
+{
+    double  u, uz;
+    long    r;
+
+    switch (verdeling)
+    {
+        case ZIPF:
+            u = genrand_real2_r (&w->toeval);
+            uz = u * zipfZetaN;
+            if (uz < 1.0)
+            {
+                r = 0;
+            }
+            else if (uz < 1.0 + pow (0.5, zipfTheta))
+            {
+                r = 1;
+            }
+            else
+            {
+                r = (long) (Nsleutels *
+                        pow (zipfEta * u - zipfEta + 1.0, zipfAlpha));
+            }
+            return (r * 7919L) % Nsleutels;
+        case SEQUENTIEEL:
+            if (w->volgende >= Nsleutels)
+            {
+                w->volgende = 0;
+            }
+            return w->volgende++;
+        default:
+            return genrand_int31_r (&w->toeval) % Nsleutels;
+    }
+}
+
+/* De eigen sleutels van een werker liggen verspreid over het bestand,
+   en zijn uniek door het werkernummer */
+
+    static void
+eigenSleutel (werker * w, long n, char *sleutel)
+{
+    sprintf (sleutel, "%4d W%02d-%07d", (int) (1000 + (n * 7919L) % 9000),
+            w->nummer % 100, (int) (n % 10000000));
+}
+
+    static int
+voerUit (werker * w, int soort)
+{
+    char    sleutel[20];
+    klant   oud, nieuw;
+    int     rv;
+
+    memset (sleutel, 0, sizeof (sleutel));
+    switch (soort)
+    {
+        case LEZEN:
+            return isam_readByKey (w->ip, sleutels[kiesSleutel (w)], &oud);
+        case UPDATE:
+            memcpy (sleutel, sleutels[kiesSleutel (w)], 20);
+            if (isam_readByKey (w->ip, sleutel, &oud))
+            {
+                return -1;
+            }
+            nieuw = oud;
+            nieuw.nummerBestelling++;
+            return isam_update (w->ip, sleutel, &oud, &nieuw);
+        case SCHRIJVEN:
+            memset (&nieuw, 0, sizeof (nieuw));
+            eigenSleutel (w, w->nieuw, sleutel);
+            nieuw.nummerBestelling = w->nieuw;
+            rv = isam_writeNew (w->ip, sleutel, &nieuw);
+            w->nieuw++;
+            return rv;
+        default:
+            /* Poets de oudste eigen sleutel; de sleutels in sleutels[]
+               blijven bestaan, zodat lezen en update niet steeds vaker
+               mislukken */
+            if (w->gepoetst >= w->nieuw)
+            {
+                return -1;
+            }
+            eigenSleutel (w, w->gepoetst++, sleutel);
+            if (isam_readByKey (w->ip, sleutel, &oud))
+            {
+                return -1;
+            }
+            return isam_delete (w->ip, sleutel, &oud);
+    }
+}
+
+    static void *
+werk (void *arg)
+{
+    werker *w = (werker *) arg;
+    unsigned long t0, t1;
+    int     soort, r;
+
+    while (!stoppen)
+    {
+        r = genrand_int31_r (&w->toeval) % 100;
+        for (soort = 0; soort < NSOORTEN - 1 && r >= menging[soort]; soort++)
+        {
+            r -= menging[soort];
+        }
+        t0 = nanoseconden ();
+        if (voerUit (w, soort))
+        {
+            w->mislukt[soort]++;
+        }
+        t1 = nanoseconden ();
+        w->aantal[soort]++;
+        w->latentie[soort][latVak (t1 - t0)]++;
+    }
+    return NULL;
+}
+
+/* Het p-de percentiel (0 < p < 1) van een histogram, in microseconden */
+
+    static double
+percentiel (long *latentie, long aantal, double p)
+{
+    long    nodig = (long) ceil (p * aantal), som = 0;
+    int     v;
+
+    for (v = 0; v < LAT_VAKKEN; v++)
+    {
+        som += latentie[v];
+        if (som >= nodig)
+        {
+            return latWaarde (v) / 1000.0;
+        }
+    }
+    return latWaarde (LAT_VAKKEN - 1) / 1000.0;
+}
+
+    static void
+meerdradig (void)
+{
+    werker *w;
+    isamPtr ip;
+    struct ISAM_CACHE_STATS stats;
+    struct timeval start, stop;
+    long    aantal[NSOORTEN], mislukt[NSOORTEN], totaal = 0;
+    long   *latentie;
+    double  t;
+    klant   k;
+    int     i, s, v, cache = cacheBlokken;
+
+    /* Elke cursor houdt twee blokken in de cache vast */
+    if (cache < 2 * draden + ISAM_DEFAULT_CACHE_SIZE / 2)
+    {
+        cache = 2 * draden + ISAM_DEFAULT_CACHE_SIZE / 2;
+    }
+    ip = isam_openWithCache ("klant.isam", openVlaggen, cache);
+    if (!ip)
+    {
+        isam_perror ("opening file for the threads");
+        return;
+    }
+    /* Gebruik alleen de sleutels die nu in het bestand staan */
+    for (i = 0; i < maxSleutels && !isam_readNext (ip, sleutels[i], &k); i++)
+        ;
+    Nsleutels = i;
+    if (Nsleutels < 1)
+    {
+        isam_close (ip);
+        return;
+    }
+    if (verdeling == ZIPF)
+    {
+        zipfInit (Nsleutels);
+    }
+    w = calloc (draden, sizeof (werker));
+    latentie = calloc (LAT_VAKKEN, sizeof (long));
+    if (!w || !latentie)
+    {
+        perror ("allocating workers");
+        exit (-1);
+    }
+    printf ("%d draden, %d s, mengsel %d/%d/%d/%d, sleutels %s, cache %d\n",
+            draden, duur, menging[LEZEN], menging[UPDATE],
+            menging[SCHRIJVEN], menging[POETSEN], verdelingNaam[verdeling],
+            cache);
+    for (i = 0; i < draden; i++)
+    {
+        w[i].nummer = i;
+        w[i].volgende = i * (Nsleutels / draden);
+        init_genrand_r (&w[i].toeval, 171717 + i);
+        w[i].ip = isam_openCursor (ip);
+        if (!w[i].ip)
+        {
+            isam_perror ("opening a cursor");
+            exit (-1);
+        }
+    }
+    isam_cacheStats (&stats);
+    stoppen = 0;
+    gettimeofday (&start, NULL);
+    for (i = 0; i < draden; i++)
+    {
+        if (pthread_create (&w[i].draad, NULL, werk, &w[i]))
+        {
+            perror ("starting a thread");
+            exit (-1);
+        }
+    }
+    sleep (duur);
+    stoppen = 1;
+    for (i = 0; i < draden; i++)
+    {
+        pthread_join (w[i].draad, NULL);
+    }
+    gettimeofday (&stop, NULL);
+    isam_cacheStats (&stats);
+    t = get_sec (stop) - get_sec (start);
+
+    printf ("soort       aantal  mislukt      ops/s    p50 us    p95 us    p99 us   p999 us\n");
+    for (s = 0; s < NSOORTEN; s++)
+    {
+        aantal[s] = mislukt[s] = 0;
+        memset (latentie, 0, LAT_VAKKEN * sizeof (long));
+        for (i = 0; i < draden; i++)
+        {
+            aantal[s] += w[i].aantal[s];
+            mislukt[s] += w[i].mislukt[s];
+            for (v = 0; v < LAT_VAKKEN; v++)
+            {
+                latentie[v] += w[i].latentie[s][v];
+            }
+        }
+        totaal += aantal[s];
+        if (!aantal[s])
+        {
+            continue;
+        }
+        printf ("%-9s %8ld %8ld %10.0f %9.2f %9.2f %9.2f %9.2f\n",
+                soortNaam[s], aantal[s], mislukt[s], aantal[s] / t,
+                percentiel (latentie, aantal[s], 0.50),
+                percentiel (latentie, aantal[s], 0.95),
+                percentiel (latentie, aantal[s], 0.99),
+                percentiel (latentie, aantal[s], 0.999));
+    }
+    printf ("totaal    %8ld          %10.0f\n", totaal, totaal / t);
+    printf ("Cache calls %d\n", stats.cache_call);
+    printf ("Cache hits %d (hit ratio %.3f)\n", stats.cache_hits,
+            stats.cache_call ?
+            (double) stats.cache_hits / stats.cache_call : 0.0);
+    printf ("Cache evictions %d\n", stats.cache_evictions);
+    printf ("Disk reads %d\n", stats.disk_reads);
+    printf ("Disk writes %d\n", stats.disk_writes);
+    printf ("Searches ended by Bloom filter %d\n", stats.bloom_skips);
+
+    if (toonStats)
+    {
+        toonStatistiek (ip);
+    }
+    for (i = 0; i < draden; i++)
+    {
+        isam_close (w[i].ip);
+    }
+    isam_close (ip);
+    free (w);
+    free (latentie);
+}
+
+/* Vergelijk isam_readByKey met isam_readManyByKey: beide lezen
+   VEEL_GROEPEN groepen van veelSleutels willekeurige sleutels uit
+   sleutels[] (ook van vertrokken klanten), elk met een pas geopend
+   bestand, en de resultaten moeten gelijk zijn */
+
+#define VEEL_GROEPEN    (20)
+
+    static void
+leesVeel (void)
+{
+    static const char *manierNaam[2] = {"readByKey", "readManyByKey"};
+    isamPtr ip;
+    const char **groep;
+    klant  *data[2];
+    unsigned long *lengte[2];
+    int    *gevonden[2];
+    struct ISAM_STATS st;
+    unsigned long t0;
+    long    n, aantal[2];
+    int     manier, g, i, fout = 0;
+
+    n = (long) VEEL_GROEPEN * veelSleutels;
+    groep = malloc (n * sizeof (char *));
+    for (manier = 0; manier < 2; manier++)
+    {
+        data[manier] = calloc (n, sizeof (klant));
+        lengte[manier] = calloc (n, sizeof (unsigned long));
+        gevonden[manier] = calloc (n, sizeof (int));
+        if (!data[manier] || !lengte[manier] || !gevonden[manier])
+        {
+            groep = NULL;
+        }
+    }
+    if (!groep)
+    {
+        perror ("allocating keys");
+        exit (-1);
+    }
+    for (i = 0; i < n; i++)
+    {
+        groep[i] = sleutels[genrand_int31 () % Nsleutels];
+    }
+    printf ("%d groepen van %d sleutels, cache %d blokken:\n",
+            VEEL_GROEPEN, veelSleutels, cacheBlokken);
+    printf ("manier           gevonden      ms  blokken gevraagd  gelezen\n");
+    for (manier = 0; manier < 2; manier++)
+    {
+        ip = isam_openWithCache ("klant.isam", openVlaggen, cacheBlokken);
+        if (!ip)
+        {
+            isam_perror ("Failed to open file");
+            return;
+        }
+        aantal[manier] = 0;
+        t0 = nanoseconden ();
+        for (g = 0; g < VEEL_GROEPEN; g++)
+        {
+            i = g * veelSleutels;
+            if (manier == 1)
+            {
+                aantal[manier] += isam_readManyByKey (ip, groep + i,
+                        veelSleutels, data[manier] + i, lengte[manier] + i,
+                        gevonden[manier] + i);
+                continue;
+            }
+            for (; i < (g + 1) * veelSleutels; i++)
+            {
+                gevonden[manier][i] = !isam_readByKey (ip, groep[i],
+                        data[manier] + i);
+                if (gevonden[manier][i])
+                {
+                    lengte[manier][i] = isam_dataLength (ip);
+                }
+                aantal[manier] += gevonden[manier][i];
+            }
+        }
+        t0 = nanoseconden () - t0;
+        isam_stats (ip, &st);
+        printf ("%-15s %9ld %7.2f %17llu %8llu\n", manierNaam[manier],
+                aantal[manier], t0 / 1e6, st.cacheCalls, st.diskReads);
+        isam_close (ip);
+    }
+    for (i = 0; i < n; i++)
+    {
+        if (gevonden[0][i] != gevonden[1][i] || (gevonden[0][i] &&
+                    (memcmp (data[0] + i, data[1] + i, sizeof (klant)) ||
+                     lengte[0][i] != lengte[1][i])))
+        {
+            fout++;
+        }
+    }
+    printf ("Verschillen tussen beide manieren: %d\n", fout);
+    for (manier = 0; manier < 2; manier++)
+    {
+        free (data[manier]);
+        free (lengte[manier]);
+        free (gevonden[manier]);
+    }
+    free (groep);
+}
+
+/* Vergelijk een scan met isam_setKey en isam_readNext met isam_scanRange,
+   over het hele bestand en over het bereik van de mailings, elk met een
+   pas geopend bestand. Beide tellen de records en berekenen een
+   controlegetal over sleutels, gegevens en de lengte van de gegevens. */
+
+typedef struct
+{
+    long    aantal;
+    unsigned long controle;
+}
+scanTelling;
+
+    static void
+telRecord (scanTelling * t, const char *sleutel, unsigned long sinds,
+           unsigned long lengte)
+{
+    int     i;
+
+    t->aantal++;
+    for (i = 0; i < 20 && sleutel[i]; i++)
+    {
+        t->controle = t->controle * 31 + (unsigned char) sleutel[i];
+    }
+    t->controle += sinds + lengte;
+}
+
+/* De gegevens in de cache hoeven niet uitgelijnd te zijn */
+
+    static int
+scanRecord (void *context, const char *sleutel, const void *data,
+            unsigned long lengte)
+{
+    unsigned long sinds;
+
+    memcpy (&sinds, (const char *) data + offsetof (klant, klantSinds),
+            sizeof (sinds));
+    telRecord ((scanTelling *) context, sleutel, sinds, lengte);
+    return 0;
+}
+
+    static void
+leesScan (void)
+{
+    static const char *manierNaam[2] = {"readNext", "scanRange"};
+    static char *bereik[2][2] = {{"", NULL}, {"2300", "4500"}};
+    isamPtr ip;
+    scanTelling telling[2];
+    struct ISAM_STATS st;
+    unsigned long t0;
+    char    sleutel[20];
+    klant   k;
+    int     manier, b;
+
+    printf ("bereik     manier      records      ms  blokken gevraagd  gelezen\n");
+    for (b = 0; b < 2; b++)
+    {
+        for (manier = 0; manier < 2; manier++)
+        {
+            ip = isam_openWithCache ("klant.isam", openVlaggen, cacheBlokken);
+            if (!ip)
+            {
+                isam_perror ("Failed to open file");
+                return;
+            }
+            memset (&telling[manier], 0, sizeof (scanTelling));
+            t0 = nanoseconden ();
+            if (manier == 1)
+            {
+                if (isam_scanRange (ip, bereik[b][0], bereik[b][1],
+                            scanRecord, &telling[manier]) < 0)
+                {
+                    isam_perror ("scanning range");
+                }
+            }
+            else
+            {
+                isam_setKey (ip, bereik[b][0]);
+                while (!isam_readNext (ip, sleutel, &k) &&
+                        (!bereik[b][1] ||
+                         strncmp (sleutel, bereik[b][1], 20) <= 0))
+                {
+                    telRecord (&telling[manier], sleutel, k.klantSinds,
+                            isam_dataLength (ip));
+                }
+            }
+            t0 = nanoseconden () - t0;
+            isam_stats (ip, &st);
+            printf ("%-10s %-10s %8ld %7.2f %17llu %8llu\n",
+                    b ? "2300-4500" : "alles", manierNaam[manier],
+                    telling[manier].aantal, t0 / 1e6, st.cacheCalls,
+                    st.diskReads);
+            isam_close (ip);
+        }
+        if (telling[0].aantal != telling[1].aantal ||
+                telling[0].controle != telling[1].controle)
+        {
+            printf ("Verschil tussen beide manieren!\n");
+        }
+    }
+}
+
+/* Vergelijk het zoeken van klanten op naam door het hele bestand te
+   lezen en met isam_readBySecondary, voor de eerste twintig namen */
+
+#define SECUNDAIRE_NAMEN (20)
+
+    static void
+leesSecundair (void)
+{
+    static const char *manierNaam[2] = {"readNext", "readBySecondary"};
+    isamPtr ip;
+    scanTelling telling[2];
+    struct ISAM_STATS st;
+    unsigned long t0;
+    unsigned long long gevraagd;
+    char    sleutel[20];
+    klant   k;
+    int     manier, i;
+
+    ip = isam_openWithCache ("klant.isam", openVlaggen, cacheBlokken);
+    if (!ip)
+    {
+        isam_perror ("Failed to open file");
+        return;
+    }
+    printf ("manier            records      ms  blokken gevraagd\n");
+    for (manier = 0; manier < 2; manier++)
+    {
+        memset (&telling[manier], 0, sizeof (scanTelling));
+        isam_stats (ip, &st);
+        gevraagd = st.cacheCalls;
+        t0 = nanoseconden ();
+        for (i = 0; i < SECUNDAIRE_NAMEN && i < Nnamen; i++)
+        {
+            if (manier == 1)
+            {
+                if (isam_readBySecondary (ip, 0, namen[i].naam, scanRecord,
+                            &telling[manier]) < 0)
+                {
+                    isam_perror ("reading by name");
+                }
+                continue;
+            }
+            isam_setKey (ip, "");
+            while (!isam_readNext (ip, sleutel, &k))
+            {
+                if (!strncmp (k.naam, namen[i].naam, 64))
+                {
+                    telRecord (&telling[manier], sleutel, k.klantSinds,
+                            isam_dataLength (ip));
+                }
+            }
+        }
+        t0 = nanoseconden () - t0;
+        isam_stats (ip, &st);
+        printf ("%-16s %8ld %7.2f %17llu\n", manierNaam[manier],
+                telling[manier].aantal, t0 / 1e6, st.cacheCalls - gevraagd);
+    }
+    /* De volgorde verschilt, dus alleen de aantallen zijn te vergelijken */
+    if (telling[0].aantal != telling[1].aantal)
+    {
+        printf ("Verschil tussen beide manieren!\n");
+    }
+    isam_close (ip);
+}
+
+/* Verwijder het bestand uit de page cache van de kernel, zodat alle
+   blokken weer van de schijf gelezen moeten worden */
+
+    static void
+vergeetBestand (const char *naam)
+{
+    int     fd = open (naam, O_RDONLY);
+
+    if (fd < 0)
+    {
+        perror (naam);
+        return;
+    }
+    fdatasync (fd);
+    posix_fadvise (fd, 0, 0, POSIX_FADV_DONTNEED);
+    close (fd);
+}
+
+/* Vergelijk isam_readManyByKey (DIEPTE_SLEUTELS willekeurige sleutels)
+   en isam_scanRange (het hele bestand) zonder en met ioDiepte
+   I/O-draden, elk met een pas geopend bestand dat niet in de page
+   cache staat */
+
+#define DIEPTE_SLEUTELS (5000)
+
+    static void
+leesDiepte (void)
+{
+    static const char *manierNaam[2] = {"readManyByKey", "scanRange"};
+    static const char *motorNaam[3] = {"-", "draden", "io_uring"};
+    isamPtr ip;
+    const char **groep;
+    klant  *data;
+    int    *gevonden;
+    scanTelling telling;
+    struct ISAM_STATS st;
+    unsigned long t0;
+    long    aantal;
+    int     manier, d, i;
+
+    groep = malloc (DIEPTE_SLEUTELS * sizeof (char *));
+    data = calloc (DIEPTE_SLEUTELS, sizeof (klant));
+    gevonden = calloc (DIEPTE_SLEUTELS, sizeof (int));
+    if (!groep || !data || !gevonden)
+    {
+        perror ("allocating keys");
+        exit (-1);
+    }
+    for (i = 0; i < DIEPTE_SLEUTELS; i++)
+    {
+        groep[i] = sleutels[genrand_int31 () % Nsleutels];
+    }
+    printf ("Koude cache, cache %d blokken:\n", cacheBlokken);
+    printf ("manier         diepte  motor     records      ms  gelezen  vooruit  io_uring\n");
+    for (manier = 0; manier < 2; manier++)
+    {
+        for (d = 0; d < 3; d++)
+        {
+            vergeetBestand ("klant.isam");
+            ip = isam_openWithCache ("klant.isam", openVlaggen, cacheBlokken);
+            if (!ip)
+            {
+                isam_perror ("Failed to open file");
+                return;
+            }
+            if (d && isam_setQueueDepth (ip,
+                        d == 1 ? ioDiepte | ISAM_QUEUE_THREADS : ioDiepte))
+            {
+                isam_perror ("setting queue depth");
+            }
+            memset (&telling, 0, sizeof (telling));
+            t0 = nanoseconden ();
+            if (manier == 0)
+            {
+                aantal = isam_readManyByKey (ip, groep, DIEPTE_SLEUTELS,
+                        data, NULL, gevonden);
+            }
+            else
+            {
+                aantal = isam_scanRange (ip, "", NULL, scanRecord, &telling);
+            }
+            t0 = nanoseconden () - t0;
+            if (aantal < 0)
+            {
+                isam_perror (manierNaam[manier]);
+            }
+            isam_stats (ip, &st);
+            printf ("%-14s %6d  %-8s %8ld %7.2f %8llu %8llu %9llu\n",
+                    manierNaam[manier], d ? ioDiepte : 0, motorNaam[d],
+                    aantal, t0 / 1e6, st.diskReads, st.prefetches,
+                    st.ringPrefetches);
+            isam_close (ip);
+        }
+    }
+    free (groep);
+    free (data);
+    free (gevonden);
+}
+
+/* Controleer het hele bestand met isam_verify, eerst niet en dan wel in
+   de page cache, en meet de snelheid van crc32c zelf */
+
+#define CRC_BYTES   (1024 * 1024)
+#define CRC_RONDES  (256)
+
+    static void
+controleer (void)
+{
+    struct ISAM_VERIFY_STATS v;
+    struct ISAM_STATS st;
+    isamPtr ip;
+    unsigned long t0, tScalar, tCrc;
+    unsigned long somScalar = 0, somCrc = 0;
+    char   *buf;
+    long    problemen;
+    int     warm, i;
+
+    printf ("Controle met isam_verify:\n");
+    printf ("cache   blokken  problemen      ms     MB/s\n");
+    for (warm = 0; warm < 2; warm++)
+    {
+        if (!warm)
+        {
+            vergeetBestand ("klant.isam");
+        }
+        ip = isam_openWithCache ("klant.isam", openVlaggen, cacheBlokken);
+        if (!ip)
+        {
+            isam_perror ("Failed to open file");
+            return;
+        }
+        isam_resetStats (ip);
+        t0 = nanoseconden ();
+        problemen = isam_verify (ip, &v);
+        t0 = nanoseconden () - t0;
+        if (problemen < 0)
+        {
+            isam_perror ("verifying the file");
+        }
+        isam_stats (ip, &st);
+        printf ("%-5s %9lu %10ld %7.2f %8.1f\n", warm ? "warm" : "koud",
+                v.blocks, problemen, t0 / 1e6,
+                t0 ? st.bytesRead * 1e3 / t0 : 0.0);
+        if (problemen > 0)
+        {
+            printf ("Foute blokken %lu (eerste %lu), header/index %lu, "
+                    "foute verwijzingen %lu, einden %lu, ketting %s\n",
+                    v.badBlocks, v.firstBadBlock, v.badHeader, v.badLinks,
+                    v.chainEnds, v.chainMismatch ? "klopt niet" : "klopt");
+        }
+        isam_close (ip);
+    }
+    buf = malloc (CRC_BYTES);
+    if (!buf)
+    {
+        perror ("allocating buffer");
+        return;
+    }
+    for (i = 0; i < CRC_BYTES; i++)
+    {
+        buf[i] = genrand_int31 ();
+    }
+    t0 = nanoseconden ();
+    for (i = 0; i < CRC_RONDES / 16; i++)
+    {
+        somScalar += crc32cScalar (0, buf, CRC_BYTES);
+    }
+    tScalar = (nanoseconden () - t0) * 16;
+    t0 = nanoseconden ();
+    for (i = 0; i < CRC_RONDES; i++)
+    {
+        somCrc += crc32c (0, buf, CRC_BYTES);
+    }
+    tCrc = nanoseconden () - t0;
+    if (somScalar * 16 != somCrc)
+    {
+        printf ("crc32c geeft een ander resultaat dan crc32cScalar!\n");
+    }
+    printf ("crc32c (scalar): %8.1f MB/s\n",
+            tScalar ? (double) CRC_RONDES * CRC_BYTES * 1e3 / tScalar : 0.0);
+    printf ("crc32c (%s): %8.1f MB/s\n", crc32cName (),
+            tCrc ? (double) CRC_RONDES * CRC_BYTES * 1e3 / tCrc : 0.0);
+    free (buf);
+}
+
+/* Lees het hele bestand SNAP_RONDES keer met isam_readNext terwijl
+   SNAP_DRADEN draden schrijven, updaten en poetsen, afwisselend met een
+   gewone cursor, die records van voor en na de wijzigingen door elkaar
+   ziet, en met een momentopname, die elke keer precies de records ziet
+   van het moment waarop die begon */
+
+#define SNAP_DRADEN (2)
+#define SNAP_RONDES (20)
+
+typedef struct SNAPTELLING
+{
+    long    minimum, maximum;     /* Gelezen records per scan         */
+    long    volgorde;             /* Sleutels niet in oplopende orde  */
+    long    hervat;               /* Fouten, scan hervat met setKey   */
+    unsigned long ns;
+}
+snapTelling;
+
+    static void
+snapScan (isamPtr ip, snapTelling * t, int ronde)
+{
+    char    sleutel[20], vorige[20];
+    klant   k;
+    unsigned long t0;
+    long    aantal = 0, hervat = 0;
+
+    memset (vorige, 0, sizeof (vorige));
+    isam_setKey (ip, "");
+    t0 = nanoseconden ();
+    for (;;)
+    {
+        if (isam_readNext (ip, sleutel, &k))
+        {
+            if (isam_error == ISAM_EOF || hervat >= 100 ||
+                    isam_setKey (ip, vorige))
+            {
+                break;
+            }
+            hervat++;
+            continue;
+        }
+        if (aantal && strncmp (sleutel, vorige, 20) <= 0)
+        {
+            t->volgorde++;
+        }
+        memcpy (vorige, sleutel, 20);
+        aantal++;
+    }
+    t->ns += nanoseconden () - t0;
+    t->hervat += hervat;
+    if (!ronde || aantal < t->minimum)
+    {
+        t->minimum = aantal;
+    }
+    if (!ronde || aantal > t->maximum)
+    {
+        t->maximum = aantal;
+    }
+}
+
+    static void
+leesMomentopname (void)
+{
+    static const char *manierNaam[2] = {"cursor", "momentopname"};
+    static int snapMenging[NSOORTEN] = {0, 40, 30, 30};
+    werker *w;
+    isamPtr ip, snap, c;
+    snapTelling t[2];
+    struct ISAM_STATS st;
+    klant   k;
+    long    voor, ops;
+    int     i, manier, ronde, oudMenging[NSOORTEN];
+
+    ip = isam_openWithCache ("klant.isam", openVlaggen,
+            cacheBlokken + 2 * (SNAP_DRADEN + 1));
+    if (!ip)
+    {
+        isam_perror ("Failed to open file");
+        return;
+    }
+    for (i = 0; i < maxSleutels && !isam_readNext (ip, sleutels[i], &k); i++)
+        ;
+    Nsleutels = i;
+    w = calloc (SNAP_DRADEN, sizeof (werker));
+    c = isam_openCursor (ip);
+    if (!w || !c || Nsleutels < 1)
+    {
+        isam_perror ("opening a cursor");
+        free (w);
+        isam_close (ip);
+        return;
+    }
+    snap = isam_snapshot_begin (ip);
+    if (!snap)
+    {
+        isam_perror ("beginning a snapshot");
+        free (w);
+        isam_close (c);
+        isam_close (ip);
+        return;
+    }
+    /* Zonder schrijvers ziet de cursor hetzelfde als de momentopname */
+    memset (t, 0, sizeof (t));
+    snapScan (c, &t[0], 0);
+    voor = t[0].minimum;
+    memset (t, 0, sizeof (t));
+    isam_resetStats (ip);
+    for (i = 0; i < NSOORTEN; i++)
+    {
+        oudMenging[i] = menging[i];
+        menging[i] = snapMenging[i];
+    }
+    stoppen = 0;
+    for (i = 0; i < SNAP_DRADEN; i++)
+    {
+        w[i].nummer = 90 + i;
+        init_genrand_r (&w[i].toeval, 272727 + i);
+        w[i].ip = isam_openCursor (ip);
+        if (!w[i].ip || pthread_create (&w[i].draad, NULL, werk, &w[i]))
+        {
+            perror ("starting a thread");
+            exit (-1);
+        }
+    }
+    for (ronde = 0; ronde < SNAP_RONDES; ronde++)
+    {
+        for (manier = 0; manier < 2; manier++)
+        {
+            snapScan (manier ? snap : c, &t[manier], ronde);
+        }
+    }
+    stoppen = 1;
+    for (i = 0, ops = 0; i < SNAP_DRADEN; i++)
+    {
+        pthread_join (w[i].draad, NULL);
+        ops += w[i].aantal[UPDATE] + w[i].aantal[SCHRIJVEN] +
+            w[i].aantal[POETSEN];
+        isam_close (w[i].ip);
+    }
+    for (i = 0; i < NSOORTEN; i++)
+    {
+        menging[i] = oudMenging[i];
+    }
+    isam_stats (ip, &st);
+
+    printf ("%d keer readNext tijdens %d schrijvende draden (%ld records "
+            "bij begin momentopname):\n", SNAP_RONDES, SNAP_DRADEN, voor);
+    printf ("manier       minimum  maximum  volgorde  hervat   ms/scan\n");
+    for (manier = 0; manier < 2; manier++)
+    {
+        printf ("%-12s %7ld %8ld %9ld %7ld %9.2f\n", manierNaam[manier],
+                t[manier].minimum, t[manier].maximum, t[manier].volgorde,
+                t[manier].hervat, t[manier].ns / 1e6 / SNAP_RONDES);
+    }
+    printf ("%ld wijzigingen, %llu blokken bewaard voor de momentopname\n",
+            ops, st.snapshotCopies);
+    if (t[1].minimum != voor || t[1].maximum != voor || t[1].volgorde ||
+            t[1].hervat)
+    {
+        printf ("De momentopname ziet een ander bestand dan bij het "
+                "begin!\n");
+    }
+    if (isam_snapshot_end (snap))
+    {
+        isam_perror ("ending the snapshot");
+    }
+    isam_close (c);
+    isam_close (ip);
+    free (w);
+}
+
+/* Zoek ZOEKACTIES willekeurige sleutels op in een index van indexSleutels
+   oplopende willekeurige sleutels (een per blok): met index_keyToBlock,
+   die eerst de prefixen van de sleutels vergelijkt, met
+   index_keyToBlockNoPrefix, die alleen hele sleutels vergelijkt, en in
+   een Eytzinger indeling van dezelfde sleutels, met prefixen, waarin de
+   kinderen van element k op 2k en 2k+1 staan. Alle drie moeten
+   hetzelfde blok vinden. */
+
+#define ZOEKACTIES  (1000000)
+
+typedef struct EYTZINGER
+{
+    long    n;
+    unsigned long *prefix;
+    char  (*sleutel)[20];
+    long   *blok;
+}
+eytzinger;
+
+/* De eerste 8 bytes van een sleutel (tot de nul) als getal, zoals
+   index.c die vergelijkt */
+
+    static unsigned long
+sleutelPrefix (const char *sleutel)
+{
+    unsigned long prefix = 0;
+    unsigned int i;
+    int     einde = 0;
+
+    for (i = 0; i < sizeof (unsigned long); i++)
+    {
+        if (!sleutel[i])
+        {
+            einde = 1;
+        }
+        prefix = (prefix << 8) | (einde ? 0 : (unsigned char) sleutel[i]);
+    }
+    return prefix;
+}
+
+/* Vul element k en zijn kinderen met de gesorteerde sleutels vanaf
+   volgende; geeft de eerste sleutel na deze deelboom terug */
+
+    static long
+vulEytzinger (eytzinger * e, char (*sleutel)[20], long volgende, long k)
+{
+    if (k > e->n)
+    {
+        return volgende;
+    }
+    volgende = vulEytzinger (e, sleutel, volgende, 2 * k);
+    memcpy (e->sleutel[k], sleutel[volgende], 20);
+    e->prefix[k] = sleutelPrefix (sleutel[volgende]);
+    e->blok[k] = volgende;
+    return vulEytzinger (e, sleutel, volgende + 1, 2 * k + 1);
+}
+
+/* Het blok van de grootste sleutel die niet groter is dan de gezochte:
+   na de afdaling geven de laatste bits van k de laatste stap naar
+   rechts aan */
+
+    static long
+zoekEytzinger (eytzinger * e, const char *sleutel)
+{
+    unsigned long prefix = sleutelPrefix (sleutel);
+    long    k = 1;
+    int     rv;
+
+    while (k <= e->n)
+    {
+        rv = (prefix != e->prefix[k]) ? (prefix < e->prefix[k] ? -1 : 1) :
+            key_compare (sleutel, e->sleutel[k], 20);
+        k = 2 * k + (rv >= 0);
+    }
+    k >>= __builtin_ffsl (k);
+    return k ? e->blok[k] : -1;
+}
+
+    static int
+sleutelOrde (const void *a, const void *b)
+{
+    return strncmp ((const char *) a, (const char *) b, 20);
+}
+
+    static void
+zoekIndex (void)
+{
+    static const char *manierNaam[3] =
+    {"index_keyToBlock", "index_keyToBlockNoPrefix", "Eytzinger"};
+    index_handle in;
+    eytzinger e;
+    char  (*sleutel)[20];
+    long   *zoek, n, i, j, blok, som[3];
+    unsigned long t0, t[3];
+    int     manier;
+
+    sleutel = calloc (indexSleutels + 1, 20);
+    zoek = malloc (ZOEKACTIES * sizeof (long));
+    if (!sleutel || !zoek)
+    {
+        perror ("allocating keys");
+        exit (-1);
+    }
+    /* Sleutel 0 is de lege sleutel, waar een nieuwe index mee begint */
+    for (i = 1; i <= indexSleutels; i++)
+    {
+        for (j = 0; j < 16; j++)
+        {
+            sleutel[i][j] = 'a' + genrand_int31 () % 26;
+        }
+    }
+    qsort (sleutel + 1, indexSleutels, 20, sleutelOrde);
+    for (i = 1, n = 1; i <= indexSleutels; i++)
+    {
+        if (strncmp (sleutel[i], sleutel[n - 1], 20))
+        {
+            memcpy (sleutel[n++], sleutel[i], 20);
+        }
+    }
+    in = index_makeNew (n, 20, 0);
+    for (i = 1; in && i < n; i++)
+    {
+        if (index_addKey (in, sleutel[i], i) < 0)
+        {
+            index_free (in);
+            in = NULL;
+        }
+    }
+    e.n = n;
+    e.prefix = malloc ((n + 1) * sizeof (unsigned long));
+    e.sleutel = malloc ((n + 1) * 20);
+    e.blok = malloc ((n + 1) * sizeof (long));
+    if (!in || !e.prefix || !e.sleutel || !e.blok)
+    {
+        printf ("Index maken mislukt (index_error %d)\n", index_error);
+        exit (-1);
+    }
+    vulEytzinger (&e, sleutel, 0, 1);
+    for (i = 0; i < ZOEKACTIES; i++)
+    {
+        zoek[i] = genrand_int31 () % n;
+    }
+    for (manier = 0; manier < 3; manier++)
+    {
+        som[manier] = 0;
+        t0 = nanoseconden ();
+        for (i = 0; i < ZOEKACTIES; i++)
+        {
+            switch (manier)
+            {
+                case 0:
+                    blok = index_keyToBlock (in, sleutel[zoek[i]]);
+                    break;
+                case 1:
+                    blok = index_keyToBlockNoPrefix (in, sleutel[zoek[i]]);
+                    break;
+                default:
+                    blok = zoekEytzinger (&e, sleutel[zoek[i]]);
+            }
+            som[manier] += blok;
+        }
+        t[manier] = nanoseconden () - t0;
+    }
+    printf ("Zoeken in een index met %ld sleutels, %d keer:\n", n,
+            ZOEKACTIES);
+    for (manier = 0; manier < 3; manier++)
+    {
+        printf ("%-26s %8.1f ns per zoekactie\n", manierNaam[manier],
+                (double) t[manier] / ZOEKACTIES);
+    }
+    if (som[0] != som[1] || som[0] != som[2])
+    {
+        printf ("De zoekacties vinden verschillende blokken!\n");
+    }
+    index_free (in);
+    free (e.prefix);
+    free (e.sleutel);
+    free (e.blok);
+    free (sleutel);
+    free (zoek);
+}
+
+/* Verdeel klant.isam over partities partities (klantp.isam.0, ...), met
+   grenzen gekozen uit een steekproef van PART_STEEKPROEF sleutels, en
+   vergelijk: isam_readByKey met ptable_readByKey, en een scan van het
+   hele bestand met een scan van de partities na elkaar en met
+   ptable_scanRange, die ze tegelijk leest (koud). Daarna wordt een op de
+   tien klanten verwijderd. */
+
+#define PART_STEEKPROEF (1000)
+
+    static void
+partitioneer (void)
+{
+    static const char *manierNaam[3] =
+    {"klant.isam", "partities na elkaar", "ptable_scanRange"};
+    const char *steekproef[PART_STEEKPROEF];
+    char    grenzen[(PTABLE_MAX_PARTS - 1) * 20];
+    char    naam[64], sleutel[20];
+    long    aantal[PTABLE_MAX_PARTS];
+    long    n, verschil, weg, rv;
+    unsigned long t0, t[3];
+    scanTelling telling[3];
+    isamPtr ip;
+    ptablePtr pt;
+    klant   k, kp;
+    int     np, i, manier;
+
+    ip = isam_openWithCache ("klant.isam", openVlaggen, cacheBlokken);
+    if (!ip)
+    {
+        isam_perror ("Failed to open file");
+        return;
+    }
+    for (i = 0; i < maxSleutels && !isam_readNext (ip, sleutels[i], &k); i++)
+        ;
+    Nsleutels = i;
+    if (Nsleutels < 1)
+    {
+        isam_close (ip);
+        return;
+    }
+    for (i = 0; i < PART_STEEKPROEF; i++)
+    {
+        steekproef[i] = sleutels[genrand_int31 () % Nsleutels];
+    }
+    np = ptable_chooseBounds (steekproef, PART_STEEKPROEF, 20,
+            partities > PTABLE_MAX_PARTS ? PTABLE_MAX_PARTS : partities,
+            grenzen);
+    unlink ("klantp.isam");
+    for (i = 0; i < PTABLE_MAX_PARTS; i++)
+    {
+        sprintf (naam, "klantp.isam.%d", i);
+        unlink (naam);
+    }
+    pt = (np < 1) ? NULL : ptable_create ("klantp.isam", NULL, np, grenzen,
+            20, sizeof (klant), 8, Nsleutels / 8 / np + 1, cacheBlokken,
+            maakOpties);
+    if (!pt)
+    {
+        isam_perror ("creating the partitioned table");
+        isam_close (ip);
+        return;
+    }
+
+    /* Kopieer de records */
+    memset (aantal, 0, sizeof (aantal));
+    isam_setKey (ip, "");
+    t0 = nanoseconden ();
+    while (!isam_readNext (ip, sleutel, &k))
+    {
+        if (ptable_writeNew (pt, sleutel, &k))
+        {
+            isam_perror ("writing to the partitioned table");
+            break;
+        }
+        aantal[ptable_partitionOf (pt, sleutel)]++;
+    }
+    t0 = nanoseconden () - t0;
+    printf ("%d partities, grenzen uit %d sleutels, gevuld in %.2f ms:\n",
+            np, PART_STEEKPROEF, t0 / 1e6);
+    for (i = 0; i < np; i++)
+    {
+        printf ("partitie %2d: %6ld records, vanaf \"%.20s\"\n", i,
+                aantal[i], i ? grenzen + (i - 1) * 20 : "");
+    }
+
+    /* Zoeken op sleutel */
+    for (manier = 0; manier < 2; manier++)
+    {
+        t0 = nanoseconden ();
+        for (i = 0; i < Nsleutels; i++)
+        {
+            if (manier)
+            {
+                ptable_readByKey (pt, sleutels[i], &kp);
+            }
+            else
+            {
+                isam_readByKey (ip, sleutels[i], &k);
+            }
+        }
+        t[manier] = nanoseconden () - t0;
+    }
+    for (i = 0, verschil = 0; i < Nsleutels; i++)
+    {
+        if (isam_readByKey (ip, sleutels[i], &k) ||
+                ptable_readByKey (pt, sleutels[i], &kp) ||
+                memcmp (&k, &kp, sizeof (klant)))
+        {
+            verschil++;
+        }
+    }
+    printf ("readByKey van %d sleutels: %.2f ms, ptable_readByKey %.2f ms, "
+            "%ld verschillen\n", Nsleutels, t[0] / 1e6, t[1] / 1e6,
+            verschil);
+
+    /* Scans, koud */
+    printf ("scan (koud)             records      ms\n");
+    for (manier = 0; manier < 3; manier++)
+    {
+        isam_flush (ip, 0);
+        vergeetBestand ("klant.isam");
+        for (i = 0; i < np; i++)
+        {
+            isam_flush (ptable_partition (pt, i), 0);
+            sprintf (naam, "klantp.isam.%d", i);
+            vergeetBestand (naam);
+        }
+        memset (&telling[manier], 0, sizeof (scanTelling));
+        t0 = nanoseconden ();
+        if (manier == 0)
+        {
+            rv = isam_scanRange (ip, "", NULL, scanRecord, &telling[manier]);
+        }
+        else if (manier == 1)
+        {
+            for (i = 0, rv = 0; i < np && rv >= 0; i++)
+            {
+                rv = isam_scanRange (ptable_partition (pt, i), "", NULL,
+                        scanRecord, &telling[manier]);
+            }
+        }
+        else
+        {
+            rv = ptable_scanRange (pt, "", NULL, scanRecord,
+                    &telling[manier]);
+        }
+        t[manier] = nanoseconden () - t0;
+        if (rv < 0)
+        {
+            isam_perror (manierNaam[manier]);
+        }
+        printf ("%-20s %10ld %7.2f\n", manierNaam[manier],
+                telling[manier].aantal, t[manier] / 1e6);
+    }
+    if (telling[0].aantal != telling[2].aantal ||
+            telling[0].controle != telling[2].controle ||
+            telling[1].controle != telling[2].controle)
+    {
+        printf ("De scans geven verschillende resultaten!\n");
+    }
+
+    /* Verwijder een op de tien klanten, en tel opnieuw (deels) */
+    for (i = 0, weg = 0; i < Nsleutels; i += 10)
+    {
+        if (!ptable_readByKey (pt, sleutels[i], &kp) &&
+                !ptable_delete (pt, sleutels[i], &kp))
+        {
+            weg++;
+        }
+    }
+    ptable_close (pt);
+    pt = ptable_open ("klantp.isam", 1, cacheBlokken);
+    if (!pt)
+    {
+        isam_perror ("opening the partitioned table");
+        isam_close (ip);
+        return;
+    }
+    memset (&telling[0], 0, sizeof (scanTelling));
+    memset (&telling[1], 0, sizeof (scanTelling));
+    n = ptable_scanRange (pt, "", NULL, scanRecord, &telling[0]);
+    rv = ptable_scanRange (pt, "2300", "4500", scanRecord, &telling[1]);
+    printf ("%ld verwijderd, daarna %ld records, %ld van 2300 tot 4500\n",
+            weg, n, rv);
+    if (n != telling[2].aantal - weg)
+    {
+        printf ("Het aantal records na verwijderen klopt niet!\n");
+    }
+    memset (&telling[1], 0, sizeof (scanTelling));
+    if (isam_scanRange (ip, "2300", "4500", scanRecord, &telling[1]) < rv)
+    {
+        printf ("De scan van 2300 tot 4500 geeft te veel records!\n");
+    }
+    ptable_close (pt);
+    isam_close (ip);
+}
+
+void print_elapsed_ru(struct rusage start, struct rusage stop) {
+    double tuser, tsystem;
+    tuser = get_sec(stop.ru_utime) - get_sec(start.ru_utime);
+    tsystem = get_sec(stop.ru_stime) - get_sec(start.ru_stime);
+    printf("User cpu time (s):     %f\n", tuser);
+    printf("System cpu time (s):   %f\n", tsystem);
+    printf("Total cpu time (s):    %f\n", tuser + tsystem);
+}
+
+double get_sec(struct timeval data) {
+    return data.tv_sec + data.tv_usec/1000000.0;
+}
+
+void print_elapsed_clock(clock_t start, clock_t stop) {
+    printf("seconds:               %f\n",
+            (float)(stop - start)/CLOCKS_PER_SEC);
+}
+
+int main (int argc, char *argv[]) {
+    isamPtr ip;
+    FILE   *inp;
+    char    sleutel[20] =
+    {0};
+    klant   nieuweKlant;
+    char    str[512];
+    int     i, j;
+
+    clock_t start, stop;
+    struct rusage start_tdata, stop_tdata;
+
+    start = clock();
+    getrusage(RUSAGE_SELF, &start_tdata);
+
+    memset(&nieuweKlant, 0, sizeof(nieuweKlant));
+    /* Lees het bestand met namen (en voorvoegsels) */
+
+    init_genrand(171717);
+    if (argc < 4)
+    {
+        printf ("Gebruik: %s namen initialen titels [cache=N] [mmap] [bloom] [wal] [pages] [varlen] [checksums] [fanout=F] [bulk] [bulktest=N] [reorg=P] [keycmp] [index=N] [stats] [many=B] [scan] [secondary] [depth=Q] [verify] [snapshot] [partitions=N] [threads=T [time=S] [mix=L,U,S,P] [keys=uniform|zipf|seq]] [optional-debug]\n", argv[0]);
+        return -1;
+    }
+    for (i = 4; i < argc; i++)
+    {
+        if (!strncmp (argv[i], "cache=", 6))
+        {
+            cacheBlokken = atoi (argv[i] + 6);
+            printf ("Cache van %d blokken\n", cacheBlokken);
+        }
+        else if (!strcmp (argv[i], "bulk"))
+        {
+            bulkLaden = 1;
+            printf ("Nieuw bestand wordt gevuld met isam_bulkLoad\n");
+        }
+        else if (!strncmp (argv[i], "bulktest=", 9))
+        {
+            bulkTest = atol (argv[i] + 9);
+        }
+        else if (!strncmp (argv[i], "reorg=", 6))
+        {
+            reorgVulling = atoi (argv[i] + 6);
+            printf ("Reorganiseer na afloop, blokken %d%% gevuld\n",
+                    reorgVulling);
+        }
+        else if (!strcmp (argv[i], "bloom"))
+        {
+            maakOpties |= ISAM_CREATE_BLOOM;
+            printf ("Nieuw bestand krijgt Bloom filters\n");
+        }
+        else if (!strcmp (argv[i], "wal"))
+        {
+            maakOpties |= ISAM_CREATE_WAL;
+            printf ("Nieuw bestand krijgt een write-ahead log\n");
+        }
+        else if (!strcmp (argv[i], "pages"))
+        {
+            maakOpties |= ISAM_CREATE_PAGES;
+            printf ("Nieuw bestand krijgt blokken met slotted pages\n");
+        }
+        else if (!strcmp (argv[i], "varlen"))
+        {
+            maakOpties |= ISAM_CREATE_VARLEN;
+            printf ("Nieuw bestand krijgt records van variabele lengte\n");
+        }
+        else if (!strcmp (argv[i], "checksums"))
+        {
+            maakOpties |= ISAM_CREATE_CHECKSUMS;
+            printf ("Nieuw bestand krijgt checksums\n");
+        }
+        else if (!strncmp (argv[i], "fanout=", 7))
+        {
+            maakOpties |= ISAM_CREATE_FANOUT (atoi (argv[i] + 7));
+            printf ("Nieuw bestand krijgt een index met fan-out %d "
+                    "(standaard %lu)\n", atoi (argv[i] + 7),
+                    isam_maxFanout (20));
+        }
+        else if (!strcmp (argv[i], "verify"))
+        {
+            controle = 1;
+        }
+        else if (!strncmp (argv[i], "partitions=", 11))
+        {
+            partities = atoi (argv[i] + 11);
+        }
+        else if (!strcmp (argv[i], "snapshot"))
+        {
+            meetMomentopname = 1;
+        }
+        else if (!strcmp (argv[i], "keycmp"))
+        {
+            meetVergelijking = 1;
+        }
+        else if (!strncmp (argv[i], "index=", 6))
+        {
+            indexSleutels = atol (argv[i] + 6);
+        }
+        else if (!strcmp (argv[i], "stats"))
+        {
+            toonStats = 1;
+        }
+        else if (!strncmp (argv[i], "many=", 5))
+        {
+            veelSleutels = atoi (argv[i] + 5);
+        }
+        else if (!strcmp (argv[i], "scan"))
+        {
+            meetScan = 1;
+        }
+        else if (!strcmp (argv[i], "secondary"))
+        {
+            meetSecundair = 1;
+        }
+        else if (!strncmp (argv[i], "depth=", 6))
+        {
+            ioDiepte = atoi (argv[i] + 6);
+        }
+        else if (!strncmp (argv[i], "threads=", 8))
+        {
+            draden = atoi (argv[i] + 8);
+        }
+        else if (!strncmp (argv[i], "time=", 5))
+        {
+            duur = atoi (argv[i] + 5);
+        }
+        else if (!strncmp (argv[i], "mix=", 4))
+        {
+            if (4 != sscanf (argv[i] + 4, "%d,%d,%d,%d", menging,
+                        menging + 1, menging + 2, menging + 3) ||
+                    menging[0] + menging[1] + menging[2] + menging[3] != 100)
+            {
+                printf ("mix=L,U,S,P: vier percentages met som 100\n");
+                return -1;
+            }
+        }
+        else if (!strncmp (argv[i], "keys=", 5))
+        {
+            for (verdeling = 0; verdeling <= SEQUENTIEEL &&
+                    strcmp (argv[i] + 5, verdelingNaam[verdeling]);
+                    verdeling++)
+                ;
+            if (verdeling > SEQUENTIEEL)
+            {
+                printf ("keys=uniform, keys=zipf of keys=seq\n");
+                return -1;
+            }
+        }
+        else if (!strcmp (argv[i], "mmap"))
+        {
+            openVlaggen |= ISAM_OPEN_MMAP;
+            printf ("Bestand wordt in het geheugen afgebeeld\n");
+        }
+        else
+        {
+            report = 1;
+            printf ("Produceer meer debug uitvoer\n");
+        }
+    }
+    inp = fopen (argv[1], "r");
+    if (inp)
+    {
+        i = 0;
+        printf ("Lees namen van %s\n", argv[1]);
+        while (fgets (str, 512, inp))
+        {
+            strncpy (namen[i].naam, strtok (str, ";\t\n"), 64);
+            strncpy (namen[i].voorvoegsel, strtok (NULL, ";\t\n"), 16);
+            i++;
+        }
+        fclose (inp);
+        Nnamen = i;
+    }
+    else
+    {
+        perror ("Failed to open names file");
+        exit (-1);
+    }
+
+    /* Lees het bestand met initialen */
+
+    inp = fopen (argv[2], "r");
+    if (inp)
+    {
+        i = 0;
+        printf ("Lees initialen van %s\n", argv[2]);
+        while (fgets (str, 512, inp))
+        {
+            strncpy (initialen[i], strtok (str, "\n"), 16);
+            i++;
+        }
+        fclose (inp);
+        Ninit = i;
+    }
+    else
+    {
+        perror ("Failed to open initials file");
+        exit (-1);
+    }
+
+    /* Lees het bestand met titels */
+
+    inp = fopen (argv[3], "r");
+    if (inp)
+    {
+        i = 0;
+        printf ("Lees titels van %s\n", argv[3]);
+        while (fgets (str, 512, inp))
+        {
+            strncpy (titels[i], strtok (str, "\n"), 16);
+            i++;
+        }
+        fclose (inp);
+        Ntitels = i;
+    }
+    else
+    {
+        perror ("Failed to open titles file");
+        exit (-1);
+    }
+
+    /* Probeer een isam bestand aan te maken. Als dat mislukt,
+       bestaat het mogelijk al - probeer het dan te lezen */
+
+    if (bulkLaden)
+    {
+        ip = laadBulk ();
+    }
+    else
+    {
+        ip = isam_createWithOptions ("klant.isam", 20, sizeof (klant), 8,
+                360, cacheBlokken, maakOpties);
+    }
+    if (!ip)
+    {
+        /* Mislukt ... bestaat het al ? */
+
+        isam_perror ("Failed to create file");
+        ip = isam_openWithCache ("klant.isam", openVlaggen, cacheBlokken);
+        if (!ip)
+        {
+            isam_perror ("Failed to open file");
+            exit (-1);
+        }
+
+        /* Lees alle sleutels */
+
+        i = 0;
+        while (0 == isam_readNext (ip, sleutels[i], &nieuweKlant))
+        {
+            i++;
+        }
+        Nsleutels = i;
+        printf ("Bestaand bestand met %d records geopend\n", Nsleutels);
+    }
+    else if (!bulkLaden)
+    {
+        /* Vul het bestand, min of meer sequentieel */
+
+        i = 0;
+        while (maakSleutel (sleutel))
+        {
+            maakKlant (&nieuweKlant);
+            if (isam_writeNew (ip, sleutel, &nieuweKlant))
+            {
+                isam_perror ("Failed to create customer record");
+            }
+            else
+            {
+                if (report)
+                {
+                    printKlant (stdout, NULL, sleutel, &nieuweKlant);
+                }
+                strncpy (sleutels[i], sleutel, 20);
+                i++;
+            }
+        }
+        printf ("Isam bestand bevat %d records\n", i);
+
+        Nsleutels = i;
+
+        /* Dit hoeft niet, maar test open en close */
+
+        isam_close (ip);
+        ip = isam_openWithCache ("klant.isam", openVlaggen, cacheBlokken);
+    }
+
+    /* Doe een aantal bewerkingen op het bestand -
+       lees sequentieel plus update
+       lees op sleutel
+       poets
+       schrijf nieuw
+       Probeer dit te herhalen.
+       */
+    int n_runs;
+    if (meetSecundair)
+    {
+        /* Een bestaande index op de naam wordt opnieuw opgebouwd */
+        isam_dropSecondary (ip, 0);
+        if (isam_addSecondary (ip, offsetof (klant, naam), 64,
+                    ISAM_SECONDARY_STRING) < 0)
+        {
+            isam_perror ("Failed to add secondary index");
+        }
+    }
+    for(n_runs = 0; n_runs < 3; n_runs++)
+    {
+        leesBereik (ip, "2300", "4500", berekenDag (25, 1, 2002));
+        for (i = 0, j = 0; i < 500; i++)
+        {
+            if (leesBestaandRecord (ip, genrand_int31 () % Nsleutels))
             {
                 j++;
             }
@@ -563,6 +2501,10 @@ int main (int argc, char *argv[]) {
         leesBereik (ip, "1000", "9999", berekenDag (25, 1, 2002));
         leesBereik (ip, "1000", "9999", berekenDag (25, 1, 2002));
     }
+    if (toonStats)
+    {
+        toonStatistiek (ip);
+    }
     isam_close (ip);
 
     /* stop measuring the timing */
@@ -574,18 +2516,69 @@ int main (int argc, char *argv[]) {
     printf("rusage() timing:\n");
     print_elapsed_ru(start_tdata, stop_tdata);
 
-    struct ISAM_CACHE_STATS* stats = malloc(3 * sizeof(int));
-    stats->cache_call = 0;
-    stats->disk_reads = 0;
-    stats->disk_writes = 0;
+    struct ISAM_CACHE_STATS* stats = calloc(1, sizeof(struct ISAM_CACHE_STATS));
 
     isam_cacheStats(stats);
 
     printf("Cache calls %d\n", stats->cache_call);
+    printf("Cache hits %d (hit ratio %.3f)\n", stats->cache_hits,
+            stats->cache_call ?
+            (double) stats->cache_hits / stats->cache_call : 0.0);
+    printf("Cache evictions %d\n", stats->cache_evictions);
     printf("Disk reads %d\n", stats->disk_reads);
     printf("Disk writes %d\n", stats->disk_writes);
+    printf("Searches ended by Bloom filter %d\n", stats->bloom_skips);
 
     free(stats);
 
+    if (bulkTest > 0)
+    {
+        testBulk ();
+    }
+    if (veelSleutels > 0)
+    {
+        leesVeel ();
+    }
+    if (meetScan)
+    {
+        leesScan ();
+    }
+    if (meetSecundair)
+    {
+        leesSecundair ();
+    }
+    if (ioDiepte > 0)
+    {
+        leesDiepte ();
+    }
+    if (controle)
+    {
+        controleer ();
+    }
+    if (meetMomentopname)
+    {
+        leesMomentopname ();
+    }
+    if (partities > 0)
+    {
+        partitioneer ();
+    }
+    if (draden > 0)
+    {
+        meerdradig ();
+    }
+    if (reorgVulling >= 0)
+    {
+        reorganiseer ();
+    }
+    if (meetVergelijking)
+    {
+        vergelijkSleutels ();
+    }
+    if (indexSleutels > 0)
+    {
+        zoekIndex ();
+    }
+
     return 0;
 }
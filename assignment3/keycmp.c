@@ -0,0 +1,179 @@
+/* Comparison of the fixed length key fields used by the isam library.
+   -------------------------------------------------------------------------
+   Goal: Part of an assignment on file system structure for the operating
+         systems course.
+   -------------------------------------------------------------------------
+   Keys are compared very often while walking the chains of records in
+   the data blocks and while searching the index. A vectorised compare
+   looks at 16 (SSE2) or 32 (AVX2) bytes at a time: it looks for the
+   first position where the bytes differ, or where the first key has a
+   zero byte, and compares the bytes at that position. That gives the
+   same result as strncmp, but needs only a few instructions per chunk.
+   It only pays for keys that share a prefix: key_compare (in keycmp.h)
+   handles the keys that differ in their first word itself.
+   The version to use is determined once, at the first call. */
+
+#include <stddef.h>
+#include "keycmp.h"
+
+#if defined(__GNUC__) && defined(__SSE2__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define KEYCMP_X86
+#include <immintrin.h>
+#endif
+
+int
+key_compareScalar(const char *a, const char *b, unsigned long len)
+{
+    unsigned long i;
+    int     ca, cb;
+
+    for (i = 0; i < len; i++)
+    {
+	ca = (unsigned char) a[i];
+	cb = (unsigned char) b[i];
+	if (ca != cb)
+	{
+	    return ca - cb;
+	}
+	if (!ca)
+	{
+	    return 0;
+	}
+    }
+    return 0;
+}
+
+#ifdef KEYCMP_X86
+
+static __inline__ __attribute__ ((always_inline)) int
+key_compareSSE2(const char *a, const char *b, unsigned long len)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i va, vb;
+    unsigned long i = 0;
+    int     stop;
+
+    for (; i + 16 <= len; i += 16)
+    {
+	va = _mm_loadu_si128((const __m128i *) (a + i));
+	vb = _mm_loadu_si128((const __m128i *) (b + i));
+	stop = (~_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) |
+		_mm_movemask_epi8(_mm_cmpeq_epi8(va, zero))) & 0xffff;
+	if (stop)
+	{
+	    i += __builtin_ctz(stop);
+	    return (int) (unsigned char) a[i] - (int) (unsigned char) b[i];
+	}
+    }
+    if (i == len)
+    {
+	return 0;
+    }
+    if (len < 16)
+    {
+	return key_compareScalar(a + i, b + i, len - i);
+    }
+    /* The last chunk overlaps the previous one: the bytes in the overlap
+       are known to be equal and not zero, so they never stop the search */
+    i = len - 16;
+    va = _mm_loadu_si128((const __m128i *) (a + i));
+    vb = _mm_loadu_si128((const __m128i *) (b + i));
+    stop = (~_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) |
+	    _mm_movemask_epi8(_mm_cmpeq_epi8(va, zero))) & 0xffff;
+    if (stop)
+    {
+	i += __builtin_ctz(stop);
+	return (int) (unsigned char) a[i] - (int) (unsigned char) b[i];
+    }
+    return 0;
+}
+
+__attribute__ ((target("avx2")))
+static int
+key_compareAVX2(const char *a, const char *b, unsigned long len)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i va, vb;
+    unsigned long i = 0;
+    unsigned int stop;
+
+    for (; i + 32 <= len; i += 32)
+    {
+	va = _mm256_loadu_si256((const __m256i *) (a + i));
+	vb = _mm256_loadu_si256((const __m256i *) (b + i));
+	stop = ~(unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb)) |
+	    (unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(va, zero));
+	if (stop)
+	{
+	    i += __builtin_ctz(stop);
+	    return (int) (unsigned char) a[i] - (int) (unsigned char) b[i];
+	}
+    }
+    if (i == len)
+    {
+	return 0;
+    }
+    if (len < 32)
+    {
+	return key_compareSSE2(a, b, len);
+    }
+    /* As in key_compareSSE2, the last chunk overlaps the previous one */
+    i = len - 32;
+    va = _mm256_loadu_si256((const __m256i *) (a + i));
+    vb = _mm256_loadu_si256((const __m256i *) (b + i));
+    stop = ~(unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb)) |
+	(unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(va, zero));
+    if (stop)
+    {
+	i += __builtin_ctz(stop);
+	return (int) (unsigned char) a[i] - (int) (unsigned char) b[i];
+    }
+    return 0;
+}
+
+#endif
+
+static int key_compareFirst(const char *a, const char *b, unsigned long len);
+
+static int (*key_compareImpl) (const char *, const char *, unsigned long) =
+    key_compareFirst;
+
+static const char *key_compareImplName = "scalar";
+
+/* Select the best version on the first call */
+static int
+key_compareFirst(const char *a, const char *b, unsigned long len)
+{
+    key_compareImpl = key_compareScalar;
+#ifdef KEYCMP_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+	key_compareImpl = key_compareAVX2;
+	key_compareImplName = "avx2";
+    }
+    else
+    {
+	key_compareImpl = key_compareSSE2;
+	key_compareImplName = "sse2";
+    }
+#endif
+    return key_compareImpl(a, b, len);
+}
+
+int
+key_compareVector(const char *a, const char *b, unsigned long len)
+{
+    return key_compareImpl(a, b, len);
+}
+
+const char *
+key_compareName(void)
+{
+    if (key_compareImpl == key_compareFirst)
+    {
+	key_compareFirst("", "", 1);
+    }
+    return key_compareImplName;
+}
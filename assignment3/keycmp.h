@@ -0,0 +1,96 @@
+#ifndef KEYCMP_H
+#define KEYCMP_H
+
+/* -------------------------------------------------------------------------
+   Comparison of the fixed length key fields used by the isam library
+   and its index.
+   Goal: Part of an assignment on file system structure for the operating
+         systems course.
+----------------------------------------------------------------------------*/
+
+#include <string.h>
+
+/* key_compare compares two key fields of length len like strncmp does:
+   the comparison stops at the first difference or at the first zero byte.
+   Unlike strncmp, it may read all len bytes of both fields, so both must
+   be at least len bytes long (key fields in records are; user supplied
+   keys should first be copied into a field of the full length).
+   Most keys compared differ in their first bytes, so key_compare is
+   inlined and compares the keys a word at a time; only long keys that
+   share their first word are passed to key_compareVector. */
+static int key_compare(const char *a, const char *b, unsigned long len);
+
+/* key_compare for keys that may share a longer prefix: on x86
+   processors a version using SSE2 or AVX2 instructions is selected the
+   first time it is called */
+int key_compareVector(const char *a, const char *b, unsigned long len);
+
+/* The portable version of key_compare, byte by byte */
+int key_compareScalar(const char *a, const char *b, unsigned long len);
+
+/* The name of the version used by key_compareVector ("scalar", "sse2"
+   or "avx2") */
+const char *key_compareName(void);
+
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && \
+    __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+/* The bytes of a word that differ, or that are zero in a: the lowest
+   bit set is in the first byte where the comparison stops (higher zero
+   bytes may be reported wrongly, lower ones never are) */
+#define KEYCMP_ONES	(~0UL / 255)
+#define KEYCMP_STOP(wa, wb) \
+    (((wa) ^ (wb)) | (((wa) - KEYCMP_ONES) & ~(wa) & (KEYCMP_ONES << 7)))
+
+/* Keys of up to this many words are compared word by word; longer keys
+   that share their first word go to key_compareVector */
+#define KEYCMP_WORDS	(4)
+
+static __inline__ int
+key_compare(const char *a, const char *b, unsigned long len)
+{
+    unsigned long wa, wb, stop, i = 0;
+
+    if (len < sizeof(unsigned long))
+    {
+	return key_compareScalar(a, b, len);
+    }
+    for (;;)
+    {
+	memcpy(&wa, a + i, sizeof(wa));
+	memcpy(&wb, b + i, sizeof(wb));
+	stop = KEYCMP_STOP(wa, wb);
+	if (stop)
+	{
+	    i += __builtin_ctzl(stop) / 8;
+	    return (int) (unsigned char) a[i] - (int) (unsigned char) b[i];
+	}
+	if (i + sizeof(unsigned long) == len)
+	{
+	    return 0;
+	}
+	if (len > KEYCMP_WORDS * sizeof(unsigned long))
+	{
+	    return key_compareVector(a, b, len);
+	}
+	/* The last word may overlap the one before: the bytes in the
+	   overlap are equal and not zero, so they never stop the search */
+	i += sizeof(unsigned long);
+	if (i + sizeof(unsigned long) > len)
+	{
+	    i = len - sizeof(unsigned long);
+	}
+    }
+}
+#else
+static int
+key_compare(const char *a, const char *b, unsigned long len)
+{
+    if (len && a[0] != b[0])
+    {
+	return (int) (unsigned char) a[0] - (int) (unsigned char) b[0];
+    }
+    return (len && a[0]) ? key_compareVector(a, b, len) : 0;
+}
+#endif
+
+#endif
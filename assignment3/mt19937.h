@@ -45,6 +45,20 @@
 /* initializes mt[N] with a seed */
 void init_genrand(unsigned long s);
 
+/* The functions ending in _r use the state given by the caller instead
+   of a single global state, e.g. for one stream of numbers per thread */
+#define MT19937_N 624
+
+typedef struct {
+    unsigned long mt[MT19937_N]; /* the array for the state vector */
+    int mti;
+} mt19937_state;
+
+void init_genrand_r(mt19937_state *state, unsigned long s);
+unsigned long genrand_int32_r(mt19937_state *state);
+long genrand_int31_r(mt19937_state *state);
+double genrand_real2_r(mt19937_state *state);
+
 /* initialize by an array with array-length */
 /* init_key is the array for initializing keys */
 /* key_length is its length */
@@ -42,20 +42,25 @@
 */
 
 #include <stdio.h>
+#include "mt19937.h"
 
 /* Period parameters */  
-#define N 624
+#define N MT19937_N
 #define M 397
 #define MATRIX_A 0x9908b0dfUL   /* constant vector a */
 #define UPPER_MASK 0x80000000UL /* most significant w-r bits */
 #define LOWER_MASK 0x7fffffffUL /* least significant r bits */
 
-static unsigned long mt[N]; /* the array for the state vector  */
-static int mti=N+1; /* mti==N+1 means mt[N] is not initialized */
+/* the state used by the functions without a state argument; */
+/* mti==N+1 means mt[N] is not initialized */
+static mt19937_state global = {{0}, N+1};
 
-/* initializes mt[N] with a seed */
-void init_genrand(unsigned long s)
+/* initializes state->mt[N] with a seed */
+void init_genrand_r(mt19937_state *state, unsigned long s)
 {
+    unsigned long *mt = state->mt;
+    int mti;
+
     mt[0]= s & 0xffffffffUL;
     for (mti=1; mti<N; mti++) {
         mt[mti] = 
@@ -67,6 +72,13 @@ void init_genrand(unsigned long s)
         mt[mti] &= 0xffffffffUL;
         /* for >32 bit machines */
     }
+    state->mti = mti;
+}
+
+/* initializes mt[N] with a seed */
+void init_genrand(unsigned long s)
+{
+    init_genrand_r(&global, s);
 }
 
 /* initialize by an array with array-length */
@@ -74,6 +86,7 @@ void init_genrand(unsigned long s)
 /* key_length is its length */
 void init_by_array(unsigned long *init_key, unsigned long key_length)
 {
+    unsigned long *mt = global.mt;
     long i, j, k;
     init_genrand(19650218UL);
     i=1; j=0;
@@ -98,17 +111,18 @@ void init_by_array(unsigned long *init_key, unsigned long key_length)
 }
 
 /* generates a random number on [0,0xffffffff]-interval */
-unsigned long genrand_int32(void)
+unsigned long genrand_int32_r(mt19937_state *state)
 {
+    unsigned long *mt = state->mt;
     unsigned long y;
-    static unsigned long mag01[2]={0x0UL, MATRIX_A};
+    static const unsigned long mag01[2]={0x0UL, MATRIX_A};
     /* mag01[x] = x * MATRIX_A  for x=0,1 */
 
-    if (mti >= N) { /* generate N words at one time */
+    if (state->mti >= N) { /* generate N words at one time */
         int kk;
 
-        if (mti == N+1)   /* if init_genrand() has not been called, */
-            init_genrand(5489UL); /* a default initial seed is used */
+        if (state->mti == N+1)   /* if init_genrand() has not been called, */
+            init_genrand_r(state, 5489UL); /* a default initial seed is used */
 
         for (kk=0;kk<N-M;kk++) {
             y = (mt[kk]&UPPER_MASK)|(mt[kk+1]&LOWER_MASK);
@@ -121,10 +135,10 @@ unsigned long genrand_int32(void)
         y = (mt[N-1]&UPPER_MASK)|(mt[0]&LOWER_MASK);
         mt[N-1] = mt[M-1] ^ (y >> 1) ^ mag01[y & 0x1UL];
 
-        mti = 0;
+        state->mti = 0;
     }
   
-    y = mt[mti++];
+    y = mt[state->mti++];
 
     /* Tempering */
     y ^= (y >> 11);
@@ -135,6 +149,18 @@ unsigned long genrand_int32(void)
     return y;
 }
 
+/* generates a random number on [0,0xffffffff]-interval */
+unsigned long genrand_int32(void)
+{
+    return genrand_int32_r(&global);
+}
+
+/* generates a random number on [0,0x7fffffff]-interval */
+long genrand_int31_r(mt19937_state *state)
+{
+    return (long)(genrand_int32_r(state)>>1);
+}
+
 /* generates a random number on [0,0x7fffffff]-interval */
 long genrand_int31(void)
 {
@@ -148,6 +174,13 @@ double genrand_real1(void)
     /* divided by 2^32-1 */ 
 }
 
+/* generates a random number on [0,1)-real-interval */
+double genrand_real2_r(mt19937_state *state)
+{
+    return genrand_int32_r(state)*(1.0/4294967296.0); 
+    /* divided by 2^32 */
+}
+
 /* generates a random number on [0,1)-real-interval */
 double genrand_real2(void)
 {
@@ -0,0 +1,670 @@
+/* Range-partitioned tables on top of the isam library.
+   -------------------------------------------------------------------------
+   Goal: Part of an assignment on file system structure for the operating
+         systems course.
+   -------------------------------------------------------------------------
+   A table is a descriptor file plus one isam file per partition. The
+   descriptor holds a header, the bounds between the partitions and the
+   names of the partition files. Single-key routines are sent to the
+   partition found by a binary search over the bounds. A range scan
+   runs a thread per partition, and hands their records to the caller
+   partition by partition, which keeps them in key order. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include "ptable.h"
+
+#define PTABLE_MAGIC	(0x50544142UL)
+
+struct ptableHead
+{
+    unsigned long magic;
+    unsigned long nParts;
+    unsigned long keyLen;
+    unsigned long dataLen;
+    unsigned long namesLen;	/* Bytes of partition names that follow
+				   the bounds, each ended by a zero */
+};
+
+struct PTABLE
+{
+    int     nParts;
+    unsigned long keyLen;
+    unsigned long dataLen;
+    char   *bounds;		/* nParts - 1 bounds of keyLen bytes */
+    isamPtr part[PTABLE_MAX_PARTS];
+};
+
+#define Bound(t,i)	((t)->bounds + (i) * (t)->keyLen)
+
+/* qsort has no context argument, so the key length for sorting a
+   sample is kept here, under sortLock */
+static unsigned long sortLen;
+static pthread_mutex_t sortLock = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+sample_order(const void *a, const void *b)
+{
+    return strncmp(*(const char **) a, *(const char **) b, sortLen);
+}
+
+int
+ptable_chooseBounds(const char **sample, size_t n, unsigned long key_len,
+		    int nParts, char *bounds)
+{
+    const char **sorted;
+    size_t  i;
+    int     k, b = 0;
+
+    if (!sample || !bounds || key_len == 0 || nParts < 1 ||
+	nParts > PTABLE_MAX_PARTS)
+    {
+	isam_error = ISAM_IDENT_INVALID;
+	return -1;
+    }
+    sorted = malloc((n + 1) * sizeof(char *));
+    if (!sorted)
+    {
+	isam_error = ISAM_READ_ERROR;
+	return -1;
+    }
+    memcpy(sorted, sample, n * sizeof(char *));
+    pthread_mutex_lock(&sortLock);
+    sortLen = key_len;
+    qsort(sorted, n, sizeof(char *), sample_order);
+    pthread_mutex_unlock(&sortLock);
+    for (k = 1; k < nParts && n > 0; k++)
+    {
+	i = (size_t) k * n / nParts;
+	/* Bounds must increase, and the first partition must not be
+	   empty by construction */
+	if (!sorted[i][0] ||
+	    (b > 0 && strncmp(sorted[i], bounds + (b - 1) * key_len,
+			      key_len) <= 0))
+	{
+	    continue;
+	}
+	memset(bounds + b * key_len, 0, key_len);
+	strncpy(bounds + b * key_len, sorted[i], key_len);
+	b++;
+    }
+    free(sorted);
+    return b + 1;
+}
+
+/* The name of partition i of table name, in a new string */
+static char *
+part_name(const char *name, const char **dirs, int i)
+{
+    const char *base = strrchr(name, '/');
+    char   *part;
+
+    base = base ? base + 1 : name;
+    part = malloc(strlen(name) + (dirs ? strlen(dirs[i]) : 0) + 24);
+    if (part)
+    {
+	if (dirs)
+	{
+	    sprintf(part, "%s/%s.%d", dirs[i], base, i);
+	}
+	else
+	{
+	    sprintf(part, "%s.%d", name, i);
+	}
+    }
+    return part;
+}
+
+/* Remove a partition file that was just created, and the companion
+   files the options of isam_createWithOptions may have given it */
+static void
+part_unlink(const char *part)
+{
+    static const char *const companions[] = {"", ".idx", ".heap", ".wal"};
+    char   *name = malloc(strlen(part) + sizeof(".heap"));
+    size_t  i;
+
+    if (!name)
+    {
+	unlink(part);
+	return;
+    }
+    for (i = 0; i < sizeof(companions) / sizeof(companions[0]); i++)
+    {
+	sprintf(name, "%s%s", part, companions[i]);
+	unlink(name);
+    }
+    free(name);
+}
+
+static ptablePtr
+table_new(int nParts, unsigned long keyLen, unsigned long dataLen)
+{
+    ptablePtr t = calloc(1, sizeof(struct PTABLE));
+
+    if (t)
+    {
+	t->nParts = nParts;
+	t->keyLen = keyLen;
+	t->dataLen = dataLen;
+	t->bounds = calloc(nParts, keyLen);
+	if (!t->bounds)
+	{
+	    free(t);
+	    t = NULL;
+	}
+    }
+    return t;
+}
+
+/* Close the partitions opened so far, keeping isam_error */
+static void
+table_free(ptablePtr t)
+{
+    enum isam_error error = isam_error;
+    int     i;
+
+    for (i = 0; i < t->nParts; i++)
+    {
+	if (t->part[i])
+	{
+	    isam_close(t->part[i]);
+	}
+    }
+    free(t->bounds);
+    free(t);
+    isam_error = error;
+}
+
+ptablePtr
+ptable_create(const char *name, const char **dirs, int nParts,
+	      const char *bounds, unsigned long key_len,
+	      unsigned long data_len, unsigned long NrecPB,
+	      unsigned long Nblocks, int cacheSize, int options)
+{
+    struct ptableHead head;
+    ptablePtr t;
+    char   *names[PTABLE_MAX_PARTS];
+    enum isam_error error;
+    int     fd, i, ok;
+
+    if (!name || nParts < 1 || nParts > PTABLE_MAX_PARTS || key_len == 0 ||
+	(nParts > 1 && !bounds))
+    {
+	isam_error = ISAM_IDENT_INVALID;
+	return NULL;
+    }
+    for (i = 1; i < nParts - 1; i++)
+    {
+	if (strncmp(bounds + (i - 1) * key_len, bounds + i * key_len,
+		    key_len) >= 0)
+	{
+	    isam_error = ISAM_NOT_SORTED;
+	    return NULL;
+	}
+    }
+    t = table_new(nParts, key_len, data_len);
+    if (!t)
+    {
+	isam_error = ISAM_OPEN_FAIL;
+	return NULL;
+    }
+    if (nParts > 1)
+    {
+	memcpy(t->bounds, bounds, (nParts - 1) * key_len);
+    }
+    memset(&head, 0, sizeof(head));
+    head.magic = PTABLE_MAGIC;
+    head.nParts = nParts;
+    head.keyLen = key_len;
+    head.dataLen = data_len;
+    for (i = 0, ok = 1; i < nParts; i++)
+    {
+	names[i] = part_name(name, dirs, i);
+	ok = ok && names[i];
+	head.namesLen += names[i] ? strlen(names[i]) + 1 : 0;
+    }
+    fd = ok ? open(name, O_RDWR | O_CREAT | O_EXCL, 0660) : -1;
+    if (fd < 0)
+    {
+	isam_error = ok ? ISAM_FILE_EXISTS : ISAM_OPEN_FAIL;
+	ok = 0;
+    }
+    else
+    {
+	ok = write(fd, &head, sizeof(head)) == (ssize_t) sizeof(head) &&
+	    write(fd, t->bounds, (nParts - 1) * key_len) ==
+	    (ssize_t) ((nParts - 1) * key_len);
+	for (i = 0; ok && i < nParts; i++)
+	{
+	    ok = write(fd, names[i], strlen(names[i]) + 1) ==
+		(ssize_t) (strlen(names[i]) + 1);
+	}
+	if (fsync(fd) || close(fd) || !ok)
+	{
+	    isam_error = ISAM_WRITE_FAIL;
+	    ok = 0;
+	}
+    }
+    for (i = 0; ok && i < nParts; i++)
+    {
+	t->part[i] = isam_createWithOptions(names[i], key_len, data_len,
+					    NrecPB, Nblocks, cacheSize,
+					    options);
+	ok = t->part[i] != NULL;
+    }
+    if (!ok)
+    {
+	error = isam_error;
+	for (i = 0; fd >= 0 && i < nParts && t->part[i]; i++)
+	{
+	    isam_close(t->part[i]);
+	    t->part[i] = NULL;
+	    part_unlink(names[i]);
+	}
+	if (fd >= 0)
+	{
+	    unlink(name);
+	}
+	isam_error = error;
+	table_free(t);
+	t = NULL;
+    }
+    for (i = 0; i < nParts; i++)
+    {
+	free(names[i]);
+    }
+    return t;
+}
+
+ptablePtr
+ptable_open(const char *name, int update, int cacheSize)
+{
+    struct ptableHead head;
+    ptablePtr t;
+    char   *names = NULL, *p;
+    int     fd, i, ok;
+
+    fd = open(name, O_RDONLY);
+    if (fd < 0)
+    {
+	isam_error = ISAM_NO_SUCH_FILE;
+	return NULL;
+    }
+    if (read(fd, &head, sizeof(head)) != (ssize_t) sizeof(head))
+    {
+	close(fd);
+	isam_error = ISAM_READ_ERROR;
+	return NULL;
+    }
+    if (head.magic != PTABLE_MAGIC)
+    {
+	close(fd);
+	isam_error = ISAM_BAD_MAGIC;
+	return NULL;
+    }
+    if (head.nParts < 1 || head.nParts > PTABLE_MAX_PARTS ||
+	head.keyLen == 0 || head.namesLen < head.nParts ||
+	!(t = table_new(head.nParts, head.keyLen, head.dataLen)))
+    {
+	close(fd);
+	isam_error = ISAM_HEADER_ERROR;
+	return NULL;
+    }
+    names = malloc(head.namesLen);
+    ok = names &&
+	read(fd, t->bounds, (head.nParts - 1) * head.keyLen) ==
+	(ssize_t) ((head.nParts - 1) * head.keyLen) &&
+	read(fd, names, head.namesLen) == (ssize_t) head.namesLen &&
+	!names[head.namesLen - 1];
+    close(fd);
+    if (!ok)
+    {
+	isam_error = ISAM_READ_ERROR;
+    }
+    for (i = 0, p = names; ok && i < t->nParts; i++)
+    {
+	if (p >= names + head.namesLen)
+	{
+	    isam_error = ISAM_HEADER_ERROR;
+	    ok = 0;
+	    break;
+	}
+	t->part[i] = isam_openWithCache(p, update, cacheSize);
+	ok = t->part[i] != NULL;
+	p += strlen(p) + 1;
+    }
+    free(names);
+    if (!ok)
+    {
+	table_free(t);
+	return NULL;
+    }
+    return t;
+}
+
+int
+ptable_close(ptablePtr table)
+{
+    int     i, rv = 0;
+
+    if (!table)
+    {
+	isam_error = ISAM_IDENT_INVALID;
+	return -1;
+    }
+    for (i = 0; i < table->nParts; i++)
+    {
+	if (isam_close(table->part[i]))
+	{
+	    rv = -1;
+	}
+    }
+    free(table->bounds);
+    free(table);
+    return rv;
+}
+
+int
+ptable_nParts(ptablePtr table)
+{
+    return table ? table->nParts : -1;
+}
+
+/* The partition holding key: the number of bounds not above it */
+int
+ptable_partitionOf(ptablePtr table, const char *key)
+{
+    int     lo = 0, hi, mid;
+
+    if (!table || !key)
+    {
+	isam_error = table ? ISAM_NULL_KEY : ISAM_IDENT_INVALID;
+	return -1;
+    }
+    hi = table->nParts - 1;
+    while (lo < hi)
+    {
+	mid = (lo + hi) / 2;
+	if (strncmp(key, Bound(table, mid), table->keyLen) >= 0)
+	{
+	    lo = mid + 1;
+	}
+	else
+	{
+	    hi = mid;
+	}
+    }
+    return lo;
+}
+
+isamPtr
+ptable_partition(ptablePtr table, int i)
+{
+    if (!table || i < 0 || i >= table->nParts)
+    {
+	isam_error = ISAM_IDENT_INVALID;
+	return NULL;
+    }
+    return table->part[i];
+}
+
+/* The partition for key, or NULL (with isam_error set) */
+static isamPtr
+route(ptablePtr table, const char *key)
+{
+    int     i = ptable_partitionOf(table, key);
+
+    return (i < 0) ? NULL : table->part[i];
+}
+
+int
+ptable_readByKey(ptablePtr table, const char *key, void *data)
+{
+    isamPtr ip = route(table, key);
+
+    return ip ? isam_readByKey(ip, key, data) : -1;
+}
+
+int
+ptable_writeNew(ptablePtr table, const char *key, const void *data)
+{
+    isamPtr ip = route(table, key);
+
+    return ip ? isam_writeNew(ip, key, data) : -1;
+}
+
+int
+ptable_update(ptablePtr table, const char *key, const void *old_data,
+	      const void *new_data)
+{
+    isamPtr ip = route(table, key);
+
+    return ip ? isam_update(ip, key, old_data, new_data) : -1;
+}
+
+int
+ptable_delete(ptablePtr table, const char *key, const void *data)
+{
+    isamPtr ip = route(table, key);
+
+    return ip ? isam_delete(ip, key, data) : -1;
+}
+
+/* A scan thread for one partition. Its records go into a ring of size
+   entries of recLen bytes: the length of the value, the key of keyLen
+   bytes and the data field of dataLen bytes; the caller takes them out in
+   batches. Entries from head on, count of them, are filled; the caller
+   uses a batch without the lock, as the thread only fills the entries
+   after them. */
+
+typedef struct SCANNER
+{
+    isamPtr ip;
+    const char *from;
+    const char *to;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t filled;	/* count is no longer 0, or done is set */
+    pthread_cond_t emptied;	/* count is below size, or stop is set */
+    char   *buf;
+    unsigned long keyLen;
+    unsigned long dataLen;
+    unsigned long recLen;
+    long    size;
+    long    head;
+    long    count;
+    int     started;
+    int     done;		/* The scan has ended */
+    int     stop;		/* The caller wants no more records */
+    long    result;		/* Of isam_scanRange */
+    enum isam_error error;	/* isam_error of the thread */
+}
+scanner;
+
+static int
+scan_put(void *context, const char *key, const void *data,
+	 unsigned long length)
+{
+    scanner *s = (scanner *) context;
+    char   *rec;
+
+    pthread_mutex_lock(&(s->lock));
+    while (s->count == s->size && !s->stop)
+    {
+	pthread_cond_wait(&(s->emptied), &(s->lock));
+    }
+    if (s->stop)
+    {
+	pthread_mutex_unlock(&(s->lock));
+	return 1;
+    }
+    rec = s->buf + ((s->head + s->count) % s->size) * s->recLen;
+    memcpy(rec, &length, sizeof(length));
+    memcpy(rec + sizeof(length), key, s->keyLen);
+    memcpy(rec + sizeof(length) + s->keyLen, data, s->dataLen);
+    if (s->count++ == 0)
+    {
+	pthread_cond_signal(&(s->filled));
+    }
+    pthread_mutex_unlock(&(s->lock));
+    return 0;
+}
+
+static void *
+scan_thread(void *arg)
+{
+    scanner *s = (scanner *) arg;
+    long    rv;
+
+    rv = isam_scanRange(s->ip, s->from, s->to, scan_put, s);
+    pthread_mutex_lock(&(s->lock));
+    s->done = 1;
+    s->result = rv;
+    s->error = isam_error;
+    pthread_cond_signal(&(s->filled));
+    pthread_mutex_unlock(&(s->lock));
+    return NULL;
+}
+
+/* Pass the records of one scanner to fn, until it is done or fn ends
+   the scan. Returns 1 when fn ended it, -1 when the scan failed, and 0
+   otherwise; *n counts the records passed */
+static int
+scan_deliver(scanner * s, isam_scanFunc fn, void *context, long *n)
+{
+    unsigned long length;
+    long    first, avail, k;
+    char   *rec;
+    int     rv = 0;
+
+    for (;;)
+    {
+	pthread_mutex_lock(&(s->lock));
+	while (!s->count && !s->done)
+	{
+	    pthread_cond_wait(&(s->filled), &(s->lock));
+	}
+	first = s->head;
+	avail = s->count;
+	pthread_mutex_unlock(&(s->lock));
+	if (!avail)
+	{
+	    break;
+	}
+	for (k = 0; k < avail && !rv; k++)
+	{
+	    rec = s->buf + ((first + k) % s->size) * s->recLen;
+	    memcpy(&length, rec, sizeof(length));
+	    rec += sizeof(length);
+	    (*n)++;
+	    rv = fn(context, rec, rec + s->keyLen, length) ? 1 : 0;
+	}
+	if (rv)
+	{
+	    return rv;
+	}
+	pthread_mutex_lock(&(s->lock));
+	s->head = (first + avail) % s->size;
+	s->count -= avail;
+	pthread_cond_signal(&(s->emptied));
+	pthread_mutex_unlock(&(s->lock));
+    }
+    if (s->result < 0)
+    {
+	isam_error = s->error;
+	return -1;
+    }
+    return 0;
+}
+
+long
+ptable_scanRange(ptablePtr table, const char *from, const char *to,
+		 isam_scanFunc fn, void *context)
+{
+    scanner s[PTABLE_MAX_PARTS];
+    int     first, last, i, rv = 0;
+    long    n = 0;
+
+    if (!table || !fn)
+    {
+	isam_error = ISAM_IDENT_INVALID;
+	return -1;
+    }
+    if (!from)
+    {
+	from = "";
+    }
+    if (to && strncmp(from, to, table->keyLen) > 0)
+    {
+	return 0;
+    }
+    first = ptable_partitionOf(table, from);
+    last = to ? ptable_partitionOf(table, to) : table->nParts - 1;
+    memset(s, 0, sizeof(s));
+    for (i = first; i <= last && !rv; i++)
+    {
+	s[i].from = (i == first) ? from : "";
+	s[i].to = (i == last) ? to : NULL;
+	s[i].keyLen = table->keyLen;
+	s[i].dataLen = table->dataLen;
+	s[i].recLen = sizeof(unsigned long) + table->keyLen + table->dataLen;
+	s[i].size = PTABLE_SCAN_BUFFER / s[i].recLen;
+	if (s[i].size < 16)
+	{
+	    s[i].size = 16;
+	}
+	s[i].buf = malloc(s[i].size * s[i].recLen);
+	s[i].ip = isam_openCursor(table->part[i]);
+	pthread_mutex_init(&(s[i].lock), NULL);
+	pthread_cond_init(&(s[i].filled), NULL);
+	pthread_cond_init(&(s[i].emptied), NULL);
+	if (!s[i].ip)
+	{
+	    rv = -1;
+	}
+	else if (!s[i].buf)
+	{
+	    isam_error = ISAM_READ_ERROR;
+	    rv = -1;
+	}
+	else if (pthread_create(&(s[i].thread), NULL, scan_thread, s + i))
+	{
+	    isam_error = ISAM_THREAD_ERROR;
+	    rv = -1;
+	}
+	else
+	{
+	    s[i].started = 1;
+	}
+    }
+    /* Hand out the records in the order of the partitions */
+    for (i = first; i <= last && !rv; i++)
+    {
+	rv = scan_deliver(s + i, fn, context, &n);
+    }
+    for (i = first; i <= last && s[i].keyLen; i++)
+    {
+	pthread_mutex_lock(&(s[i].lock));
+	s[i].stop = 1;
+	pthread_cond_signal(&(s[i].emptied));
+	pthread_mutex_unlock(&(s[i].lock));
+	if (s[i].started)
+	{
+	    pthread_join(s[i].thread, NULL);
+	}
+	if (s[i].ip)
+	{
+	    isam_close(s[i].ip);
+	}
+	free(s[i].buf);
+	pthread_mutex_destroy(&(s[i].lock));
+	pthread_cond_destroy(&(s[i].filled));
+	pthread_cond_destroy(&(s[i].emptied));
+    }
+    return (rv < 0) ? -1 : n;
+}
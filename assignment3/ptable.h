@@ -0,0 +1,127 @@
+#ifndef PTABLE_H
+#define PTABLE_H
+
+/* -------------------------------------------------------------------------
+   Range-partitioned tables: a table whose records are spread over a
+   number of isam files (the partitions) by key range.
+   Goal: Part of an assignment on file system structure for the operating
+         systems course.
+----------------------------------------------------------------------------*/
+
+#include <stddef.h>
+#include "isam.h"
+
+/* A table of nParts partitions has nParts - 1 bounds, in increasing
+   order: partition 0 holds the keys below bounds[0], partition i the
+   keys from bounds[i - 1] up to bounds[i], and the last partition the
+   keys from the last bound on. The bounds and the names of the
+   partition files are kept in a small descriptor file with the name of
+   the table. Each partition is an ordinary isam file, that can be
+   opened, checked or reorganised on its own; together they hold more
+   records than one file's index was sized for, and they can be placed
+   on different disks.
+   Errors are reported through isam_error, as for the isam routines. A
+   ptablePtr, like an isamPtr, must be used by one thread at a time. */
+
+typedef struct PTABLE *ptablePtr;
+
+#define PTABLE_MAX_PARTS	(64)
+
+/* ptable_chooseBounds chooses the bounds for at most nParts partitions
+   of about equal size from a sample of n keys, for example keys taken
+   at random from the data to be loaded: it sorts the sample and takes
+   every (n / nParts)-th key. Equal keys give a single bound, so there
+   may be fewer partitions.
+   The parameters are:
+   sample:   an array of n key strings (the sample is not changed).
+   n:        the number of keys in the sample.
+   key_len:  the key length of the table.
+   nParts:   the number of partitions wanted.
+   bounds:   room for nParts - 1 bounds of key_len bytes each.
+   ptable_chooseBounds will return the number of partitions (one more
+   than the number of bounds stored), or -1 on failure.
+*/
+
+int ptable_chooseBounds(const char **sample, size_t n, unsigned long key_len,
+    int nParts, char *bounds);
+
+/* ptable_create creates a new table of nParts partitions, each an isam
+   file created with isam_createWithOptions.
+   The parameters are:
+   name:      the name of the descriptor file; the partitions are named
+          name.0, name.1, ...
+   dirs:      NULL, or an array of nParts directories, one for each
+          partition file (which is then named dir/base.i, with base the
+          last component of name).
+   nParts:    the number of partitions (at most PTABLE_MAX_PARTS).
+   bounds:    nParts - 1 increasing bounds of key_len bytes each (see
+          ptable_chooseBounds).
+   key_len, data_len, NrecPB, cacheSize, options: as for
+          isam_createWithOptions; Nblocks is the number of regular
+          blocks of each partition.
+   ptable_create will return a ptablePtr on success, NULL on failure.
+*/
+
+ptablePtr ptable_create(const char *name, const char **dirs, int nParts,
+    const char *bounds, unsigned long key_len, unsigned long data_len,
+    unsigned long NrecPB, unsigned long Nblocks, int cacheSize, int options);
+
+/* ptable_open opens an existing table, and all its partitions with
+   isam_openWithCache (with the same update and cacheSize).
+   ptable_open will return a ptablePtr on success, NULL on failure.
+*/
+
+ptablePtr ptable_open(const char *name, int update, int cacheSize);
+
+/* ptable_close closes all partitions of a table.
+   ptable_close will return 0 on success, -1 on failure.
+*/
+
+int ptable_close(ptablePtr table);
+
+/* ptable_nParts returns the number of partitions, ptable_partitionOf
+   the number of the partition that holds key, and ptable_partition the
+   isamPtr of partition i (which remains owned by the table), for
+   routines not offered here.
+*/
+
+int ptable_nParts(ptablePtr table);
+
+int ptable_partitionOf(ptablePtr table, const char *key);
+
+isamPtr ptable_partition(ptablePtr table, int i);
+
+/* These routines do the same as the isam routines of the same name, on
+   the partition that holds key.
+*/
+
+int ptable_readByKey(ptablePtr table, const char *key, void *data);
+
+int ptable_writeNew(ptablePtr table, const char *key, const void *data);
+
+int ptable_update(ptablePtr table, const char *key, const void *old_data,
+    const void *new_data);
+
+int ptable_delete(ptablePtr table, const char *key, const void *data);
+
+/* ptable_scanRange calls a function for all records with keys from from
+   up to and including to, in the order of their keys, like
+   isam_scanRange. The partitions in the range are scanned at the same
+   time, each by a thread of its own with an isamPtr of its own; each
+   thread copies its records into a buffer of PTABLE_SCAN_BUFFER bytes,
+   and waits while that is full. fn is called in the calling thread, for
+   the records of one partition after the other, so that the partitions
+   further on are read while fn works on the earlier ones. The key and
+   data passed to fn are only valid during the call. As with
+   isam_scanRange, fn must not modify the table.
+   The parameters are as for isam_scanRange.
+   ptable_scanRange will return the number of records passed to fn, or -1
+   on failure.
+*/
+
+#define PTABLE_SCAN_BUFFER	(1024 * 1024)
+
+long ptable_scanRange(ptablePtr table, const char *from, const char *to,
+    isam_scanFunc fn, void *context);
+
+#endif